@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Compares the per-pod cost of one ADD per pod with a single ADD_BATCH of the same pods: wall time, and
+# the netlink sockets, messages and syscalls that sknf-cni reports on stderr.
+#
+# Usage: sudo ./scripts/bench-batch-add.sh [pods] [conf]
+#
+# Run it on a dev box, not on a cluster node: like clean_network.sh, it deletes brsknf, vxsknf and every
+# sknf* interface, and it also resets the sknf nftables table and the IPAM state before each measure.
+
+set -eu
+
+PODS=${1:-64}
+CONF=${2:-./sknf-cni/conf/example-conf.json}
+PLUGIN=./sknf-cni/bin/sknf-cni
+NETNS_PREFIX=sknf-bench-
+
+export CNI_PATH=./sknf-cni/bin
+export CNI_IFNAME=eth0
+
+reset() {
+    ip link del brsknf 2>/dev/null || true
+    ip link del vxsknf 2>/dev/null || true
+    for ifname in $(ip -o link show | awk -F': ' '{ print $2 }' | cut -d@ -f1 | grep '^sknf' || true); do
+        ip link del "$ifname"
+    done
+    nft delete table ip sknf 2>/dev/null || true
+    rm -f /tmp/sknf-cni-ips /tmp/sknf-cni-ips-leases
+    for i in $(seq 0 $((PODS - 1))); do
+        ip netns del "$NETNS_PREFIX$i" 2>/dev/null || true
+        ip netns add "$NETNS_PREFIX$i"
+    done
+}
+
+# Sums the "netlink: ..." lines of sknf-cni and prints the totals per pod, prefixed by the wall time
+report() {
+    awk -v name="$1" -v pods="$PODS" -v ms="$2" '
+        /^netlink: .* used / { sockets += $4; messages += $7 + $12; syscalls += $16 }
+        END {
+            printf "%-9s %4d pods in %8.2f ms: per pod %6.3f ms, %6.2f sockets, %7.2f messages, %7.2f syscalls\n",
+                name, pods, ms, ms / pods, sockets / pods, messages / pods, syscalls / pods
+        }'
+}
+
+elapsed_ms() {
+    echo $(( ($(date +%s%N) - $1) / 1000 )) | awk '{ printf "%.2f", $1 / 1000 }'
+}
+
+reset
+log=$(mktemp)
+start=$(date +%s%N)
+for i in $(seq 0 $((PODS - 1))); do
+    CNI_COMMAND=ADD CNI_CONTAINERID="bench-$i" CNI_NETNS="/var/run/netns/$NETNS_PREFIX$i" \
+        $PLUGIN < "$CONF" >/dev/null 2>>"$log" || echo "ADD of bench-$i failed" >&2
+done
+report ADD "$(elapsed_ms "$start")" < "$log"
+
+reset
+containers=$(for i in $(seq 0 $((PODS - 1))); do
+    printf '{"containerId":"bench-%d","netns":"/var/run/netns/%s%d","ifName":"eth0"},' "$i" "$NETNS_PREFIX" "$i"
+done)
+batch_conf=$(mktemp)
+sed '$ s|}[[:space:]]*$|, "containers": ['"${containers%,}"']}|' "$CONF" > "$batch_conf"
+: > "$log"
+start=$(date +%s%N)
+CNI_COMMAND=ADD_BATCH $PLUGIN < "$batch_conf" >/dev/null 2>>"$log" || echo "ADD_BATCH failed for some pods" >&2
+report ADD_BATCH "$(elapsed_ms "$start")" < "$log"
+
+rm -f "$log" "$batch_conf"
+echo "Cleanup: ./scripts/clean_network.sh; ip netns del $NETNS_PREFIX<0..$((PODS - 1))>"
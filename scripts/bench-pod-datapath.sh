@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Measures the pod datapath of the pod interface currently in use (POD_INTERFACE of sknf-app): TCP
+# throughput and round-trip latency from a client pod to a server pod on the same node and, when a
+# second node is given, to a server pod on that node (the path the netkit forwarding program shortcuts).
+#
+# Usage: ./scripts/bench-pod-datapath.sh <node> [remote node] [seconds]
+#
+# Run it once with POD_INTERFACE=veth and once with POD_INTERFACE=netkit (restarting sknf-app and
+# recreating the pods in between) on the same nodes and compare the output.
+
+set -eu
+
+NODE=$1
+REMOTE_NODE=${2:-}
+SECONDS_PER_RUN=${3:-10}
+NS=sknf-bench-datapath
+IMAGE=networkstatic/iperf3
+
+kubectl create namespace $NS --dry-run=client -o yaml | kubectl apply -f - >/dev/null
+
+# run_pod <name> <node> <command...>: a pod pinned to a node
+run_pod() {
+    local name=$1 node=$2
+    shift 2
+    kubectl -n $NS run "$name" --image=$IMAGE --restart=Never \
+        --overrides="{\"spec\":{\"nodeName\":\"$node\"}}" --command -- "$@" >/dev/null 2>&1 || true
+}
+
+run_pod client "$NODE" sleep infinity
+run_pod server-local "$NODE" iperf3 -s
+[ -n "$REMOTE_NODE" ] && run_pod server-remote "$REMOTE_NODE" iperf3 -s
+kubectl -n $NS wait --for=condition=Ready pod --all --timeout=120s >/dev/null
+
+# bench <server pod>: throughput of a single stream, then ping latency, from the client
+bench() {
+    local server=$1
+    local ip
+    ip=$(kubectl -n $NS get pod "$server" -o jsonpath='{.status.podIP}')
+    kubectl -n $NS exec client -- iperf3 -c "$ip" -t "$SECONDS_PER_RUN" -J |
+        awk -v s="$server" '/"sum_received"/ { r = 1 } r && /"bits_per_second"/ { gsub(/,/, ""); printf "%s throughput: %.2f Gbit/s\n", s, $2 / 1e9; exit }'
+    kubectl -n $NS exec client -- ping -q -c 100 -i 0.01 "$ip" |
+        awk -F/ -v s="$server" '/^rtt|^round-trip/ { printf "%s latency: avg %s ms, max %s ms\n", s, $5, $6 }'
+}
+
+bench server-local
+[ -n "$REMOTE_NODE" ] && bench server-remote
+
+echo "Cleanup: kubectl delete namespace $NS"
@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Compares service programming time and first-packet latency of the ClusterIP implementation
+# currently running in the cluster (kube-proxy, or sknf-app with SERVICE_PROXY=true).
+#
+# Usage: ./scripts/bench-services.sh [services] [samples]
+#
+# Run it once per implementation on the same cluster and compare the output.
+
+set -eu
+
+SERVICES=${1:-10000}
+SAMPLES=${2:-20}
+NS=sknf-bench
+
+kubectl create namespace $NS --dry-run=client -o yaml | kubectl apply -f - >/dev/null
+kubectl -n $NS create deployment echo --image=registry.k8s.io/e2e-test-images/agnhost:2.47 \
+    --replicas=2 --dry-run=client -o yaml -- /agnhost netexec --http-port=8080 | kubectl apply -f - >/dev/null
+kubectl -n $NS run client --image=curlimages/curl --restart=Never --dry-run=client -o yaml \
+    --command -- sleep infinity | kubectl apply -f - >/dev/null
+kubectl -n $NS rollout status deployment/echo >/dev/null
+kubectl -n $NS wait --for=condition=Ready pod/client >/dev/null
+
+echo "Creating $SERVICES services..."
+existing=$(kubectl -n $NS get services --no-headers | grep -c '^bench-' || true)
+[ "$existing" -lt "$SERVICES" ] && for i in $(seq "$existing" $((SERVICES - 1))); do
+    cat <<EOF
+apiVersion: v1
+kind: Service
+metadata:
+  name: bench-$i
+spec:
+  selector:
+    app: echo
+  ports:
+  - port: 80
+    targetPort: 8080
+---
+EOF
+done | kubectl -n $NS apply -f - >/dev/null
+
+# Programming time: from the creation of one more service until the client can reach it
+echo "Measuring rule update time..."
+for s in $(seq 1 "$SAMPLES"); do
+    kubectl -n $NS delete service probe --ignore-not-found >/dev/null
+    start=$(date +%s%N)
+    kubectl -n $NS create service clusterip probe --tcp=80:8080 >/dev/null
+    kubectl -n $NS patch service probe -p '{"spec":{"selector":{"app":"echo"}}}' >/dev/null
+    ip=$(kubectl -n $NS get service probe -o jsonpath='{.spec.clusterIP}')
+    kubectl -n $NS exec client -- sh -c "until curl -s -o /dev/null --max-time 0.1 http://$ip; do :; done"
+    echo "update_ms $(( ($(date +%s%N) - start) / 1000000 ))"
+done | awk '{ v[NR] = $2 } END { asort(v); printf "rule update time: median %d ms, max %d ms\n", v[int((NR + 1) / 2)], v[NR] }'
+
+# First-packet latency: TCP connect time to ClusterIPs spread over the whole range, one new
+# connection per sample (addresses are used directly to keep DNS out of the measure)
+echo "Measuring first-packet latency..."
+ips=$(kubectl -n $NS get services -o jsonpath='{range .items[*]}{.spec.clusterIP}{"\n"}{end}' | shuf -n "$SAMPLES")
+kubectl -n $NS exec client -- sh -c "
+    for ip in $(echo $ips); do
+        curl -s -o /dev/null -w '%{time_connect}\n' http://\$ip
+    done" | awk '{ v[NR] = $1 * 1000000 } END { asort(v); printf "connect latency: median %d us, p90 %d us\n", v[int((NR + 1) / 2)], v[int(NR * 0.9)] }'
+
+echo "Cleanup: kubectl delete namespace $NS"
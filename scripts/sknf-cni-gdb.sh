@@ -1,7 +1,8 @@
 #!/bin/bash
+# Runs the debug build (make build-sknf-cni-debug): the release one is optimized and stripped
 ./scripts/clean_network.sh
 
-sudo gdb ./sknf-cni/bin/sknf-cni \
+sudo gdb ./sknf-cni/bin/sknf-cni-debug \
 	-ex "set environment CNI_COMMAND ADD" \
 	-ex "set environment CNI_CONTAINERID cnitool-77383ca0a0715733ca6f" \
 	-ex "set environment CNI_NETNS /var/run/netns/testing" \
@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Netlink budget check of sknf-cni (see nlstat.c): ADD/DEL of a plain pod, ADD/DEL of a pod with bandwidth limits
+# and a hostPort, and an ADD_BATCH with its DELs, in scratch netns, with SKNF_CNI_NL_STRICT set. A command over
+# its budget fails with an error result, so any failure fails the check; the netlink lines of the failing command
+# are printed.
+#
+# Usage: sudo ./scripts/sknf-cni-nl-budget.sh [conf] [plugin]
+#
+# Like sknf-cni-pgo-train.sh, it deletes brsknf, vxsknf, every sknf* interface, the sknf nftables table and the
+# IPAM state before and after the check: run it on a dev box, not on a cluster node.
+
+set -eu
+
+CONF=${1:-./sknf-cni/conf/example-conf.json}
+PLUGIN=${2:-./sknf-cni/bin/sknf-cni}
+NETNS_PREFIX=sknf-nl-
+BATCH_PODS=16
+
+export CNI_PATH=$(dirname "$PLUGIN")
+export CNI_IFNAME=eth0
+export SKNF_CNI_NL_STRICT=1
+
+reset() {
+    ip link del brsknf 2>/dev/null || true
+    ip link del vxsknf 2>/dev/null || true
+    for ifname in $(ip -o link show | awk -F': ' '{ print $2 }' | cut -d@ -f1 | grep '^sknf' || true); do
+        ip link del "$ifname"
+    done
+    nft delete table ip sknf 2>/dev/null || true
+    rm -f /tmp/sknf-cni-ips /tmp/sknf-cni-ips-leases
+    for i in $(seq 0 $((BATCH_PODS - 1))); do
+        ip netns del "$NETNS_PREFIX$i" 2>/dev/null || true
+    done
+}
+
+failures=0
+log=$(mktemp)
+
+# run <name> <conf> <command> [containerid netns]: runs the plugin, result on stdout
+run() {
+    local name=$1 conf=$2
+    if ! CNI_COMMAND=$3 CNI_CONTAINERID=${4:-} CNI_NETNS=${5:-} $PLUGIN < "$conf" 2>"$log"; then
+        echo "[sknf] $name failed:" >&2
+        grep -e '^netlink:' -e '^failure' "$log" >&2 || true
+        return 1
+    fi
+    grep '^netlink:' "$log" | sed "s/^/[sknf] $name: /" >&2
+}
+
+# Configuration with the given JSON members added to the top-level object
+conf_with() {
+    local conf
+    conf=$(mktemp)
+    sed '$ s|}[[:space:]]*$|, '"$1"'}|' "$CONF" > "$conf"
+    echo "$conf"
+}
+
+# add_del <name> <conf>: ADD of a pod in the first netns, then its DEL with the ADD result as prevResult
+add_del() {
+    local result del_conf
+    if ! result=$(run "$1 ADD" "$2" ADD "nl-$1" "/var/run/netns/${NETNS_PREFIX}0"); then
+        failures=$((failures + 1))
+        return
+    fi
+    del_conf=$(mktemp)
+    sed '$ s|}[[:space:]]*$|, "prevResult": '"$(echo "$result" | tr -d '\n')"'}|' "$2" > "$del_conf"
+    run "$1 DEL" "$del_conf" DEL "nl-$1" "/var/run/netns/${NETNS_PREFIX}0" >/dev/null || failures=$((failures + 1))
+    rm -f "$del_conf"
+}
+
+reset
+trap 'reset; rm -f "$log"' EXIT
+for i in $(seq 0 $((BATCH_PODS - 1))); do
+    ip netns add "$NETNS_PREFIX$i"
+done
+
+# the first ADD also creates brsknf and vxsknf, which the ADD budget includes
+add_del plain "$CONF"
+
+shaped_conf=$(conf_with '"runtimeConfig": {
+    "bandwidth": { "ingressRate": 10000000, "ingressBurst": 2147483647, "egressRate": 10000000, "egressBurst": 2147483647 },
+    "portMappings": [ { "hostPort": 18080, "containerPort": 80, "protocol": "tcp" } ] }')
+add_del shaped "$shaped_conf"
+rm -f "$shaped_conf"
+
+containers=$(for i in $(seq 0 $((BATCH_PODS - 1))); do
+    printf '{"containerId":"nl-batch-%d","netns":"/var/run/netns/%s%d","ifName":"eth0"},' "$i" "$NETNS_PREFIX" "$i"
+done)
+batch_conf=$(conf_with '"containers": ['"${containers%,}"']')
+run ADD_BATCH "$batch_conf" ADD_BATCH >/dev/null || failures=$((failures + 1))
+rm -f "$batch_conf"
+for i in $(seq 0 $((BATCH_PODS - 1))); do
+    run "batch DEL $i" "$CONF" DEL "nl-batch-$i" "/var/run/netns/$NETNS_PREFIX$i" >/dev/null || failures=$((failures + 1))
+done
+
+if [ "$failures" -ne 0 ]; then
+    echo "[sknf] $failures commands failed or went over their netlink budget" >&2
+    exit 1
+fi
+echo "[sknf] Every command within its netlink budget"
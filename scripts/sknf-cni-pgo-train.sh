@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Profile training run of an instrumented sknf-cni (see build-sknf-cni-pgo): ADD/DEL cycles of pods in scratch
+# netns, one ADD_BATCH and its DELs, and VERSION, i.e. what a kubelet execs. Every run adds its counts to the
+# .gcda files of the profile directory the binary was built with.
+#
+# Usage: sudo ./scripts/sknf-cni-pgo-train.sh [cycles] [conf]
+#
+# DEL releases the IP of each cycle, so 16 IPs of the node subnet of the configuration are enough.
+#
+# Like bench-batch-add.sh, it deletes brsknf, vxsknf, every sknf* interface, the sknf nftables table and the
+# IPAM state before and after training: run it on a dev box, not on a cluster node.
+
+set -eu
+
+CYCLES=${1:-64}
+CONF=${2:-./sknf-cni/conf/example-conf.json}
+PLUGIN=./sknf-cni/bin/sknf-cni
+NETNS_PREFIX=sknf-pgo-
+BATCH_PODS=16
+
+export CNI_PATH=./sknf-cni/bin
+export CNI_IFNAME=eth0
+
+reset() {
+    ip link del brsknf 2>/dev/null || true
+    ip link del vxsknf 2>/dev/null || true
+    for ifname in $(ip -o link show | awk -F': ' '{ print $2 }' | cut -d@ -f1 | grep '^sknf' || true); do
+        ip link del "$ifname"
+    done
+    nft delete table ip sknf 2>/dev/null || true
+    rm -f /tmp/sknf-cni-ips /tmp/sknf-cni-ips-leases
+    for i in $(seq 0 $((BATCH_PODS - 1))); do
+        ip netns del "$NETNS_PREFIX$i" 2>/dev/null || true
+    done
+}
+
+# Configuration of a DEL, with the ADD result read from stdin as its prevResult
+del_conf() {
+    sed '$ s|}[[:space:]]*$|, "prevResult": '"$(tr -d '\n')"'}|' "$CONF"
+}
+
+reset
+trap reset EXIT
+for i in $(seq 0 $((BATCH_PODS - 1))); do
+    ip netns add "$NETNS_PREFIX$i"
+done
+failures=0
+
+CNI_COMMAND=VERSION $PLUGIN < "$CONF" >/dev/null 2>&1
+
+# pods take turns in the netns; the first ADD also creates brsknf and vxsknf
+for i in $(seq 0 $((CYCLES - 1))); do
+    netns="$NETNS_PREFIX$((i % BATCH_PODS))"
+    if ! result=$(CNI_COMMAND=ADD CNI_CONTAINERID="pgo-$i" CNI_NETNS="/var/run/netns/$netns" $PLUGIN < "$CONF" 2>/dev/null); then
+        failures=$((failures + 1))
+        continue
+    fi
+    conf=$(mktemp)
+    echo "$result" | del_conf > "$conf"
+    CNI_COMMAND=DEL CNI_CONTAINERID="pgo-$i" CNI_NETNS="/var/run/netns/$netns" $PLUGIN < "$conf" >/dev/null 2>&1 ||
+        echo "DEL of pgo-$i failed" >&2
+    rm -f "$conf"
+done
+
+containers=$(for i in $(seq 0 $((BATCH_PODS - 1))); do
+    printf '{"containerId":"pgo-batch-%d","netns":"/var/run/netns/%s%d","ifName":"eth0"},' "$i" "$NETNS_PREFIX" "$i"
+done)
+batch_conf=$(mktemp)
+sed '$ s|}[[:space:]]*$|, "containers": ['"${containers%,}"']}|' "$CONF" > "$batch_conf"
+CNI_COMMAND=ADD_BATCH $PLUGIN < "$batch_conf" >/dev/null 2>&1 || failures=$((failures + 1))
+for i in $(seq 0 $((BATCH_PODS - 1))); do
+    CNI_COMMAND=DEL CNI_CONTAINERID="pgo-batch-$i" CNI_NETNS="/var/run/netns/$NETNS_PREFIX$i" $PLUGIN < "$CONF" >/dev/null 2>&1 || true
+done
+rm -f "$batch_conf"
+
+echo "[sknf] Trained with $CYCLES ADD/DEL cycles and a $BATCH_PODS pod ADD_BATCH ($failures failed ADDs)"
+if [ "$failures" -eq "$CYCLES" ]; then
+    echo "[sknf] Every ADD failed, check hostPhysicalInterface in $CONF" >&2
+    exit 1
+fi
@@ -0,0 +1,103 @@
+#!/bin/bash
+
+# Startup cost of sknf-cni binaries, as a kubelet exec pays it: size on disk and of the text segment, exec-to-exit
+# time of VERSION (startup and argument parsing alone) and, as root, of ADD and DEL, with the page faults and peak
+# RSS of one exec of each (through GNU time, when installed).
+#
+# Usage: [sudo] ./scripts/sknf-cni-startup-report.sh <conf> <binary>...
+#
+# As root, it deletes brsknf, vxsknf, every sknf* interface, the sknf nftables table and the IPAM state before
+# measuring each binary: run it on a dev box, not on a cluster node.
+
+set -eu
+
+CONF=$1
+shift
+RUNS=${SKNF_REPORT_RUNS:-200}
+POD_RUNS=${SKNF_REPORT_POD_RUNS:-32}
+NETNS=sknf-report
+
+export CNI_PATH=./sknf-cni/bin
+export CNI_IFNAME=eth0
+export CNI_NETNS=/var/run/netns/$NETNS
+
+reset() {
+    ip link del brsknf 2>/dev/null || true
+    ip link del vxsknf 2>/dev/null || true
+    for ifname in $(ip -o link show | awk -F': ' '{ print $2 }' | cut -d@ -f1 | grep '^sknf' || true); do
+        ip link del "$ifname"
+    done
+    nft delete table ip sknf 2>/dev/null || true
+    rm -f /tmp/sknf-cni-ips /tmp/sknf-cni-ips-leases
+    ip netns del "$NETNS" 2>/dev/null || true
+}
+
+# Runs "$@" once and writes its minor/major page faults and peak RSS to $stats
+faults() {
+    if [ ! -x /usr/bin/time ]; then
+        echo "faults n/a (no GNU time)" > "$stats"
+        "$@" 2>/dev/null || true
+        return
+    fi
+    /usr/bin/time -f 'faults %R/%F, rss %MKiB' -o "$stats" "$@" 2>/dev/null || true
+}
+
+report() {
+    printf '  %-8s %8.3f ms/exec, %s\n' "$1" "$(echo "$2 $3" | awk '{ print $1 / $2 / 1e3 }')" "$4"
+}
+
+# Configuration of a DEL, with the ADD result read from stdin as its prevResult
+del_conf() {
+    sed '$ s|}[[:space:]]*$|, "prevResult": '"$(tr -d '\n')"'}|' "$CONF" > "$conf"
+}
+
+# ADD then DEL of the same pod; prints the microseconds each one took (EPOCHREALTIME: no fork in the timings)
+add_del() {
+    start=${EPOCHREALTIME//[.,]/}
+    if ! result=$(CNI_COMMAND=ADD CNI_CONTAINERID="report-$2" "$1" < "$CONF" 2>/dev/null); then
+        echo "ADD with $1 failed, check hostPhysicalInterface in $CONF" >&2
+        exit 1
+    fi
+    added=${EPOCHREALTIME//[.,]/}
+    echo "$result" | del_conf
+    deleting=${EPOCHREALTIME//[.,]/}
+    CNI_COMMAND=DEL CNI_CONTAINERID="report-$2" "$1" < "$conf" >/dev/null 2>&1
+    echo $((added - start)) $((${EPOCHREALTIME//[.,]/} - deleting))
+}
+
+conf=$(mktemp)
+stats=$(mktemp)
+trap 'rm -f "$conf" "$stats"; if [ "$(id -u)" -eq 0 ]; then reset; fi' EXIT
+
+for bin in "$@"; do
+    echo "$bin: $(stat -c %s "$bin") bytes, text $(size "$bin" | awk 'NR == 2 { print $1 }') bytes"
+
+    start=${EPOCHREALTIME//[.,]/}
+    for i in $(seq "$RUNS"); do
+        CNI_COMMAND=VERSION "$bin" < "$CONF" >/dev/null 2>&1
+    done
+    elapsed=$((${EPOCHREALTIME//[.,]/} - start))
+    CNI_COMMAND=VERSION faults "$bin" < "$CONF" >/dev/null
+    report VERSION "$elapsed" "$RUNS" "$(cat "$stats")"
+
+    if [ "$(id -u)" -ne 0 ]; then
+        echo "  ADD/DEL skipped, not root"
+        continue
+    fi
+
+    reset
+    ip netns add "$NETNS"
+    # the first ADD of a node creates brsknf and vxsknf, which pods do not pay for
+    add_del "$bin" warmup >/dev/null
+    add_us=0
+    del_us=0
+    for i in $(seq "$POD_RUNS"); do
+        read -r a d < <(add_del "$bin" "$i")
+        add_us=$((add_us + a))
+        del_us=$((del_us + d))
+    done
+    CNI_COMMAND=ADD CNI_CONTAINERID=report-faults faults "$bin" < "$CONF" | del_conf
+    report ADD "$add_us" "$POD_RUNS" "$(cat "$stats")"
+    CNI_COMMAND=DEL CNI_CONTAINERID=report-faults faults "$bin" < "$conf" >/dev/null
+    report DEL "$del_us" "$POD_RUNS" "$(cat "$stats")"
+done
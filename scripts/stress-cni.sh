@@ -0,0 +1,171 @@
+#!/bin/bash
+
+# Fires concurrent ADDs and DELs of sknf-cni, the way kubelet runs them for different pods, then checks the
+# invariants parallel invocations must keep (no duplicate IPs, no leaked links, no orphan nftables objects or
+# routes) and sums the "contention: ..." lines of sknf-cni to show where the invocations waited on each other.
+#
+# Usage: sudo ./scripts/stress-cni.sh [pods] [rounds] [conf]
+#
+# Each round ADDs 'pods' new pods while the pods of the previous round are DELeted, all at once, and a last
+# round DELetes the remaining ones. A DEL releases its IP, but may do so after ADDs of the next round already
+# ran, so 2 * pods IPs must fit in the subnet of the conf (the default 64 pods fit the /24 of the example conf).
+#
+# Run it on a dev box, not on a cluster node: like bench-batch-add.sh, it deletes brsknf, vxsknf and every
+# sknf* interface, and it resets the sknf nftables table and the IPAM state first.
+
+set -u
+
+PODS=${1:-64}
+ROUNDS=${2:-3}
+CONF=${3:-./sknf-cni/conf/example-conf.json}
+PLUGIN=./sknf-cni/bin/sknf-cni
+NETNS_PREFIX=sknf-stress-
+
+export CNI_PATH=./sknf-cni/bin
+export CNI_IFNAME=eth0
+
+dir=$(mktemp -d)
+violations=0
+
+host_links() {
+    ip -o link show | awk -F': ' '{ print $2 }' | cut -d@ -f1 | grep -E '^(sknf|tmp)' || true
+}
+
+reset() {
+    ip link del brsknf 2>/dev/null || true
+    ip link del vxsknf 2>/dev/null || true
+    for ifname in $(host_links); do
+        ip link del "$ifname"
+    done
+    nft delete table ip sknf 2>/dev/null || true
+    rm -f /tmp/sknf-cni-ips /tmp/sknf-cni-ips-leases
+    for i in $(seq 0 $((PODS * ROUNDS - 1))); do
+        ip netns del "$NETNS_PREFIX$i" 2>/dev/null || true
+        ip netns add "$NETNS_PREFIX$i"
+    done
+}
+
+violation() {
+    echo "VIOLATION: $*"
+    violations=$((violations + 1))
+}
+
+pod_ip() {
+    grep -o '"address": *"[^"]*"' "$dir/$1.json" 2>/dev/null | head -1 | cut -d'"' -f4 | cut -d/ -f1
+}
+
+add() {
+    CNI_COMMAND=ADD CNI_CONTAINERID="stress-$1" CNI_NETNS="/var/run/netns/$NETNS_PREFIX$1" \
+        $PLUGIN < "$CONF" > "$dir/$1.json" 2> "$dir/add-$1.log" || echo "$1" >> "$dir/add-failed"
+}
+
+del() {
+    local conf="$dir/del-$1.conf"
+    if [ -s "$dir/$1.json" ]; then
+        sed '$ s|}[[:space:]]*$|, "prevResult": '"$(tr -d '\n' < "$dir/$1.json")"'}|' "$CONF" > "$conf"
+    else
+        cp "$CONF" "$conf"
+    fi
+    CNI_COMMAND=DEL CNI_CONTAINERID="stress-$1" CNI_NETNS="/var/run/netns/$NETNS_PREFIX$1" \
+        $PLUGIN < "$conf" > /dev/null 2> "$dir/del-$1.log" || echo "$1" >> "$dir/del-failed"
+}
+
+# Pods of the first argument must be fully in place and those of the second fully gone
+check() {
+    local live=$1 deleted=$2
+    local ruleset routes
+    ruleset=$(nft list table ip sknf 2>/dev/null)
+    routes=$(ip -4 route show)
+
+    for f in add-failed del-failed; do
+        if [ -s "$dir/$f" ]; then
+            for i in $(cat "$dir/$f"); do
+                violation "${f%-failed} of stress-$i failed: $(tail -1 "$dir/${f%-failed}-$i.log")"
+            done
+            : > "$dir/$f"
+        fi
+    done
+
+    local dups
+    dups=$(for i in $live; do pod_ip "$i"; done | sort | uniq -d)
+    [ -z "$dups" ] || violation "IPs handed out twice: $(echo $dups)"
+
+    for i in $live; do
+        local ip
+        ip=$(pod_ip "$i")
+        [ -n "$ip" ] || continue
+        ip -n "$NETNS_PREFIX$i" -4 -o addr show dev eth0 2>/dev/null | grep -qwF "$ip" ||
+            violation "stress-$i has no eth0 with $ip"
+        grep -qwF "$ip" <<< "$ruleset" || violation "no nftables objects for stress-$i ($ip)"
+    done
+    for i in $deleted; do
+        local ip
+        ip=$(pod_ip "$i")
+        [ -n "$ip" ] || continue
+        ! ip -n "$NETNS_PREFIX$i" link show dev eth0 >/dev/null 2>&1 || violation "stress-$i still has eth0"
+        ! grep -qwF "$ip" <<< "$ruleset" || violation "orphan nftables objects of stress-$i ($ip): $(grep -wF "$ip" <<< "$ruleset" | head -3 | xargs)"
+        ! grep -qwF "$ip" <<< "$routes" || violation "orphan route of stress-$i ($ip)"
+    done
+
+    # one host interface per pod; tmp* names only exist while a pod is being created
+    local links expected
+    links=$(host_links | wc -l)
+    expected=$(for i in $live; do pod_ip "$i"; done | wc -l)
+    [ "$links" -eq "$expected" ] || violation "$links sknf/tmp host interfaces for $expected pods: $(host_links | grep '^tmp' | xargs)"
+}
+
+# Sums the "contention: ..." lines of sknf-cni per command
+report() {
+    awk '
+        /^contention: / {
+            c = $2; calls[c]++; took[c] += $4; if ($4 > max[c]) max[c] = $4
+            ipam[c] += $7; contended[c] += substr($13, 2)
+            rtnl[c] += $15; replies[c] += $18; ct[c] += $21; nft[c] += $27
+            races[c] += $33; rejected[c] += $37
+        }
+        END {
+            for (c in calls) {
+                n = calls[c]
+                printf "%-9s %4d calls, %8.2f ms avg (%8.2f max), waiting per call: IPAM lock %6.2f ms (%d contended), ", \
+                    c, n, took[c] / n / 1000, max[c] / 1000, ipam[c] / n / 1000, contended[c]
+                printf "rtnetlink %6.2f ms (%.1f replies), conntrack %6.2f ms, nftables %6.2f ms; %d node object races, %d nftables commits rejected\n", \
+                    rtnl[c] / n / 1000, replies[c] / n, ct[c] / n / 1000, nft[c] / n / 1000, races[c], rejected[c]
+            }
+        }'
+}
+
+elapsed_ms() {
+    echo $(( ($(date +%s%N) - $1) / 1000 )) | awk '{ printf "%.2f", $1 / 1000 }'
+}
+
+reset
+previous=""
+for round in $(seq 0 "$ROUNDS"); do
+    current=""
+    if [ "$round" -lt "$ROUNDS" ]; then
+        current=$(seq $((round * PODS)) $((round * PODS + PODS - 1)))
+    fi
+
+    start=$(date +%s%N)
+    for i in $current; do add "$i" & done
+    for i in $previous; do del "$i" & done
+    wait
+    ms=$(elapsed_ms "$start")
+
+    # the sum of the call times over the wall time tells how many calls actually ran at once
+    busy_ms=$(cat /dev/null $(for i in $current; do echo "$dir/add-$i.log"; done) $(for i in $previous; do echo "$dir/del-$i.log"; done) |
+        awk '/^contention: / { us += $4 } END { printf "%.2f", us / 1000 }')
+    echo "round $round: $(echo $current | wc -w) ADD, $(echo $previous | wc -w) DEL in $ms ms, concurrency $(awk -v b="$busy_ms" -v w="$ms" 'BEGIN { printf "%.1f", (w > 0 ? b / w : 0) }')"
+    check "$current" "$previous"
+    previous=$current
+done
+
+echo
+cat "$dir"/*.log | report
+
+if [ "$violations" -gt 0 ]; then
+    echo "$violations invariant violations, logs kept in $dir"
+    exit 1
+fi
+rm -rf "$dir"
+echo "Invariants held. Cleanup: ./scripts/clean_network.sh; ip netns del $NETNS_PREFIX<0..$((PODS * ROUNDS - 1))>"
@@ -0,0 +1,92 @@
+// Package ct reads the kernel connection tracking table over ctnetlink.
+package ct
+
+import (
+	"fmt"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+const NFNL_SUBSYS_CTNETLINK = 1
+const NFNETLINK_V0 = 0
+const SIZEOF_NFGENMSG = 4
+
+// enum cntl_msg_types
+const IPCTNL_MSG_CT_GET = 1
+
+// enum ctattr_type
+const CTA_TUPLE_ORIG = 1
+const CTA_TUPLE_REPLY = 2
+const CTA_STATUS = 3
+
+// enum ctattr_tuple, ctattr_ip and ctattr_l4proto
+const CTA_TUPLE_IP = 1
+const CTA_TUPLE_PROTO = 2
+const CTA_IP_V4_SRC = 1
+const CTA_IP_V4_DST = 2
+const CTA_PROTO_NUM = 1
+const CTA_PROTO_SRC_PORT = 2
+const CTA_PROTO_DST_PORT = 3
+
+// enum ip_conntrack_status
+const IPS_SRC_NAT = 1 << 4
+
+// Tuple is one direction of a connection; addresses are host-order IPv4.
+type Tuple struct {
+	Src     uint32
+	Dst     uint32
+	Proto   uint8
+	SrcPort uint16
+	DstPort uint16
+}
+
+// Conn is a conntrack entry. For a source-NATed connection, Reply.Dst and Reply.DstPort
+// are the translated source address and port.
+type Conn struct {
+	Orig   Tuple
+	Reply  Tuple
+	Status uint32
+}
+
+func MsgType(msg uint16) uint16 {
+	return NFNL_SUBSYS_CTNETLINK<<8 | msg
+}
+
+// Dump calls fn for every IPv4 conntrack entry, with a single dump that is not buffered as a whole.
+func Dump(sk *nl.Socket, fn func(c *Conn)) error {
+	req := []byte{syscall.AF_INET, NFNETLINK_V0, 0, 0}
+	var c Conn
+	err := sk.DumpFunc(MsgType(IPCTNL_MSG_CT_GET), req, func(m syscall.NetlinkMessage) {
+		if len(m.Data) < SIZEOF_NFGENMSG {
+			return
+		}
+		attrs := nl.Attrs(m.Data[SIZEOF_NFGENMSG:])
+		c = Conn{
+			Orig:   parseTuple(attrs[CTA_TUPLE_ORIG]),
+			Reply:  parseTuple(attrs[CTA_TUPLE_REPLY]),
+			Status: nl.Uint32BE(attrs[CTA_STATUS]),
+		}
+		fn(&c)
+	})
+	if err != nil {
+		return fmt.Errorf("dumping conntrack table: %w", err)
+	}
+	return nil
+}
+
+func parseTuple(b []byte) Tuple {
+	attrs := nl.Attrs(b)
+	ip := nl.Attrs(attrs[CTA_TUPLE_IP])
+	proto := nl.Attrs(attrs[CTA_TUPLE_PROTO])
+	t := Tuple{
+		Src:     nl.Uint32BE(ip[CTA_IP_V4_SRC]),
+		Dst:     nl.Uint32BE(ip[CTA_IP_V4_DST]),
+		SrcPort: nl.Uint16BE(proto[CTA_PROTO_SRC_PORT]),
+		DstPort: nl.Uint16BE(proto[CTA_PROTO_DST_PORT]),
+	}
+	if p := proto[CTA_PROTO_NUM]; len(p) > 0 {
+		t.Proto = p[0]
+	}
+	return t
+}
@@ -0,0 +1,99 @@
+package dns
+
+import (
+	"encoding/binary"
+	"sync"
+	"time"
+)
+
+// Upper bounds on how long answers are kept, whatever their TTL; negative answers (NXDOMAIN, no
+// record of the type) are kept shorter, so that a name is found soon after it is created
+const MAX_TTL = 30 * time.Second
+const MAX_NEGATIVE_TTL = 5 * time.Second
+
+const MAX_CACHE_ENTRIES = 10000
+
+type entry struct {
+	msg     []byte
+	ttlOffs []int
+	stored  time.Time
+	expires time.Time
+}
+
+// cache holds upstream responses by query key (see parseQuery)
+type cache struct {
+	mu      sync.Mutex
+	entries map[string]*entry
+}
+
+func newCache() *cache {
+	return &cache{entries: make(map[string]*entry)}
+}
+
+// get returns a copy of the cached response to a query, with the id and question (whose case may differ)
+// of the query and aged TTLs, if it is fresh and fits in maxLen bytes
+func (c *cache) get(key string, query []byte, questionEnd int, maxLen int, now time.Time) []byte {
+	c.mu.Lock()
+	e, ok := c.entries[key]
+	c.mu.Unlock()
+	if !ok || !now.Before(e.expires) || len(e.msg) > maxLen {
+		return nil
+	}
+
+	out := append([]byte(nil), e.msg...)
+	copy(out[0:2], query[0:2])
+	copy(out[HEADER_LEN:questionEnd], query[HEADER_LEN:questionEnd])
+	age := uint32(now.Sub(e.stored) / time.Second)
+	for _, off := range e.ttlOffs {
+		ttl := binary.BigEndian.Uint32(out[off:])
+		binary.BigEndian.PutUint32(out[off:], ttl-min(ttl, age))
+	}
+	return out
+}
+
+// put caches a successful or negative upstream response. Truncated responses, failures and
+// responses without any TTL to go by are not cached.
+func (c *cache) put(key string, msg []byte, questionEnd int, now time.Time) {
+	r, err := parseResponse(msg, questionEnd)
+	if err != nil || r.truncated || (r.rcode != RCODE_SUCCESS && r.rcode != RCODE_NXDOMAIN) || len(r.ttlOffs) == 0 {
+		return
+	}
+	ttl := time.Duration(r.minTTL) * time.Second
+	if r.rcode == RCODE_NXDOMAIN || r.empty {
+		ttl = min(ttl, MAX_NEGATIVE_TTL)
+	}
+	ttl = min(ttl, MAX_TTL)
+	if ttl <= 0 {
+		return
+	}
+
+	e := &entry{msg: append([]byte(nil), msg...), ttlOffs: r.ttlOffs, stored: now, expires: now.Add(ttl)}
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if _, ok := c.entries[key]; !ok && len(c.entries) >= MAX_CACHE_ENTRIES {
+		c.evict(now)
+	}
+	c.entries[key] = e
+}
+
+// evict drops the expired entries or, when there are none, an arbitrary one
+func (c *cache) evict(now time.Time) {
+	for k, e := range c.entries {
+		if !now.Before(e.expires) {
+			delete(c.entries, k)
+		}
+	}
+	if len(c.entries) < MAX_CACHE_ENTRIES {
+		return
+	}
+	for k := range c.entries {
+		delete(c.entries, k)
+		return
+	}
+}
+
+func (c *cache) len() int {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return len(c.entries)
+}
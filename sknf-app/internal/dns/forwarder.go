@@ -0,0 +1,344 @@
+// Package dns is the node-local DNS cache.
+//
+// Pods query the cluster DNS service (kube-dns) by its ClusterIP. Without the cache, every lookup
+// is DNATed to a CoreDNS pod, usually on another node, and leaves a conntrack entry behind; UDP DNS
+// entries race on insertion and fill the table. With the cache, the ClusterIP is also a local address
+// of the node and the forwarder of this package listens on it, and on the brsknf gateway address.
+// Queries to either address skip conntrack (see redirect.go), so that kube-proxy's DNAT never sees
+// them and they are delivered locally.
+//
+// Answers are cached for their TTL, capped at MAX_TTL. Misses are forwarded to the CoreDNS pods
+// directly, over a single UDP socket, or over TCP for queries that came over TCP.
+package dns
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"math/rand"
+	"net"
+	"net/netip"
+	"os"
+	"slices"
+	"sync"
+	"time"
+)
+
+const DNS_PORT = 53
+
+// A query without an upstream answer after this long gets SERVFAIL
+const UPSTREAM_TIMEOUT = 2 * time.Second
+const TCP_IDLE_TIMEOUT = 10 * time.Second
+const MAX_MSG_LEN = 65535
+
+type Forwarder struct {
+	udp      []*net.UDPConn
+	tcp      []*net.TCPListener
+	upstream *net.UDPConn
+	cache    *cache
+	stats    stats
+
+	mu           sync.Mutex
+	udpUpstreams []netip.AddrPort
+	tcpUpstreams []netip.AddrPort
+	next         int
+	// queries forwarded over UDP, by upstream id
+	pending map[uint16]*pending
+}
+
+type pending struct {
+	conn   *net.UDPConn
+	client netip.AddrPort
+	// header and question of the client query, with the client's id
+	head        []byte
+	questionEnd int
+	key         string
+	upstream    netip.AddrPort
+	start       time.Time
+}
+
+// New listens on port 53 of every address of ips, over UDP and TCP. Nothing is answered before Serve.
+func New(ips ...net.IP) (*Forwarder, error) {
+	f := &Forwarder{cache: newCache(), pending: make(map[uint16]*pending)}
+	for _, ip := range ips {
+		u, err := net.ListenUDP("udp4", &net.UDPAddr{IP: ip, Port: DNS_PORT})
+		if err != nil {
+			f.close()
+			return nil, err
+		}
+		f.udp = append(f.udp, u)
+		t, err := net.ListenTCP("tcp4", &net.TCPAddr{IP: ip, Port: DNS_PORT})
+		if err != nil {
+			f.close()
+			return nil, err
+		}
+		f.tcp = append(f.tcp, t)
+	}
+	u, err := net.ListenUDP("udp4", nil)
+	if err != nil {
+		f.close()
+		return nil, err
+	}
+	f.upstream = u
+	return f, nil
+}
+
+// SetUpstreams replaces the CoreDNS addresses queries are forwarded to.
+func (f *Forwarder) SetUpstreams(udp, tcp []netip.AddrPort) {
+	f.mu.Lock()
+	defer f.mu.Unlock()
+	f.udpUpstreams = udp
+	f.tcpUpstreams = tcp
+}
+
+// Serve answers queries until the forwarder is closed.
+func (f *Forwarder) Serve() {
+	for _, u := range f.udp {
+		go f.serveUDP(u)
+	}
+	for _, t := range f.tcp {
+		go f.serveTCP(t)
+	}
+	go f.expire()
+	f.readUpstream()
+}
+
+// Close removes the redirect of pod DNS traffic, which goes back to the DNS service, and stops answering.
+func (f *Forwarder) Close() {
+	if err := Teardown(); err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure removing the node-local DNS redirect: %v\n", err)
+	}
+	f.close()
+}
+
+func (f *Forwarder) close() {
+	for _, u := range f.udp {
+		u.Close()
+	}
+	for _, t := range f.tcp {
+		t.Close()
+	}
+	if f.upstream != nil {
+		f.upstream.Close()
+	}
+}
+
+func (f *Forwarder) serveUDP(conn *net.UDPConn) {
+	buf := make([]byte, MAX_MSG_LEN)
+	for {
+		n, client, err := conn.ReadFromUDPAddrPort(buf)
+		if errors.Is(err, net.ErrClosed) {
+			return
+		}
+		if err != nil {
+			continue
+		}
+		start := time.Now()
+		msg := buf[:n]
+		q, err := parseQuery(msg)
+		if err != nil {
+			continue
+		}
+		if q.key != "" {
+			if out := f.cache.get(q.key, msg, q.questionEnd, q.maxUDPLen, start); out != nil {
+				conn.WriteToUDPAddrPort(out, client)
+				f.stats.observe(RESULT_HIT, time.Since(start))
+				continue
+			}
+		}
+		f.forward(conn, client, msg, q, start)
+	}
+}
+
+// forward sends a query to the next upstream under an id of its own, which readUpstream maps back
+func (f *Forwarder) forward(conn *net.UDPConn, client netip.AddrPort, msg []byte, q query, start time.Time) {
+	p := &pending{
+		conn:        conn,
+		client:      client,
+		head:        append([]byte(nil), msg[:max(q.questionEnd, HEADER_LEN)]...),
+		questionEnd: q.questionEnd,
+		key:         q.key,
+		start:       start,
+	}
+
+	f.mu.Lock()
+	if len(f.udpUpstreams) == 0 || len(f.pending) >= 1<<16 {
+		f.mu.Unlock()
+		conn.WriteToUDPAddrPort(servfail(msg, q), client)
+		f.stats.observe(RESULT_ERROR, time.Since(start))
+		return
+	}
+	p.upstream = f.udpUpstreams[f.next%len(f.udpUpstreams)]
+	f.next++
+	id := uint16(rand.Uint32())
+	for f.pending[id] != nil {
+		id++
+	}
+	f.pending[id] = p
+	f.mu.Unlock()
+
+	binary.BigEndian.PutUint16(msg[0:2], id)
+	f.upstream.WriteToUDPAddrPort(msg, p.upstream)
+}
+
+func (f *Forwarder) readUpstream() {
+	buf := make([]byte, MAX_MSG_LEN)
+	for {
+		n, from, err := f.upstream.ReadFromUDPAddrPort(buf)
+		if errors.Is(err, net.ErrClosed) {
+			return
+		}
+		if err != nil || n < HEADER_LEN {
+			continue
+		}
+		msg := buf[:n]
+		id := binary.BigEndian.Uint16(msg[0:2])
+
+		f.mu.Lock()
+		p := f.pending[id]
+		// anything else than the answer to the question asked, from the upstream asked, is dropped
+		if p == nil || p.upstream != netip.AddrPortFrom(from.Addr().Unmap(), from.Port()) ||
+			n < len(p.head) || !slices.Equal(msg[HEADER_LEN:len(p.head)], p.head[HEADER_LEN:]) {
+			f.mu.Unlock()
+			continue
+		}
+		delete(f.pending, id)
+		f.mu.Unlock()
+
+		copy(msg[0:2], p.head[0:2])
+		if p.key != "" {
+			f.cache.put(p.key, msg, p.questionEnd, time.Now())
+		}
+		p.conn.WriteToUDPAddrPort(msg, p.client)
+		f.stats.observe(RESULT_MISS, time.Since(p.start))
+	}
+}
+
+// expire answers SERVFAIL to the queries an upstream did not answer in time
+func (f *Forwarder) expire() {
+	ticker := time.NewTicker(UPSTREAM_TIMEOUT / 2)
+	defer ticker.Stop()
+	for range ticker.C {
+		now := time.Now()
+		var expired []*pending
+		f.mu.Lock()
+		for id, p := range f.pending {
+			if now.Sub(p.start) >= UPSTREAM_TIMEOUT {
+				expired = append(expired, p)
+				delete(f.pending, id)
+			}
+		}
+		f.mu.Unlock()
+
+		for _, p := range expired {
+			if _, err := p.conn.WriteToUDPAddrPort(servfail(p.head, query{questionEnd: p.questionEnd}), p.client); errors.Is(err, net.ErrClosed) {
+				return
+			}
+			f.stats.observe(RESULT_ERROR, now.Sub(p.start))
+		}
+	}
+}
+
+func (f *Forwarder) serveTCP(l *net.TCPListener) {
+	for {
+		c, err := l.AcceptTCP()
+		if errors.Is(err, net.ErrClosed) {
+			return
+		}
+		if err != nil {
+			continue
+		}
+		go f.handleTCP(c)
+	}
+}
+
+// handleTCP answers the queries of a TCP connection in order, forwarding misses over a TCP connection
+// to an upstream kept for as long as the client's
+func (f *Forwarder) handleTCP(c *net.TCPConn) {
+	defer c.Close()
+	var up net.Conn
+	defer func() {
+		if up != nil {
+			up.Close()
+		}
+	}()
+
+	for {
+		c.SetDeadline(time.Now().Add(TCP_IDLE_TIMEOUT))
+		msg, err := readTCPMsg(c)
+		if err != nil {
+			return
+		}
+		start := time.Now()
+		q, err := parseQuery(msg)
+		if err != nil {
+			return
+		}
+		if q.key != "" {
+			if out := f.cache.get(q.key, msg, q.questionEnd, MAX_MSG_LEN, start); out != nil {
+				writeTCPMsg(c, out)
+				f.stats.observe(RESULT_HIT, time.Since(start))
+				continue
+			}
+		}
+
+		resp, err := f.exchangeTCP(&up, msg)
+		if err != nil {
+			if up != nil {
+				up.Close()
+				up = nil
+			}
+			writeTCPMsg(c, servfail(msg, q))
+			f.stats.observe(RESULT_ERROR, time.Since(start))
+			continue
+		}
+		if q.key != "" {
+			f.cache.put(q.key, resp, q.questionEnd, time.Now())
+		}
+		writeTCPMsg(c, resp)
+		f.stats.observe(RESULT_MISS, time.Since(start))
+	}
+}
+
+func (f *Forwarder) exchangeTCP(up *net.Conn, msg []byte) ([]byte, error) {
+	if *up == nil {
+		f.mu.Lock()
+		if len(f.tcpUpstreams) == 0 {
+			f.mu.Unlock()
+			return nil, errors.New("no upstream")
+		}
+		addr := f.tcpUpstreams[f.next%len(f.tcpUpstreams)]
+		f.next++
+		f.mu.Unlock()
+
+		c, err := net.DialTimeout("tcp4", addr.String(), UPSTREAM_TIMEOUT)
+		if err != nil {
+			return nil, err
+		}
+		*up = c
+	}
+	(*up).SetDeadline(time.Now().Add(UPSTREAM_TIMEOUT))
+	if err := writeTCPMsg(*up, msg); err != nil {
+		return nil, err
+	}
+	return readTCPMsg(*up)
+}
+
+// DNS over TCP prefixes every message with its length (RFC 1035 4.2.2)
+func readTCPMsg(r io.Reader) ([]byte, error) {
+	var l [2]byte
+	if _, err := io.ReadFull(r, l[:]); err != nil {
+		return nil, err
+	}
+	msg := make([]byte, binary.BigEndian.Uint16(l[:]))
+	if _, err := io.ReadFull(r, msg); err != nil {
+		return nil, err
+	}
+	return msg, nil
+}
+
+func writeTCPMsg(w io.Writer, msg []byte) error {
+	_, err := w.Write(append(binary.BigEndian.AppendUint16(nil, uint16(len(msg))), msg...))
+	return err
+}
@@ -0,0 +1,199 @@
+package dns
+
+import (
+	"encoding/binary"
+	"errors"
+)
+
+// RFC 1035 header: id, flags, qdcount, ancount, nscount, arcount
+const HEADER_LEN = 12
+
+const FLAG_QR = 0x8000
+const FLAG_TC = 0x0200
+const FLAG_CD = 0x0010
+const OPCODE_MASK = 0x7800
+const RCODE_MASK = 0x000f
+
+const RCODE_SUCCESS = 0
+const RCODE_SERVFAIL = 2
+const RCODE_NXDOMAIN = 3
+
+const TYPE_OPT = 41
+
+// EDNS flag in the TTL field of OPT: DNSSEC OK
+const EDNS_DO = 0x8000
+
+// Largest response a client without EDNS accepts over UDP
+const MAX_PLAIN_UDP_LEN = 512
+
+var errMalformed = errors.New("malformed DNS message")
+
+// query is what the forwarder needs from a client query
+type query struct {
+	// lowercased question, qtype and qclass, followed by the EDNS and DO/CD bits; empty when the
+	// query cannot be cached (several questions, unusual opcode)
+	key string
+	// end of the question section in the message
+	questionEnd int
+	// largest UDP response the client accepts
+	maxUDPLen int
+}
+
+// parseQuery parses a client query. Only standard queries of a single question are cacheable.
+func parseQuery(msg []byte) (query, error) {
+	if len(msg) < HEADER_LEN {
+		return query{}, errMalformed
+	}
+	q := query{maxUDPLen: MAX_PLAIN_UDP_LEN}
+	flags := binary.BigEndian.Uint16(msg[2:4])
+	if flags&FLAG_QR != 0 {
+		return query{}, errMalformed
+	}
+	if binary.BigEndian.Uint16(msg[4:6]) != 1 || flags&OPCODE_MASK != 0 {
+		return q, nil
+	}
+
+	end, err := skipName(msg, HEADER_LEN)
+	if err != nil || end+4 > len(msg) {
+		return query{}, errMalformed
+	}
+	q.questionEnd = end + 4
+
+	key := make([]byte, 0, q.questionEnd-HEADER_LEN+2)
+	for _, c := range msg[HEADER_LEN:q.questionEnd] {
+		if c >= 'A' && c <= 'Z' {
+			c += 'a' - 'A'
+		}
+		key = append(key, c)
+	}
+
+	var edns, do byte
+	off := q.questionEnd
+	for i := 0; i < int(binary.BigEndian.Uint16(msg[6:8]))+int(binary.BigEndian.Uint16(msg[8:10]))+
+		int(binary.BigEndian.Uint16(msg[10:12])); i++ {
+		rr, next, err := parseRR(msg, off)
+		if err != nil {
+			return query{}, err
+		}
+		if rr.typ == TYPE_OPT {
+			edns = 1
+			q.maxUDPLen = max(int(rr.class), MAX_PLAIN_UDP_LEN)
+			if rr.ttl&EDNS_DO != 0 {
+				do = 1
+			}
+		}
+		off = next
+	}
+	q.key = string(append(key, edns, do, byte(flags&FLAG_CD>>4)))
+	return q, nil
+}
+
+type rr struct {
+	typ    uint16
+	class  uint16
+	ttl    uint32
+	ttlOff int
+}
+
+// parseRR parses the resource record at off and returns the offset of the next one
+func parseRR(msg []byte, off int) (rr, int, error) {
+	off, err := skipName(msg, off)
+	if err != nil || off+10 > len(msg) {
+		return rr{}, 0, errMalformed
+	}
+	r := rr{
+		typ:    binary.BigEndian.Uint16(msg[off:]),
+		class:  binary.BigEndian.Uint16(msg[off+2:]),
+		ttl:    binary.BigEndian.Uint32(msg[off+4:]),
+		ttlOff: off + 4,
+	}
+	next := off + 10 + int(binary.BigEndian.Uint16(msg[off+8:]))
+	if next > len(msg) {
+		return rr{}, 0, errMalformed
+	}
+	return r, next, nil
+}
+
+// skipName returns the offset following the (possibly compressed) name at off
+func skipName(msg []byte, off int) (int, error) {
+	for {
+		if off >= len(msg) {
+			return 0, errMalformed
+		}
+		l := int(msg[off])
+		switch {
+		case l == 0:
+			return off + 1, nil
+		case l&0xc0 == 0xc0:
+			if off+2 > len(msg) {
+				return 0, errMalformed
+			}
+			return off + 2, nil
+		case l&0xc0 != 0:
+			return 0, errMalformed
+		}
+		off += 1 + l
+	}
+}
+
+// response is what the cache needs from an upstream response
+type response struct {
+	rcode     uint16
+	truncated bool
+	// offsets of the TTL of every record but OPT, which are aged on every cache hit
+	ttlOffs []int
+	// smallest TTL of the answer and authority sections; 0 when they are empty
+	minTTL uint32
+	empty  bool
+}
+
+func parseResponse(msg []byte, questionEnd int) (response, error) {
+	if len(msg) < HEADER_LEN || questionEnd > len(msg) {
+		return response{}, errMalformed
+	}
+	flags := binary.BigEndian.Uint16(msg[2:4])
+	r := response{rcode: flags & RCODE_MASK, truncated: flags&FLAG_TC != 0}
+	counts := [3]int{
+		int(binary.BigEndian.Uint16(msg[6:8])),
+		int(binary.BigEndian.Uint16(msg[8:10])),
+		int(binary.BigEndian.Uint16(msg[10:12])),
+	}
+	r.empty = counts[0] == 0
+
+	off := questionEnd
+	first := true
+	for section, n := range counts {
+		for i := 0; i < n; i++ {
+			rec, next, err := parseRR(msg, off)
+			if err != nil {
+				return response{}, err
+			}
+			if rec.typ != TYPE_OPT {
+				r.ttlOffs = append(r.ttlOffs, rec.ttlOff)
+				if section < 2 && (first || rec.ttl < r.minTTL) {
+					r.minTTL = rec.ttl
+					first = false
+				}
+			}
+			off = next
+		}
+	}
+	return r, nil
+}
+
+// servfail answers a query that could not be forwarded
+func servfail(msg []byte, q query) []byte {
+	end := q.questionEnd
+	if end == 0 {
+		end = HEADER_LEN
+	}
+	out := append([]byte(nil), msg[:end]...)
+	flags := binary.BigEndian.Uint16(out[2:4])
+	binary.BigEndian.PutUint16(out[2:4], flags&^RCODE_MASK|FLAG_QR|RCODE_SERVFAIL)
+	// the question is echoed, nothing else
+	if q.questionEnd == 0 {
+		binary.BigEndian.PutUint16(out[4:6], 0)
+	}
+	clear(out[6:12])
+	return out
+}
@@ -0,0 +1,85 @@
+package dns
+
+import (
+	"strconv"
+	"sync"
+	"time"
+
+	"github.com/felipeek/sknf/sknf-app/internal/metrics"
+)
+
+const (
+	RESULT_HIT = iota
+	RESULT_MISS
+	RESULT_ERROR
+	RESULT_COUNT
+)
+
+var resultNames = [RESULT_COUNT]string{"hit", "miss", "error"}
+
+// Upper bounds of the request duration histogram; hits take microseconds, misses a pod network round trip
+var durationBuckets = []time.Duration{
+	10 * time.Microsecond, 25 * time.Microsecond, 50 * time.Microsecond, 100 * time.Microsecond,
+	250 * time.Microsecond, 500 * time.Microsecond, time.Millisecond, 2500 * time.Microsecond,
+	5 * time.Millisecond, 10 * time.Millisecond, 25 * time.Millisecond, 50 * time.Millisecond,
+	100 * time.Millisecond, 250 * time.Millisecond, 500 * time.Millisecond, time.Second,
+}
+
+type stats struct {
+	mu sync.Mutex
+	// per result; counts[r][i] is the number of requests within durationBuckets[i], the last one counts all
+	counts [RESULT_COUNT][]uint64
+	sums   [RESULT_COUNT]time.Duration
+}
+
+func (s *stats) observe(result int, d time.Duration) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if s.counts[result] == nil {
+		s.counts[result] = make([]uint64, len(durationBuckets)+1)
+	}
+	for i, le := range durationBuckets {
+		if d <= le {
+			s.counts[result][i]++
+		}
+	}
+	s.counts[result][len(durationBuckets)]++
+	s.sums[result] += d
+}
+
+func (f *Forwarder) WriteMetrics(w *metrics.Writer) {
+	f.stats.mu.Lock()
+	defer f.stats.mu.Unlock()
+
+	w.Family("sknf_dns_requests_total", "counter", "DNS queries answered by the node-local cache, by result (hit, miss forwarded to CoreDNS, error).")
+	for r, name := range resultNames {
+		var n uint64
+		if c := f.stats.counts[r]; c != nil {
+			n = c[len(durationBuckets)]
+		}
+		w.Sample("sknf_dns_requests_total", float64(n), "result", name)
+	}
+
+	w.Family("sknf_dns_request_duration_seconds", "histogram", "Time from a DNS query to its answer in the node-local cache, by result.")
+	for r, name := range resultNames {
+		c := f.stats.counts[r]
+		if c == nil {
+			continue
+		}
+		for i, le := range durationBuckets {
+			w.Sample("sknf_dns_request_duration_seconds_bucket", float64(c[i]), "result", name, "le", strconv.FormatFloat(le.Seconds(), 'g', -1, 64))
+		}
+		w.Sample("sknf_dns_request_duration_seconds_bucket", float64(c[len(durationBuckets)]), "result", name, "le", "+Inf")
+		w.Sample("sknf_dns_request_duration_seconds_sum", f.stats.sums[r].Seconds(), "result", name)
+		w.Sample("sknf_dns_request_duration_seconds_count", float64(c[len(durationBuckets)]), "result", name)
+	}
+
+	w.Family("sknf_dns_cache_entries", "gauge", "Answers held by the node-local DNS cache.")
+	w.Sample("sknf_dns_cache_entries", float64(f.cache.len()))
+
+	f.mu.Lock()
+	upstreams := len(f.udpUpstreams)
+	f.mu.Unlock()
+	w.Family("sknf_dns_upstreams", "gauge", "CoreDNS endpoints misses are forwarded to.")
+	w.Sample("sknf_dns_upstreams", float64(upstreams))
+}
@@ -0,0 +1,145 @@
+package dns
+
+import (
+	"encoding/binary"
+	"fmt"
+	"net"
+	"slices"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nft"
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Chains skipping conntrack for DNS traffic to (and from) the forwarder, at raw priority so that they
+// run before conntrack and NAT
+const PREROUTING_CHAIN_NAME = "DNS_PREROUTING"
+const OUTPUT_CHAIN_NAME = "DNS_OUTPUT"
+
+// The DNS service ClusterIP is assigned to lo under this label, which Teardown looks for
+const LOOPBACK_IF = "lo"
+const SERVICE_ADDR_LABEL = "lo:sknfdns"
+
+// Redirect keeps DNS traffic to and from the forwarder addresses out of conntrack. With the ClusterIP
+// assigned to the node (AddServiceAddr), queries to the DNS service are then delivered to the forwarder
+// instead of being DNATed to a CoreDNS pod. It is installed once the forwarder listens.
+func Redirect(serviceIP, bridgeIP net.IP) error {
+	sk, err := nl.Open(syscall.NETLINK_NETFILTER)
+	if err != nil {
+		return err
+	}
+	defer sk.Close()
+
+	b := nft.NewBatch(sk)
+	b.AddTable()
+	b.AddBaseChain(PREROUTING_CHAIN_NAME, "filter", nft.NF_INET_PRE_ROUTING, nft.NF_IP_PRI_RAW)
+	b.FlushChain(PREROUTING_CHAIN_NAME)
+	b.AddBaseChain(OUTPUT_CHAIN_NAME, "filter", nft.NF_INET_LOCAL_OUT, nft.NF_IP_PRI_RAW)
+	b.FlushChain(OUTPUT_CHAIN_NAME)
+	for _, ip := range []net.IP{serviceIP, bridgeIP} {
+		// queries from pods, and from the node itself
+		notrack(b, PREROUTING_CHAIN_NAME, nft.IPV4_DADDR_OFFSET, ip, nft.TH_DPORT_OFFSET)
+		notrack(b, OUTPUT_CHAIN_NAME, nft.IPV4_DADDR_OFFSET, ip, nft.TH_DPORT_OFFSET)
+		// answers
+		notrack(b, OUTPUT_CHAIN_NAME, nft.IPV4_SADDR_OFFSET, ip, nft.TH_SPORT_OFFSET)
+	}
+	if err := b.Commit(); err != nil {
+		return fmt.Errorf("installing the DNS redirect: %w", err)
+	}
+	return nil
+}
+
+// notrack appends to chain: ip saddr|daddr <ip> meta l4proto {udp, tcp} th sport|dport 53 notrack
+func notrack(b *nft.Batch, chain string, addrOffset uint32, ip net.IP, portOffset uint32) {
+	for _, proto := range []byte{syscall.IPPROTO_UDP, syscall.IPPROTO_TCP} {
+		b.AddRule(chain,
+			nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, addrOffset, net.IPv4len, nft.NFT_REG_1),
+			nft.Cmp(nft.NFT_REG_1, nft.NFT_CMP_EQ, ip.To4()),
+			nft.Meta(nft.NFT_META_L4PROTO, nft.NFT_REG_1),
+			nft.Cmp(nft.NFT_REG_1, nft.NFT_CMP_EQ, []byte{proto}),
+			nft.Payload(nft.NFT_PAYLOAD_TRANSPORT_HEADER, portOffset, 2, nft.NFT_REG_1),
+			nft.Cmp(nft.NFT_REG_1, nft.NFT_CMP_EQ, binary.BigEndian.AppendUint16(nil, DNS_PORT)),
+			nft.Notrack())
+	}
+}
+
+// AddServiceAddr assigns the DNS service ClusterIP to lo.
+func AddServiceAddr(serviceIP net.IP) error {
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		return err
+	}
+	defer sk.Close()
+
+	lo, err := net.InterfaceByName(LOOPBACK_IF)
+	if err != nil {
+		return err
+	}
+	req := ifAddrMsg(lo.Index, 32)
+	req = nl.AppendAttr(req, syscall.IFA_LOCAL, serviceIP.To4())
+	req = nl.AppendAttr(req, syscall.IFA_ADDRESS, serviceIP.To4())
+	req = nl.AppendStringAttr(req, syscall.IFA_LABEL, SERVICE_ADDR_LABEL)
+	if err := sk.Request(syscall.RTM_NEWADDR, syscall.NLM_F_CREATE|syscall.NLM_F_REPLACE, req); err != nil {
+		return fmt.Errorf("assigning %s/32 to %s: %w", serviceIP, LOOPBACK_IF, err)
+	}
+	return nil
+}
+
+// Teardown removes the redirect and the ClusterIP of lo, if present, so that pod DNS traffic goes to the
+// DNS service again. It is called at startup when the cache is disabled, after a run that had it enabled.
+func Teardown() error {
+	nftSk, err := nl.Open(syscall.NETLINK_NETFILTER)
+	if err != nil {
+		return err
+	}
+	defer nftSk.Close()
+	chains, err := nft.ListChains(nftSk)
+	if err != nil {
+		return err
+	}
+	b := nft.NewBatch(nftSk)
+	for _, chain := range []string{PREROUTING_CHAIN_NAME, OUTPUT_CHAIN_NAME} {
+		if slices.Contains(chains, chain) {
+			b.FlushChain(chain)
+			b.DelChain(chain)
+		}
+	}
+	if !b.Empty() {
+		if err := b.Commit(); err != nil {
+			return fmt.Errorf("removing the DNS redirect: %w", err)
+		}
+	}
+
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		return err
+	}
+	defer sk.Close()
+	msgs, err := sk.Dump(syscall.RTM_GETADDR, ifAddrMsg(0, 0))
+	if err != nil {
+		return fmt.Errorf("dumping addresses: %w", err)
+	}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWADDR || len(m.Data) < syscall.SizeofIfAddrmsg {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[syscall.SizeofIfAddrmsg:])
+		if nl.String(attrs[syscall.IFA_LABEL]) != SERVICE_ADDR_LABEL {
+			continue
+		}
+		req := append([]byte(nil), m.Data[:syscall.SizeofIfAddrmsg]...)
+		req = nl.AppendAttr(req, syscall.IFA_LOCAL, attrs[syscall.IFA_LOCAL])
+		if err := sk.Request(syscall.RTM_DELADDR, 0, req); err != nil {
+			return fmt.Errorf("removing %s from %s: %w", net.IP(attrs[syscall.IFA_LOCAL]), LOOPBACK_IF, err)
+		}
+	}
+	return nil
+}
+
+func ifAddrMsg(index int, prefix int) []byte {
+	req := make([]byte, syscall.SizeofIfAddrmsg)
+	req[0] = syscall.AF_INET
+	req[1] = byte(prefix)
+	binary.NativeEndian.PutUint32(req[4:8], uint32(index))
+	return req
+}
@@ -0,0 +1,162 @@
+package dns
+
+import (
+	"context"
+	"fmt"
+	"net"
+	"net/netip"
+	"os"
+	"slices"
+	"strings"
+
+	corev1 "k8s.io/api/core/v1"
+	discoveryv1 "k8s.io/api/discovery/v1"
+	metav1 "k8s.io/apimachinery/pkg/apis/meta/v1"
+	"k8s.io/apimachinery/pkg/labels"
+	"k8s.io/client-go/informers"
+	"k8s.io/client-go/kubernetes"
+	"k8s.io/client-go/tools/cache"
+)
+
+const SERVICE_DEFAULT = "kube-system/kube-dns"
+
+// Start takes over the DNS service (namespace/name) for the pods of the node: it assigns the ClusterIP
+// to the node, answers on it and on bridgeIP, and redirects queries once the CoreDNS endpoints are known.
+// The upstreams follow the endpoints of the service until ctx is cancelled; the caller closes the forwarder.
+func Start(ctx context.Context, clientset kubernetes.Interface, service string, bridgeIP net.IP) (*Forwarder, error) {
+	namespace, name, ok := strings.Cut(service, "/")
+	if !ok {
+		return nil, fmt.Errorf("invalid service %q, expected namespace/name", service)
+	}
+	svc, err := clientset.CoreV1().Services(namespace).Get(context.Background(), name, metav1.GetOptions{})
+	if err != nil {
+		return nil, err
+	}
+	serviceIP := net.ParseIP(svc.Spec.ClusterIP).To4()
+	if serviceIP == nil {
+		return nil, fmt.Errorf("service %s has no IPv4 ClusterIP", service)
+	}
+
+	factory := informers.NewSharedInformerFactoryWithOptions(clientset, 0, informers.WithNamespace(namespace),
+		informers.WithTweakListOptions(func(o *metav1.ListOptions) {
+			o.LabelSelector = discoveryv1.LabelServiceName + "=" + name
+		}))
+	endpointSlices := factory.Discovery().V1().EndpointSlices()
+
+	dirty := make(chan struct{}, 1)
+	kick := func() {
+		select {
+		case dirty <- struct{}{}:
+		default:
+		}
+	}
+	endpointSlices.Informer().AddEventHandler(cache.ResourceEventHandlerFuncs{
+		AddFunc:    func(obj interface{}) { kick() },
+		UpdateFunc: func(oldObj, newObj interface{}) { kick() },
+		DeleteFunc: func(obj interface{}) { kick() },
+	})
+
+	factory.Start(ctx.Done())
+	for typ, ok := range factory.WaitForCacheSync(ctx.Done()) {
+		if !ok {
+			return nil, fmt.Errorf("syncing %v cache", typ)
+		}
+	}
+	list, err := endpointSlices.Lister().List(labels.Everything())
+	if err != nil {
+		return nil, err
+	}
+
+	// the ClusterIP must be local before anything listens on it
+	if err := AddServiceAddr(serviceIP); err != nil {
+		return nil, err
+	}
+	f, err := New(serviceIP, bridgeIP)
+	if err != nil {
+		Teardown()
+		return nil, err
+	}
+	f.SetUpstreams(upstreams(list, svc))
+	if err := Redirect(serviceIP, bridgeIP); err != nil {
+		f.Close()
+		return nil, err
+	}
+	go f.Serve()
+
+	go func() {
+		for {
+			select {
+			case <-ctx.Done():
+				return
+			case <-dirty:
+			}
+			list, err := endpointSlices.Lister().List(labels.Everything())
+			if err != nil {
+				fmt.Fprintf(os.Stderr, "[sknf] Failure listing endpoints of %s: %v\n", service, err)
+				continue
+			}
+			udp, tcp := upstreams(list, svc)
+			if len(udp) == 0 {
+				fmt.Fprintf(os.Stderr, "[sknf] No ready endpoint behind %s, DNS queries fail until there is one\n", service)
+			}
+			f.SetUpstreams(udp, tcp)
+		}
+	}()
+	return f, nil
+}
+
+// upstreams returns the ready endpoints of the UDP and TCP DNS ports of the service, in a stable order
+func upstreams(endpointSlices []*discoveryv1.EndpointSlice, svc *corev1.Service) (udp, tcp []netip.AddrPort) {
+	for _, port := range svc.Spec.Ports {
+		if port.Port != DNS_PORT {
+			continue
+		}
+		switch port.Protocol {
+		case corev1.ProtocolUDP:
+			udp = endpoints(endpointSlices, &port)
+		case corev1.ProtocolTCP:
+			tcp = endpoints(endpointSlices, &port)
+		}
+	}
+	return udp, tcp
+}
+
+func endpoints(endpointSlices []*discoveryv1.EndpointSlice, port *corev1.ServicePort) []netip.AddrPort {
+	var out []netip.AddrPort
+	for _, eps := range endpointSlices {
+		if eps.AddressType != discoveryv1.AddressTypeIPv4 {
+			continue
+		}
+		// endpoint slice ports are matched by name, which is empty for single-port services
+		var target uint16
+		for _, p := range eps.Ports {
+			protocol := corev1.ProtocolTCP
+			if p.Protocol != nil {
+				protocol = *p.Protocol
+			}
+			name := ""
+			if p.Name != nil {
+				name = *p.Name
+			}
+			if name == port.Name && protocol == port.Protocol && p.Port != nil {
+				target = uint16(*p.Port)
+			}
+		}
+		if target == 0 {
+			continue
+		}
+
+		for _, ep := range eps.Endpoints {
+			if ep.Conditions.Ready != nil && !*ep.Conditions.Ready {
+				continue
+			}
+			for _, addr := range ep.Addresses {
+				if ip, err := netip.ParseAddr(addr); err == nil && ip.Is4() {
+					out = append(out, netip.AddrPortFrom(ip, target))
+				}
+			}
+		}
+	}
+	slices.SortFunc(out, netip.AddrPort.Compare)
+	return slices.Compact(out)
+}
@@ -0,0 +1,68 @@
+// Package link creates and removes host network interfaces over rtnetlink.
+package link
+
+import (
+	"errors"
+	"fmt"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// linux/if_link.h: IFLA_INFO_* (nested in IFLA_LINKINFO) and IFLA_NETKIT_* (nested in IFLA_INFO_DATA)
+const IFLA_INFO_KIND = 1
+const IFLA_INFO_DATA = 2
+const IFLA_NETKIT_PEER_INFO = 1
+const IFLA_NETKIT_MODE = 5
+
+// enum netkit_mode
+const NETKIT_L2 = 0
+
+// Names of the throwaway pair created by NetkitSupported
+const NETKIT_PROBE_NAME = "nkprobesknf"
+const NETKIT_PROBE_PEER_NAME = "nkprobesknf-p"
+
+// NetkitSupported reports whether the kernel can create netkit pairs (Linux 6.7+ built with CONFIG_NETKIT)
+// by creating one the way sknf-cni does and deleting it right away. Only EOPNOTSUPP, the answer of kernels
+// that do not know the "netkit" link kind, means unsupported; other failures are returned.
+func NetkitSupported() (bool, error) {
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		return false, err
+	}
+	defer sk.Close()
+
+	// a leftover from a probe interrupted midway would make the creation fail with EEXIST
+	deleteLink(sk, NETKIT_PROBE_NAME)
+
+	req := nl.IfInfoMsg(0, 0)
+	req = nl.AppendStringAttr(req, syscall.IFLA_IFNAME, NETKIT_PROBE_NAME)
+	req = nl.AppendNested(req, syscall.IFLA_LINKINFO, func(b []byte) []byte {
+		b = nl.AppendStringAttr(b, IFLA_INFO_KIND, "netkit")
+		return nl.AppendNested(b, IFLA_INFO_DATA, func(b []byte) []byte {
+			b = nl.AppendAttr(b, IFLA_NETKIT_MODE, nl.U32(NETKIT_L2))
+			return nl.AppendNested(b, IFLA_NETKIT_PEER_INFO, func(b []byte) []byte {
+				b = append(b, nl.IfInfoMsg(0, 0)...)
+				return nl.AppendStringAttr(b, syscall.IFLA_IFNAME, NETKIT_PROBE_PEER_NAME)
+			})
+		})
+	})
+
+	err = sk.Request(syscall.RTM_NEWLINK, syscall.NLM_F_CREATE|syscall.NLM_F_EXCL, req)
+	if errors.Is(err, syscall.EOPNOTSUPP) {
+		return false, nil
+	}
+	if err != nil {
+		return false, fmt.Errorf("creating netkit pair: %w", err)
+	}
+
+	// deleting one end removes the pair
+	if err := deleteLink(sk, NETKIT_PROBE_NAME); err != nil {
+		return true, fmt.Errorf("deleting netkit pair %s: %w", NETKIT_PROBE_NAME, err)
+	}
+	return true, nil
+}
+
+func deleteLink(sk *nl.Socket, name string) error {
+	return sk.Request(syscall.RTM_DELLINK, 0, nl.AppendStringAttr(nl.IfInfoMsg(0, 0), syscall.IFLA_IFNAME, name))
+}
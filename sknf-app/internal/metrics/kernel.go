@@ -0,0 +1,469 @@
+package metrics
+
+import (
+	"context"
+	"encoding/binary"
+	"fmt"
+	"net"
+	"os"
+	"strconv"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+
+	"github.com/felipeek/sknf/sknf-app/internal/ct"
+	"github.com/felipeek/sknf/sknf-app/internal/nft"
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Interface names must match the ones created by sknf-cni (see sknf-cni/src/net.h and net.c).
+const HOST_BRIDGE_NAME = "brsknf"
+const HOST_VXLAN_NAME = "vxsknf"
+const HOST_VETH_NAME_PREFIX = "sknf"
+const CONTAINER_VETH_TMP_NAME_PREFIX = "tmp"
+
+const CONNTRACK_COUNT_PATH = "/proc/sys/net/netfilter/nf_conntrack_count"
+const CONNTRACK_MAX_PATH = "/proc/sys/net/netfilter/nf_conntrack_max"
+
+// rtnetlink attributes not exported by the syscall package
+const IFLA_STATS64 = 23
+const NDA_MASTER = 9
+const IFF_LOWER_UP = 0x10000
+const SIZEOF_NDMSG = 12
+
+type KernelConfig struct {
+	// Node pod CIDR, used to compute IPAM capacity
+	Subnet string
+	// Path to the sknf-cni IPAM state file, as seen by sknf-app
+	IpamStatePath string
+	// How often the kernel is polled; scrapes are served from the last poll
+	Interval time.Duration
+	// Pods are routed (podAttach "routed"), so their host veths are not expected to be bridged
+	RoutedPods bool
+}
+
+type linkStats struct {
+	name      string
+	index     int32
+	master    int32
+	flags     uint32
+	rxPackets uint64
+	txPackets uint64
+	rxBytes   uint64
+	txBytes   uint64
+	rxErrors  uint64
+	txErrors  uint64
+	rxDropped uint64
+	txDropped uint64
+}
+
+// Source NAT usage of one egress address and protocol. Ports are allocated per destination,
+// so exhaustion happens when maxPerDestination approaches the size of the port range.
+type snatUsage struct {
+	egressIP          string
+	protocol          string
+	conns             uint64
+	maxPerDestination uint64
+}
+
+type kernelSnapshot struct {
+	veths           []linkStats
+	vxlan           *linkStats
+	bridgeFdb       int
+	vxlanFdb        int
+	unbridgedVeths  int
+	tmpInterfaces   int
+	conntrackCount  uint64
+	conntrackMax    uint64
+	conntrackOk     bool
+	ipamAllocated   uint64
+	ipamCapacity    uint64
+	ipamOk          bool
+	podCounters     []nft.PodCounter
+	snat            []snatUsage
+	snatOk          bool
+	collectDuration time.Duration
+}
+
+// KernelCollector polls node network state with one link dump, one FDB dump, one
+// nftables counter dump and one conntrack dump per interval, independently of the number
+// of pods, and serves the last result on scrape.
+type KernelCollector struct {
+	cfg KernelConfig
+
+	mu            sync.RWMutex
+	snap          *kernelSnapshot
+	collectErrors uint64
+}
+
+func NewKernelCollector(cfg KernelConfig) *KernelCollector {
+	return &KernelCollector{cfg: cfg}
+}
+
+func (c *KernelCollector) Run(ctx context.Context) {
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure opening rtnetlink socket for metrics: %v\n", err)
+		return
+	}
+	defer sk.Close()
+
+	nfsk, err := nl.Open(syscall.NETLINK_NETFILTER)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure opening nfnetlink socket for metrics: %v\n", err)
+		return
+	}
+	defer nfsk.Close()
+
+	ticker := time.NewTicker(c.cfg.Interval)
+	defer ticker.Stop()
+
+	for {
+		snap, err := c.collect(sk, nfsk)
+		c.mu.Lock()
+		if err != nil {
+			c.collectErrors++
+			fmt.Fprintf(os.Stderr, "[sknf] Failure collecting kernel metrics: %v\n", err)
+		} else {
+			c.snap = snap
+		}
+		c.mu.Unlock()
+
+		select {
+		case <-ctx.Done():
+			return
+		case <-ticker.C:
+		}
+	}
+}
+
+func (c *KernelCollector) collect(sk, nfsk *nl.Socket) (*kernelSnapshot, error) {
+	start := time.Now()
+	snap := &kernelSnapshot{}
+
+	// one dump for every link: names, masters and IFLA_STATS64 come in the same reply
+	ifinfo := make([]byte, syscall.SizeofIfInfomsg)
+	ifinfo[0] = syscall.AF_UNSPEC
+	msgs, err := sk.Dump(syscall.RTM_GETLINK, ifinfo)
+	if err != nil {
+		return nil, fmt.Errorf("dumping links: %w", err)
+	}
+
+	var bridgeIndex, vxlanIndex int32
+	var veths []linkStats
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWLINK || len(m.Data) < syscall.SizeofIfInfomsg {
+			continue
+		}
+		l := parseLink(m.Data)
+		switch {
+		case l.name == HOST_BRIDGE_NAME:
+			bridgeIndex = l.index
+		case l.name == HOST_VXLAN_NAME:
+			vxlanIndex = l.index
+			v := l
+			snap.vxlan = &v
+		case nl.IsGeneratedName(l.name, HOST_VETH_NAME_PREFIX):
+			veths = append(veths, l)
+		case nl.IsGeneratedName(l.name, CONTAINER_VETH_TMP_NAME_PREFIX):
+			// container-side veths are renamed and moved away on success; one left behind
+			// in the host netns means an ADD failed halfway through
+			snap.tmpInterfaces++
+		}
+	}
+
+	for _, v := range veths {
+		if !c.cfg.RoutedPods && (bridgeIndex == 0 || v.master != bridgeIndex) {
+			snap.unbridgedVeths++
+		}
+	}
+	snap.veths = veths
+
+	// one dump for the whole bridge-family neighbour table
+	ndmsg := make([]byte, SIZEOF_NDMSG)
+	ndmsg[0] = syscall.AF_BRIDGE
+	msgs, err = sk.Dump(syscall.RTM_GETNEIGH, ndmsg)
+	if err != nil {
+		return nil, fmt.Errorf("dumping fdb: %w", err)
+	}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWNEIGH || len(m.Data) < SIZEOF_NDMSG {
+			continue
+		}
+		ifindex := int32(binary.NativeEndian.Uint32(m.Data[4:8]))
+		attrs := nl.Attrs(m.Data[SIZEOF_NDMSG:])
+		if master, ok := attrs[NDA_MASTER]; ok && bridgeIndex != 0 && int32(nl.Uint32(master)) == bridgeIndex {
+			snap.bridgeFdb++
+		} else if vxlanIndex != 0 && ifindex == vxlanIndex {
+			snap.vxlanFdb++
+		}
+	}
+
+	snap.conntrackCount, err = readUint(CONNTRACK_COUNT_PATH)
+	if err == nil {
+		snap.conntrackMax, err = readUint(CONNTRACK_MAX_PATH)
+		snap.conntrackOk = err == nil
+	}
+
+	snap.ipamAllocated, snap.ipamCapacity, err = ipamUsage(c.cfg.Subnet, c.cfg.IpamStatePath)
+	snap.ipamOk = err == nil
+
+	// per-pod accounting counters kept by sknf-cni in the sknf nftables table
+	snap.podCounters, err = nft.DumpPodCounters(nfsk)
+	if err != nil {
+		return nil, err
+	}
+
+	// a missing conntrack module only hides the SNAT metrics
+	snap.snat, err = snatUsageOf(nfsk, c.cfg.Subnet)
+	snap.snatOk = err == nil
+
+	snap.collectDuration = time.Since(start)
+	return snap, nil
+}
+
+// snatUsageOf counts the source-NATed connections of the pods of subnet per egress address,
+// protocol and destination.
+func snatUsageOf(nfsk *nl.Socket, subnet string) ([]snatUsage, error) {
+	_, ipnet, err := net.ParseCIDR(subnet)
+	if err != nil {
+		return nil, err
+	}
+	base := nl.IPv4ToUint(ipnet.IP)
+	mask := nl.IPv4ToUint(net.IP(ipnet.Mask))
+
+	type egressKey struct {
+		ip    uint32
+		proto uint8
+	}
+	type destKey struct {
+		egressKey
+		dst  uint32
+		port uint16
+	}
+	perEgress := make(map[egressKey]uint64)
+	perDest := make(map[destKey]uint64)
+
+	err = ct.Dump(nfsk, func(c *ct.Conn) {
+		if c.Status&ct.IPS_SRC_NAT == 0 || c.Orig.Src&mask != base {
+			return
+		}
+		k := egressKey{c.Reply.Dst, c.Orig.Proto}
+		perEgress[k]++
+		perDest[destKey{k, c.Orig.Dst, c.Orig.DstPort}]++
+	})
+	if err != nil {
+		return nil, err
+	}
+
+	maxPerDest := make(map[egressKey]uint64)
+	for k, n := range perDest {
+		maxPerDest[k.egressKey] = max(maxPerDest[k.egressKey], n)
+	}
+
+	usage := make([]snatUsage, 0, len(perEgress))
+	for k, n := range perEgress {
+		usage = append(usage, snatUsage{
+			egressIP:          net.IPv4(byte(k.ip>>24), byte(k.ip>>16), byte(k.ip>>8), byte(k.ip)).String(),
+			protocol:          protocolName(k.proto),
+			conns:             n,
+			maxPerDestination: maxPerDest[k],
+		})
+	}
+	return usage, nil
+}
+
+func protocolName(proto uint8) string {
+	switch proto {
+	case syscall.IPPROTO_TCP:
+		return "tcp"
+	case syscall.IPPROTO_UDP:
+		return "udp"
+	case syscall.IPPROTO_ICMP:
+		return "icmp"
+	}
+	return strconv.Itoa(int(proto))
+}
+
+func parseLink(b []byte) linkStats {
+	l := linkStats{
+		index: int32(binary.NativeEndian.Uint32(b[4:8])),
+		flags: binary.NativeEndian.Uint32(b[8:12]),
+	}
+	attrs := nl.Attrs(b[syscall.SizeofIfInfomsg:])
+	l.name = nl.String(attrs[syscall.IFLA_IFNAME])
+	l.master = int32(nl.Uint32(attrs[syscall.IFLA_MASTER]))
+	if s := attrs[IFLA_STATS64]; len(s) >= 8*8 {
+		// struct rtnl_link_stats64 leading fields
+		l.rxPackets = nl.Uint64(s[0:])
+		l.txPackets = nl.Uint64(s[8:])
+		l.rxBytes = nl.Uint64(s[16:])
+		l.txBytes = nl.Uint64(s[24:])
+		l.rxErrors = nl.Uint64(s[32:])
+		l.txErrors = nl.Uint64(s[40:])
+		l.rxDropped = nl.Uint64(s[48:])
+		l.txDropped = nl.Uint64(s[56:])
+	}
+	return l
+}
+
+func readUint(path string) (uint64, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return 0, err
+	}
+	return strconv.ParseUint(strings.TrimSpace(string(data)), 10, 64)
+}
+
+// Released addresses of sknf-cni, next to its IPAM state file: lines with an address alone
+const IPAM_LEASES_SUFFIX = "-leases"
+
+// ipamUsage mirrors sknf-cni's IPAM (sknf-cni/src/ip.c): the first address of the
+// subnet is the network, the second belongs to the bridge and the state file holds
+// the last address handed to a container. Released addresses up to it are free again.
+func ipamUsage(subnet, statePath string) (uint64, uint64, error) {
+	_, ipnet, err := net.ParseCIDR(subnet)
+	if err != nil {
+		return 0, 0, err
+	}
+	ones, bits := ipnet.Mask.Size()
+	size := uint64(1) << uint(bits-ones)
+	capacity := uint64(0)
+	if size > 3 {
+		capacity = size - 3 // network, bridge and broadcast
+	}
+
+	data, err := os.ReadFile(statePath)
+	if os.IsNotExist(err) {
+		return 0, capacity, nil
+	}
+	if err != nil {
+		return 0, capacity, err
+	}
+
+	last, _, err := net.ParseCIDR(strings.TrimSpace(string(data)))
+	if err != nil {
+		return 0, capacity, err
+	}
+
+	base := nl.IPv4ToUint(ipnet.IP)
+	lastInt := nl.IPv4ToUint(last)
+	if lastInt <= base+1 {
+		return 0, capacity, nil
+	}
+	allocated := uint64(lastInt - base - 1)
+
+	leases, err := os.ReadFile(statePath + IPAM_LEASES_SUFFIX)
+	if err != nil && !os.IsNotExist(err) {
+		return 0, capacity, err
+	}
+	for _, line := range strings.Split(string(leases), "\n") {
+		ip := net.ParseIP(line).To4()
+		if ip != nil && nl.IPv4ToUint(ip) > base+1 && nl.IPv4ToUint(ip) <= lastInt && allocated > 0 {
+			allocated--
+		}
+	}
+	return allocated, capacity, nil
+}
+
+func (c *KernelCollector) WriteMetrics(w *Writer) {
+	c.mu.RLock()
+	snap := c.snap
+	collectErrors := c.collectErrors
+	c.mu.RUnlock()
+
+	w.Family("sknf_kernel_collect_errors_total", "counter", "Kernel polls that failed.")
+	w.Sample("sknf_kernel_collect_errors_total", float64(collectErrors))
+
+	if snap == nil {
+		return
+	}
+
+	w.Family("sknf_kernel_collect_duration_seconds", "gauge", "Time spent in the last kernel poll.")
+	w.Sample("sknf_kernel_collect_duration_seconds", snap.collectDuration.Seconds())
+
+	vethCounters := []struct {
+		name string
+		help string
+		get  func(l *linkStats) uint64
+	}{
+		{"sknf_veth_rx_bytes_total", "Bytes received by the host veth (sent by the pod).", func(l *linkStats) uint64 { return l.rxBytes }},
+		{"sknf_veth_tx_bytes_total", "Bytes transmitted by the host veth (received by the pod).", func(l *linkStats) uint64 { return l.txBytes }},
+		{"sknf_veth_rx_packets_total", "Packets received by the host veth.", func(l *linkStats) uint64 { return l.rxPackets }},
+		{"sknf_veth_tx_packets_total", "Packets transmitted by the host veth.", func(l *linkStats) uint64 { return l.txPackets }},
+		{"sknf_veth_rx_dropped_total", "Packets dropped on receive by the host veth.", func(l *linkStats) uint64 { return l.rxDropped }},
+		{"sknf_veth_tx_dropped_total", "Packets dropped on transmit by the host veth.", func(l *linkStats) uint64 { return l.txDropped }},
+	}
+	for _, vc := range vethCounters {
+		w.Family(vc.name, "counter", vc.help)
+		for i := range snap.veths {
+			w.Sample(vc.name, float64(vc.get(&snap.veths[i])), "interface", snap.veths[i].name)
+		}
+	}
+
+	w.Family("sknf_pod_bytes_total", "counter", "Bytes forwarded for a local pod, by direction (egress leaves the cluster, crossnode goes to pods on other nodes, ingress reaches the pod).")
+	for _, pc := range snap.podCounters {
+		w.Sample("sknf_pod_bytes_total", float64(pc.Bytes), "pod_ip", pc.PodIP, "direction", pc.Direction)
+	}
+	w.Family("sknf_pod_packets_total", "counter", "Packets forwarded for a local pod, by direction.")
+	for _, pc := range snap.podCounters {
+		w.Sample("sknf_pod_packets_total", float64(pc.Packets), "pod_ip", pc.PodIP, "direction", pc.Direction)
+	}
+
+	w.Family("sknf_pod_interfaces", "gauge", "Host-side pod veths present on the node.")
+	w.Sample("sknf_pod_interfaces", float64(len(snap.veths)))
+
+	if snap.vxlan != nil {
+		vxlanCounters := []struct {
+			name string
+			help string
+			val  uint64
+		}{
+			{"sknf_vxlan_rx_bytes_total", "Bytes decapsulated by vxsknf.", snap.vxlan.rxBytes},
+			{"sknf_vxlan_tx_bytes_total", "Bytes encapsulated by vxsknf.", snap.vxlan.txBytes},
+			{"sknf_vxlan_rx_errors_total", "Decapsulation errors on vxsknf.", snap.vxlan.rxErrors},
+			{"sknf_vxlan_tx_errors_total", "Encapsulation errors on vxsknf (e.g. no route to the remote VTEP).", snap.vxlan.txErrors},
+			{"sknf_vxlan_rx_dropped_total", "Packets dropped by vxsknf on receive.", snap.vxlan.rxDropped},
+			{"sknf_vxlan_tx_dropped_total", "Packets dropped by vxsknf on transmit.", snap.vxlan.txDropped},
+		}
+		for _, vc := range vxlanCounters {
+			w.Family(vc.name, "counter", vc.help)
+			w.Sample(vc.name, float64(vc.val))
+		}
+	}
+
+	w.Family("sknf_bridge_fdb_entries", "gauge", "Forwarding database entries learned by brsknf.")
+	w.Sample("sknf_bridge_fdb_entries", float64(snap.bridgeFdb))
+	w.Family("sknf_vxlan_fdb_entries", "gauge", "Forwarding database entries held by vxsknf.")
+	w.Sample("sknf_vxlan_fdb_entries", float64(snap.vxlanFdb))
+
+	w.Family("sknf_leaked_interfaces", "gauge", "Interfaces left behind by incomplete ADD/DEL invocations.")
+	w.Sample("sknf_leaked_interfaces", float64(snap.unbridgedVeths), "reason", "unbridged_veth")
+	w.Sample("sknf_leaked_interfaces", float64(snap.tmpInterfaces), "reason", "temporary_name")
+
+	if snap.conntrackOk {
+		w.Family("sknf_conntrack_entries", "gauge", "Entries in the node conntrack table.")
+		w.Sample("sknf_conntrack_entries", float64(snap.conntrackCount))
+		w.Family("sknf_conntrack_max_entries", "gauge", "Size limit of the node conntrack table.")
+		w.Sample("sknf_conntrack_max_entries", float64(snap.conntrackMax))
+	}
+
+	if snap.snatOk {
+		w.Family("sknf_snat_connections", "gauge", "Connections of local pods source-NATed behind an egress address.")
+		for _, u := range snap.snat {
+			w.Sample("sknf_snat_connections", float64(u.conns), "egress_ip", u.egressIP, "protocol", u.protocol)
+		}
+		w.Family("sknf_snat_max_destination_connections", "gauge", "Largest number of those connections towards a single destination address and port; each destination has its own source port range.")
+		for _, u := range snap.snat {
+			w.Sample("sknf_snat_max_destination_connections", float64(u.maxPerDestination), "egress_ip", u.egressIP, "protocol", u.protocol)
+		}
+	}
+
+	if snap.ipamOk {
+		w.Family("sknf_ipam_allocated_addresses", "gauge", "Pod addresses handed out from the node subnet.")
+		w.Sample("sknf_ipam_allocated_addresses", float64(snap.ipamAllocated))
+		w.Family("sknf_ipam_capacity_addresses", "gauge", "Pod addresses available in the node subnet.")
+		w.Sample("sknf_ipam_capacity_addresses", float64(snap.ipamCapacity))
+	}
+}
@@ -0,0 +1,49 @@
+// Package metrics exposes node network health in the Prometheus text format.
+package metrics
+
+import (
+	"context"
+	"fmt"
+	"net/http"
+	"os"
+	"time"
+)
+
+// Source contributes metric families to every scrape. Sources must render from
+// state they already hold; a scrape never triggers kernel round-trips.
+type Source interface {
+	WriteMetrics(w *Writer)
+}
+
+func Handler(sources ...Source) http.Handler {
+	return http.HandlerFunc(func(rw http.ResponseWriter, r *http.Request) {
+		w := &Writer{}
+		for _, s := range sources {
+			s.WriteMetrics(w)
+		}
+		rw.Header().Set("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+		rw.Write(w.Bytes())
+	})
+}
+
+// Serve runs the metrics HTTP server until ctx is cancelled.
+func Serve(ctx context.Context, addr string, sources ...Source) {
+	mux := http.NewServeMux()
+	mux.Handle("/metrics", Handler(sources...))
+
+	srv := &http.Server{
+		Addr:              addr,
+		Handler:           mux,
+		ReadHeaderTimeout: 5 * time.Second,
+	}
+
+	go func() {
+		<-ctx.Done()
+		srv.Close()
+	}()
+
+	fmt.Printf("[sknf] Serving metrics on %s/metrics\n", addr)
+	if err := srv.ListenAndServe(); err != nil && err != http.ErrServerClosed {
+		fmt.Fprintf(os.Stderr, "[sknf] Metrics server failed: %v\n", err)
+	}
+}
@@ -0,0 +1,316 @@
+package nft
+
+import (
+	"encoding/binary"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+const NFNL_MSG_BATCH_BEGIN = 0x10
+const NFNL_MSG_BATCH_END = 0x11
+
+// enum nf_tables_msg_types
+const NFT_MSG_NEWTABLE = 0
+const NFT_MSG_NEWCHAIN = 3
+const NFT_MSG_DELCHAIN = 5
+const NFT_MSG_NEWRULE = 6
+const NFT_MSG_DELRULE = 8
+const NFT_MSG_NEWSET = 9
+const NFT_MSG_NEWSETELEM = 12
+const NFT_MSG_DELSETELEM = 14
+const NFT_MSG_DELOBJ = 20
+
+const NFTA_LIST_ELEM = 1
+
+const NFTA_TABLE_NAME = 1
+
+const NFTA_CHAIN_TABLE = 1
+const NFTA_CHAIN_NAME = 3
+const NFTA_CHAIN_HOOK = 4
+const NFTA_CHAIN_TYPE = 7
+const NFTA_HOOK_HOOKNUM = 1
+const NFTA_HOOK_PRIORITY = 2
+
+const NFTA_RULE_TABLE = 1
+const NFTA_RULE_CHAIN = 2
+const NFTA_RULE_EXPRESSIONS = 4
+
+const NFTA_SET_TABLE = 1
+const NFTA_SET_NAME = 2
+const NFTA_SET_FLAGS = 3
+const NFTA_SET_KEY_TYPE = 4
+const NFTA_SET_KEY_LEN = 5
+const NFTA_SET_DATA_TYPE = 6
+const NFTA_SET_DATA_LEN = 7
+const NFTA_SET_DESC = 9
+const NFTA_SET_ID = 10
+const NFTA_SET_DESC_CONCAT = 2
+const NFTA_SET_FIELD_LEN = 1
+
+const NFT_SET_INTERVAL = 0x4
+const NFT_SET_MAP = 0x8
+const NFT_SET_CONCAT = 0x80
+
+const NFTA_SET_ELEM_LIST_TABLE = 1
+const NFTA_SET_ELEM_LIST_SET = 2
+const NFTA_SET_ELEM_LIST_ELEMENTS = 3
+const NFTA_SET_ELEM_KEY = 1
+const NFTA_SET_ELEM_DATA = 2
+const NFTA_SET_ELEM_KEY_END = 10
+
+const NFTA_DATA_VALUE = 1
+const NFTA_DATA_VERDICT = 2
+const NFTA_VERDICT_CODE = 1
+const NFTA_VERDICT_CHAIN = 2
+
+const NFT_DATA_VERDICT = 0xffffff00
+
+// nftables datatype ids (see nft's datatype.h); concatenations shift each id by 6 bits
+const NFT_DATATYPE_INTEGER = 4
+const NFT_DATATYPE_IPADDR = 7
+const NFT_DATATYPE_INET_PROTOCOL = 12
+const NFT_DATATYPE_INET_SERVICE = 13
+
+const NF_INET_PRE_ROUTING = 0
+const NF_INET_FORWARD = 2
+const NF_INET_LOCAL_OUT = 3
+const NF_INET_POST_ROUTING = 4
+const NF_IP_PRI_RAW = -300
+const NF_IP_PRI_MANGLE = -150
+const NF_IP_PRI_NAT_DST = -100
+const NF_IP_PRI_FILTER = 0
+const NF_IP_PRI_NAT_SRC = 100
+
+const NF_DROP = 0
+const NF_ACCEPT = 1
+const NFT_GOTO = -4
+
+// Elements per set element message; keeps the nested element list below the 64KB attribute limit
+const ELEMS_PER_MSG = 256
+
+// Set describes an nftables set or map. Fields lists the byte length of each concatenated
+// key component; it is only sent for concatenations.
+type Set struct {
+	Name     string
+	Flags    uint32
+	KeyType  uint32
+	KeyLen   uint32
+	Fields   []uint32
+	DataType uint32
+	DataLen  uint32
+}
+
+// Elem is a set element. KeyEnd is only used by interval sets, Verdict (and Chain, for
+// jump/goto) only by verdict maps and Data only by data maps.
+type Elem struct {
+	Key     []byte
+	KeyEnd  []byte
+	Verdict *int32
+	Chain   string
+	Data    []byte
+}
+
+// Batch is a single nftables transaction on the sknf table, committed atomically by Commit.
+// Mirrors struct NftBatch in sknf-cni/src/nft.c.
+type Batch struct {
+	sk      *nl.Socket
+	buf     []byte
+	lastOff int
+	lastSeq uint32
+	setID   uint32
+}
+
+func NewBatch(sk *nl.Socket) *Batch {
+	b := &Batch{sk: sk}
+	b.buf = append(b.buf, nl.Message(NFNL_MSG_BATCH_BEGIN, syscall.NLM_F_REQUEST, sk.NextSeq(), batchGenMsg())...)
+	return b
+}
+
+// Empty reports whether nothing was added to the batch yet.
+func (b *Batch) Empty() bool {
+	return b.lastSeq == 0
+}
+
+// Commit sends the whole transaction with a single sendmsg and returns the first error reported by the kernel.
+// Only the last message asks for an ack (errors are always reported), so large transactions do not
+// flood the receive buffer with acks.
+func (b *Batch) Commit() error {
+	if b.Empty() {
+		return nil
+	}
+	flags := binary.NativeEndian.Uint16(b.buf[b.lastOff+6:])
+	binary.NativeEndian.PutUint16(b.buf[b.lastOff+6:], flags|syscall.NLM_F_ACK)
+	b.buf = append(b.buf, nl.Message(NFNL_MSG_BATCH_END, syscall.NLM_F_REQUEST, b.sk.NextSeq(), batchGenMsg())...)
+	return b.sk.Execute(b.buf, b.lastSeq)
+}
+
+func (b *Batch) msg(typ uint16, flags uint16, attrs []byte) {
+	seq := b.sk.NextSeq()
+	b.lastSeq = seq
+	b.lastOff = len(b.buf)
+	payload := append(NfGenMsg(NFPROTO_IPV4), attrs...)
+	b.buf = append(b.buf, nl.Message(MsgType(typ), syscall.NLM_F_REQUEST|flags, seq, payload)...)
+}
+
+func (b *Batch) AddTable() {
+	b.msg(NFT_MSG_NEWTABLE, syscall.NLM_F_CREATE, nl.AppendStringAttr(nil, NFTA_TABLE_NAME, TABLE_NAME))
+}
+
+func (b *Batch) AddBaseChain(name, typ string, hooknum uint32, prio int32) {
+	a := nl.AppendStringAttr(nil, NFTA_CHAIN_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_CHAIN_NAME, name)
+	a = nl.AppendNested(a, NFTA_CHAIN_HOOK, func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_HOOK_HOOKNUM, nl.BE32(hooknum))
+		return nl.AppendAttr(a, NFTA_HOOK_PRIORITY, nl.BE32(uint32(prio)))
+	})
+	a = nl.AppendStringAttr(a, NFTA_CHAIN_TYPE, typ)
+	b.msg(NFT_MSG_NEWCHAIN, syscall.NLM_F_CREATE, a)
+}
+
+// AddChain creates a regular (non-base) chain, used as a jump/goto target.
+func (b *Batch) AddChain(name string) {
+	a := nl.AppendStringAttr(nil, NFTA_CHAIN_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_CHAIN_NAME, name)
+	b.msg(NFT_MSG_NEWCHAIN, syscall.NLM_F_CREATE, a)
+}
+
+// DelChain deletes an empty chain that is no longer referenced.
+func (b *Batch) DelChain(name string) {
+	a := nl.AppendStringAttr(nil, NFTA_CHAIN_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_CHAIN_NAME, name)
+	b.msg(NFT_MSG_DELCHAIN, 0, a)
+}
+
+// FlushChain deletes every rule of a chain, so that rules are replaced (not appended) on restart.
+func (b *Batch) FlushChain(chain string) {
+	a := nl.AppendStringAttr(nil, NFTA_RULE_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_RULE_CHAIN, chain)
+	b.msg(NFT_MSG_DELRULE, 0, a)
+}
+
+// AddRule appends a rule made of the given expressions (see expr.go) to chain.
+func (b *Batch) AddRule(chain string, exprs ...[]byte) {
+	a := nl.AppendStringAttr(nil, NFTA_RULE_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_RULE_CHAIN, chain)
+	a = nl.AppendNested(a, NFTA_RULE_EXPRESSIONS, func(a []byte) []byte {
+		for _, e := range exprs {
+			a = append(a, e...)
+		}
+		return a
+	})
+	b.msg(NFT_MSG_NEWRULE, syscall.NLM_F_CREATE|syscall.NLM_F_APPEND, a)
+}
+
+// AddSet creates a set if missing; creation is idempotent as long as the definition does not change.
+func (b *Batch) AddSet(s Set) {
+	b.setID++
+	a := nl.AppendStringAttr(nil, NFTA_SET_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_SET_NAME, s.Name)
+	a = nl.AppendAttr(a, NFTA_SET_FLAGS, nl.BE32(s.Flags))
+	a = nl.AppendAttr(a, NFTA_SET_KEY_TYPE, nl.BE32(s.KeyType))
+	a = nl.AppendAttr(a, NFTA_SET_KEY_LEN, nl.BE32(s.KeyLen))
+	if s.Flags&NFT_SET_MAP != 0 {
+		a = nl.AppendAttr(a, NFTA_SET_DATA_TYPE, nl.BE32(s.DataType))
+		a = nl.AppendAttr(a, NFTA_SET_DATA_LEN, nl.BE32(s.DataLen))
+	}
+	if len(s.Fields) > 0 {
+		a = nl.AppendNested(a, NFTA_SET_DESC, func(a []byte) []byte {
+			return nl.AppendNested(a, NFTA_SET_DESC_CONCAT, func(a []byte) []byte {
+				for _, f := range s.Fields {
+					a = nl.AppendNested(a, NFTA_LIST_ELEM, func(a []byte) []byte {
+						return nl.AppendAttr(a, NFTA_SET_FIELD_LEN, nl.BE32(f))
+					})
+				}
+				return a
+			})
+		})
+	}
+	a = nl.AppendAttr(a, NFTA_SET_ID, nl.BE32(b.setID))
+	b.msg(NFT_MSG_NEWSET, syscall.NLM_F_CREATE, a)
+}
+
+// FlushSet removes every element of a set.
+func (b *Batch) FlushSet(set string) {
+	a := nl.AppendStringAttr(nil, NFTA_SET_ELEM_LIST_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_SET_ELEM_LIST_SET, set)
+	b.msg(NFT_MSG_DELSETELEM, 0, a)
+}
+
+func (b *Batch) AddElems(set string, elems []Elem) {
+	b.elems(NFT_MSG_NEWSETELEM, syscall.NLM_F_CREATE, set, elems)
+}
+
+func (b *Batch) DelElems(set string, elems []Elem) {
+	b.elems(NFT_MSG_DELSETELEM, 0, set, elems)
+}
+
+func (b *Batch) elems(typ uint16, flags uint16, set string, elems []Elem) {
+	for len(elems) > 0 {
+		n := min(len(elems), ELEMS_PER_MSG)
+		chunk := elems[:n]
+		elems = elems[n:]
+
+		a := nl.AppendStringAttr(nil, NFTA_SET_ELEM_LIST_TABLE, TABLE_NAME)
+		a = nl.AppendStringAttr(a, NFTA_SET_ELEM_LIST_SET, set)
+		a = nl.AppendNested(a, NFTA_SET_ELEM_LIST_ELEMENTS, func(a []byte) []byte {
+			for _, e := range chunk {
+				a = nl.AppendNested(a, NFTA_LIST_ELEM, func(a []byte) []byte {
+					a = nl.AppendNested(a, NFTA_SET_ELEM_KEY, func(a []byte) []byte {
+						return nl.AppendAttr(a, NFTA_DATA_VALUE, e.Key)
+					})
+					if e.KeyEnd != nil {
+						a = nl.AppendNested(a, NFTA_SET_ELEM_KEY_END, func(a []byte) []byte {
+							return nl.AppendAttr(a, NFTA_DATA_VALUE, e.KeyEnd)
+						})
+					}
+					if e.Verdict != nil && typ == NFT_MSG_NEWSETELEM {
+						a = nl.AppendNested(a, NFTA_SET_ELEM_DATA, func(a []byte) []byte {
+							return verdictData(a, *e.Verdict, e.Chain)
+						})
+					}
+					if e.Data != nil && typ == NFT_MSG_NEWSETELEM {
+						a = dataValue(a, NFTA_SET_ELEM_DATA, e.Data)
+					}
+					return a
+				})
+			}
+			return a
+		})
+		b.msg(typ, flags, a)
+	}
+}
+
+// DelObj deletes a stateful object (e.g. a named counter); map elements referencing it must be deleted first.
+func (b *Batch) DelObj(name string, typ uint32) {
+	a := nl.AppendStringAttr(nil, NFTA_OBJ_TABLE, TABLE_NAME)
+	a = nl.AppendStringAttr(a, NFTA_OBJ_NAME, name)
+	a = nl.AppendAttr(a, NFTA_OBJ_TYPE, nl.BE32(typ))
+	b.msg(NFT_MSG_DELOBJ, 0, a)
+}
+
+// ConcatType encodes the datatype of a concatenation the way nft does.
+func ConcatType(types ...uint32) uint32 {
+	var t uint32
+	for _, v := range types {
+		t = t<<6 | v
+	}
+	return t
+}
+
+func verdictData(a []byte, code int32, chain string) []byte {
+	return nl.AppendNested(a, NFTA_DATA_VERDICT, func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_VERDICT_CODE, nl.BE32(uint32(code)))
+		if chain != "" {
+			a = nl.AppendStringAttr(a, NFTA_VERDICT_CHAIN, chain)
+		}
+		return a
+	})
+}
+
+// batch delimiters carry the nftables subsystem id in the nfgenmsg res_id field
+func batchGenMsg() []byte {
+	m := NfGenMsg(syscall.AF_UNSPEC)
+	binary.BigEndian.PutUint16(m[2:4], NFNL_SUBSYS_NFTABLES)
+	return m
+}
@@ -0,0 +1,216 @@
+package nft
+
+import (
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+const NFTA_EXPR_NAME = 1
+const NFTA_EXPR_DATA = 2
+
+const NFT_REG_VERDICT = 0
+const NFT_REG_1 = 1
+
+// 32-bit registers; concatenated keys are loaded into consecutive ones
+const NFT_REG32_00 = 8
+
+const NFT_PAYLOAD_NETWORK_HEADER = 1
+const NFT_PAYLOAD_TRANSPORT_HEADER = 2
+
+const NFTA_PAYLOAD_DREG = 1
+const NFTA_PAYLOAD_BASE = 2
+const NFTA_PAYLOAD_OFFSET = 3
+const NFTA_PAYLOAD_LEN = 4
+
+const NFTA_META_DREG = 1
+const NFTA_META_KEY = 2
+const NFTA_META_SREG = 3
+const NFT_META_MARK = 3
+const NFT_META_L4PROTO = 16
+
+const NFTA_CT_DREG = 1
+const NFTA_CT_KEY = 2
+const NFT_CT_STATE = 0
+
+// NF_CT_STATE_BIT(IP_CT_ESTABLISHED) | NF_CT_STATE_BIT(IP_CT_RELATED)
+const CT_STATE_ESTABLISHED_RELATED = 0x2 | 0x4
+
+const NFTA_BITWISE_SREG = 1
+const NFTA_BITWISE_DREG = 2
+const NFTA_BITWISE_LEN = 3
+const NFTA_BITWISE_MASK = 4
+const NFTA_BITWISE_XOR = 5
+
+const NFTA_CMP_SREG = 1
+const NFTA_CMP_OP = 2
+const NFTA_CMP_DATA = 3
+const NFT_CMP_EQ = 0
+const NFT_CMP_NEQ = 1
+
+const NFTA_LOOKUP_SET = 1
+const NFTA_LOOKUP_SREG = 2
+const NFTA_LOOKUP_DREG = 3
+
+const NFTA_IMMEDIATE_DREG = 1
+const NFTA_IMMEDIATE_DATA = 2
+
+const NFTA_NG_DREG = 1
+const NFTA_NG_MODULUS = 2
+const NFTA_NG_TYPE = 3
+const NFT_NG_RANDOM = 1
+
+const NFTA_HASH_SREG = 1
+const NFTA_HASH_DREG = 2
+const NFTA_HASH_LEN = 3
+const NFTA_HASH_MODULUS = 4
+const NFTA_HASH_SEED = 5
+const NFTA_HASH_TYPE = 7
+const NFT_HASH_JENKINS = 0
+
+const NFTA_NAT_TYPE = 1
+const NFTA_NAT_FAMILY = 2
+const NFTA_NAT_REG_ADDR_MIN = 3
+const NFTA_NAT_REG_PROTO_MIN = 5
+const NFT_NAT_DNAT = 1
+
+const IPV4_SADDR_OFFSET = 12
+const IPV4_DADDR_OFFSET = 16
+const TH_SPORT_OFFSET = 0
+const TH_DPORT_OFFSET = 2
+
+func expr(name string, fn func(a []byte) []byte) []byte {
+	return nl.AppendNested(nil, NFTA_LIST_ELEM, func(a []byte) []byte {
+		a = nl.AppendStringAttr(a, NFTA_EXPR_NAME, name)
+		return nl.AppendNested(a, NFTA_EXPR_DATA, fn)
+	})
+}
+
+func dataValue(a []byte, t uint16, v []byte) []byte {
+	return nl.AppendNested(a, t, func(a []byte) []byte {
+		return nl.AppendAttr(a, NFTA_DATA_VALUE, v)
+	})
+}
+
+// Payload loads len bytes at offset of the given header into dreg.
+func Payload(base, offset, length, dreg uint32) []byte {
+	return expr("payload", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_PAYLOAD_DREG, nl.BE32(dreg))
+		a = nl.AppendAttr(a, NFTA_PAYLOAD_BASE, nl.BE32(base))
+		a = nl.AppendAttr(a, NFTA_PAYLOAD_OFFSET, nl.BE32(offset))
+		return nl.AppendAttr(a, NFTA_PAYLOAD_LEN, nl.BE32(length))
+	})
+}
+
+func Meta(key, dreg uint32) []byte {
+	return expr("meta", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_META_DREG, nl.BE32(dreg))
+		return nl.AppendAttr(a, NFTA_META_KEY, nl.BE32(key))
+	})
+}
+
+// MetaSet stores sreg into the meta key (e.g. the packet mark).
+func MetaSet(key, sreg uint32) []byte {
+	return expr("meta", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_META_KEY, nl.BE32(key))
+		return nl.AppendAttr(a, NFTA_META_SREG, nl.BE32(sreg))
+	})
+}
+
+func Ct(key, dreg uint32) []byte {
+	return expr("ct", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_CT_DREG, nl.BE32(dreg))
+		return nl.AppendAttr(a, NFTA_CT_KEY, nl.BE32(key))
+	})
+}
+
+// Bitwise computes reg = (reg & mask) ^ xor, with len(mask) == len(xor).
+func Bitwise(reg uint32, mask, xor []byte) []byte {
+	return expr("bitwise", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_BITWISE_SREG, nl.BE32(reg))
+		a = nl.AppendAttr(a, NFTA_BITWISE_DREG, nl.BE32(reg))
+		a = nl.AppendAttr(a, NFTA_BITWISE_LEN, nl.BE32(uint32(len(mask))))
+		a = dataValue(a, NFTA_BITWISE_MASK, mask)
+		return dataValue(a, NFTA_BITWISE_XOR, xor)
+	})
+}
+
+func Cmp(sreg, op uint32, data []byte) []byte {
+	return expr("cmp", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_CMP_SREG, nl.BE32(sreg))
+		a = nl.AppendAttr(a, NFTA_CMP_OP, nl.BE32(op))
+		return dataValue(a, NFTA_CMP_DATA, data)
+	})
+}
+
+// Lookup matches sreg against a set.
+func Lookup(set string, sreg uint32) []byte {
+	return expr("lookup", func(a []byte) []byte {
+		a = nl.AppendStringAttr(a, NFTA_LOOKUP_SET, set)
+		return nl.AppendAttr(a, NFTA_LOOKUP_SREG, nl.BE32(sreg))
+	})
+}
+
+// VerdictMap looks sreg up in a verdict map and applies the verdict found, if any.
+func VerdictMap(set string, sreg uint32) []byte {
+	return expr("lookup", func(a []byte) []byte {
+		a = nl.AppendStringAttr(a, NFTA_LOOKUP_SET, set)
+		a = nl.AppendAttr(a, NFTA_LOOKUP_SREG, nl.BE32(sreg))
+		return nl.AppendAttr(a, NFTA_LOOKUP_DREG, nl.BE32(NFT_REG_VERDICT))
+	})
+}
+
+// NumgenRandom loads a random number in [0, modulus) into dreg.
+func NumgenRandom(modulus, dreg uint32) []byte {
+	return expr("numgen", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_NG_DREG, nl.BE32(dreg))
+		a = nl.AppendAttr(a, NFTA_NG_MODULUS, nl.BE32(modulus))
+		return nl.AppendAttr(a, NFTA_NG_TYPE, nl.BE32(NFT_NG_RANDOM))
+	})
+}
+
+// Jhash hashes length bytes of sreg into [0, modulus) and loads the result into dreg.
+func Jhash(sreg, length, modulus, seed, dreg uint32) []byte {
+	return expr("hash", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_HASH_SREG, nl.BE32(sreg))
+		a = nl.AppendAttr(a, NFTA_HASH_DREG, nl.BE32(dreg))
+		a = nl.AppendAttr(a, NFTA_HASH_LEN, nl.BE32(length))
+		a = nl.AppendAttr(a, NFTA_HASH_MODULUS, nl.BE32(modulus))
+		a = nl.AppendAttr(a, NFTA_HASH_SEED, nl.BE32(seed))
+		return nl.AppendAttr(a, NFTA_HASH_TYPE, nl.BE32(NFT_HASH_JENKINS))
+	})
+}
+
+// Dnat rewrites the destination to the address in addrReg and the port in protoReg.
+func Dnat(addrReg, protoReg uint32) []byte {
+	return expr("nat", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_NAT_TYPE, nl.BE32(NFT_NAT_DNAT))
+		a = nl.AppendAttr(a, NFTA_NAT_FAMILY, nl.BE32(NFPROTO_IPV4))
+		a = nl.AppendAttr(a, NFTA_NAT_REG_ADDR_MIN, nl.BE32(addrReg))
+		return nl.AppendAttr(a, NFTA_NAT_REG_PROTO_MIN, nl.BE32(protoReg))
+	})
+}
+
+// Notrack keeps the packet out of conntrack, and so out of NAT; only valid before conntrack (raw priority).
+func Notrack() []byte {
+	return expr("notrack", func(a []byte) []byte { return a })
+}
+
+func Masquerade() []byte {
+	return expr("masq", func(a []byte) []byte { return a })
+}
+
+// Immediate loads a constant into dreg.
+func Immediate(data []byte, dreg uint32) []byte {
+	return expr("immediate", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_IMMEDIATE_DREG, nl.BE32(dreg))
+		return dataValue(a, NFTA_IMMEDIATE_DATA, data)
+	})
+}
+
+func Verdict(code int32) []byte {
+	return expr("immediate", func(a []byte) []byte {
+		a = nl.AppendAttr(a, NFTA_IMMEDIATE_DREG, nl.BE32(NFT_REG_VERDICT))
+		return nl.AppendNested(a, NFTA_IMMEDIATE_DATA, func(a []byte) []byte {
+			return verdictData(a, code, "")
+		})
+	})
+}
@@ -0,0 +1,166 @@
+// Package nft talks nf_tables over nfnetlink for the 'sknf' table shared with sknf-cni.
+package nft
+
+import (
+	"fmt"
+	"strings"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Must match sknf-cni/src/nft.c
+const TABLE_NAME = "sknf"
+const EGRESS_COUNTER_PREFIX = "egress-"
+const INGRESS_COUNTER_PREFIX = "ingress-"
+const CROSSNODE_COUNTER_PREFIX = "crossnode-"
+const EGRESS_MAP_NAME = "pod_egress"
+const INGRESS_MAP_NAME = "pod_ingress"
+const CROSSNODE_MAP_NAME = "pod_crossnode"
+const HOSTPORTS_MAP_NAME = "hostports"
+
+const NFNL_SUBSYS_NFTABLES = 10
+const NFNETLINK_V0 = 0
+const NFPROTO_IPV4 = 2
+const SIZEOF_NFGENMSG = 4
+
+// enum nf_tables_msg_types
+const NFT_MSG_GETCHAIN = 4
+const NFT_MSG_GETSETELEM = 13
+const NFT_MSG_GETOBJ = 19
+
+// enum nft_object_attributes
+const NFTA_OBJ_TABLE = 1
+const NFTA_OBJ_NAME = 2
+const NFTA_OBJ_TYPE = 3
+const NFTA_OBJ_DATA = 4
+
+// enum nft_counter_attributes
+const NFTA_COUNTER_BYTES = 1
+const NFTA_COUNTER_PACKETS = 2
+
+const NFT_OBJECT_COUNTER = 1
+
+// PodCounter is one per-pod accounting counter maintained by sknf-cni.
+type PodCounter struct {
+	PodIP     string
+	Direction string // "egress", "ingress" or "crossnode"
+	Bytes     uint64
+	Packets   uint64
+}
+
+func MsgType(msg uint16) uint16 {
+	return NFNL_SUBSYS_NFTABLES<<8 | msg
+}
+
+// NfGenMsg is the nfnetlink header preceding every nf_tables attribute payload.
+func NfGenMsg(family uint8) []byte {
+	return []byte{family, NFNETLINK_V0, 0, 0}
+}
+
+// DumpPodCounters reads every named counter of the sknf table with a single dump.
+func DumpPodCounters(sk *nl.Socket) ([]PodCounter, error) {
+	req := NfGenMsg(NFPROTO_IPV4)
+	req = nl.AppendStringAttr(req, NFTA_OBJ_TABLE, TABLE_NAME)
+	req = nl.AppendAttr(req, NFTA_OBJ_TYPE, nl.BE32(NFT_OBJECT_COUNTER))
+
+	msgs, err := sk.Dump(MsgType(NFT_MSG_GETOBJ), req)
+	if err != nil {
+		if err == syscall.ENOENT {
+			// the table does not exist before the first pod is attached
+			return nil, nil
+		}
+		return nil, fmt.Errorf("dumping nft objects: %w", err)
+	}
+
+	var counters []PodCounter
+	for _, m := range msgs {
+		if len(m.Data) < SIZEOF_NFGENMSG {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[SIZEOF_NFGENMSG:])
+		if nl.String(attrs[NFTA_OBJ_TABLE]) != TABLE_NAME || nl.Uint32BE(attrs[NFTA_OBJ_TYPE]) != NFT_OBJECT_COUNTER {
+			continue
+		}
+
+		c, ok := parseCounterName(nl.String(attrs[NFTA_OBJ_NAME]))
+		if !ok {
+			continue
+		}
+		data := nl.Attrs(attrs[NFTA_OBJ_DATA])
+		c.Bytes = nl.Uint64BE(data[NFTA_COUNTER_BYTES])
+		c.Packets = nl.Uint64BE(data[NFTA_COUNTER_PACKETS])
+		counters = append(counters, c)
+	}
+	return counters, nil
+}
+
+// DumpElems returns the elements of a set or map of the sknf table, with their key and, for data
+// maps, their data. A missing table or set has no elements.
+func DumpElems(sk *nl.Socket, set string) ([]Elem, error) {
+	req := NfGenMsg(NFPROTO_IPV4)
+	req = nl.AppendStringAttr(req, NFTA_SET_ELEM_LIST_TABLE, TABLE_NAME)
+	req = nl.AppendStringAttr(req, NFTA_SET_ELEM_LIST_SET, set)
+
+	msgs, err := sk.Dump(MsgType(NFT_MSG_GETSETELEM), req)
+	if err != nil {
+		if err == syscall.ENOENT {
+			return nil, nil
+		}
+		return nil, fmt.Errorf("dumping nft set %s: %w", set, err)
+	}
+
+	var elems []Elem
+	for _, m := range msgs {
+		if len(m.Data) < SIZEOF_NFGENMSG {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[SIZEOF_NFGENMSG:])
+		nl.ForEachAttr(attrs[NFTA_SET_ELEM_LIST_ELEMENTS], func(t uint16, v []byte) {
+			if t != NFTA_LIST_ELEM {
+				return
+			}
+			e := nl.Attrs(v)
+			elems = append(elems, Elem{
+				Key:  nl.Attrs(e[NFTA_SET_ELEM_KEY])[NFTA_DATA_VALUE],
+				Data: nl.Attrs(e[NFTA_SET_ELEM_DATA])[NFTA_DATA_VALUE],
+			})
+		})
+	}
+	return elems, nil
+}
+
+// ListChains returns the names of the chains of the sknf table; a missing table has no chains.
+func ListChains(sk *nl.Socket) ([]string, error) {
+	msgs, err := sk.Dump(MsgType(NFT_MSG_GETCHAIN), NfGenMsg(NFPROTO_IPV4))
+	if err != nil {
+		if err == syscall.ENOENT {
+			return nil, nil
+		}
+		return nil, fmt.Errorf("dumping nft chains: %w", err)
+	}
+
+	var names []string
+	for _, m := range msgs {
+		if len(m.Data) < SIZEOF_NFGENMSG {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[SIZEOF_NFGENMSG:])
+		if nl.String(attrs[NFTA_CHAIN_TABLE]) == TABLE_NAME {
+			names = append(names, nl.String(attrs[NFTA_CHAIN_NAME]))
+		}
+	}
+	return names, nil
+}
+
+func parseCounterName(name string) (PodCounter, bool) {
+	for _, prefix := range []string{EGRESS_COUNTER_PREFIX, INGRESS_COUNTER_PREFIX, CROSSNODE_COUNTER_PREFIX} {
+		if strings.HasPrefix(name, prefix) {
+			return PodCounter{
+				PodIP:     name[len(prefix):],
+				Direction: strings.TrimSuffix(prefix, "-"),
+			}, true
+		}
+	}
+	return PodCounter{}, false
+}
@@ -0,0 +1,32 @@
+package nl
+
+import (
+	"encoding/binary"
+	"net"
+	"strconv"
+	"strings"
+)
+
+// Names and addresses as sknf-cni generates them, for the packages that find its interfaces in dumps.
+
+// MacOf derives the MAC sknf-cni assigns to an IP (0a:58:<ipv4>, see nu_mac_from_cidr)
+func MacOf(ip net.IP) []byte {
+	return append([]byte{0x0a, 0x58}, ip.To4()...)
+}
+
+// IsGeneratedName matches the '<prefix>%08x' names generated by sknf-cni
+func IsGeneratedName(name, prefix string) bool {
+	if len(name) != len(prefix)+8 || !strings.HasPrefix(name, prefix) {
+		return false
+	}
+	_, err := strconv.ParseUint(name[len(prefix):], 16, 32)
+	return err == nil
+}
+
+func IPv4ToUint(ip net.IP) uint32 {
+	v4 := ip.To4()
+	if v4 == nil {
+		return 0
+	}
+	return binary.BigEndian.Uint32(v4)
+}
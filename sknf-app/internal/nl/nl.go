@@ -0,0 +1,368 @@
+// Package nl is a minimal netlink client built on the syscall package.
+//
+// It only implements what sknf-app needs: one-shot request/ack round-trips and
+// dumps that return every message of a multipart reply at once, so callers can
+// gather a whole kernel table with a single request.
+package nl
+
+import (
+	"encoding/binary"
+	"fmt"
+	"sync"
+	"syscall"
+)
+
+const RECV_BUFFER_SIZE = 1 << 16
+
+const NLMSG_HDRLEN = syscall.NLMSG_HDRLEN
+const NLA_HDRLEN = syscall.SizeofRtAttr
+
+const NLA_F_NESTED = 0x8000
+const NLA_F_NET_BYTEORDER = 0x4000
+const NLA_TYPE_MASK = ^uint16(NLA_F_NESTED | NLA_F_NET_BYTEORDER)
+
+const SOL_NETLINK = 270
+const NETLINK_GET_STRICT_CHK = 12
+
+// Socket is a blocking netlink socket bound to an auto-assigned port id.
+// It is safe for concurrent use; round-trips are serialized.
+type Socket struct {
+	mu     sync.Mutex
+	fd     int
+	pid    uint32
+	seq    uint32
+	buf    []byte
+	sndbuf int
+}
+
+func Open(protocol int) (*Socket, error) {
+	return open(protocol, 0)
+}
+
+// Subscribe opens a socket that also receives the notifications of the given multicast groups
+// (a bitmask of 1 << (group - 1)); they are read with Receive.
+func Subscribe(protocol int, groups uint32) (*Socket, error) {
+	return open(protocol, groups)
+}
+
+func open(protocol int, groups uint32) (*Socket, error) {
+	fd, err := syscall.Socket(syscall.AF_NETLINK, syscall.SOCK_RAW|syscall.SOCK_CLOEXEC, protocol)
+	if err != nil {
+		return nil, fmt.Errorf("socket: %w", err)
+	}
+
+	if err := syscall.Bind(fd, &syscall.SockaddrNetlink{Family: syscall.AF_NETLINK, Groups: groups}); err != nil {
+		syscall.Close(fd)
+		return nil, fmt.Errorf("bind: %w", err)
+	}
+
+	sa, err := syscall.Getsockname(fd)
+	if err != nil {
+		syscall.Close(fd)
+		return nil, fmt.Errorf("getsockname: %w", err)
+	}
+
+	sndbuf, err := syscall.GetsockoptInt(fd, syscall.SOL_SOCKET, syscall.SO_SNDBUF)
+	if err != nil {
+		syscall.Close(fd)
+		return nil, fmt.Errorf("getsockopt: %w", err)
+	}
+
+	return &Socket{
+		fd:     fd,
+		pid:    sa.(*syscall.SockaddrNetlink).Pid,
+		buf:    make([]byte, RECV_BUFFER_SIZE),
+		sndbuf: sndbuf,
+	}, nil
+}
+
+func (s *Socket) Close() error {
+	return syscall.Close(s.fd)
+}
+
+// EnableStrictCheck makes the kernel validate dump requests strictly (Linux 4.20+). Some dump filters,
+// e.g. IFA_TARGET_NETNSID on address dumps, are only honoured on such sockets.
+func (s *Socket) EnableStrictCheck() error {
+	if err := syscall.SetsockoptInt(s.fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, 1); err != nil {
+		return fmt.Errorf("setsockopt: %w", err)
+	}
+	return nil
+}
+
+// Dump sends a single NLM_F_DUMP request and returns every message of the reply.
+func (s *Socket) Dump(msgType uint16, payload []byte) ([]syscall.NetlinkMessage, error) {
+	var out []syscall.NetlinkMessage
+	err := s.DumpFunc(msgType, payload, func(m syscall.NetlinkMessage) {
+		out = append(out, m)
+	})
+	if err != nil {
+		return nil, err
+	}
+	return out, nil
+}
+
+// DumpFunc is Dump for large tables: fn is called for every message of the reply as it is
+// received, instead of buffering the whole reply.
+func (s *Socket) DumpFunc(msgType uint16, payload []byte, fn func(m syscall.NetlinkMessage)) error {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	s.seq++
+	seq := s.seq
+	if err := s.send(Message(msgType, syscall.NLM_F_REQUEST|syscall.NLM_F_DUMP, seq, payload)); err != nil {
+		return err
+	}
+
+	for {
+		msgs, err := s.recv()
+		if err != nil {
+			return err
+		}
+		for _, m := range msgs {
+			if m.Header.Seq != seq {
+				continue
+			}
+			switch m.Header.Type {
+			case syscall.NLMSG_DONE:
+				return nil
+			case syscall.NLMSG_ERROR:
+				if err := errnoOf(m); err != nil {
+					return err
+				}
+			default:
+				fn(m)
+			}
+		}
+	}
+}
+
+// Execute sends one or more already-encoded messages in a single sendmsg and
+// waits until the message carrying lastSeq is acknowledged. The first kernel
+// error reported for any of the messages is returned.
+func (s *Socket) Execute(raw []byte, lastSeq uint32) error {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	if err := s.send(raw); err != nil {
+		return err
+	}
+
+	var first error
+	for {
+		msgs, err := s.recv()
+		if err != nil {
+			return err
+		}
+		for _, m := range msgs {
+			if m.Header.Type != syscall.NLMSG_ERROR {
+				continue
+			}
+			if err := errnoOf(m); err != nil && first == nil {
+				first = err
+			}
+			if m.Header.Seq == lastSeq {
+				return first
+			}
+		}
+	}
+}
+
+// Receive blocks until notifications arrive on a socket opened with Subscribe. ENOBUFS means some
+// were dropped because the socket fell behind.
+func (s *Socket) Receive() ([]syscall.NetlinkMessage, error) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	return s.recv()
+}
+
+// NextSeq reserves a sequence number for a message that will be passed to Execute.
+func (s *Socket) NextSeq() uint32 {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.seq++
+	return s.seq
+}
+
+// Request sends a single message and waits for its ack.
+func (s *Socket) Request(msgType, flags uint16, payload []byte) error {
+	seq := s.NextSeq()
+	return s.Execute(Message(msgType, syscall.NLM_F_REQUEST|syscall.NLM_F_ACK|flags, seq, payload), seq)
+}
+
+func (s *Socket) send(b []byte) error {
+	// netlink rejects messages larger than the send buffer; large nftables batches need it grown
+	if len(b) > s.sndbuf {
+		// SO_SNDBUFFORCE needs CAP_NET_ADMIN; otherwise the size is capped by net.core.wmem_max
+		if err := syscall.SetsockoptInt(s.fd, syscall.SOL_SOCKET, syscall.SO_SNDBUFFORCE, len(b)); err != nil {
+			if err := syscall.SetsockoptInt(s.fd, syscall.SOL_SOCKET, syscall.SO_SNDBUF, len(b)); err != nil {
+				return fmt.Errorf("setsockopt: %w", err)
+			}
+		}
+		s.sndbuf = len(b)
+	}
+	if err := syscall.Sendto(s.fd, b, 0, &syscall.SockaddrNetlink{Family: syscall.AF_NETLINK}); err != nil {
+		return fmt.Errorf("sendto: %w", err)
+	}
+	return nil
+}
+
+func (s *Socket) recv() ([]syscall.NetlinkMessage, error) {
+	n, _, err := syscall.Recvfrom(s.fd, s.buf, 0)
+	if err != nil {
+		return nil, fmt.Errorf("recvfrom: %w", err)
+	}
+	// messages keep referencing the receive buffer, so hand out a copy
+	b := make([]byte, n)
+	copy(b, s.buf[:n])
+	msgs, err := syscall.ParseNetlinkMessage(b)
+	if err != nil {
+		return nil, fmt.Errorf("parsing netlink reply: %w", err)
+	}
+	return msgs, nil
+}
+
+func errnoOf(m syscall.NetlinkMessage) error {
+	if len(m.Data) < 4 {
+		return fmt.Errorf("truncated netlink error message")
+	}
+	code := int32(binary.NativeEndian.Uint32(m.Data[:4]))
+	if code == 0 {
+		return nil
+	}
+	return syscall.Errno(-code)
+}
+
+// Message encodes a netlink header followed by payload.
+func Message(msgType, flags uint16, seq uint32, payload []byte) []byte {
+	b := make([]byte, NLMSG_HDRLEN, NLMSG_HDRLEN+len(payload))
+	binary.NativeEndian.PutUint32(b[0:4], uint32(NLMSG_HDRLEN+len(payload)))
+	binary.NativeEndian.PutUint16(b[4:6], msgType)
+	binary.NativeEndian.PutUint16(b[6:8], flags)
+	binary.NativeEndian.PutUint32(b[8:12], seq)
+	return append(b, payload...)
+}
+
+// IfInfoMsg encodes a struct ifinfomsg that sets 'flags' (and only those) on interface 'index'.
+func IfInfoMsg(index int32, flags uint32) []byte {
+	msg := make([]byte, syscall.SizeofIfInfomsg)
+	msg[0] = syscall.AF_UNSPEC
+	binary.NativeEndian.PutUint32(msg[4:8], uint32(index))
+	binary.NativeEndian.PutUint32(msg[8:12], flags)
+	binary.NativeEndian.PutUint32(msg[12:16], flags)
+	return msg
+}
+
+// Attrs maps attribute types (without the nested/byteorder flags) to their payload.
+// When an attribute type repeats, the last occurrence wins; use ForEachAttr for lists.
+func Attrs(b []byte) map[uint16][]byte {
+	m := make(map[uint16][]byte)
+	ForEachAttr(b, func(t uint16, v []byte) {
+		m[t] = v
+	})
+	return m
+}
+
+func ForEachAttr(b []byte, fn func(t uint16, v []byte)) {
+	for len(b) >= NLA_HDRLEN {
+		l := int(binary.NativeEndian.Uint16(b[0:2]))
+		t := binary.NativeEndian.Uint16(b[2:4]) & NLA_TYPE_MASK
+		if l < NLA_HDRLEN || l > len(b) {
+			return
+		}
+		fn(t, b[NLA_HDRLEN:l])
+		al := align(l)
+		if al > len(b) {
+			return
+		}
+		b = b[al:]
+	}
+}
+
+// AppendAttr appends a netlink attribute (header, payload and padding) to b.
+func AppendAttr(b []byte, t uint16, v []byte) []byte {
+	var hdr [NLA_HDRLEN]byte
+	binary.NativeEndian.PutUint16(hdr[0:2], uint16(NLA_HDRLEN+len(v)))
+	binary.NativeEndian.PutUint16(hdr[2:4], t)
+	b = append(b, hdr[:]...)
+	b = append(b, v...)
+	for i := len(v); i < align(len(v)); i++ {
+		b = append(b, 0)
+	}
+	return b
+}
+
+// AppendStringAttr appends a NUL-terminated string attribute.
+func AppendStringAttr(b []byte, t uint16, s string) []byte {
+	return AppendAttr(b, t, append([]byte(s), 0))
+}
+
+// AppendNested appends an NLA_F_NESTED attribute whose payload is built by fn.
+func AppendNested(b []byte, t uint16, fn func(b []byte) []byte) []byte {
+	start := len(b)
+	b = AppendAttr(b, t|NLA_F_NESTED, nil)
+	b = fn(b)
+	binary.NativeEndian.PutUint16(b[start:start+2], uint16(len(b)-start))
+	return b
+}
+
+// U32 encodes v in host byte order, as rtnetlink attributes are.
+func U32(v uint32) []byte {
+	b := make([]byte, 4)
+	binary.NativeEndian.PutUint32(b, v)
+	return b
+}
+
+func BE32(v uint32) []byte {
+	b := make([]byte, 4)
+	binary.BigEndian.PutUint32(b, v)
+	return b
+}
+
+func align(l int) int {
+	return (l + syscall.NLMSG_ALIGNTO - 1) & ^(syscall.NLMSG_ALIGNTO - 1)
+}
+
+func String(v []byte) string {
+	for i, c := range v {
+		if c == 0 {
+			return string(v[:i])
+		}
+	}
+	return string(v)
+}
+
+func Uint32(v []byte) uint32 {
+	if len(v) < 4 {
+		return 0
+	}
+	return binary.NativeEndian.Uint32(v)
+}
+
+func Uint64(v []byte) uint64 {
+	if len(v) < 8 {
+		return 0
+	}
+	return binary.NativeEndian.Uint64(v)
+}
+
+// Uint16BE, Uint32BE and Uint64BE decode attributes sent in network byte order (nfnetlink).
+func Uint16BE(v []byte) uint16 {
+	if len(v) < 2 {
+		return 0
+	}
+	return binary.BigEndian.Uint16(v)
+}
+
+func Uint32BE(v []byte) uint32 {
+	if len(v) < 4 {
+		return 0
+	}
+	return binary.BigEndian.Uint32(v)
+}
+
+func Uint64BE(v []byte) uint64 {
+	if len(v) < 8 {
+		return 0
+	}
+	return binary.BigEndian.Uint64(v)
+}
@@ -0,0 +1,309 @@
+package policy
+
+import (
+	"fmt"
+	"math"
+	"net"
+	"os"
+
+	corev1 "k8s.io/api/core/v1"
+	networkingv1 "k8s.io/api/networking/v1"
+	metav1 "k8s.io/apimachinery/pkg/apis/meta/v1"
+	"k8s.io/apimachinery/pkg/labels"
+	"k8s.io/apimachinery/pkg/util/intstr"
+)
+
+const IPPROTO_TCP = 6
+const IPPROTO_UDP = 17
+const IPPROTO_SCTP = 132
+
+// a peer address range, with the pod behind it when the peer was selected by labels
+type peer struct {
+	lo, hi uint32
+	pod    *corev1.Pod
+}
+
+// a protocol/port range pair
+type portRange struct {
+	proto [2]uint32
+	port  [2]uint32
+}
+
+var anyPeer = peer{lo: 0, hi: math.MaxUint32}
+var anyPort = portRange{proto: [2]uint32{0, math.MaxUint8}, port: [2]uint32{0, math.MaxUint16}}
+
+// Compile computes the policy elements of the pods running on nodeName. Peers may live
+// anywhere in the cluster.
+func Compile(nodeName string, pods []*corev1.Pod, namespaces []*corev1.Namespace, policies []*networkingv1.NetworkPolicy) *State {
+	nsLabels := make(map[string]labels.Set, len(namespaces))
+	for _, ns := range namespaces {
+		nsLabels[ns.Name] = ns.Labels
+	}
+
+	podsByNs := make(map[string][]*corev1.Pod)
+	for _, p := range pods {
+		if _, ok := podIP(p); ok {
+			podsByNs[p.Namespace] = append(podsByNs[p.Namespace], p)
+		}
+	}
+
+	ingress := make(map[uint32][]box)
+	egress := make(map[uint32][]box)
+	state := NewState()
+
+	for _, np := range policies {
+		sel, err := metav1.LabelSelectorAsSelector(&np.Spec.PodSelector)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Ignoring network policy %s/%s: %v\n", np.Namespace, np.Name, err)
+			continue
+		}
+
+		var targets []*corev1.Pod
+		for _, p := range podsByNs[np.Namespace] {
+			if p.Spec.NodeName == nodeName && sel.Matches(labels.Set(p.Labels)) {
+				targets = append(targets, p)
+			}
+		}
+		if len(targets) == 0 {
+			continue
+		}
+
+		hasIngress, hasEgress := policyTypes(np)
+
+		if hasIngress {
+			for _, t := range targets {
+				ip, _ := podIP(t)
+				state.IngressIsolated[ip] = struct{}{}
+			}
+			for _, rule := range np.Spec.Ingress {
+				peers := resolvePeers(rule.From, np.Namespace, nsLabels, podsByNs)
+				for _, t := range targets {
+					ip, _ := podIP(t)
+					// named ports refer to the ports of the pod receiving the traffic
+					ports := resolvePorts(rule.Ports, t)
+					for _, pr := range peers {
+						for _, pt := range ports {
+							ingress[ip] = append(ingress[ip], box{{pr.lo, pr.hi}, pt.proto, pt.port})
+						}
+					}
+				}
+			}
+		}
+
+		if hasEgress {
+			for _, t := range targets {
+				ip, _ := podIP(t)
+				state.EgressIsolated[ip] = struct{}{}
+			}
+			for _, rule := range np.Spec.Egress {
+				peers := resolvePeers(rule.To, np.Namespace, nsLabels, podsByNs)
+				for _, pr := range peers {
+					// named ports refer to the ports of the destination pod; they never match ipBlocks
+					ports := resolvePorts(rule.Ports, pr.pod)
+					for _, t := range targets {
+						ip, _ := podIP(t)
+						for _, pt := range ports {
+							egress[ip] = append(egress[ip], box{{pr.lo, pr.hi}, pt.proto, pt.port})
+						}
+					}
+				}
+			}
+		}
+	}
+
+	for ip, boxes := range ingress {
+		for _, b := range disjoint(boxes) {
+			state.Ingress[Element{Pod: ip, Box: b}] = struct{}{}
+		}
+	}
+	for ip, boxes := range egress {
+		for _, b := range disjoint(boxes) {
+			state.Egress[Element{Pod: ip, Box: b}] = struct{}{}
+		}
+	}
+	return state
+}
+
+func policyTypes(np *networkingv1.NetworkPolicy) (bool, bool) {
+	if len(np.Spec.PolicyTypes) == 0 {
+		// default: always ingress, egress only when egress rules are present
+		return true, len(np.Spec.Egress) > 0
+	}
+	var ingress, egress bool
+	for _, t := range np.Spec.PolicyTypes {
+		switch t {
+		case networkingv1.PolicyTypeIngress:
+			ingress = true
+		case networkingv1.PolicyTypeEgress:
+			egress = true
+		}
+	}
+	return ingress, egress
+}
+
+// resolvePeers expands the peers of a rule into address ranges. An empty list allows every address.
+func resolvePeers(peers []networkingv1.NetworkPolicyPeer, namespace string, nsLabels map[string]labels.Set,
+	podsByNs map[string][]*corev1.Pod) []peer {
+	if len(peers) == 0 {
+		return []peer{anyPeer}
+	}
+
+	var out []peer
+	for _, p := range peers {
+		if p.IPBlock != nil {
+			out = append(out, resolveIPBlock(p.IPBlock)...)
+			continue
+		}
+
+		podSel := labels.Everything()
+		if p.PodSelector != nil {
+			s, err := metav1.LabelSelectorAsSelector(p.PodSelector)
+			if err != nil {
+				continue
+			}
+			podSel = s
+		}
+
+		// without a namespace selector, only pods of the policy namespace are selected
+		namespaces := []string{namespace}
+		if p.NamespaceSelector != nil {
+			nsSel, err := metav1.LabelSelectorAsSelector(p.NamespaceSelector)
+			if err != nil {
+				continue
+			}
+			namespaces = namespaces[:0]
+			for ns, l := range nsLabels {
+				if nsSel.Matches(l) {
+					namespaces = append(namespaces, ns)
+				}
+			}
+		}
+
+		for _, ns := range namespaces {
+			for _, pod := range podsByNs[ns] {
+				if podSel.Matches(labels.Set(pod.Labels)) {
+					ip, _ := podIP(pod)
+					out = append(out, peer{lo: ip, hi: ip, pod: pod})
+				}
+			}
+		}
+	}
+	return out
+}
+
+// resolveIPBlock turns 'cidr except [...]' into the address ranges left once the exceptions are removed.
+func resolveIPBlock(block *networkingv1.IPBlock) []peer {
+	lo, hi, ok := cidrRange(block.CIDR)
+	if !ok {
+		return nil
+	}
+	ranges := []peer{{lo: lo, hi: hi}}
+	for _, except := range block.Except {
+		elo, ehi, ok := cidrRange(except)
+		if !ok {
+			continue
+		}
+		var next []peer
+		for _, r := range ranges {
+			if ehi < r.lo || elo > r.hi {
+				next = append(next, r)
+				continue
+			}
+			if elo > r.lo {
+				next = append(next, peer{lo: r.lo, hi: elo - 1})
+			}
+			if ehi < r.hi {
+				next = append(next, peer{lo: ehi + 1, hi: r.hi})
+			}
+		}
+		ranges = next
+	}
+	return ranges
+}
+
+// resolvePorts expands the ports of a rule. An empty list allows every protocol and port.
+// Named ports are looked up in 'pod' and are dropped when it is nil or does not expose them.
+func resolvePorts(ports []networkingv1.NetworkPolicyPort, pod *corev1.Pod) []portRange {
+	if len(ports) == 0 {
+		return []portRange{anyPort}
+	}
+
+	var out []portRange
+	for _, p := range ports {
+		protocol := corev1.ProtocolTCP
+		if p.Protocol != nil {
+			protocol = *p.Protocol
+		}
+		proto, ok := protocolNumber(protocol)
+		if !ok {
+			continue
+		}
+		pr := portRange{proto: [2]uint32{proto, proto}}
+
+		switch {
+		case p.Port == nil:
+			pr.port = [2]uint32{0, math.MaxUint16}
+			out = append(out, pr)
+		case p.Port.Type == intstr.Int:
+			start := uint32(p.Port.IntVal)
+			end := start
+			if p.EndPort != nil && uint32(*p.EndPort) > start {
+				end = uint32(*p.EndPort)
+			}
+			pr.port = [2]uint32{start, end}
+			out = append(out, pr)
+		default:
+			if pod == nil {
+				continue
+			}
+			for _, c := range pod.Spec.Containers {
+				for _, cp := range c.Ports {
+					if cp.Name == p.Port.StrVal && (cp.Protocol == protocol || (cp.Protocol == "" && protocol == corev1.ProtocolTCP)) {
+						pr.port = [2]uint32{uint32(cp.ContainerPort), uint32(cp.ContainerPort)}
+						out = append(out, pr)
+					}
+				}
+			}
+		}
+	}
+	return out
+}
+
+func protocolNumber(p corev1.Protocol) (uint32, bool) {
+	switch p {
+	case corev1.ProtocolTCP:
+		return IPPROTO_TCP, true
+	case corev1.ProtocolUDP:
+		return IPPROTO_UDP, true
+	case corev1.ProtocolSCTP:
+		return IPPROTO_SCTP, true
+	}
+	return 0, false
+}
+
+// podIP returns the IPv4 address of a pod attached by sknf; host network and finished pods are skipped.
+func podIP(p *corev1.Pod) (uint32, bool) {
+	if p.Spec.HostNetwork || p.Status.Phase == corev1.PodSucceeded || p.Status.Phase == corev1.PodFailed {
+		return 0, false
+	}
+	ip := net.ParseIP(p.Status.PodIP).To4()
+	if ip == nil {
+		return 0, false
+	}
+	return ipToUint32(ip), true
+}
+
+func cidrRange(cidr string) (uint32, uint32, bool) {
+	_, ipnet, err := net.ParseCIDR(cidr)
+	if err != nil || ipnet.IP.To4() == nil {
+		return 0, 0, false
+	}
+	ones, _ := ipnet.Mask.Size()
+	lo := ipToUint32(ipnet.IP.To4())
+	hi := lo | uint32(uint64(math.MaxUint32)>>uint(ones))
+	return lo, hi, true
+}
+
+func ipToUint32(ip net.IP) uint32 {
+	return uint32(ip[0])<<24 | uint32(ip[1])<<16 | uint32(ip[2])<<8 | uint32(ip[3])
+}
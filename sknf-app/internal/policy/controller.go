@@ -0,0 +1,152 @@
+// Package policy enforces Kubernetes NetworkPolicy for the pods of the local node.
+//
+// Policies, pods and namespaces are watched with informers and compiled into verdict maps
+// of the sknf nftables table (see ruleset.go); every change only sends the map elements
+// that differ from what the kernel already holds.
+package policy
+
+import (
+	"context"
+	"fmt"
+	"os"
+	"reflect"
+	"syscall"
+	"time"
+
+	corev1 "k8s.io/api/core/v1"
+	"k8s.io/apimachinery/pkg/labels"
+	"k8s.io/client-go/informers"
+	"k8s.io/client-go/kubernetes"
+	"k8s.io/client-go/tools/cache"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Pod-to-pod traffic is bridged by brsknf; it only reaches the forward hook with br_netfilter.
+const BRIDGE_NF_CALL_IPTABLES_PATH = "/proc/sys/net/bridge/bridge-nf-call-iptables"
+
+// Bursts of events (e.g. a deployment rolling out) are coalesced into one sync
+const SYNC_DELAY = 200 * time.Millisecond
+
+// A failed sync is retried after this delay
+const RETRY_DELAY = 5 * time.Second
+
+// IsolationSink is told, after every sync, the local pods selected by a policy in either direction
+// (IPs in host byte order), e.g. to keep them off paths that bypass the policy chains.
+type IsolationSink interface {
+	SetIsolated(ips map[uint32]struct{}) error
+}
+
+// Run watches NetworkPolicy, Pod and Namespace objects and keeps the node ruleset in sync until ctx is cancelled.
+// isolation may be nil.
+func Run(ctx context.Context, clientset kubernetes.Interface, nodeName string, isolation IsolationSink) {
+	if err := os.WriteFile(BRIDGE_NF_CALL_IPTABLES_PATH, []byte("1"), 0644); err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure enabling %s, traffic between pods will not be filtered: %v\n",
+			BRIDGE_NF_CALL_IPTABLES_PATH, err)
+	}
+
+	sk, err := nl.Open(syscall.NETLINK_NETFILTER)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure opening nfnetlink socket for network policy: %v\n", err)
+		return
+	}
+	defer sk.Close()
+
+	factory := informers.NewSharedInformerFactory(clientset, 0)
+	pods := factory.Core().V1().Pods()
+	namespaces := factory.Core().V1().Namespaces()
+	policies := factory.Networking().V1().NetworkPolicies()
+
+	dirty := make(chan struct{}, 1)
+	kick := func() {
+		select {
+		case dirty <- struct{}{}:
+		default:
+		}
+	}
+
+	handler := cache.ResourceEventHandlerFuncs{
+		AddFunc:    func(obj interface{}) { kick() },
+		UpdateFunc: func(oldObj, newObj interface{}) { kick() },
+		DeleteFunc: func(obj interface{}) { kick() },
+	}
+	// pod status changes all the time; only react to what policies depend on
+	podHandler := handler
+	podHandler.UpdateFunc = func(oldObj, newObj interface{}) {
+		if podChanged(oldObj.(*corev1.Pod), newObj.(*corev1.Pod)) {
+			kick()
+		}
+	}
+
+	pods.Informer().AddEventHandler(podHandler)
+	namespaces.Informer().AddEventHandler(handler)
+	policies.Informer().AddEventHandler(handler)
+
+	factory.Start(ctx.Done())
+	for typ, ok := range factory.WaitForCacheSync(ctx.Done()) {
+		if !ok {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure syncing %v informer cache\n", typ)
+			return
+		}
+	}
+	fmt.Println("[sknf] Network policy enforcement started")
+
+	ruleset := NewRuleset(sk)
+	kick()
+
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-dirty:
+		}
+
+		select {
+		case <-ctx.Done():
+			return
+		case <-time.After(SYNC_DELAY):
+		}
+
+		podList, err1 := pods.Lister().List(labels.Everything())
+		nsList, err2 := namespaces.Lister().List(labels.Everything())
+		npList, err3 := policies.Lister().List(labels.Everything())
+		if err1 != nil || err2 != nil || err3 != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure listing cached objects for network policy\n")
+			continue
+		}
+
+		state := Compile(nodeName, podList, nsList, npList)
+		if err := ruleset.Sync(state); err != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure syncing network policy: %v\n", err)
+			time.AfterFunc(RETRY_DELAY, kick)
+			continue
+		}
+
+		if isolation != nil {
+			if err := isolation.SetIsolated(isolatedPods(state)); err != nil {
+				fmt.Fprintf(os.Stderr, "[sknf] Failure syncing policy isolated pods: %v\n", err)
+				time.AfterFunc(RETRY_DELAY, kick)
+			}
+		}
+	}
+}
+
+// isolatedPods merges the pods isolated for ingress and for egress: replies of an egress isolated pod are
+// only accepted as established if conntrack saw the traffic they answer.
+func isolatedPods(state *State) map[uint32]struct{} {
+	ips := make(map[uint32]struct{}, len(state.IngressIsolated)+len(state.EgressIsolated))
+	for ip := range state.IngressIsolated {
+		ips[ip] = struct{}{}
+	}
+	for ip := range state.EgressIsolated {
+		ips[ip] = struct{}{}
+	}
+	return ips
+}
+
+func podChanged(o, n *corev1.Pod) bool {
+	return o.Status.PodIP != n.Status.PodIP ||
+		o.Status.Phase != n.Status.Phase ||
+		o.Spec.NodeName != n.Spec.NodeName ||
+		!reflect.DeepEqual(o.Labels, n.Labels)
+}
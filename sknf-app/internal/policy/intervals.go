@@ -0,0 +1,97 @@
+package policy
+
+import (
+	"slices"
+	"sort"
+)
+
+// Dimensions of a policy element besides the local pod address
+const DIM_PEER = 0
+const DIM_PROTO = 1
+const DIM_PORT = 2
+const DIMS = 3
+
+// box is a closed range on every dimension: peer address, L4 protocol and destination port.
+type box [DIMS][2]uint32
+
+// disjoint rewrites a list of possibly overlapping boxes as a canonical list of
+// non-overlapping boxes covering the same space. The kernel rejects overlapping
+// elements in concatenated interval sets, and NetworkPolicy rules overlap all the
+// time (e.g. a namespace selector and an ipBlock covering the same pods).
+func disjoint(boxes []box) []box {
+	return disjointFrom(boxes, 0)
+}
+
+func disjointFrom(boxes []box, dim int) []box {
+	if len(boxes) == 0 {
+		return nil
+	}
+
+	if dim == DIMS-1 {
+		// last dimension: merge overlapping and adjacent ranges
+		sort.Slice(boxes, func(i, j int) bool { return boxes[i][dim][0] < boxes[j][dim][0] })
+		var out []box
+		for _, b := range boxes {
+			n := len(out)
+			if n > 0 && uint64(b[dim][0]) <= uint64(out[n-1][dim][1])+1 {
+				out[n-1][dim][1] = max(out[n-1][dim][1], b[dim][1])
+				continue
+			}
+			var nb box
+			nb[dim] = b[dim]
+			out = append(out, nb)
+		}
+		return out
+	}
+
+	// Sweep over the elementary segments of this dimension, keeping the boxes that cover
+	// the current segment; the remaining dimensions are resolved recursively and adjacent
+	// segments with the same result are merged back together.
+	var points []uint64
+	for _, b := range boxes {
+		points = append(points, uint64(b[dim][0]), uint64(b[dim][1])+1)
+	}
+	slices.Sort(points)
+	points = slices.Compact(points)
+
+	sorted := slices.Clone(boxes)
+	sort.Slice(sorted, func(i, j int) bool { return sorted[i][dim][0] < sorted[j][dim][0] })
+
+	var out []box
+	var active []box
+	var cur []box
+	var curLo, curHi uint64
+	flush := func() {
+		for _, b := range cur {
+			b[dim] = [2]uint32{uint32(curLo), uint32(curHi)}
+			out = append(out, b)
+		}
+		cur = nil
+	}
+
+	next := 0
+	for i := 0; i+1 < len(points); i++ {
+		lo, hi := points[i], points[i+1]-1
+
+		for next < len(sorted) && uint64(sorted[next][dim][0]) == lo {
+			active = append(active, sorted[next])
+			next++
+		}
+		active = slices.DeleteFunc(active, func(b box) bool { return uint64(b[dim][1]) < lo })
+
+		if len(active) == 0 {
+			flush()
+			continue
+		}
+
+		sub := disjointFrom(slices.Clone(active), dim+1)
+		if cur != nil && curHi+1 == lo && slices.Equal(cur, sub) {
+			curHi = hi
+			continue
+		}
+		flush()
+		cur, curLo, curHi = sub, lo, hi
+	}
+	flush()
+	return out
+}
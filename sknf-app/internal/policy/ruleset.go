@@ -0,0 +1,216 @@
+package policy
+
+import (
+	"encoding/binary"
+	"fmt"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nft"
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Chains and sets owned by sknf-app in the sknf table (sknf-cni owns POSTROUTING and ACCOUNTING).
+const INGRESS_CHAIN_NAME = "POLICY_INGRESS"
+const EGRESS_CHAIN_NAME = "POLICY_EGRESS"
+const INGRESS_MAP_NAME = "policy_ingress"
+const EGRESS_MAP_NAME = "policy_egress"
+const INGRESS_ISOLATED_SET_NAME = "policy_ingress_isolated"
+const EGRESS_ISOLATED_SET_NAME = "policy_egress_isolated"
+
+// key of the verdict maps: local pod . peer . l4proto . dport, each padded to a 32-bit register
+const KEY_LEN = 16
+
+// Element allows traffic between a local pod and every (peer, protocol, port) in Box.
+type Element struct {
+	Pod uint32
+	Box box
+}
+
+// State is the complete set of policy elements for the local pods of this node.
+type State struct {
+	Ingress         map[Element]struct{}
+	Egress          map[Element]struct{}
+	IngressIsolated map[uint32]struct{}
+	EgressIsolated  map[uint32]struct{}
+}
+
+func NewState() *State {
+	return &State{
+		Ingress:         make(map[Element]struct{}),
+		Egress:          make(map[Element]struct{}),
+		IngressIsolated: make(map[uint32]struct{}),
+		EgressIsolated:  make(map[uint32]struct{}),
+	}
+}
+
+// Ruleset keeps the kernel in sync with a State. The first sync (and the first one after
+// a failure) replaces the whole ruleset in one transaction; later ones only send the
+// elements that changed.
+type Ruleset struct {
+	sk      *nl.Socket
+	applied *State
+}
+
+func NewRuleset(sk *nl.Socket) *Ruleset {
+	return &Ruleset{sk: sk}
+}
+
+func (r *Ruleset) Sync(desired *State) error {
+	b := nft.NewBatch(r.sk)
+
+	var added, removed int
+	if r.applied == nil {
+		addRuleset(b)
+		for _, set := range []string{INGRESS_MAP_NAME, EGRESS_MAP_NAME, INGRESS_ISOLATED_SET_NAME, EGRESS_ISOLATED_SET_NAME} {
+			b.FlushSet(set)
+		}
+		added += addElements(b, INGRESS_MAP_NAME, desired.Ingress, nil)
+		added += addElements(b, EGRESS_MAP_NAME, desired.Egress, nil)
+		added += addAddresses(b, INGRESS_ISOLATED_SET_NAME, desired.IngressIsolated, nil)
+		added += addAddresses(b, EGRESS_ISOLATED_SET_NAME, desired.EgressIsolated, nil)
+	} else {
+		// deletions go first so that a reshaped range never overlaps its previous version
+		removed += delElements(b, INGRESS_MAP_NAME, r.applied.Ingress, desired.Ingress)
+		removed += delElements(b, EGRESS_MAP_NAME, r.applied.Egress, desired.Egress)
+		removed += delAddresses(b, INGRESS_ISOLATED_SET_NAME, r.applied.IngressIsolated, desired.IngressIsolated)
+		removed += delAddresses(b, EGRESS_ISOLATED_SET_NAME, r.applied.EgressIsolated, desired.EgressIsolated)
+		added += addElements(b, INGRESS_MAP_NAME, desired.Ingress, r.applied.Ingress)
+		added += addElements(b, EGRESS_MAP_NAME, desired.Egress, r.applied.Egress)
+		added += addAddresses(b, INGRESS_ISOLATED_SET_NAME, desired.IngressIsolated, r.applied.IngressIsolated)
+		added += addAddresses(b, EGRESS_ISOLATED_SET_NAME, desired.EgressIsolated, r.applied.EgressIsolated)
+	}
+
+	if b.Empty() {
+		return nil
+	}
+
+	if err := b.Commit(); err != nil {
+		r.applied = nil
+		return fmt.Errorf("committing policy ruleset: %w", err)
+	}
+	r.applied = desired
+
+	fmt.Printf("[sknf] Network policy synced: %d elements added, %d removed\n", added, removed)
+	return nil
+}
+
+// addRuleset (re)creates the policy chains; both hook into forward after the ACCOUNTING chain:
+//
+//	ct state established,related accept
+//	ip daddr . ip saddr . meta l4proto . th dport vmap @policy_ingress
+//	ip daddr @policy_ingress_isolated drop
+//
+// and the same on ip saddr / ip daddr for egress. Each chain does one pipapo lookup and one
+// hash lookup per packet, whatever the number of policies.
+func addRuleset(b *nft.Batch) {
+	b.AddTable()
+
+	for _, name := range []string{INGRESS_MAP_NAME, EGRESS_MAP_NAME} {
+		b.AddSet(nft.Set{
+			Name:     name,
+			Flags:    nft.NFT_SET_INTERVAL | nft.NFT_SET_MAP | nft.NFT_SET_CONCAT,
+			KeyType:  nft.ConcatType(nft.NFT_DATATYPE_IPADDR, nft.NFT_DATATYPE_IPADDR, nft.NFT_DATATYPE_INET_PROTOCOL, nft.NFT_DATATYPE_INET_SERVICE),
+			KeyLen:   KEY_LEN,
+			Fields:   []uint32{4, 4, 1, 2},
+			DataType: nft.NFT_DATA_VERDICT,
+		})
+	}
+	for _, name := range []string{INGRESS_ISOLATED_SET_NAME, EGRESS_ISOLATED_SET_NAME} {
+		b.AddSet(nft.Set{Name: name, KeyType: nft.NFT_DATATYPE_IPADDR, KeyLen: 4})
+	}
+
+	chains := []struct {
+		name     string
+		vmap     string
+		isolated string
+		podAddr  uint32
+		peerAddr uint32
+	}{
+		{INGRESS_CHAIN_NAME, INGRESS_MAP_NAME, INGRESS_ISOLATED_SET_NAME, nft.IPV4_DADDR_OFFSET, nft.IPV4_SADDR_OFFSET},
+		{EGRESS_CHAIN_NAME, EGRESS_MAP_NAME, EGRESS_ISOLATED_SET_NAME, nft.IPV4_SADDR_OFFSET, nft.IPV4_DADDR_OFFSET},
+	}
+
+	ctMask := make([]byte, 4)
+	binary.NativeEndian.PutUint32(ctMask, nft.CT_STATE_ESTABLISHED_RELATED)
+	zero := make([]byte, 4)
+
+	for _, c := range chains {
+		b.AddBaseChain(c.name, "filter", nft.NF_INET_FORWARD, nft.NF_IP_PRI_FILTER)
+		b.FlushChain(c.name)
+
+		b.AddRule(c.name,
+			nft.Ct(nft.NFT_CT_STATE, nft.NFT_REG_1),
+			nft.Bitwise(nft.NFT_REG_1, ctMask, zero),
+			nft.Cmp(nft.NFT_REG_1, nft.NFT_CMP_NEQ, zero),
+			nft.Verdict(nft.NF_ACCEPT))
+
+		b.AddRule(c.name,
+			nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, c.podAddr, 4, nft.NFT_REG32_00),
+			nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, c.peerAddr, 4, nft.NFT_REG32_00+1),
+			nft.Meta(nft.NFT_META_L4PROTO, nft.NFT_REG32_00+2),
+			nft.Payload(nft.NFT_PAYLOAD_TRANSPORT_HEADER, nft.TH_DPORT_OFFSET, 2, nft.NFT_REG32_00+3),
+			nft.VerdictMap(c.vmap, nft.NFT_REG32_00))
+
+		b.AddRule(c.name,
+			nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, c.podAddr, 4, nft.NFT_REG_1),
+			nft.Lookup(c.isolated, nft.NFT_REG_1),
+			nft.Verdict(nft.NF_DROP))
+	}
+}
+
+// encodeKey lays out pod . peer . proto . port with every field padded to 4 bytes; which
+// end of each range is used is selected by 'end'.
+func encodeKey(e Element, end int) []byte {
+	k := make([]byte, KEY_LEN)
+	binary.BigEndian.PutUint32(k[0:4], e.Pod)
+	binary.BigEndian.PutUint32(k[4:8], e.Box[DIM_PEER][end])
+	k[8] = byte(e.Box[DIM_PROTO][end])
+	binary.BigEndian.PutUint16(k[12:14], uint16(e.Box[DIM_PORT][end]))
+	return k
+}
+
+func addElements(b *nft.Batch, set string, want, have map[Element]struct{}) int {
+	accept := int32(nft.NF_ACCEPT)
+	var elems []nft.Elem
+	for e := range want {
+		if _, ok := have[e]; ok {
+			continue
+		}
+		elems = append(elems, nft.Elem{Key: encodeKey(e, 0), KeyEnd: encodeKey(e, 1), Verdict: &accept})
+	}
+	b.AddElems(set, elems)
+	return len(elems)
+}
+
+func delElements(b *nft.Batch, set string, have, want map[Element]struct{}) int {
+	var elems []nft.Elem
+	for e := range have {
+		if _, ok := want[e]; ok {
+			continue
+		}
+		elems = append(elems, nft.Elem{Key: encodeKey(e, 0), KeyEnd: encodeKey(e, 1)})
+	}
+	b.DelElems(set, elems)
+	return len(elems)
+}
+
+func addAddresses(b *nft.Batch, set string, want, have map[uint32]struct{}) int {
+	var elems []nft.Elem
+	for ip := range want {
+		if _, ok := have[ip]; !ok {
+			elems = append(elems, nft.Elem{Key: nl.BE32(ip)})
+		}
+	}
+	b.AddElems(set, elems)
+	return len(elems)
+}
+
+func delAddresses(b *nft.Batch, set string, have, want map[uint32]struct{}) int {
+	var elems []nft.Elem
+	for ip := range have {
+		if _, ok := want[ip]; !ok {
+			elems = append(elems, nft.Elem{Key: nl.BE32(ip)})
+		}
+	}
+	b.DelElems(set, elems)
+	return len(elems)
+}
@@ -0,0 +1,194 @@
+package probe
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"runtime"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Interface names must match the ones created by sknf-cni (see sknf-cni/src/net.h and net.c).
+const HOST_BRIDGE_NAME = "brsknf"
+
+// Host end of the prober pair. It does not look like a pod veth (sknf%08x), so the metrics leak
+// checks and the startup reconcile leave it alone.
+const PROBER_HOST_NAME = "prsknf"
+const PROBER_NETIF_NAME = "eth0"
+
+// linux/if_link.h and linux/veth.h
+const IFLA_INFO_KIND = 1
+const IFLA_INFO_DATA = 2
+const IFLA_NET_NS_FD = 28
+const VETH_INFO_PEER = 1
+
+// linux/in.h
+const IP_MTU_DISCOVER = 10
+const IP_PMTUDISC_PROBE = 3
+
+const NETNS_PATH = "/proc/thread-self/ns/net"
+
+// probeNetns is what is kept from the prober netns: the netns itself stays alive as long as
+// its sockets are open.
+type probeNetns struct {
+	fd   int
+	rtnl *nl.Socket
+	udp  int
+}
+
+// setupNetns creates the prober netns and its veth pair, attaches the host end to brsknf and
+// returns the UDP socket of the prober along with the MTU of its interface.
+//
+// The netns is created by a thread that never leaves it: sockets opened there stay bound to it,
+// so no setns back to the host netns is needed, and the thread exits with its goroutine. The
+// netns goes away with sknf-app, taking the pair with it.
+func setupNetns(ip net.IP, clusterPrefix int) (*net.UDPConn, int, error) {
+	type result struct {
+		ns  *probeNetns
+		err error
+	}
+	ch := make(chan result)
+	go func() {
+		runtime.LockOSThread()
+		ns, err := newNetns()
+		ch <- result{ns, err}
+	}()
+	res := <-ch
+	if res.err != nil {
+		return nil, 0, fmt.Errorf("creating prober netns: %w", res.err)
+	}
+	ns := res.ns
+	defer syscall.Close(ns.fd)
+	defer ns.rtnl.Close()
+
+	conn, mtu, err := configure(ns, ip, clusterPrefix)
+	if err != nil {
+		if ns.udp >= 0 {
+			syscall.Close(ns.udp)
+		}
+		return nil, 0, err
+	}
+	return conn, mtu, nil
+}
+
+func newNetns() (*probeNetns, error) {
+	if err := syscall.Unshare(syscall.CLONE_NEWNET); err != nil {
+		return nil, err
+	}
+	fd, err := syscall.Open(NETNS_PATH, syscall.O_RDONLY|syscall.O_CLOEXEC, 0)
+	if err != nil {
+		return nil, err
+	}
+	rtnl, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		syscall.Close(fd)
+		return nil, err
+	}
+	udp, err := syscall.Socket(syscall.AF_INET, syscall.SOCK_DGRAM|syscall.SOCK_CLOEXEC, 0)
+	if err != nil {
+		rtnl.Close()
+		syscall.Close(fd)
+		return nil, err
+	}
+	return &probeNetns{fd: fd, rtnl: rtnl, udp: udp}, nil
+}
+
+func configure(ns *probeNetns, ip net.IP, clusterPrefix int) (*net.UDPConn, int, error) {
+	host, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		return nil, 0, err
+	}
+	defer host.Close()
+
+	// a pair left by a previous sknf-app whose netns is still held by someone
+	if err := host.Request(syscall.RTM_DELLINK, 0,
+		nl.AppendStringAttr(nl.IfInfoMsg(0, 0), syscall.IFLA_IFNAME, PROBER_HOST_NAME)); err != nil && !errors.Is(err, syscall.ENODEV) {
+		return nil, 0, fmt.Errorf("deleting leftover %s: %w", PROBER_HOST_NAME, err)
+	}
+
+	req := nl.AppendStringAttr(nl.IfInfoMsg(0, 0), syscall.IFLA_IFNAME, PROBER_HOST_NAME)
+	req = nl.AppendNested(req, syscall.IFLA_LINKINFO, func(b []byte) []byte {
+		b = nl.AppendStringAttr(b, IFLA_INFO_KIND, "veth")
+		return nl.AppendNested(b, IFLA_INFO_DATA, func(b []byte) []byte {
+			return nl.AppendNested(b, VETH_INFO_PEER, func(b []byte) []byte {
+				b = append(b, nl.IfInfoMsg(0, 0)...)
+				b = nl.AppendStringAttr(b, syscall.IFLA_IFNAME, PROBER_NETIF_NAME)
+				// same MAC scheme as pods (0a:58:<ip>), see sknf-cni/src/net.c
+				b = nl.AppendAttr(b, syscall.IFLA_ADDRESS, append([]byte{0x0a, 0x58}, ip.To4()...))
+				return nl.AppendAttr(b, IFLA_NET_NS_FD, nl.U32(uint32(ns.fd)))
+			})
+		})
+	})
+	if err := host.Request(syscall.RTM_NEWLINK, syscall.NLM_F_CREATE|syscall.NLM_F_EXCL, req); err != nil {
+		return nil, 0, fmt.Errorf("creating %s: %w", PROBER_HOST_NAME, err)
+	}
+
+	hostIf, err := net.InterfaceByName(PROBER_HOST_NAME)
+	if err != nil {
+		return nil, 0, err
+	}
+	bridge, err := net.InterfaceByName(HOST_BRIDGE_NAME)
+	if err != nil {
+		return nil, 0, err
+	}
+	req = nl.AppendAttr(nl.IfInfoMsg(int32(hostIf.Index), syscall.IFF_UP), syscall.IFLA_MASTER, nl.U32(uint32(bridge.Index)))
+	if err := host.Request(syscall.RTM_NEWLINK, 0, req); err != nil {
+		return nil, 0, fmt.Errorf("attaching %s to %s: %w", PROBER_HOST_NAME, HOST_BRIDGE_NAME, err)
+	}
+
+	// inside the prober netns: lo and eth0 are the only links
+	index, mtu := int32(0), 0
+	msgs, err := ns.rtnl.Dump(syscall.RTM_GETLINK, nl.IfInfoMsg(0, 0))
+	if err != nil {
+		return nil, 0, err
+	}
+	for _, m := range msgs {
+		if len(m.Data) < syscall.SizeofIfInfomsg {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[syscall.SizeofIfInfomsg:])
+		idx := int32(binary.NativeEndian.Uint32(m.Data[4:8]))
+		if err := ns.rtnl.Request(syscall.RTM_NEWLINK, 0, nl.IfInfoMsg(idx, syscall.IFF_UP)); err != nil {
+			return nil, 0, fmt.Errorf("setting %s up: %w", nl.String(attrs[syscall.IFLA_IFNAME]), err)
+		}
+		if nl.String(attrs[syscall.IFLA_IFNAME]) == PROBER_NETIF_NAME {
+			index, mtu = idx, int(nl.Uint32(attrs[syscall.IFLA_MTU]))
+		}
+	}
+	if index == 0 {
+		return nil, 0, fmt.Errorf("%s did not show up in the prober netns", PROBER_NETIF_NAME)
+	}
+
+	// /<cluster prefix> as for pods: the probers of all nodes are on-link over the overlay
+	addr := make([]byte, syscall.SizeofIfAddrmsg)
+	addr[0] = syscall.AF_INET
+	addr[1] = byte(clusterPrefix)
+	binary.NativeEndian.PutUint32(addr[4:8], uint32(index))
+	addr = nl.AppendAttr(addr, syscall.IFA_LOCAL, ip.To4())
+	addr = nl.AppendAttr(addr, syscall.IFA_ADDRESS, ip.To4())
+	if err := ns.rtnl.Request(syscall.RTM_NEWADDR, syscall.NLM_F_CREATE|syscall.NLM_F_EXCL, addr); err != nil {
+		return nil, 0, fmt.Errorf("assigning %s to the prober: %w", ip, err)
+	}
+
+	// DF on every probe and no local fragmentation, whatever the cached path MTU says
+	if err := syscall.SetsockoptInt(ns.udp, syscall.IPPROTO_IP, IP_MTU_DISCOVER, IP_PMTUDISC_PROBE); err != nil {
+		return nil, 0, err
+	}
+	if err := syscall.Bind(ns.udp, &syscall.SockaddrInet4{Port: PROBE_PORT}); err != nil {
+		return nil, 0, fmt.Errorf("binding prober port %d: %w", PROBE_PORT, err)
+	}
+
+	f := os.NewFile(uintptr(ns.udp), "prober")
+	pc, err := net.FilePacketConn(f)
+	// FilePacketConn works on a dup, the original is closed either way
+	f.Close()
+	ns.udp = -1
+	if err != nil {
+		return nil, 0, err
+	}
+	return pc.(*net.UDPConn), mtu, nil
+}
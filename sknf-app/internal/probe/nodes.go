@@ -0,0 +1,87 @@
+package probe
+
+import (
+	"context"
+	"fmt"
+	"net"
+	"os"
+
+	corev1 "k8s.io/api/core/v1"
+	"k8s.io/apimachinery/pkg/labels"
+	"k8s.io/client-go/informers"
+	"k8s.io/client-go/kubernetes"
+	"k8s.io/client-go/tools/cache"
+)
+
+// WatchNodes keeps the peers of p in sync with the nodes of the cluster until ctx is cancelled.
+// Every node with a pod CIDR is expected to run a prober at the last address of it.
+func WatchNodes(ctx context.Context, clientset kubernetes.Interface, p *Prober) {
+	factory := informers.NewSharedInformerFactory(clientset, 0)
+	nodes := factory.Core().V1().Nodes()
+
+	dirty := make(chan struct{}, 1)
+	kick := func() {
+		select {
+		case dirty <- struct{}{}:
+		default:
+		}
+	}
+	nodes.Informer().AddEventHandler(cache.ResourceEventHandlerFuncs{
+		AddFunc: func(obj interface{}) { kick() },
+		// node status is updated every few seconds; only a pod CIDR change matters here
+		UpdateFunc: func(oldObj, newObj interface{}) {
+			if nodePodCidr(oldObj.(*corev1.Node)) != nodePodCidr(newObj.(*corev1.Node)) {
+				kick()
+			}
+		},
+		DeleteFunc: func(obj interface{}) { kick() },
+	})
+
+	factory.Start(ctx.Done())
+	for typ, ok := range factory.WaitForCacheSync(ctx.Done()) {
+		if !ok {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure syncing %v cache for the prober\n", typ)
+			return
+		}
+	}
+
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-dirty:
+		}
+
+		list, err := nodes.Lister().List(labels.Everything())
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure listing nodes for the prober: %v\n", err)
+			continue
+		}
+		peers := make(map[string]net.IP, len(list))
+		for _, node := range list {
+			if ip := nodeProberIP(node); ip != nil {
+				peers[node.Name] = ip
+			}
+		}
+		p.SetPeers(peers)
+	}
+}
+
+func nodePodCidr(node *corev1.Node) string {
+	if node.Spec.PodCIDR == "" && len(node.Spec.PodCIDRs) > 0 {
+		return node.Spec.PodCIDRs[0]
+	}
+	return node.Spec.PodCIDR
+}
+
+func nodeProberIP(node *corev1.Node) net.IP {
+	cidr := nodePodCidr(node)
+	if cidr == "" {
+		return nil
+	}
+	ip, err := ProberIP(cidr)
+	if err != nil {
+		return nil
+	}
+	return ip
+}
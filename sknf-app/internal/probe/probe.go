@@ -0,0 +1,402 @@
+// Package probe measures the pod network between nodes.
+//
+// Every node runs a prober in its own netns, attached to brsknf like a pod (see netns.go), at
+// the last address of the node pod CIDR, which sknf-cni never hands out. Probers exchange UDP
+// echoes over the real pod path (bridge, VXLAN overlay, underlay) and keep RTT, jitter and loss
+// per peer; with every node exporting its row, the metrics form a node-to-node matrix.
+package probe
+
+import (
+	"context"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"slices"
+	"sync"
+	"time"
+
+	"github.com/felipeek/sknf/sknf-app/internal/metrics"
+)
+
+const PROBE_PORT = 7946
+
+const PROBE_INTERVAL_DEFAULT = time.Second
+const PROBE_FANOUT_DEFAULT = 16
+
+// A probe without a reply after this long is counted as lost
+const PROBE_TIMEOUT = 2 * time.Second
+
+// RTT, jitter and loss are computed over the last PROBE_WINDOW probes of each peer and size
+const PROBE_WINDOW = 64
+
+// Probe payload sizes. Full-size probes fill the pod MTU with DF set, so a path that drops big
+// packets (an MTU black hole) shows up as loss on "mtu" while "small" still goes through.
+const SIZE_SMALL = 0
+const SIZE_MTU = 1
+const SMALL_PAYLOAD_LEN = 64
+
+// IPv4 and UDP headers
+const IP_UDP_HEADER_LEN = 28
+
+const MSG_MAGIC = 0x736b6e70 // "sknp"
+const MSG_REQUEST = 1
+const MSG_REPLY = 2
+const MSG_HEADER_LEN = 12
+
+var sizeNames = [...]string{SIZE_SMALL: "small", SIZE_MTU: "mtu"}
+
+type Config struct {
+	NodeName string
+	// Node pod CIDR; the prober takes its last address
+	Subnet string
+	// Cluster CIDR, the prefix of the prober address as for pods
+	ClusterCidr string
+	// A round probes the next Fanout peers; every peer is probed once every ceil(peers/Fanout) rounds
+	Interval time.Duration
+	Fanout   int
+}
+
+type sample struct {
+	rtt  time.Duration
+	lost bool
+}
+
+// window keeps the last PROBE_WINDOW results of one peer and size
+type window struct {
+	samples [PROBE_WINDOW]sample
+	next    int
+	count   int
+	sent    uint64
+	lost    uint64
+}
+
+type peer struct {
+	ip    net.IP
+	sizes [len(sizeNames)]window
+}
+
+type pending struct {
+	node   string
+	size   int
+	sentAt time.Time
+}
+
+// Prober sends probes to the probers of the other nodes and answers theirs.
+type Prober struct {
+	cfg Config
+	ip  net.IP
+
+	conn *net.UDPConn
+	// payload of full-size probes, from the MTU of the prober interface
+	mtuPayloadLen int
+
+	mu      sync.Mutex
+	peers   map[string]*peer
+	order   []string
+	cursor  int
+	pending map[uint32]pending
+	seq     uint32
+}
+
+// ProberIP returns the address of the prober of the node that owns subnet: the last one of the subnet.
+func ProberIP(subnet string) (net.IP, error) {
+	_, ipnet, err := net.ParseCIDR(subnet)
+	if err != nil {
+		return nil, err
+	}
+	ip := ipnet.IP.To4()
+	if ip == nil {
+		return nil, fmt.Errorf("%s is not an IPv4 CIDR", subnet)
+	}
+	last := make(net.IP, 4)
+	for i := range last {
+		last[i] = ip[i] | ^ipnet.Mask[i]
+	}
+	return last, nil
+}
+
+// New creates the prober netns and interface. Probes start with Run, once peers are set.
+func New(cfg Config) (*Prober, error) {
+	if cfg.Interval <= 0 {
+		cfg.Interval = PROBE_INTERVAL_DEFAULT
+	}
+	if cfg.Fanout <= 0 {
+		cfg.Fanout = PROBE_FANOUT_DEFAULT
+	}
+
+	ip, err := ProberIP(cfg.Subnet)
+	if err != nil {
+		return nil, fmt.Errorf("invalid subnet %s: %w", cfg.Subnet, err)
+	}
+	_, cluster, err := net.ParseCIDR(cfg.ClusterCidr)
+	if err != nil {
+		return nil, fmt.Errorf("invalid cluster CIDR %s: %w", cfg.ClusterCidr, err)
+	}
+	clusterPrefix, _ := cluster.Mask.Size()
+
+	conn, mtu, err := setupNetns(ip, clusterPrefix)
+	if err != nil {
+		return nil, err
+	}
+
+	return &Prober{
+		cfg:           cfg,
+		ip:            ip,
+		conn:          conn,
+		mtuPayloadLen: mtu - IP_UDP_HEADER_LEN,
+		peers:         map[string]*peer{},
+		pending:       map[uint32]pending{},
+	}, nil
+}
+
+func (p *Prober) IP() net.IP {
+	return p.ip
+}
+
+// SetPeers replaces the set of probed nodes (node name to prober address). Results of nodes that
+// are still present are kept.
+func (p *Prober) SetPeers(ips map[string]net.IP) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	for name := range p.peers {
+		if _, ok := ips[name]; !ok {
+			delete(p.peers, name)
+		}
+	}
+	for name, ip := range ips {
+		if name == p.cfg.NodeName {
+			continue
+		}
+		if pr, ok := p.peers[name]; ok && pr.ip.Equal(ip) {
+			continue
+		}
+		p.peers[name] = &peer{ip: ip}
+	}
+
+	p.order = p.order[:0]
+	for name := range p.peers {
+		p.order = append(p.order, name)
+	}
+	slices.Sort(p.order)
+	if p.cursor >= len(p.order) {
+		p.cursor = 0
+	}
+}
+
+// Run answers and sends probes until ctx is cancelled.
+func (p *Prober) Run(ctx context.Context) {
+	go func() {
+		<-ctx.Done()
+		p.conn.Close()
+	}()
+	go p.receive()
+
+	fmt.Printf("[sknf] Prober listening on %s:%d\n", p.ip, PROBE_PORT)
+
+	ticker := time.NewTicker(p.cfg.Interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-ticker.C:
+		}
+		p.expire(time.Now())
+		p.round()
+	}
+}
+
+// round probes the next Fanout peers in name order, with one probe of each size.
+func (p *Prober) round() {
+	type target struct {
+		addr *net.UDPAddr
+		seq  uint32
+		size int
+	}
+
+	p.mu.Lock()
+	var targets []target
+	now := time.Now()
+	for i := 0; i < p.cfg.Fanout && i < len(p.order); i++ {
+		name := p.order[p.cursor]
+		p.cursor = (p.cursor + 1) % len(p.order)
+		pr := p.peers[name]
+		for size := range pr.sizes {
+			p.seq++
+			p.pending[p.seq] = pending{node: name, size: size, sentAt: now}
+			pr.sizes[size].sent++
+			targets = append(targets, target{&net.UDPAddr{IP: pr.ip, Port: PROBE_PORT}, p.seq, size})
+		}
+	}
+	p.mu.Unlock()
+
+	buf := make([]byte, max(p.mtuPayloadLen, SMALL_PAYLOAD_LEN))
+	for _, t := range targets {
+		n := SMALL_PAYLOAD_LEN
+		if t.size == SIZE_MTU {
+			n = p.mtuPayloadLen
+		}
+		putHeader(buf, MSG_REQUEST, t.seq)
+		// a failed send (e.g. EMSGSIZE) is left to expire as a loss
+		p.conn.WriteToUDP(buf[:n], t.addr)
+	}
+}
+
+func (p *Prober) receive() {
+	buf := make([]byte, 1<<16)
+	for {
+		n, addr, err := p.conn.ReadFromUDP(buf)
+		if err != nil {
+			if !errors.Is(err, net.ErrClosed) {
+				fmt.Fprintf(os.Stderr, "[sknf] Prober receive failed: %v\n", err)
+			}
+			return
+		}
+		now := time.Now()
+		if n < MSG_HEADER_LEN || binary.BigEndian.Uint32(buf[0:4]) != MSG_MAGIC {
+			continue
+		}
+		seq := binary.BigEndian.Uint32(buf[8:12])
+		switch buf[4] {
+		case MSG_REQUEST:
+			// echoed with the same size, so the reply takes the same path constraints back
+			putHeader(buf, MSG_REPLY, seq)
+			p.conn.WriteToUDP(buf[:n], addr)
+		case MSG_REPLY:
+			p.complete(seq, now)
+		}
+	}
+}
+
+func (p *Prober) complete(seq uint32, now time.Time) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	pd, ok := p.pending[seq]
+	if !ok {
+		return
+	}
+	delete(p.pending, seq)
+	if pr, ok := p.peers[pd.node]; ok {
+		pr.sizes[pd.size].add(sample{rtt: now.Sub(pd.sentAt)})
+	}
+}
+
+func (p *Prober) expire(now time.Time) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	for seq, pd := range p.pending {
+		if now.Sub(pd.sentAt) < PROBE_TIMEOUT {
+			continue
+		}
+		delete(p.pending, seq)
+		if pr, ok := p.peers[pd.node]; ok {
+			pr.sizes[pd.size].lost++
+			pr.sizes[pd.size].add(sample{lost: true})
+		}
+	}
+}
+
+func (w *window) add(s sample) {
+	w.samples[w.next] = s
+	w.next = (w.next + 1) % PROBE_WINDOW
+	if w.count < PROBE_WINDOW {
+		w.count++
+	}
+}
+
+// stats returns the mean RTT, the jitter (mean difference between consecutive RTTs, as in
+// RFC 3550) and the loss ratio over the window. ok is false when no reply is in the window.
+func (w *window) stats() (rtt, jitter time.Duration, loss float64, ok bool) {
+	var received, lost, jitterCount int
+	var sum, jitterSum, prev time.Duration
+	havePrev := false
+	for i := 0; i < w.count; i++ {
+		s := w.samples[(w.next-w.count+i+PROBE_WINDOW)%PROBE_WINDOW]
+		if s.lost {
+			lost++
+			continue
+		}
+		received++
+		sum += s.rtt
+		if havePrev {
+			d := s.rtt - prev
+			if d < 0 {
+				d = -d
+			}
+			jitterSum += d
+			jitterCount++
+		}
+		prev = s.rtt
+		havePrev = true
+	}
+	if w.count > 0 {
+		loss = float64(lost) / float64(w.count)
+	}
+	if received == 0 {
+		return 0, 0, loss, false
+	}
+	rtt = sum / time.Duration(received)
+	if jitterCount > 0 {
+		jitter = jitterSum / time.Duration(jitterCount)
+	}
+	return rtt, jitter, loss, true
+}
+
+func (p *Prober) WriteMetrics(w *metrics.Writer) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	src := p.cfg.NodeName
+
+	w.Family("sknf_probe_peers", "gauge", "Nodes probed by this node.")
+	w.Sample("sknf_probe_peers", float64(len(p.order)))
+
+	w.Family("sknf_probe_rtt_seconds", "gauge", "Mean pod network round-trip time to the prober of another node, over the last probes.")
+	p.forEach(func(dst, size string, win *window) {
+		if rtt, _, _, ok := win.stats(); ok {
+			w.Sample("sknf_probe_rtt_seconds", rtt.Seconds(), "source_node", src, "target_node", dst, "size", size)
+		}
+	})
+	w.Family("sknf_probe_jitter_seconds", "gauge", "Mean difference between consecutive round-trip times to another node, over the last probes.")
+	p.forEach(func(dst, size string, win *window) {
+		if _, jitter, _, ok := win.stats(); ok {
+			w.Sample("sknf_probe_jitter_seconds", jitter.Seconds(), "source_node", src, "target_node", dst, "size", size)
+		}
+	})
+	w.Family("sknf_probe_loss_ratio", "gauge", "Fraction of the last probes to another node that got no reply.")
+	p.forEach(func(dst, size string, win *window) {
+		if win.count > 0 {
+			_, _, loss, _ := win.stats()
+			w.Sample("sknf_probe_loss_ratio", loss, "source_node", src, "target_node", dst, "size", size)
+		}
+	})
+	w.Family("sknf_probe_sent_total", "counter", "Probes sent to another node.")
+	p.forEach(func(dst, size string, win *window) {
+		w.Sample("sknf_probe_sent_total", float64(win.sent), "source_node", src, "target_node", dst, "size", size)
+	})
+	w.Family("sknf_probe_lost_total", "counter", "Probes to another node that got no reply.")
+	p.forEach(func(dst, size string, win *window) {
+		w.Sample("sknf_probe_lost_total", float64(win.lost), "source_node", src, "target_node", dst, "size", size)
+	})
+}
+
+func (p *Prober) forEach(fn func(dst, size string, win *window)) {
+	for _, name := range p.order {
+		pr := p.peers[name]
+		for size := range pr.sizes {
+			fn(name, sizeNames[size], &pr.sizes[size])
+		}
+	}
+}
+
+func putHeader(b []byte, typ byte, seq uint32) {
+	binary.BigEndian.PutUint32(b[0:4], MSG_MAGIC)
+	b[4] = typ
+	b[5], b[6], b[7] = 0, 0, 0
+	binary.BigEndian.PutUint32(b[8:12], seq)
+}
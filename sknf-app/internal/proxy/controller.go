@@ -0,0 +1,225 @@
+// Package proxy implements ClusterIP services in the sknf nftables table, as a replacement
+// for kube-proxy.
+//
+// Services and EndpointSlices are watched with informers and compiled into a verdict map
+// keyed by ClusterIP, protocol and port, which jumps to one chain per service port (see
+// ruleset.go); every change only rewrites the chains of the service ports that changed.
+package proxy
+
+import (
+	"cmp"
+	"context"
+	"fmt"
+	"hash/fnv"
+	"net"
+	"os"
+	"slices"
+	"syscall"
+	"time"
+
+	corev1 "k8s.io/api/core/v1"
+	discoveryv1 "k8s.io/api/discovery/v1"
+	"k8s.io/apimachinery/pkg/labels"
+	"k8s.io/client-go/informers"
+	"k8s.io/client-go/kubernetes"
+	"k8s.io/client-go/tools/cache"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Replies of a pod to a pod of the same node are bridged by brsknf; they are only un-DNATed
+// with br_netfilter.
+const BRIDGE_NF_CALL_IPTABLES_PATH = "/proc/sys/net/bridge/bridge-nf-call-iptables"
+
+// Bursts of events (e.g. a deployment rolling out) are coalesced into one sync
+const SYNC_DELAY = 200 * time.Millisecond
+
+// A failed sync is retried after this delay
+const RETRY_DELAY = 5 * time.Second
+
+const IPPROTO_TCP = 6
+const IPPROTO_UDP = 17
+const IPPROTO_SCTP = 132
+
+// Run watches Service and EndpointSlice objects and keeps the node ruleset in sync until ctx is cancelled.
+func Run(ctx context.Context, clientset kubernetes.Interface) {
+	if err := os.WriteFile(BRIDGE_NF_CALL_IPTABLES_PATH, []byte("1"), 0644); err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure enabling %s, services between pods of a node will not work: %v\n",
+			BRIDGE_NF_CALL_IPTABLES_PATH, err)
+	}
+
+	sk, err := nl.Open(syscall.NETLINK_NETFILTER)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure opening nfnetlink socket for service proxy: %v\n", err)
+		return
+	}
+	defer sk.Close()
+
+	factory := informers.NewSharedInformerFactory(clientset, 0)
+	services := factory.Core().V1().Services()
+	endpointSlices := factory.Discovery().V1().EndpointSlices()
+
+	dirty := make(chan struct{}, 1)
+	kick := func() {
+		select {
+		case dirty <- struct{}{}:
+		default:
+		}
+	}
+
+	handler := cache.ResourceEventHandlerFuncs{
+		AddFunc:    func(obj interface{}) { kick() },
+		UpdateFunc: func(oldObj, newObj interface{}) { kick() },
+		DeleteFunc: func(obj interface{}) { kick() },
+	}
+	services.Informer().AddEventHandler(handler)
+	endpointSlices.Informer().AddEventHandler(handler)
+
+	factory.Start(ctx.Done())
+	for typ, ok := range factory.WaitForCacheSync(ctx.Done()) {
+		if !ok {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure syncing %v informer cache\n", typ)
+			return
+		}
+	}
+	fmt.Println("[sknf] Service proxy started")
+
+	ruleset := NewRuleset(sk)
+	kick()
+
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-dirty:
+		}
+
+		select {
+		case <-ctx.Done():
+			return
+		case <-time.After(SYNC_DELAY):
+		}
+
+		svcList, err1 := services.Lister().List(labels.Everything())
+		epsList, err2 := endpointSlices.Lister().List(labels.Everything())
+		if err1 != nil || err2 != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure listing cached objects for service proxy\n")
+			continue
+		}
+
+		if err := ruleset.Sync(Compile(svcList, epsList)); err != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure syncing services: %v\n", err)
+			time.AfterFunc(RETRY_DELAY, kick)
+		}
+	}
+}
+
+// Compile computes the service ports of the cluster, keyed by chain name. Only IPv4 ClusterIP
+// services are handled; headless and ExternalName services have nothing to balance.
+func Compile(services []*corev1.Service, endpointSlices []*discoveryv1.EndpointSlice) map[string]*ServicePort {
+	slicesBySvc := make(map[string][]*discoveryv1.EndpointSlice)
+	for _, eps := range endpointSlices {
+		name := eps.Labels[discoveryv1.LabelServiceName]
+		if name == "" || eps.AddressType != discoveryv1.AddressTypeIPv4 {
+			continue
+		}
+		slicesBySvc[eps.Namespace+"/"+name] = append(slicesBySvc[eps.Namespace+"/"+name], eps)
+	}
+
+	out := make(map[string]*ServicePort)
+	for _, svc := range services {
+		if svc.Spec.Type == corev1.ServiceTypeExternalName {
+			continue
+		}
+		clusterIP := net.ParseIP(svc.Spec.ClusterIP).To4()
+		if clusterIP == nil {
+			continue
+		}
+
+		for _, port := range svc.Spec.Ports {
+			proto, ok := protocolNumber(port.Protocol)
+			if !ok {
+				continue
+			}
+			sp := &ServicePort{
+				Chain:     serviceChain(svc, &port),
+				ClusterIP: ipToUint32(clusterIP),
+				Proto:     proto,
+				Port:      uint16(port.Port),
+				Affinity:  svc.Spec.SessionAffinity == corev1.ServiceAffinityClientIP,
+				Endpoints: resolveEndpoints(slicesBySvc[svc.Namespace+"/"+svc.Name], &port),
+			}
+			out[sp.Chain] = sp
+		}
+	}
+	return out
+}
+
+// resolveEndpoints returns the ready endpoints of a service port, sorted so that unrelated
+// changes to the slices do not reshuffle them.
+func resolveEndpoints(endpointSlices []*discoveryv1.EndpointSlice, port *corev1.ServicePort) []Endpoint {
+	var out []Endpoint
+	for _, eps := range endpointSlices {
+		// endpoint slice ports are matched by name, which is empty for single-port services
+		var target uint16
+		for _, p := range eps.Ports {
+			protocol := corev1.ProtocolTCP
+			if p.Protocol != nil {
+				protocol = *p.Protocol
+			}
+			name := ""
+			if p.Name != nil {
+				name = *p.Name
+			}
+			if name == port.Name && protocol == port.Protocol && p.Port != nil {
+				target = uint16(*p.Port)
+			}
+		}
+		if target == 0 {
+			continue
+		}
+
+		for _, ep := range eps.Endpoints {
+			if ep.Conditions.Ready != nil && !*ep.Conditions.Ready {
+				continue
+			}
+			for _, addr := range ep.Addresses {
+				if ip := net.ParseIP(addr).To4(); ip != nil {
+					out = append(out, Endpoint{IP: ipToUint32(ip), Port: target})
+				}
+			}
+		}
+	}
+
+	slices.SortFunc(out, func(a, b Endpoint) int {
+		if a.IP != b.IP {
+			return cmp.Compare(a.IP, b.IP)
+		}
+		return cmp.Compare(a.Port, b.Port)
+	})
+	return slices.Compact(out)
+}
+
+// serviceChain names the chain of a service port after a hash of its identity, which survives
+// changes to the ClusterIP and restarts of sknf-app.
+func serviceChain(svc *corev1.Service, port *corev1.ServicePort) string {
+	h := fnv.New64a()
+	fmt.Fprintf(h, "%s/%s/%s/%s", svc.Namespace, svc.Name, port.Name, port.Protocol)
+	return fmt.Sprintf("%s%016x", SERVICE_CHAIN_PREFIX, h.Sum64())
+}
+
+func protocolNumber(p corev1.Protocol) (uint8, bool) {
+	switch p {
+	case corev1.ProtocolTCP, "":
+		return IPPROTO_TCP, true
+	case corev1.ProtocolUDP:
+		return IPPROTO_UDP, true
+	case corev1.ProtocolSCTP:
+		return IPPROTO_SCTP, true
+	}
+	return 0, false
+}
+
+func ipToUint32(ip net.IP) uint32 {
+	return uint32(ip[0])<<24 | uint32(ip[1])<<16 | uint32(ip[2])<<8 | uint32(ip[3])
+}
@@ -0,0 +1,314 @@
+package proxy
+
+import (
+	"encoding/binary"
+	"fmt"
+	"slices"
+	"strings"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nft"
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Chains and sets owned by the service proxy in the sknf table
+const PREROUTING_CHAIN_NAME = "SERVICES_PREROUTING"
+const OUTPUT_CHAIN_NAME = "SERVICES_OUTPUT"
+const POSTROUTING_CHAIN_NAME = "SERVICES_POSTROUTING"
+const SERVICES_MAP_NAME = "services"
+const HAIRPIN_SET_NAME = "services_hairpin"
+
+// Every service port gets a chain named 'svc-%016x' after a hash of its name (see controller.go)
+const SERVICE_CHAIN_PREFIX = "svc-"
+
+// services map key: ip daddr . meta l4proto . th dport, each padded to a 32-bit register
+const SERVICE_KEY_LEN = 12
+
+const AFFINITY_HASH_SEED = 0x736b6e66
+
+type Endpoint struct {
+	IP   uint32
+	Port uint16
+}
+
+// ServicePort is a ClusterIP:port/protocol and its ready endpoints, in a stable order.
+type ServicePort struct {
+	Chain     string
+	ClusterIP uint32
+	Proto     uint8
+	Port      uint16
+	Affinity  bool
+	Endpoints []Endpoint
+}
+
+// Ruleset keeps the kernel in sync with the service ports of the cluster. The first sync (and
+// the first one after a failure) rebuilds everything in one transaction; later ones only touch
+// the chains of the service ports that changed.
+// Sync keeps a reference to the map it is given, which must not be modified afterwards.
+type Ruleset struct {
+	sk      *nl.Socket
+	applied map[string]*ServicePort
+}
+
+func NewRuleset(sk *nl.Socket) *Ruleset {
+	return &Ruleset{sk: sk}
+}
+
+func (r *Ruleset) Sync(desired map[string]*ServicePort) error {
+	b := nft.NewBatch(r.sk)
+
+	// Jumps are added after every rule: once the services map jumps to a chain, each rule
+	// added to it makes the kernel revalidate the map.
+	var jumps []nft.Elem
+	var changed int
+	if r.applied == nil {
+		existing, err := nft.ListChains(r.sk)
+		if err != nil {
+			return err
+		}
+
+		addRuleset(b)
+		b.FlushSet(SERVICES_MAP_NAME)
+		b.FlushSet(HAIRPIN_SET_NAME)
+		// chains of a previous run are reused when still wanted and deleted otherwise; they are
+		// no longer referenced since the services map was flushed
+		for _, chain := range existing {
+			if !strings.HasPrefix(chain, SERVICE_CHAIN_PREFIX) {
+				continue
+			}
+			b.FlushChain(chain)
+			if _, ok := desired[chain]; !ok {
+				b.DelChain(chain)
+			}
+		}
+		for _, sp := range desired {
+			addServicePort(b, sp, &jumps)
+		}
+		addHairpin(b, desired, nil)
+		changed = len(desired)
+	} else {
+		for chain, old := range r.applied {
+			if _, ok := desired[chain]; !ok {
+				deleteServicePort(b, old)
+				changed++
+			}
+		}
+		for chain, sp := range desired {
+			old, ok := r.applied[chain]
+			if !ok {
+				addServicePort(b, sp, &jumps)
+				changed++
+			} else if updateServicePort(b, old, sp, &jumps) {
+				changed++
+			}
+		}
+		delHairpin(b, r.applied, desired)
+		addHairpin(b, desired, r.applied)
+	}
+	b.AddElems(SERVICES_MAP_NAME, jumps)
+
+	if b.Empty() {
+		return nil
+	}
+
+	if err := b.Commit(); err != nil {
+		r.applied = nil
+		return fmt.Errorf("committing service ruleset: %w", err)
+	}
+	r.applied = desired
+
+	if changed > 0 {
+		fmt.Printf("[sknf] Services synced: %d service ports updated, %d total\n", changed, len(desired))
+	}
+	return nil
+}
+
+// addRuleset (re)creates the node-wide chains:
+//
+//	prerouting/output: ip daddr . meta l4proto . th dport vmap @services   (goto svc-<hash>)
+//	postrouting:       ip saddr . ip daddr @services_hairpin masquerade
+//
+// and each svc-<id> chain holds the endpoint rules of one service port (see addEndpointRules),
+// so the first packet of a connection costs one hash lookup whatever the number of services.
+// Endpoints are plain rules rather than a map: the kernel validates every map element against
+// every rule using the map, and looks named sets up linearly, so both a shared endpoints map and
+// a map per service would make loading the ruleset quadratic in the number of services.
+func addRuleset(b *nft.Batch) {
+	b.AddTable()
+	b.AddSet(nft.Set{
+		Name:     SERVICES_MAP_NAME,
+		Flags:    nft.NFT_SET_MAP,
+		KeyType:  nft.ConcatType(nft.NFT_DATATYPE_IPADDR, nft.NFT_DATATYPE_INET_PROTOCOL, nft.NFT_DATATYPE_INET_SERVICE),
+		KeyLen:   SERVICE_KEY_LEN,
+		DataType: nft.NFT_DATA_VERDICT,
+	})
+	b.AddSet(nft.Set{
+		Name:    HAIRPIN_SET_NAME,
+		KeyType: nft.ConcatType(nft.NFT_DATATYPE_IPADDR, nft.NFT_DATATYPE_IPADDR),
+		KeyLen:  8,
+	})
+
+	for _, c := range []struct {
+		name string
+		hook uint32
+	}{
+		{PREROUTING_CHAIN_NAME, nft.NF_INET_PRE_ROUTING},
+		{OUTPUT_CHAIN_NAME, nft.NF_INET_LOCAL_OUT},
+	} {
+		b.AddBaseChain(c.name, "nat", c.hook, nft.NF_IP_PRI_NAT_DST)
+		b.FlushChain(c.name)
+		b.AddRule(c.name,
+			nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, nft.IPV4_DADDR_OFFSET, 4, nft.NFT_REG32_00),
+			nft.Meta(nft.NFT_META_L4PROTO, nft.NFT_REG32_00+1),
+			nft.Payload(nft.NFT_PAYLOAD_TRANSPORT_HEADER, nft.TH_DPORT_OFFSET, 2, nft.NFT_REG32_00+2),
+			nft.VerdictMap(SERVICES_MAP_NAME, nft.NFT_REG32_00))
+	}
+
+	// a pod reaching itself through its service would see its own address as source
+	b.AddBaseChain(POSTROUTING_CHAIN_NAME, "nat", nft.NF_INET_POST_ROUTING, nft.NF_IP_PRI_NAT_SRC)
+	b.FlushChain(POSTROUTING_CHAIN_NAME)
+	b.AddRule(POSTROUTING_CHAIN_NAME,
+		nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, nft.IPV4_SADDR_OFFSET, 4, nft.NFT_REG32_00),
+		nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, nft.IPV4_DADDR_OFFSET, 4, nft.NFT_REG32_00+1),
+		nft.Lookup(HAIRPIN_SET_NAME, nft.NFT_REG32_00),
+		nft.Masquerade())
+}
+
+func addServicePort(b *nft.Batch, sp *ServicePort, jumps *[]nft.Elem) {
+	b.AddChain(sp.Chain)
+	if len(sp.Endpoints) == 0 {
+		// not in the services map: traffic to it is left alone, as if there was no service
+		return
+	}
+	addEndpointRules(b, sp)
+	*jumps = append(*jumps, serviceElem(sp))
+}
+
+func deleteServicePort(b *nft.Batch, sp *ServicePort) {
+	if len(sp.Endpoints) > 0 {
+		// the services map element jumps to the chain, so it goes first
+		b.DelElems(SERVICES_MAP_NAME, []nft.Elem{{Key: serviceKey(sp)}})
+	}
+	b.FlushChain(sp.Chain)
+	b.DelChain(sp.Chain)
+}
+
+// updateServicePort applies the difference between two versions of a service port; it reports
+// whether anything was sent.
+func updateServicePort(b *nft.Batch, old, sp *ServicePort, jumps *[]nft.Elem) bool {
+	keyChanged := serviceKeyOf(old) != serviceKeyOf(sp)
+	if !keyChanged && old.Affinity == sp.Affinity && slices.Equal(old.Endpoints, sp.Endpoints) {
+		return false
+	}
+
+	if len(old.Endpoints) > 0 && (keyChanged || len(sp.Endpoints) == 0) {
+		b.DelElems(SERVICES_MAP_NAME, []nft.Elem{{Key: serviceKey(old)}})
+	}
+
+	// every rule depends on the endpoint count, so the chain is rewritten as a whole
+	if old.Affinity != sp.Affinity || !slices.Equal(old.Endpoints, sp.Endpoints) {
+		b.FlushChain(sp.Chain)
+		addEndpointRules(b, sp)
+	}
+
+	if len(sp.Endpoints) > 0 && (keyChanged || len(old.Endpoints) == 0) {
+		*jumps = append(*jumps, serviceElem(sp))
+	}
+	return true
+}
+
+// addEndpointRules fills the chain of a service port with one rule per endpoint. Without
+// affinity, rule i of N is taken with probability 1/(N-i), which spreads connections evenly;
+// with ClientIP affinity, rule i is taken when jhash(ip saddr) mod N == i.
+func addEndpointRules(b *nft.Batch, sp *ServicePort) {
+	n := uint32(len(sp.Endpoints))
+	for i, ep := range sp.Endpoints {
+		var match [][]byte
+		switch {
+		case n == 1:
+		case sp.Affinity:
+			match = [][]byte{
+				nft.Payload(nft.NFT_PAYLOAD_NETWORK_HEADER, nft.IPV4_SADDR_OFFSET, 4, nft.NFT_REG32_00),
+				nft.Jhash(nft.NFT_REG32_00, 4, n, AFFINITY_HASH_SEED, nft.NFT_REG32_00),
+				nft.Cmp(nft.NFT_REG32_00, nft.NFT_CMP_EQ, hostUint32(uint32(i))),
+			}
+		case uint32(i) < n-1:
+			match = [][]byte{
+				nft.NumgenRandom(n-uint32(i), nft.NFT_REG32_00),
+				nft.Cmp(nft.NFT_REG32_00, nft.NFT_CMP_EQ, hostUint32(0)),
+			}
+		}
+		b.AddRule(sp.Chain, append(match,
+			nft.Immediate(binary.BigEndian.AppendUint32(nil, ep.IP), nft.NFT_REG32_00),
+			nft.Immediate(binary.BigEndian.AppendUint16(nil, ep.Port), nft.NFT_REG32_00+1),
+			nft.Dnat(nft.NFT_REG32_00, nft.NFT_REG32_00+1))...)
+	}
+}
+
+type serviceKeyFields struct {
+	ip    uint32
+	proto uint8
+	port  uint16
+}
+
+func serviceKeyOf(sp *ServicePort) serviceKeyFields {
+	return serviceKeyFields{sp.ClusterIP, sp.Proto, sp.Port}
+}
+
+func serviceKey(sp *ServicePort) []byte {
+	k := make([]byte, SERVICE_KEY_LEN)
+	binary.BigEndian.PutUint32(k[0:4], sp.ClusterIP)
+	k[4] = sp.Proto
+	binary.BigEndian.PutUint16(k[8:10], sp.Port)
+	return k
+}
+
+func serviceElem(sp *ServicePort) nft.Elem {
+	verdict := int32(nft.NFT_GOTO)
+	return nft.Elem{Key: serviceKey(sp), Verdict: &verdict, Chain: sp.Chain}
+}
+
+// numgen and jhash produce host-endian integers
+func hostUint32(v uint32) []byte {
+	b := make([]byte, 4)
+	binary.NativeEndian.PutUint32(b, v)
+	return b
+}
+
+func hairpinAddresses(ports map[string]*ServicePort) map[uint32]struct{} {
+	m := make(map[uint32]struct{})
+	for _, sp := range ports {
+		for _, ep := range sp.Endpoints {
+			m[ep.IP] = struct{}{}
+		}
+	}
+	return m
+}
+
+func hairpinElem(ip uint32) nft.Elem {
+	k := make([]byte, 8)
+	binary.BigEndian.PutUint32(k[0:4], ip)
+	binary.BigEndian.PutUint32(k[4:8], ip)
+	return nft.Elem{Key: k}
+}
+
+func addHairpin(b *nft.Batch, want, have map[string]*ServicePort) {
+	haveIPs := hairpinAddresses(have)
+	var elems []nft.Elem
+	for ip := range hairpinAddresses(want) {
+		if _, ok := haveIPs[ip]; !ok {
+			elems = append(elems, hairpinElem(ip))
+		}
+	}
+	b.AddElems(HAIRPIN_SET_NAME, elems)
+}
+
+func delHairpin(b *nft.Batch, have, want map[string]*ServicePort) {
+	wantIPs := hairpinAddresses(want)
+	var elems []nft.Elem
+	for ip := range hairpinAddresses(have) {
+		if _, ok := wantIPs[ip]; !ok {
+			elems = append(elems, hairpinElem(ip))
+		}
+	}
+	b.DelElems(HAIRPIN_SET_NAME, elems)
+}
@@ -0,0 +1,695 @@
+// Package reconcile brings the node's network state back in line with the pods that actually exist.
+//
+// It runs once when sknf-app starts, before the CNI configuration is installed (the kubelet reports the
+// node ready only then). The kernel is the source of truth: links, pod addresses and the sknf nftables
+// table are dumped, the IPAM state of sknf-cni is rebuilt from the pods found, and drift is repaired.
+// The work is bounded by a handful of dumps plus one address dump per pod.
+package reconcile
+
+import (
+	"encoding/binary"
+	"fmt"
+	"net"
+	"os"
+	"path/filepath"
+	"strings"
+	"syscall"
+	"time"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nft"
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Must match sknf-cni/src/net.h and net.c
+const HOST_BRIDGE_NAME = "brsknf"
+const HOST_VXLAN_NAME = "vxsknf"
+const HOST_VETH_NAME_PREFIX = "sknf"
+const HOST_IFB_NAME_PREFIX = "sknfb"
+const CONTAINER_VETH_TMP_NAME_PREFIX = "tmp"
+const HOST_VXLAN_VNI_ID = 100
+const HOST_VXLAN_GROUP = "239.1.1.100"
+const HOST_VXLAN_PORT = 4789
+
+const PROXY_ARP_PATH = "/proc/sys/net/ipv4/conf/%s/proxy_arp"
+
+// rtnetlink attributes not exported by the syscall package
+const IFLA_LINK_NETNSID = 37
+const IFA_TARGET_NETNSID = 10
+const IFLA_INFO_KIND = 1
+const IFLA_INFO_DATA = 2
+const IFLA_VXLAN_ID = 1
+const IFLA_VXLAN_GROUP = 2
+const IFLA_VXLAN_LINK = 3
+const IFLA_VXLAN_PORT = 15
+const NDA_DST = 1
+const NDA_LLADDR = 2
+const SIZEOF_NDMSG = 12
+const NUD_PERMANENT = 0x80
+
+// linux/rtnetlink.h and linux/pkt_sched.h: struct tcmsg, TCA_KIND and TC_H_ROOT
+const SIZEOF_TCMSG = 20
+const TCA_KIND = 1
+const TC_H_ROOT = 0xffffffff
+
+const NFT_OBJECT_COUNTER = 1
+
+// Leases of sknf-cni, next to its IPAM state file (see IP_LEASES_FILE_PATH in sknf-cni/src/ip.c)
+const IPAM_LEASES_SUFFIX = "-leases"
+
+// Must match IP_INFO_LOCK_FILE_PATH and IP_LEASE_UNKNOWN in sknf-cni/src/ip.c
+const IPAM_LOCK_SUFFIX = ".lock"
+const IPAM_LEASE_UNKNOWN = "-"
+
+type Config struct {
+	// Node pod CIDR
+	Subnet string
+	// Cluster-wide pod CIDR; its prefix is the one of pod and bridge addresses
+	ClusterCidr string
+	// Underlay of the VXLAN overlay
+	HostPhysicalIf string
+	// Path to the sknf-cni IPAM state file, as seen by sknf-app
+	IpamStatePath string
+	// Pods are routed (podAttach "routed") instead of bridged
+	RoutedPods bool
+}
+
+// Report summarizes a reconciliation; Repairs lists every change made, in order.
+type Report struct {
+	Pods int
+	// Index of the host end of every pod interface, by pod IP
+	PodLinks map[string]int32
+	// Host ends shaping the ingress of their pod (a tbf root qdisc, see limit_container_ingress in sknf-cni)
+	ShapedLinks map[int32]bool
+	// Host ends of the netkit pods; true when the pod's egress is not shaped (it has no ifb), so it can
+	// take the forwarding program of the xdp package
+	NetkitLinks map[int32]bool
+	// Gateway address of the pods, on brsknf
+	BridgeIP net.IP
+	Repairs  []string
+	Duration time.Duration
+}
+
+type link struct {
+	name    string
+	kind    string // IFLA_INFO_KIND, e.g. "veth" or "netkit"
+	index   int32
+	master  int32
+	peer    int32 // IFLA_LINK: index of the peer, in the netns identified by netnsid
+	netnsid int32 // -1 when the peer lives in this netns
+}
+
+type pod struct {
+	veth link
+	ip   net.IP
+}
+
+func Run(cfg Config) (*Report, error) {
+	start := time.Now()
+	r := &Report{}
+
+	_, subnet, err := net.ParseCIDR(cfg.Subnet)
+	if err != nil {
+		return nil, fmt.Errorf("parsing subnet %s: %w", cfg.Subnet, err)
+	}
+	_, cluster, err := net.ParseCIDR(cfg.ClusterCidr)
+	if err != nil {
+		return nil, fmt.Errorf("parsing cluster CIDR %s: %w", cfg.ClusterCidr, err)
+	}
+	clusterPrefix, _ := cluster.Mask.Size()
+
+	nfsk, err := nl.Open(syscall.NETLINK_NETFILTER)
+	if err != nil {
+		return nil, fmt.Errorf("opening nfnetlink socket: %w", err)
+	}
+	defer nfsk.Close()
+
+	// nftables state is read before the links: an ADD running meanwhile creates its veth before its
+	// nftables state, so every pod whose counters are seen here is also seen by the link dump
+	counters, err := nft.DumpPodCounters(nfsk)
+	if err != nil {
+		return nil, err
+	}
+	elems := map[string][]nft.Elem{}
+	for _, m := range []string{nft.EGRESS_MAP_NAME, nft.INGRESS_MAP_NAME, nft.CROSSNODE_MAP_NAME, nft.HOSTPORTS_MAP_NAME} {
+		if elems[m], err = nft.DumpElems(nfsk, m); err != nil {
+			return nil, err
+		}
+	}
+
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		return nil, fmt.Errorf("opening rtnetlink socket: %w", err)
+	}
+	defer sk.Close()
+	if err := sk.EnableStrictCheck(); err != nil {
+		return nil, err
+	}
+
+	links, err := dumpLinks(sk)
+	if err != nil {
+		return nil, err
+	}
+
+	var pods []pod
+	var bridge, vxlan *link
+	var ifbs []*link
+	veths := map[string]bool{}
+	for i := range links {
+		l := &links[i]
+		switch {
+		case nl.IsGeneratedName(l.name, HOST_IFB_NAME_PREFIX):
+			ifbs = append(ifbs, l)
+		case l.name == HOST_BRIDGE_NAME:
+			bridge = l
+		case l.name == HOST_VXLAN_NAME:
+			vxlan = l
+		case nl.IsGeneratedName(l.name, HOST_VETH_NAME_PREFIX) || nl.IsGeneratedName(l.name, CONTAINER_VETH_TMP_NAME_PREFIX):
+			if l.netnsid < 0 {
+				// both ends still in the host netns: an ADD failed before moving the pod end (or is
+				// about to, in which case it fails and is retried by the kubelet)
+				// ENODEV: the pair went away together with its other end, deleted earlier in this loop
+				err := deleteLink(sk, l.index)
+				if err != nil && err != syscall.ENODEV {
+					return nil, fmt.Errorf("deleting leftover interface %s: %w", l.name, err)
+				}
+				if err == nil {
+					r.Repairs = append(r.Repairs, "deleted leftover interface "+l.name)
+				}
+				continue
+			}
+			if !nl.IsGeneratedName(l.name, HOST_VETH_NAME_PREFIX) {
+				continue
+			}
+			veths[l.name[len(HOST_VETH_NAME_PREFIX):]] = true
+			ip, err := podAddress(sk, l.netnsid, l.peer, cluster)
+			if err != nil {
+				return nil, fmt.Errorf("reading pod address behind %s: %w", l.name, err)
+			}
+			// a pod without an address is still being set up by an ADD
+			if ip != nil {
+				pods = append(pods, pod{veth: *l, ip: ip})
+			}
+		}
+	}
+	r.Pods = len(pods)
+
+	// the ifb shaping a pod's egress has the hash of its host veth, and is left behind when a DEL did not run
+	egressShaped := map[string]bool{}
+	for _, l := range ifbs {
+		if veths[l.name[len(HOST_IFB_NAME_PREFIX):]] {
+			egressShaped[l.name[len(HOST_IFB_NAME_PREFIX):]] = true
+			continue
+		}
+		err := deleteLink(sk, l.index)
+		if err != nil && err != syscall.ENODEV {
+			return nil, fmt.Errorf("deleting leftover interface %s: %w", l.name, err)
+		}
+		if err == nil {
+			r.Repairs = append(r.Repairs, "deleted leftover interface "+l.name)
+		}
+	}
+
+	bridgeIP := nextIP(subnet.IP)
+	r.BridgeIP = bridgeIP
+	if err := ensureBridge(sk, r, bridge, bridgeIP, clusterPrefix); err != nil {
+		return nil, err
+	}
+	bridgeIndex, err := indexOf(HOST_BRIDGE_NAME)
+	if err != nil {
+		return nil, err
+	}
+	if err := ensureVxlan(sk, r, vxlan, cfg.HostPhysicalIf, bridgeIndex); err != nil {
+		return nil, err
+	}
+
+	for _, p := range pods {
+		if cfg.RoutedPods {
+			err = ensureRouted(sk, r, p)
+		} else if p.veth.master != bridgeIndex {
+			err = setMaster(sk, p.veth.index, bridgeIndex)
+			r.Repairs = append(r.Repairs, "attached "+p.veth.name+" to "+HOST_BRIDGE_NAME)
+		}
+		if err != nil {
+			return nil, fmt.Errorf("repairing %s: %w", p.veth.name, err)
+		}
+	}
+	if cfg.RoutedPods && len(pods) > 0 {
+		if err := os.WriteFile(fmt.Sprintf(PROXY_ARP_PATH, HOST_BRIDGE_NAME), []byte("1"), 0644); err != nil {
+			return nil, err
+		}
+	}
+
+	live := make(map[string]bool, len(pods))
+	r.PodLinks = make(map[string]int32, len(pods))
+	r.NetkitLinks = map[int32]bool{}
+	for _, p := range pods {
+		live[p.ip.String()] = true
+		r.PodLinks[p.ip.String()] = p.veth.index
+		if p.veth.kind == "netkit" {
+			r.NetkitLinks[p.veth.index] = !egressShaped[p.veth.name[len(HOST_VETH_NAME_PREFIX):]]
+		}
+	}
+	if r.ShapedLinks, err = dumpShaped(sk); err != nil {
+		return nil, err
+	}
+	if err := cleanNft(nfsk, r, live, counters, elems); err != nil {
+		return nil, err
+	}
+
+	if err := rebuildIpam(r, cfg.IpamStatePath, subnet, clusterPrefix, pods, start); err != nil {
+		return nil, err
+	}
+
+	r.Duration = time.Since(start)
+	return r, nil
+}
+
+func dumpLinks(sk *nl.Socket) ([]link, error) {
+	ifinfo := make([]byte, syscall.SizeofIfInfomsg)
+	ifinfo[0] = syscall.AF_UNSPEC
+	msgs, err := sk.Dump(syscall.RTM_GETLINK, ifinfo)
+	if err != nil {
+		return nil, fmt.Errorf("dumping links: %w", err)
+	}
+
+	var links []link
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWLINK || len(m.Data) < syscall.SizeofIfInfomsg {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[syscall.SizeofIfInfomsg:])
+		l := link{
+			name:    nl.String(attrs[syscall.IFLA_IFNAME]),
+			index:   int32(binary.NativeEndian.Uint32(m.Data[4:8])),
+			master:  int32(nl.Uint32(attrs[syscall.IFLA_MASTER])),
+			peer:    int32(nl.Uint32(attrs[syscall.IFLA_LINK])),
+			netnsid: -1,
+		}
+		if v, ok := attrs[syscall.IFLA_LINKINFO]; ok {
+			l.kind = nl.String(nl.Attrs(v)[IFLA_INFO_KIND])
+		}
+		if v, ok := attrs[IFLA_LINK_NETNSID]; ok {
+			l.netnsid = int32(nl.Uint32(v))
+		}
+		links = append(links, l)
+	}
+	return links, nil
+}
+
+// dumpShaped returns the interfaces whose root qdisc is a tbf
+func dumpShaped(sk *nl.Socket) (map[int32]bool, error) {
+	msgs, err := sk.Dump(syscall.RTM_GETQDISC, make([]byte, SIZEOF_TCMSG))
+	if err != nil {
+		return nil, fmt.Errorf("dumping qdiscs: %w", err)
+	}
+
+	shaped := map[int32]bool{}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWQDISC || len(m.Data) < SIZEOF_TCMSG {
+			continue
+		}
+		if binary.NativeEndian.Uint32(m.Data[12:16]) != TC_H_ROOT {
+			continue
+		}
+		if nl.String(nl.Attrs(m.Data[SIZEOF_TCMSG:])[TCA_KIND]) == "tbf" {
+			shaped[int32(binary.NativeEndian.Uint32(m.Data[4:8]))] = true
+		}
+	}
+	return shaped, nil
+}
+
+// podAddress returns the cluster address of interface 'index' in the netns 'netnsid' (as numbered by
+// the host netns), or nil if it has none, with a single filtered address dump.
+func podAddress(sk *nl.Socket, netnsid, index int32, cluster *net.IPNet) (net.IP, error) {
+	req := make([]byte, syscall.SizeofIfAddrmsg)
+	req[0] = syscall.AF_INET
+	binary.NativeEndian.PutUint32(req[4:8], uint32(index))
+	req = nl.AppendAttr(req, IFA_TARGET_NETNSID, nl.U32(uint32(netnsid)))
+
+	msgs, err := sk.Dump(syscall.RTM_GETADDR, req)
+	if err != nil {
+		return nil, err
+	}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWADDR || len(m.Data) < syscall.SizeofIfAddrmsg {
+			continue
+		}
+		if int32(binary.NativeEndian.Uint32(m.Data[4:8])) != index {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[syscall.SizeofIfAddrmsg:])
+		if ip := net.IP(attrs[syscall.IFA_LOCAL]).To4(); ip != nil && cluster.Contains(ip) {
+			return ip, nil
+		}
+	}
+	return nil, nil
+}
+
+// ensureBridge creates brsknf as sknf-cni does (nu_create_bridge) when it is missing and restores its
+// address when it was removed.
+func ensureBridge(sk *nl.Socket, r *Report, bridge *link, bridgeIP net.IP, clusterPrefix int) error {
+	if bridge == nil {
+		req := nl.IfInfoMsg(0, syscall.IFF_UP)
+		req = nl.AppendStringAttr(req, syscall.IFLA_IFNAME, HOST_BRIDGE_NAME)
+		// a bridge without an assigned MAC takes the lowest MAC among its ports
+		req = nl.AppendAttr(req, syscall.IFLA_ADDRESS, nl.MacOf(bridgeIP))
+		req = nl.AppendNested(req, syscall.IFLA_LINKINFO, func(b []byte) []byte {
+			return nl.AppendStringAttr(b, IFLA_INFO_KIND, "bridge")
+		})
+		if err := sk.Request(syscall.RTM_NEWLINK, syscall.NLM_F_CREATE|syscall.NLM_F_EXCL, req); err != nil {
+			return fmt.Errorf("creating %s: %w", HOST_BRIDGE_NAME, err)
+		}
+		r.Repairs = append(r.Repairs, "created "+HOST_BRIDGE_NAME)
+	}
+
+	index, err := indexOf(HOST_BRIDGE_NAME)
+	if err != nil {
+		return err
+	}
+
+	req := make([]byte, syscall.SizeofIfAddrmsg)
+	req[0] = syscall.AF_INET
+	binary.NativeEndian.PutUint32(req[4:8], uint32(index))
+	msgs, err := sk.Dump(syscall.RTM_GETADDR, req)
+	if err != nil {
+		return fmt.Errorf("dumping %s addresses: %w", HOST_BRIDGE_NAME, err)
+	}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWADDR || len(m.Data) < syscall.SizeofIfAddrmsg {
+			continue
+		}
+		attrs := nl.Attrs(m.Data[syscall.SizeofIfAddrmsg:])
+		if int(m.Data[1]) == clusterPrefix && net.IP(attrs[syscall.IFA_LOCAL]).Equal(bridgeIP) {
+			return nil
+		}
+	}
+
+	req[1] = byte(clusterPrefix)
+	req = nl.AppendAttr(req, syscall.IFA_LOCAL, bridgeIP.To4())
+	req = nl.AppendAttr(req, syscall.IFA_ADDRESS, bridgeIP.To4())
+	if err := sk.Request(syscall.RTM_NEWADDR, syscall.NLM_F_CREATE|syscall.NLM_F_REPLACE, req); err != nil {
+		return fmt.Errorf("assigning %s/%d to %s: %w", bridgeIP, clusterPrefix, HOST_BRIDGE_NAME, err)
+	}
+	r.Repairs = append(r.Repairs, fmt.Sprintf("assigned %s/%d to %s", bridgeIP, clusterPrefix, HOST_BRIDGE_NAME))
+	return nil
+}
+
+// ensureVxlan creates vxsknf as sknf-cni does (nu_create_vxlan) when it is missing and attaches it to the bridge.
+func ensureVxlan(sk *nl.Socket, r *Report, vxlan *link, underlay string, bridgeIndex int32) error {
+	if vxlan == nil {
+		underlayIndex, err := indexOf(underlay)
+		if err != nil {
+			return err
+		}
+		req := nl.IfInfoMsg(0, syscall.IFF_UP)
+		req = nl.AppendStringAttr(req, syscall.IFLA_IFNAME, HOST_VXLAN_NAME)
+		req = nl.AppendNested(req, syscall.IFLA_LINKINFO, func(b []byte) []byte {
+			b = nl.AppendStringAttr(b, IFLA_INFO_KIND, "vxlan")
+			return nl.AppendNested(b, IFLA_INFO_DATA, func(b []byte) []byte {
+				b = nl.AppendAttr(b, IFLA_VXLAN_ID, nl.U32(HOST_VXLAN_VNI_ID))
+				b = nl.AppendAttr(b, IFLA_VXLAN_GROUP, net.ParseIP(HOST_VXLAN_GROUP).To4())
+				b = nl.AppendAttr(b, IFLA_VXLAN_LINK, nl.U32(uint32(underlayIndex)))
+				return nl.AppendAttr(b, IFLA_VXLAN_PORT, binary.BigEndian.AppendUint16(nil, HOST_VXLAN_PORT))
+			})
+		})
+		if err := sk.Request(syscall.RTM_NEWLINK, syscall.NLM_F_CREATE|syscall.NLM_F_EXCL, req); err != nil {
+			return fmt.Errorf("creating %s: %w", HOST_VXLAN_NAME, err)
+		}
+		r.Repairs = append(r.Repairs, "created "+HOST_VXLAN_NAME)
+
+		index, err := indexOf(HOST_VXLAN_NAME)
+		if err != nil {
+			return err
+		}
+		vxlan = &link{name: HOST_VXLAN_NAME, index: index}
+	}
+
+	if vxlan.master == bridgeIndex {
+		return nil
+	}
+	if err := setMaster(sk, vxlan.index, bridgeIndex); err != nil {
+		return fmt.Errorf("attaching %s to %s: %w", HOST_VXLAN_NAME, HOST_BRIDGE_NAME, err)
+	}
+	r.Repairs = append(r.Repairs, "attached "+HOST_VXLAN_NAME+" to "+HOST_BRIDGE_NAME)
+	return nil
+}
+
+// ensureRouted restores what route_to_container (sknf-cni/src/net.c) sets up for a routed pod. Route and
+// neighbor are replaced unconditionally, which is cheaper than dumping and comparing them.
+func ensureRouted(sk *nl.Socket, r *Report, p pod) error {
+	if err := os.WriteFile(fmt.Sprintf(PROXY_ARP_PATH, p.veth.name), []byte("1"), 0644); err != nil {
+		return err
+	}
+
+	rt := make([]byte, syscall.SizeofRtMsg)
+	rt[0] = syscall.AF_INET
+	rt[1] = 32
+	rt[4] = syscall.RT_TABLE_MAIN
+	rt[5] = syscall.RTPROT_STATIC
+	rt[6] = syscall.RT_SCOPE_LINK
+	rt[7] = syscall.RTN_UNICAST
+	rt = nl.AppendAttr(rt, syscall.RTA_DST, p.ip.To4())
+	rt = nl.AppendAttr(rt, syscall.RTA_OIF, nl.U32(uint32(p.veth.index)))
+	if err := sk.Request(syscall.RTM_NEWROUTE, syscall.NLM_F_CREATE|syscall.NLM_F_REPLACE, rt); err != nil {
+		return fmt.Errorf("adding route to %s: %w", p.ip, err)
+	}
+
+	nd := make([]byte, SIZEOF_NDMSG)
+	nd[0] = syscall.AF_INET
+	binary.NativeEndian.PutUint32(nd[4:8], uint32(p.veth.index))
+	binary.NativeEndian.PutUint16(nd[8:10], NUD_PERMANENT)
+	nd = nl.AppendAttr(nd, NDA_DST, p.ip.To4())
+	nd = nl.AppendAttr(nd, NDA_LLADDR, nl.MacOf(p.ip))
+	if err := sk.Request(syscall.RTM_NEWNEIGH, syscall.NLM_F_CREATE|syscall.NLM_F_REPLACE, nd); err != nil {
+		return fmt.Errorf("adding neighbor %s: %w", p.ip, err)
+	}
+	return nil
+}
+
+// cleanNft removes the per-pod counters and hostPort mappings of pods that no longer exist, which a DEL
+// that never ran (or failed) leaves behind, in a single transaction. Only elements and counters seen in
+// the dumps are deleted, so the transaction cannot fail on a missing one.
+func cleanNft(sk *nl.Socket, r *Report, live map[string]bool, counters []nft.PodCounter, maps map[string][]nft.Elem) error {
+	b := nft.NewBatch(sk)
+	stale := map[string]bool{}
+
+	// elements reference the counters, so they go first
+	for _, m := range []string{nft.EGRESS_MAP_NAME, nft.INGRESS_MAP_NAME, nft.CROSSNODE_MAP_NAME} {
+		var dead []nft.Elem
+		for _, e := range maps[m] {
+			if ip := net.IP(e.Key).To4(); ip != nil && !live[ip.String()] {
+				dead = append(dead, nft.Elem{Key: e.Key})
+				stale[ip.String()] = true
+			}
+		}
+		if len(dead) > 0 {
+			b.DelElems(m, dead)
+		}
+	}
+	for _, c := range counters {
+		if !live[c.PodIP] {
+			b.DelObj(c.Direction+"-"+c.PodIP, NFT_OBJECT_COUNTER)
+			stale[c.PodIP] = true
+		}
+	}
+
+	// hostports data is <pod IP> . <container port>
+	var deadPorts []nft.Elem
+	for _, e := range maps[nft.HOSTPORTS_MAP_NAME] {
+		if len(e.Data) >= 4 && !live[net.IP(e.Data[:4]).String()] {
+			deadPorts = append(deadPorts, nft.Elem{Key: e.Key})
+		}
+	}
+	if len(deadPorts) > 0 {
+		b.DelElems(nft.HOSTPORTS_MAP_NAME, deadPorts)
+	}
+
+	if err := b.Commit(); err != nil {
+		return fmt.Errorf("deleting stale nftables state: %w", err)
+	}
+	for ip := range stale {
+		r.Repairs = append(r.Repairs, "deleted counters of "+ip)
+	}
+	if len(deadPorts) > 0 {
+		r.Repairs = append(r.Repairs, fmt.Sprintf("deleted %d stale hostPort mappings", len(deadPorts)))
+	}
+	return nil
+}
+
+// rebuildIpam keeps the IPAM state of sknf-cni consistent with the pods found. sknf-cni hands out
+// released addresses up to the last one it handed out, then the address after it (sknf-cni/src/ip.c),
+// so the state must never be below an address in use. It lives in /tmp, so it is gone after a reboot, and
+// may be behind after a restore. The state is only ever moved forward; the leases are rebuilt by
+// rebuildLeases. Both are changed under the lock of sknf-cni, so that an ADD or DEL running meanwhile
+// never reads them half done.
+func rebuildIpam(r *Report, path string, subnet *net.IPNet, clusterPrefix int, pods []pod, start time.Time) error {
+	lock, err := os.OpenFile(path+IPAM_LOCK_SUFFIX, os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return fmt.Errorf("opening IPAM lock: %w", err)
+	}
+	// closing the file releases the lock
+	defer lock.Close()
+	if err := syscall.Flock(int(lock.Fd()), syscall.LOCK_EX); err != nil {
+		return fmt.Errorf("locking IPAM: %w", err)
+	}
+
+	var highest uint32
+	for _, p := range pods {
+		if subnet.Contains(p.ip) && nl.IPv4ToUint(p.ip) > highest {
+			highest = nl.IPv4ToUint(p.ip)
+		}
+	}
+
+	var last uint32
+	data, err := os.ReadFile(path)
+	if err != nil && !os.IsNotExist(err) {
+		return fmt.Errorf("reading IPAM state: %w", err)
+	}
+	if err == nil {
+		ip, _, perr := net.ParseCIDR(strings.TrimSpace(string(data)))
+		if perr != nil || !subnet.Contains(ip) {
+			// sknf-cni cannot allocate from a corrupt state either; start over from the pods found
+			r.Repairs = append(r.Repairs, fmt.Sprintf("discarded invalid IPAM state %q", strings.TrimSpace(string(data))))
+			if highest == 0 {
+				// no pod holds an address, nor the lease of one
+				if err := os.Remove(path + IPAM_LEASES_SUFFIX); err != nil && !os.IsNotExist(err) {
+					return err
+				}
+				return os.Remove(path)
+			}
+		} else {
+			last = nl.IPv4ToUint(ip)
+		}
+	}
+
+	if highest != 0 && last < highest {
+		state := fmt.Sprintf("%s/%d", uintToIPv4(highest), clusterPrefix)
+		if err := writeReplacing(path, state); err != nil {
+			return fmt.Errorf("writing IPAM state: %w", err)
+		}
+		r.Repairs = append(r.Repairs, "set IPAM state to "+state)
+	}
+	return rebuildLeases(r, path+IPAM_LEASES_SUFFIX, subnet, pods, start)
+}
+
+// rebuildLeases makes the leases of sknf-cni match the pods found: the leases of addresses no pod holds
+// are released, and the pods holding an address without a lease get one, held by IPAM_LEASE_UNKNOWN and
+// their host interface (the DEL of the pod releases it through the latter). Leases written before the host
+// interface was recorded get it.
+//
+// sknf-cni writes the lease of a pod before it creates its interfaces, and releases it before it deletes
+// them, so the leases of an ADD or DEL that ran after the links were dumped cannot be told from stale ones.
+// The leases are left as they are when they changed since start: a missing lease only keeps DEL and GC
+// from finding the pod, and a lease not released is left to the GC of the runtime.
+func rebuildLeases(r *Report, path string, subnet *net.IPNet, pods []pod, start time.Time) error {
+	var data []byte
+	info, err := os.Stat(path)
+	if err != nil && !os.IsNotExist(err) {
+		return fmt.Errorf("reading IPAM leases: %w", err)
+	}
+	if err == nil {
+		if info.ModTime().After(start) {
+			return nil
+		}
+		if data, err = os.ReadFile(path); err != nil {
+			return fmt.Errorf("reading IPAM leases: %w", err)
+		}
+	}
+
+	hostIfs := map[string]string{}
+	for _, p := range pods {
+		if subnet.Contains(p.ip) {
+			hostIfs[p.ip.String()] = p.veth.name
+		}
+	}
+
+	var out strings.Builder
+	held := map[string]bool{}
+	var released, recorded int
+	for _, line := range strings.Split(string(data), "\n") {
+		fields := strings.Fields(line)
+		if len(fields) == 0 {
+			continue
+		}
+		ip := net.ParseIP(fields[0]).To4()
+		if ip == nil || len(fields) == 2 {
+			// sknf-cni drops these as well
+			continue
+		}
+		hostIf, live := hostIfs[ip.String()]
+		switch {
+		case len(fields) == 1 && live && !held[ip.String()]:
+			fmt.Fprintf(&out, "%s %s %s %s\n", ip, IPAM_LEASE_UNKNOWN, IPAM_LEASE_UNKNOWN, hostIf)
+			held[ip.String()] = true
+			recorded++
+		case len(fields) == 1:
+			fmt.Fprintf(&out, "%s\n", ip)
+		case !live:
+			fmt.Fprintf(&out, "%s\n", ip)
+			released++
+		case held[ip.String()]:
+			// a second lease of the address; the first one stands
+		default:
+			fmt.Fprintf(&out, "%s %s %s %s\n", ip, fields[1], fields[2], hostIf)
+			held[ip.String()] = true
+			if len(fields) == 3 {
+				recorded++
+			}
+		}
+	}
+	for _, p := range pods {
+		if hostIf, live := hostIfs[p.ip.String()]; live && !held[p.ip.String()] {
+			fmt.Fprintf(&out, "%s %s %s %s\n", p.ip, IPAM_LEASE_UNKNOWN, IPAM_LEASE_UNKNOWN, hostIf)
+			held[p.ip.String()] = true
+			recorded++
+		}
+	}
+
+	if out.String() == string(data) {
+		return nil
+	}
+	if err := writeReplacing(path, out.String()); err != nil {
+		return fmt.Errorf("writing IPAM leases: %w", err)
+	}
+	if released > 0 {
+		r.Repairs = append(r.Repairs, fmt.Sprintf("released %d IPAM leases of missing pods", released))
+	}
+	if recorded > 0 {
+		r.Repairs = append(r.Repairs, fmt.Sprintf("recorded %d IPAM leases of pods found", recorded))
+	}
+	return nil
+}
+
+// writeReplacing writes a file through a rename, as sknf-cni does, so that it is never seen half written
+func writeReplacing(path, data string) error {
+	tmp := filepath.Join(filepath.Dir(path), "."+filepath.Base(path)+".tmp")
+	if err := os.WriteFile(tmp, []byte(data), 0644); err != nil {
+		return err
+	}
+	return os.Rename(tmp, path)
+}
+
+func setMaster(sk *nl.Socket, index, master int32) error {
+	req := nl.AppendAttr(nl.IfInfoMsg(index, 0), syscall.IFLA_MASTER, nl.U32(uint32(master)))
+	return sk.Request(syscall.RTM_NEWLINK, 0, req)
+}
+
+func deleteLink(sk *nl.Socket, index int32) error {
+	return sk.Request(syscall.RTM_DELLINK, 0, nl.IfInfoMsg(index, 0))
+}
+
+func indexOf(name string) (int32, error) {
+	ifi, err := net.InterfaceByName(name)
+	if err != nil {
+		return 0, fmt.Errorf("resolving %s: %w", name, err)
+	}
+	return int32(ifi.Index), nil
+}
+
+func nextIP(ip net.IP) net.IP {
+	return uintToIPv4(nl.IPv4ToUint(ip) + 1)
+}
+
+func uintToIPv4(v uint32) net.IP {
+	return net.IP(binary.BigEndian.AppendUint32(nil, v))
+}
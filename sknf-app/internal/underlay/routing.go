@@ -0,0 +1,325 @@
+package underlay
+
+import (
+	"encoding/binary"
+	"fmt"
+	"net"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// linux/rtnetlink.h: legacy multicast groups (1 << (RTNLGRP_* - 1))
+const RTMGRP_LINK = 0x1
+const RTMGRP_IPV4_IFADDR = 0x10
+const RTMGRP_IPV4_ROUTE = 0x40
+
+// linux/fib_rules.h: struct fib_rule_hdr and FRA_*
+const SIZEOF_FIB_RULE_HDR = 12
+const FR_ACT_TO_TBL = 1
+const FRA_PRIORITY = 6
+const FRA_TABLE = 15
+const FRA_IP_PROTO = 22
+const FRA_SPORT_RANGE = 23
+const FRA_DPORT_RANGE = 24
+
+const IFLA_INFO_KIND = 1
+const IFLA_INFO_DATA = 2
+const IFLA_VXLAN_PORT_RANGE = 10
+
+// rule sends the VXLAN traffic whose source port is in [sportLow, sportHigh] (any source port when both
+// are 0) to an underlay table
+type rule struct {
+	priority  uint32
+	table     uint32
+	dport     uint16
+	sportLow  uint16
+	sportHigh uint16
+}
+
+type route struct {
+	dst     string // empty for the default route; addresses are held as strings to compare with ==
+	dstLen  uint8
+	scope   uint8
+	gateway string
+	metric  uint32
+	oif     int32
+	prefsrc string
+}
+
+type linkInfo struct {
+	index int32
+	flags uint32
+	// source port range of a vxlan link, 0-0 when unset
+	portLow  uint16
+	portHigh uint16
+}
+
+func isUnderlayTable(table uint32) bool {
+	return table > UNDERLAY_TABLE_BASE && table < UNDERLAY_TABLE_BASE+MAX_UNDERLAYS
+}
+
+// syncRules replaces the rules pointing to underlay tables with want; rules already in place are kept,
+// so that a sync does not open a window without them
+func syncRules(sk *nl.Socket, want []rule) error {
+	req := make([]byte, SIZEOF_FIB_RULE_HDR)
+	req[0] = syscall.AF_INET
+	msgs, err := sk.Dump(syscall.RTM_GETRULE, req)
+	if err != nil {
+		return fmt.Errorf("dumping rules: %w", err)
+	}
+
+	have := map[rule]bool{}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWRULE || len(m.Data) < SIZEOF_FIB_RULE_HDR {
+			continue
+		}
+		r := rule{table: uint32(m.Data[4])}
+		nl.ForEachAttr(m.Data[SIZEOF_FIB_RULE_HDR:], func(t uint16, v []byte) {
+			switch t {
+			case FRA_PRIORITY:
+				r.priority = nl.Uint32(v)
+			case FRA_TABLE:
+				r.table = nl.Uint32(v)
+			case FRA_DPORT_RANGE:
+				r.dport = portRangeStart(v)
+			case FRA_SPORT_RANGE:
+				r.sportLow, r.sportHigh = portRangeStart(v), portRangeEnd(v)
+			}
+		})
+		if isUnderlayTable(r.table) {
+			have[r] = true
+		}
+	}
+
+	wanted := map[rule]bool{}
+	for _, r := range want {
+		wanted[r] = true
+	}
+	for r := range have {
+		if !wanted[r] {
+			if err := sk.Request(syscall.RTM_DELRULE, 0, ruleMsg(r)); err != nil && err != syscall.ENOENT {
+				return fmt.Errorf("deleting rule %d: %w", r.priority, err)
+			}
+		}
+	}
+	for _, r := range want {
+		if !have[r] {
+			if err := sk.Request(syscall.RTM_NEWRULE, syscall.NLM_F_CREATE|syscall.NLM_F_EXCL, ruleMsg(r)); err != nil {
+				return fmt.Errorf("adding rule %d: %w", r.priority, err)
+			}
+		}
+	}
+	return nil
+}
+
+func ruleMsg(r rule) []byte {
+	msg := make([]byte, SIZEOF_FIB_RULE_HDR)
+	msg[0] = syscall.AF_INET
+	msg[7] = FR_ACT_TO_TBL
+	msg = nl.AppendAttr(msg, FRA_PRIORITY, nl.U32(r.priority))
+	msg = nl.AppendAttr(msg, FRA_TABLE, nl.U32(r.table))
+	msg = nl.AppendAttr(msg, FRA_IP_PROTO, []byte{syscall.IPPROTO_UDP})
+	msg = nl.AppendAttr(msg, FRA_DPORT_RANGE, portRange(r.dport, r.dport))
+	if r.sportHigh != 0 {
+		msg = nl.AppendAttr(msg, FRA_SPORT_RANGE, portRange(r.sportLow, r.sportHigh))
+	}
+	return msg
+}
+
+// syncTables makes every underlay table hold exactly its routes in want. Wanted routes are replaced
+// unconditionally, which is cheaper than comparing them.
+func syncTables(sk *nl.Socket, want map[uint32][]route) error {
+	all, err := dumpRoutes(sk, 0)
+	if err != nil {
+		return err
+	}
+	for table, routes := range all {
+		if !isUnderlayTable(table) {
+			continue
+		}
+		for _, r := range routes {
+			if !containsDst(want[table], r) {
+				if err := sk.Request(syscall.RTM_DELROUTE, 0, routeMsg(table, r)); err != nil && err != syscall.ESRCH {
+					return fmt.Errorf("deleting route %s/%d from table %d: %w", ipOrDefault(r.dst), r.dstLen, table, err)
+				}
+			}
+		}
+	}
+	for table, routes := range want {
+		for _, r := range routes {
+			if err := sk.Request(syscall.RTM_NEWROUTE, syscall.NLM_F_CREATE|syscall.NLM_F_REPLACE, routeMsg(table, r)); err != nil {
+				return fmt.Errorf("adding route %s/%d to table %d: %w", ipOrDefault(r.dst), r.dstLen, table, err)
+			}
+		}
+	}
+	return nil
+}
+
+// containsDst reports whether routes has one replacing r (same destination and metric)
+func containsDst(routes []route, r route) bool {
+	for _, w := range routes {
+		if w.dst == r.dst && w.dstLen == r.dstLen && w.metric == r.metric {
+			return true
+		}
+	}
+	return false
+}
+
+func routeMsg(table uint32, r route) []byte {
+	msg := make([]byte, syscall.SizeofRtMsg)
+	msg[0] = syscall.AF_INET
+	msg[1] = r.dstLen
+	msg[5] = syscall.RTPROT_STATIC
+	msg[6] = r.scope
+	msg[7] = syscall.RTN_UNICAST
+	msg = nl.AppendAttr(msg, syscall.RTA_TABLE, nl.U32(table))
+	if r.dst != "" {
+		msg = nl.AppendAttr(msg, syscall.RTA_DST, []byte(r.dst))
+	}
+	if r.metric != 0 {
+		msg = nl.AppendAttr(msg, syscall.RTA_PRIORITY, nl.U32(r.metric))
+	}
+	if r.oif == 0 {
+		return msg
+	}
+	msg = nl.AppendAttr(msg, syscall.RTA_OIF, nl.U32(uint32(r.oif)))
+	if r.gateway != "" {
+		// the gateway is on the primary's network, which the underlay reaches without having an address in it
+		binary.NativeEndian.PutUint32(msg[8:12], syscall.RTNH_F_ONLINK)
+		msg = nl.AppendAttr(msg, syscall.RTA_GATEWAY, []byte(r.gateway))
+	}
+	if r.prefsrc != "" {
+		msg = nl.AppendAttr(msg, syscall.RTA_PREFSRC, []byte(r.prefsrc))
+	}
+	return msg
+}
+
+// dumpRoutes returns the single-path unicast IPv4 routes of a table, or of every table by table id for table 0
+func dumpRoutes(sk *nl.Socket, table uint32) (map[uint32][]route, error) {
+	req := make([]byte, syscall.SizeofRtMsg)
+	req[0] = syscall.AF_INET
+	msgs, err := sk.Dump(syscall.RTM_GETROUTE, req)
+	if err != nil {
+		return nil, fmt.Errorf("dumping routes: %w", err)
+	}
+
+	out := map[uint32][]route{}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWROUTE || len(m.Data) < syscall.SizeofRtMsg || m.Data[7] != syscall.RTN_UNICAST {
+			continue
+		}
+		t := tableOf(m.Data)
+		if table != 0 && t != table {
+			continue
+		}
+		r := route{dstLen: m.Data[1], scope: m.Data[6]}
+		nl.ForEachAttr(m.Data[syscall.SizeofRtMsg:], func(t uint16, v []byte) {
+			switch t {
+			case syscall.RTA_DST:
+				r.dst = string(v)
+			case syscall.RTA_GATEWAY:
+				r.gateway = string(v)
+			case syscall.RTA_PRIORITY:
+				r.metric = nl.Uint32(v)
+			case syscall.RTA_OIF:
+				r.oif = int32(nl.Uint32(v))
+			case syscall.RTA_PREFSRC:
+				r.prefsrc = string(v)
+			}
+		})
+		out[t] = append(out[t], r)
+	}
+	return out, nil
+}
+
+// tableOf returns the table of a route message, which is only complete in RTA_TABLE
+func tableOf(rtmsg []byte) uint32 {
+	table := uint32(rtmsg[4])
+	nl.ForEachAttr(rtmsg[syscall.SizeofRtMsg:], func(t uint16, v []byte) {
+		if t == syscall.RTA_TABLE {
+			table = nl.Uint32(v)
+		}
+	})
+	return table
+}
+
+// dumpLinks maps the name of every link to its index, flags and, for vxlan links, source port range
+func dumpLinks(sk *nl.Socket) (map[string]linkInfo, error) {
+	msgs, err := sk.Dump(syscall.RTM_GETLINK, make([]byte, syscall.SizeofIfInfomsg))
+	if err != nil {
+		return nil, fmt.Errorf("dumping links: %w", err)
+	}
+	out := map[string]linkInfo{}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWLINK || len(m.Data) < syscall.SizeofIfInfomsg {
+			continue
+		}
+		l := linkInfo{
+			index: int32(binary.NativeEndian.Uint32(m.Data[4:8])),
+			flags: binary.NativeEndian.Uint32(m.Data[8:12]),
+		}
+		attrs := nl.Attrs(m.Data[syscall.SizeofIfInfomsg:])
+		info := nl.Attrs(attrs[syscall.IFLA_LINKINFO])
+		if nl.String(info[IFLA_INFO_KIND]) == "vxlan" {
+			if v := nl.Attrs(info[IFLA_INFO_DATA])[IFLA_VXLAN_PORT_RANGE]; len(v) >= 4 {
+				l.portLow, l.portHigh = nl.Uint16BE(v[0:2]), nl.Uint16BE(v[2:4])
+			}
+		}
+		out[nl.String(attrs[syscall.IFLA_IFNAME])] = l
+	}
+	return out, nil
+}
+
+// firstAddr returns the first IPv4 address of an interface, the VTEP address when it is the primary underlay
+func firstAddr(sk *nl.Socket, index int32) (string, error) {
+	req := make([]byte, syscall.SizeofIfAddrmsg)
+	req[0] = syscall.AF_INET
+	msgs, err := sk.Dump(syscall.RTM_GETADDR, req)
+	if err != nil {
+		return "", fmt.Errorf("dumping addresses: %w", err)
+	}
+	for _, m := range msgs {
+		if m.Header.Type != syscall.RTM_NEWADDR || len(m.Data) < syscall.SizeofIfAddrmsg ||
+			int32(binary.NativeEndian.Uint32(m.Data[4:8])) != index {
+			continue
+		}
+		if local := nl.Attrs(m.Data[syscall.SizeofIfAddrmsg:])[syscall.IFA_LOCAL]; len(local) == net.IPv4len {
+			return string(local), nil
+		}
+	}
+	return "", fmt.Errorf("no IPv4 address on interface %d", index)
+}
+
+// struct fib_rule_port_range holds its ports in host byte order
+func portRange(start, end uint16) []byte {
+	b := make([]byte, 4)
+	binary.NativeEndian.PutUint16(b[0:2], start)
+	binary.NativeEndian.PutUint16(b[2:4], end)
+	return b
+}
+
+func portRangeStart(v []byte) uint16 {
+	if len(v) < 4 {
+		return 0
+	}
+	return binary.NativeEndian.Uint16(v[0:2])
+}
+
+func portRangeEnd(v []byte) uint16 {
+	if len(v) < 4 {
+		return 0
+	}
+	return binary.NativeEndian.Uint16(v[2:4])
+}
+
+func ipOrDefault(dst string) string {
+	if dst == "" {
+		return "default"
+	}
+	return net.IP(dst).String()
+}
+
+func be16(v uint16) []byte {
+	return binary.BigEndian.AppendUint16(nil, v)
+}
@@ -0,0 +1,316 @@
+// Package underlay spreads the VXLAN traffic of vxsknf over several physical interfaces.
+//
+// vxsknf stays bound to HOST_PHYSICAL_IF (the primary underlay), which carries the multicast
+// flooding of the overlay and whose address is the VTEP peers learn. Outer packets to learned
+// peers are routed, so they can leave through any interface that reaches the peer's VTEP:
+//
+//   - the source port of an outer packet is the vxlan hash of its inner flow, and its port range
+//     is split in as many parts as underlays. The first part keeps the main table (the primary);
+//     for every other one a routing rule sends it to a table of the same routes through another
+//     underlay, from the same VTEP address;
+//   - vxlan caches the route of each peer, so the UNDERLAY_OUTPUT route chain marks outer packets
+//     to have them rerouted per flow by the rules;
+//   - routes of an interface without carrier are ignored (ignore_routes_with_linkdown), so its
+//     flows fall through to the main table, and when the primary loses carrier fallback rules
+//     after the main table move them to the other underlays. Watch re-installs the routes the
+//     kernel deletes when an interface is set down.
+package underlay
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"strconv"
+	"strings"
+	"syscall"
+	"time"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nft"
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Chain owned by the underlay spreading in the sknf table
+const OUTPUT_CHAIN_NAME = "UNDERLAY_OUTPUT"
+
+// Set on outer packets so that they are rerouted; any bit works, this one is left alone by kube-proxy
+const UNDERLAY_MARK = 0x00100000
+
+// Tables UNDERLAY_TABLE_BASE + i hold the routes through underlay i (1 <= i < MAX_UNDERLAYS); the rules
+// sending traffic to them go before the main table (spreading) and after it (fallback)
+const UNDERLAY_TABLE_BASE = 47890
+const MAX_UNDERLAYS = 16
+const SPREAD_RULE_PRIORITY = 30000
+const FALLBACK_RULE_PRIORITY = 32800
+
+const IGNORE_LINKDOWN_PATH = "/proc/sys/net/ipv4/conf/%s/ignore_routes_with_linkdown"
+const RP_FILTER_PATH = "/proc/sys/net/ipv4/conf/%s/rp_filter"
+const LOCAL_PORT_RANGE_PATH = "/proc/sys/net/ipv4/ip_local_port_range"
+
+// Loose reverse path filtering: peers send from their VTEP through any of their underlays
+const RP_FILTER_LOOSE = "2"
+
+// Bursts of link and route notifications (an interface going down flushes its routes) make a single sync
+const RESYNC_DELAY = 200 * time.Millisecond
+
+type Config struct {
+	// Primary underlay, vxsknf's
+	HostPhysicalIf string
+	// Other underlays, in the order their parts of the source port range are assigned
+	Ifs       []string
+	VxlanIf   string
+	VxlanPort uint16
+}
+
+// ParseIfs parses the comma separated UNDERLAY_IFS setting; the primary underlay may be repeated in it.
+func ParseIfs(setting, hostPhysicalIf string) ([]string, error) {
+	var ifs []string
+	seen := map[string]bool{hostPhysicalIf: true}
+	for _, name := range strings.Split(setting, ",") {
+		name = strings.TrimSpace(name)
+		if name == "" || seen[name] {
+			continue
+		}
+		seen[name] = true
+		ifs = append(ifs, name)
+	}
+	if len(ifs)+1 > MAX_UNDERLAYS {
+		return nil, fmt.Errorf("%d underlays, at most %d are supported", len(ifs)+1, MAX_UNDERLAYS)
+	}
+	return ifs, nil
+}
+
+// Setup installs the spreading over cfg.Ifs, or removes the one of a previous run when there are none.
+func Setup(cfg Config) error {
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		return err
+	}
+	defer sk.Close()
+
+	nftSk, err := nl.Open(syscall.NETLINK_NETFILTER)
+	if err != nil {
+		return err
+	}
+	defer nftSk.Close()
+
+	if len(cfg.Ifs) == 0 {
+		if err := teardownChain(nftSk); err != nil {
+			return err
+		}
+		return Sync(sk, cfg)
+	}
+
+	for _, name := range append([]string{cfg.HostPhysicalIf}, cfg.Ifs...) {
+		if _, err := net.InterfaceByName(name); err != nil {
+			return err
+		}
+		if err := os.WriteFile(fmt.Sprintf(IGNORE_LINKDOWN_PATH, name), []byte("1"), 0644); err != nil {
+			return err
+		}
+	}
+	for _, name := range cfg.Ifs {
+		if err := os.WriteFile(fmt.Sprintf(RP_FILTER_PATH, name), []byte(RP_FILTER_LOOSE), 0644); err != nil {
+			return err
+		}
+	}
+
+	b := nft.NewBatch(nftSk)
+	b.AddTable()
+	b.AddBaseChain(OUTPUT_CHAIN_NAME, "route", nft.NF_INET_LOCAL_OUT, nft.NF_IP_PRI_MANGLE)
+	b.FlushChain(OUTPUT_CHAIN_NAME)
+	b.AddRule(OUTPUT_CHAIN_NAME,
+		nft.Meta(nft.NFT_META_L4PROTO, nft.NFT_REG_1),
+		nft.Cmp(nft.NFT_REG_1, nft.NFT_CMP_EQ, []byte{syscall.IPPROTO_UDP}),
+		nft.Payload(nft.NFT_PAYLOAD_TRANSPORT_HEADER, nft.TH_DPORT_OFFSET, 2, nft.NFT_REG_1),
+		nft.Cmp(nft.NFT_REG_1, nft.NFT_CMP_EQ, be16(cfg.VxlanPort)),
+		nft.Meta(nft.NFT_META_MARK, nft.NFT_REG_1),
+		nft.Bitwise(nft.NFT_REG_1, nl.BE32(^uint32(UNDERLAY_MARK)), nl.BE32(UNDERLAY_MARK)),
+		nft.MetaSet(nft.NFT_META_MARK, nft.NFT_REG_1),
+	)
+	if err := b.Commit(); err != nil {
+		return fmt.Errorf("adding %s chain: %w", OUTPUT_CHAIN_NAME, err)
+	}
+	return Sync(sk, cfg)
+}
+
+// Sync brings the routing rules and the underlay tables in line with cfg and the current main table.
+// Underlays that are missing or down get no routes, so their flows use the main table.
+func Sync(sk *nl.Socket, cfg Config) error {
+	links, err := dumpLinks(sk)
+	if err != nil {
+		return err
+	}
+	low, high, err := sourcePortRange(links[cfg.VxlanIf])
+	if err != nil {
+		return err
+	}
+
+	var want []rule
+	wantRoutes := map[uint32][]route{}
+	if len(cfg.Ifs) > 0 {
+		primary, ok := links[cfg.HostPhysicalIf]
+		if !ok {
+			return fmt.Errorf("resolving %s: no such interface", cfg.HostPhysicalIf)
+		}
+		vtep, err := firstAddr(sk, primary.index)
+		if err != nil {
+			return err
+		}
+		main, err := dumpRoutes(sk, syscall.RT_TABLE_MAIN)
+		if err != nil {
+			return err
+		}
+
+		n := uint32(len(cfg.Ifs) + 1)
+		for i, name := range cfg.Ifs {
+			part := uint32(i + 1)
+			table := UNDERLAY_TABLE_BASE + part
+			want = append(want,
+				rule{priority: SPREAD_RULE_PRIORITY + part, table: table, dport: cfg.VxlanPort,
+					sportLow: low + uint16(uint32(high-low)*part/n), sportHigh: low + uint16(uint32(high-low)*(part+1)/n) - 1},
+				rule{priority: FALLBACK_RULE_PRIORITY + part, table: table, dport: cfg.VxlanPort})
+
+			l, ok := links[name]
+			if !ok || l.flags&syscall.IFF_UP == 0 {
+				continue
+			}
+			for _, r := range main[syscall.RT_TABLE_MAIN] {
+				if r.oif == primary.index {
+					wantRoutes[table] = append(wantRoutes[table], route{dst: r.dst, dstLen: r.dstLen, scope: r.scope,
+						gateway: r.gateway, metric: r.metric, oif: l.index, prefsrc: vtep})
+				}
+			}
+		}
+	}
+
+	if err := syncRules(sk, want); err != nil {
+		return err
+	}
+	return syncTables(sk, wantRoutes)
+}
+
+// Watch re-syncs whenever an interface, an IPv4 address or a route of the main table changes. A first
+// sync runs right away, to cover what changed since Setup.
+func Watch(ctx context.Context, cfg Config) {
+	events, err := nl.Subscribe(syscall.NETLINK_ROUTE, RTMGRP_LINK|RTMGRP_IPV4_IFADDR|RTMGRP_IPV4_ROUTE)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure watching underlays, failback disabled: %v\n", err)
+		return
+	}
+	defer events.Close()
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure watching underlays, failback disabled: %v\n", err)
+		return
+	}
+	defer sk.Close()
+
+	dirty := make(chan struct{}, 1)
+	dirty <- struct{}{}
+	go func() {
+		for ctx.Err() == nil {
+			msgs, err := events.Receive()
+			if err != nil && !errors.Is(err, syscall.ENOBUFS) {
+				fmt.Fprintf(os.Stderr, "[sknf] Failure watching underlays, failback disabled: %v\n", err)
+				return
+			}
+			// notifications were lost: anything may have changed
+			relevant := err != nil
+			for _, m := range msgs {
+				relevant = relevant || isRelevant(m)
+			}
+			if relevant {
+				select {
+				case dirty <- struct{}{}:
+				default:
+				}
+			}
+		}
+	}()
+
+	up := map[string]bool{}
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-dirty:
+		}
+		time.Sleep(RESYNC_DELAY)
+		if err := Sync(sk, cfg); err != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure syncing underlays: %v\n", err)
+		}
+		reportStates(cfg, up)
+	}
+}
+
+// isRelevant filters out the notifications of the underlay tables, which Sync itself causes
+func isRelevant(m syscall.NetlinkMessage) bool {
+	switch m.Header.Type {
+	case syscall.RTM_NEWROUTE, syscall.RTM_DELROUTE:
+		return len(m.Data) >= syscall.SizeofRtMsg && tableOf(m.Data) == syscall.RT_TABLE_MAIN
+	case syscall.RTM_NEWLINK, syscall.RTM_DELLINK, syscall.RTM_NEWADDR, syscall.RTM_DELADDR:
+		return true
+	}
+	return false
+}
+
+// reportStates logs the underlays whose carrier changed since the last call
+func reportStates(cfg Config, up map[string]bool) {
+	for _, name := range append([]string{cfg.HostPhysicalIf}, cfg.Ifs...) {
+		running := false
+		if ifi, err := net.InterfaceByName(name); err == nil {
+			running = ifi.Flags&net.FlagUp != 0 && ifi.Flags&net.FlagRunning != 0
+		}
+		if was, ok := up[name]; ok && was == running {
+			continue
+		}
+		up[name] = running
+		if running {
+			fmt.Printf("[sknf] Underlay %s is up\n", name)
+		} else {
+			fmt.Printf("[sknf] Underlay %s is down, its flows moved to the other underlays\n", name)
+		}
+	}
+}
+
+// sourcePortRange returns the [low, high) range vxlan picks source ports from: its own, or the local port
+// range of the namespace when unset (see udp_flow_src_port)
+func sourcePortRange(vxlan linkInfo) (uint16, uint16, error) {
+	if vxlan.portLow < vxlan.portHigh {
+		return vxlan.portLow, vxlan.portHigh, nil
+	}
+	b, err := os.ReadFile(LOCAL_PORT_RANGE_PATH)
+	if err != nil {
+		return 0, 0, err
+	}
+	fields := strings.Fields(string(b))
+	if len(fields) != 2 {
+		return 0, 0, fmt.Errorf("parsing %s: %q", LOCAL_PORT_RANGE_PATH, b)
+	}
+	l, err1 := strconv.ParseUint(fields[0], 10, 16)
+	h, err2 := strconv.ParseUint(fields[1], 10, 16)
+	if err1 != nil || err2 != nil || l >= h {
+		return 0, 0, fmt.Errorf("parsing %s: %q", LOCAL_PORT_RANGE_PATH, b)
+	}
+	return uint16(l), uint16(h), nil
+}
+
+func teardownChain(sk *nl.Socket) error {
+	chains, err := nft.ListChains(sk)
+	if err != nil {
+		return err
+	}
+	for _, chain := range chains {
+		if chain == OUTPUT_CHAIN_NAME {
+			b := nft.NewBatch(sk)
+			b.FlushChain(OUTPUT_CHAIN_NAME)
+			b.DelChain(OUTPUT_CHAIN_NAME)
+			if err := b.Commit(); err != nil {
+				return fmt.Errorf("deleting %s chain: %w", OUTPUT_CHAIN_NAME, err)
+			}
+		}
+	}
+	return nil
+}
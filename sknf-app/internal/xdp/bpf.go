@@ -0,0 +1,203 @@
+package xdp
+
+import (
+	"fmt"
+	"syscall"
+	"unsafe"
+)
+
+// linux/bpf.h: commands, map and program types
+const BPF_MAP_CREATE = 0
+const BPF_MAP_UPDATE_ELEM = 2
+const BPF_MAP_DELETE_ELEM = 3
+const BPF_MAP_GET_NEXT_KEY = 4
+const BPF_PROG_LOAD = 5
+const BPF_OBJ_PIN = 6
+const BPF_OBJ_GET = 7
+const BPF_PROG_ATTACH = 8
+const BPF_PROG_DETACH = 9
+
+const BPF_MAP_TYPE_HASH = 1
+const BPF_PROG_TYPE_SCHED_CLS = 3
+const BPF_PROG_TYPE_XDP = 6
+
+// enum bpf_attach_type of Linux 6.7+: programs of a netkit pair, run on the transmit path of its peer end
+const BPF_NETKIT_PEER = 55
+
+const BPF_ANY = 0
+
+// Verifier log of a rejected program; the decap program is small enough for this to hold it whole
+const VERIFIER_LOG_SIZE = 1 << 16
+
+// Prefixes of the bpf_attr union used by each command. Its __aligned_u64 pointers are held as unsafe.Pointer
+// so that the runtime keeps (and moves) what they point to: sknf-app only runs on 64-bit nodes.
+type mapCreateAttr struct {
+	mapType    uint32
+	keySize    uint32
+	valueSize  uint32
+	maxEntries uint32
+	mapFlags   uint32
+}
+
+type mapElemAttr struct {
+	mapFd uint32
+	_     uint32
+	key   unsafe.Pointer
+	value unsafe.Pointer // or next_key
+	flags uint64
+}
+
+type progLoadAttr struct {
+	progType    uint32
+	insnCnt     uint32
+	insns       unsafe.Pointer
+	license     unsafe.Pointer
+	logLevel    uint32
+	logSize     uint32
+	logBuf      unsafe.Pointer
+	kernVersion uint32
+	progFlags   uint32
+	progName    [16]byte
+	progIfindex uint32
+	attachType  uint32 // expected_attach_type
+}
+
+type progAttachAttr struct {
+	targetIfindex uint32
+	attachBpfFd   uint32
+	attachType    uint32
+}
+
+type objAttr struct {
+	pathname  unsafe.Pointer
+	bpfFd     uint32
+	fileFlags uint32
+}
+
+func bpf(cmd int, attr unsafe.Pointer, size uintptr) (int, error) {
+	r, _, errno := syscall.Syscall(SYS_BPF, uintptr(cmd), uintptr(attr), size)
+	if errno != 0 {
+		return -1, errno
+	}
+	return int(r), nil
+}
+
+func createMap(keySize, valueSize, maxEntries uint32) (int, error) {
+	attr := mapCreateAttr{
+		mapType:    BPF_MAP_TYPE_HASH,
+		keySize:    keySize,
+		valueSize:  valueSize,
+		maxEntries: maxEntries,
+	}
+	fd, err := bpf(BPF_MAP_CREATE, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	if err != nil {
+		return -1, fmt.Errorf("creating map: %w", err)
+	}
+	return fd, nil
+}
+
+func updateElem(fd int, key, value []byte) error {
+	attr := mapElemAttr{
+		mapFd: uint32(fd),
+		key:   unsafe.Pointer(&key[0]),
+		value: unsafe.Pointer(&value[0]),
+		flags: BPF_ANY,
+	}
+	_, err := bpf(BPF_MAP_UPDATE_ELEM, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	return err
+}
+
+func deleteElem(fd int, key []byte) error {
+	attr := mapElemAttr{
+		mapFd: uint32(fd),
+		key:   unsafe.Pointer(&key[0]),
+	}
+	_, err := bpf(BPF_MAP_DELETE_ELEM, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	return err
+}
+
+// keys returns every key of a hash map of keySize byte keys
+func keys(fd int, keySize int) ([][]byte, error) {
+	var out [][]byte
+	var key []byte // nil: start from the first key
+	for {
+		next := make([]byte, keySize)
+		attr := mapElemAttr{
+			mapFd: uint32(fd),
+			value: unsafe.Pointer(&next[0]),
+		}
+		if key != nil {
+			attr.key = unsafe.Pointer(&key[0])
+		}
+		_, err := bpf(BPF_MAP_GET_NEXT_KEY, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+		if err == syscall.ENOENT {
+			return out, nil
+		}
+		if err != nil {
+			return nil, fmt.Errorf("iterating map: %w", err)
+		}
+		out = append(out, next)
+		key = next
+	}
+}
+
+func loadProg(progType, attachType uint32, name string, insns []byte) (int, error) {
+	license := []byte("GPL\x00")
+	log := make([]byte, VERIFIER_LOG_SIZE)
+	attr := progLoadAttr{
+		progType:   progType,
+		insnCnt:    uint32(len(insns) / INSN_SIZE),
+		insns:      unsafe.Pointer(&insns[0]),
+		license:    unsafe.Pointer(&license[0]),
+		logLevel:   1,
+		logSize:    uint32(len(log)),
+		logBuf:     unsafe.Pointer(&log[0]),
+		attachType: attachType,
+	}
+	copy(attr.progName[:len(attr.progName)-1], name)
+	fd, err := bpf(BPF_PROG_LOAD, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	if err != nil {
+		return -1, fmt.Errorf("loading program: %w\n%s", err, cString(log))
+	}
+	return fd, nil
+}
+
+// attachProg adds prog to the programs of the device index (netkit: the primary end) for attachType
+func attachProg(index int32, prog int, attachType uint32) error {
+	attr := progAttachAttr{targetIfindex: uint32(index), attachBpfFd: uint32(prog), attachType: attachType}
+	_, err := bpf(BPF_PROG_ATTACH, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	return err
+}
+
+func detachProg(index int32, prog int, attachType uint32) error {
+	attr := progAttachAttr{targetIfindex: uint32(index), attachBpfFd: uint32(prog), attachType: attachType}
+	_, err := bpf(BPF_PROG_DETACH, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	return err
+}
+
+func pin(fd int, path string) error {
+	p := append([]byte(path), 0)
+	attr := objAttr{pathname: unsafe.Pointer(&p[0]), bpfFd: uint32(fd)}
+	_, err := bpf(BPF_OBJ_PIN, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	if err != nil {
+		return fmt.Errorf("pinning %s: %w", path, err)
+	}
+	return nil
+}
+
+// getPinned opens a pinned object; a missing pin is returned as syscall.ENOENT
+func getPinned(path string) (int, error) {
+	p := append([]byte(path), 0)
+	attr := objAttr{pathname: unsafe.Pointer(&p[0])}
+	fd, err := bpf(BPF_OBJ_GET, unsafe.Pointer(&attr), unsafe.Sizeof(attr))
+	return fd, err
+}
+
+func cString(b []byte) string {
+	for i, c := range b {
+		if c == 0 {
+			return string(b[:i])
+		}
+	}
+	return string(b)
+}
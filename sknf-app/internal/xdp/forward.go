@@ -0,0 +1,104 @@
+package xdp
+
+import (
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"syscall"
+)
+
+// Must match sknf-cni/src/xdp.h
+const FORWARD_PROG_PIN_PATH = PIN_DIR + "/netkit_fwd"
+
+const FORWARD_PROG_NAME = "sknf_netkit_fwd"
+
+type ForwardConfig struct {
+	// Pods get netkit pairs attached to brsknf, which take the program
+	Enabled bool
+	// Node pod CIDR
+	Subnet string
+	// Cluster-wide pod CIDR
+	ClusterCidr string
+	// Where frames to the pods of other nodes are redirected
+	VxlanIf string
+}
+
+// SetupForward loads the forwarding program of netkit pods and pins it for sknf-cni, which attaches it to
+// the pods it adds. Frames a pod sends to a pod of another node go straight to the VXLAN interface,
+// skipping the backlog of the host end and the bridge. links holds the host ends of the netkit pods found
+// by reconcile: the program of a previous run is detached from all of them, and the new one attached to
+// those mapped to true. Disabled, the program of a previous run is detached and unpinned, and the returned
+// Isolation is nil.
+//
+// Pods are without a program between the two, and an ADD in that window pins none: their frames take the
+// pass policy of the pair, i.e. the normal path.
+func SetupForward(cfg ForwardConfig, links map[int32]bool) (*Isolation, error) {
+	old, err := getPinned(FORWARD_PROG_PIN_PATH)
+	if err != nil && err != syscall.ENOENT {
+		return nil, fmt.Errorf("opening %s: %w", FORWARD_PROG_PIN_PATH, err)
+	}
+	if err == nil {
+		// Errors ignored: pods shaped on egress never had the program
+		for index := range links {
+			detachProg(index, old, BPF_NETKIT_PEER)
+		}
+		syscall.Close(old)
+		if err := os.Remove(FORWARD_PROG_PIN_PATH); err != nil && !errors.Is(err, os.ErrNotExist) {
+			return nil, err
+		}
+	}
+	if !cfg.Enabled {
+		return nil, nil
+	}
+
+	_, node, err := net.ParseCIDR(cfg.Subnet)
+	if err != nil {
+		return nil, fmt.Errorf("parsing subnet %s: %w", cfg.Subnet, err)
+	}
+	_, cluster, err := net.ParseCIDR(cfg.ClusterCidr)
+	if err != nil {
+		return nil, fmt.Errorf("parsing cluster CIDR %s: %w", cfg.ClusterCidr, err)
+	}
+	if node.IP.To4() == nil || cluster.IP.To4() == nil {
+		return nil, fmt.Errorf("cluster CIDR %s and subnet %s must be IPv4", cfg.ClusterCidr, cfg.Subnet)
+	}
+	vxlan, err := net.InterfaceByName(cfg.VxlanIf)
+	if err != nil {
+		return nil, err
+	}
+
+	if err := mountBpffs(); err != nil {
+		return nil, err
+	}
+	if err := os.MkdirAll(PIN_DIR, 0o700); err != nil {
+		return nil, err
+	}
+	d, err := openIsolation()
+	if err != nil {
+		return nil, err
+	}
+
+	prog, err := loadProg(BPF_PROG_TYPE_SCHED_CLS, BPF_NETKIT_PEER, FORWARD_PROG_NAME,
+		forwardProgram(d.isolated, cluster, node, vxlan.Index))
+	if err != nil {
+		syscall.Close(d.isolated)
+		return nil, err
+	}
+	defer syscall.Close(prog)
+
+	for index, forward := range links {
+		if !forward {
+			continue
+		}
+		if err := attachProg(index, prog, BPF_NETKIT_PEER); err != nil {
+			syscall.Close(d.isolated)
+			return nil, fmt.Errorf("attaching to interface %d: %w", index, err)
+		}
+	}
+	if err := pin(prog, FORWARD_PROG_PIN_PATH); err != nil {
+		syscall.Close(d.isolated)
+		return nil, err
+	}
+	return d, nil
+}
@@ -0,0 +1,227 @@
+package xdp
+
+import (
+	"encoding/binary"
+	"net"
+)
+
+// linux/bpf_common.h and linux/bpf.h opcodes used by the programs
+const BPF_LDX_MEM_W = 0x61
+const BPF_LDX_MEM_H = 0x69
+const BPF_LDX_MEM_B = 0x71
+const BPF_STX_MEM_W = 0x63
+const BPF_STX_MEM_H = 0x6b
+const BPF_LD_IMM64 = 0x18
+const BPF_ALU64_MOV_K = 0xb7
+const BPF_ALU64_MOV_X = 0xbf
+const BPF_ALU64_ADD_K = 0x07
+const BPF_ALU64_AND_K = 0x57
+const BPF_ALU_AND_K = 0x54
+const BPF_JMP_JEQ_K = 0x15
+const BPF_JMP_JNE_K = 0x55
+const BPF_JMP_JGT_X = 0x2d
+const BPF_JMP32_JEQ_K = 0x16
+const BPF_JMP32_JNE_K = 0x56
+const BPF_JMP_CALL = 0x85
+const BPF_JMP_EXIT = 0x95
+
+const BPF_PSEUDO_MAP_FD = 1
+
+const BPF_FUNC_MAP_LOOKUP_ELEM = 1
+const BPF_FUNC_REDIRECT = 23
+const BPF_FUNC_XDP_ADJUST_HEAD = 44
+
+const XDP_PASS = 2
+
+// enum netkit_action: NETKIT_NEXT leaves the frame to the next program, or to the pass policy of the pair
+const NETKIT_NEXT = -1
+
+const INSN_SIZE = 8
+
+// Registers: r0 return value, r1-r5 arguments (clobbered by calls), r6-r9 callee saved, r10 frame pointer
+const R0, R1, R2, R3, R4, R5, R6, R7, R10 = 0, 1, 2, 3, 4, 5, 6, 7, 10
+
+// Offsets in the frame of a VXLAN packet on the underlay: Ethernet (14), IPv4 without options (20),
+// UDP (8) and VXLAN (8) headers, then the inner Ethernet frame
+const ETH_PROTO_OFFSET = 12
+const IP_VERSION_IHL_OFFSET = 14
+const IP_FRAG_OFFSET = 20
+const IP_PROTO_OFFSET = 23
+const UDP_DPORT_OFFSET = 36
+const VXLAN_FLAGS_OFFSET = 42
+const VXLAN_VNI_OFFSET = 46
+const INNER_ETH_OFFSET = 50
+const INNER_ETH_DST_LEN = 6
+const MIN_FRAME_LEN = INNER_ETH_OFFSET + 14
+
+const VXLAN_FLAG_VNI = 0x08
+
+// struct __sk_buff offsets of the packet pointers, and the frame offsets read by the forwarding program
+const SKB_DATA_OFFSET = 76
+const SKB_DATA_END_OFFSET = 80
+const ETH_DST_IP_OFFSET = 2
+const ETH_SRC_OFFSET = 6
+const ETH_HLEN = 14
+
+// First bytes of a pod MAC, 0a:58 (see nl.MacOf), as a little-endian load
+const POD_MAC_PREFIX = 0x580a
+
+// assembler emits eBPF instructions; jumps to the pass exit are patched once it is placed
+type assembler struct {
+	insns  []byte
+	toPass []int
+}
+
+func (a *assembler) emit(code uint8, dst, src uint8, off int16, imm int32) {
+	var insn [INSN_SIZE]byte
+	insn[0] = code
+	insn[1] = src<<4 | dst
+	binary.LittleEndian.PutUint16(insn[2:4], uint16(off))
+	binary.LittleEndian.PutUint32(insn[4:8], uint32(imm))
+	a.insns = append(a.insns, insn[:]...)
+}
+
+func (a *assembler) n() int {
+	return len(a.insns) / INSN_SIZE
+}
+
+// passIf emits a conditional jump (code against imm) to the pass exit
+func (a *assembler) passIf(code uint8, dst uint8, imm int32) {
+	a.toPass = append(a.toPass, a.n())
+	a.emit(code, dst, 0, 0, imm)
+}
+
+func (a *assembler) loadMapFd(dst uint8, fd int) {
+	a.emit(BPF_LD_IMM64, dst, BPF_PSEUDO_MAP_FD, 0, int32(fd))
+	a.emit(0, 0, 0, 0, 0)
+}
+
+// pass places the exit that returns verdict, the one of frames left to the normal path
+func (a *assembler) pass(verdict int32) {
+	for _, i := range a.toPass {
+		binary.LittleEndian.PutUint16(a.insns[i*INSN_SIZE+2:], uint16(a.n()-i-1))
+	}
+	a.emit(BPF_ALU64_MOV_K, R0, 0, 0, verdict)
+	a.emit(BPF_JMP_EXIT, 0, 0, 0, 0)
+}
+
+// decapProgram assembles the XDP program: VXLAN frames of vni on port whose inner destination MAC is in
+// podMacs (and not in isolatedMacs) have their outer headers stripped and are redirected to the ifindex
+// found in podMacs; every other frame is passed to the stack untouched. Packet fields are compared as
+// the little-endian loads of their network byte order bytes.
+func decapProgram(podMacs, isolatedMacs int, vni uint32, port uint16) []byte {
+	var a assembler
+
+	a.emit(BPF_ALU64_MOV_X, R6, R1, 0, 0)
+	// r2 = xdp_md->data, r3 = xdp_md->data_end; every header read below is within MIN_FRAME_LEN
+	a.emit(BPF_LDX_MEM_W, R2, R6, 0, 0)
+	a.emit(BPF_LDX_MEM_W, R3, R6, 4, 0)
+	a.emit(BPF_ALU64_MOV_X, R4, R2, 0, 0)
+	a.emit(BPF_ALU64_ADD_K, R4, 0, 0, MIN_FRAME_LEN)
+	a.toPass = append(a.toPass, a.n())
+	a.emit(BPF_JMP_JGT_X, R4, R3, 0, 0)
+
+	// IPv4 without options, UDP, not a fragment (MF clear, offset 0)
+	a.emit(BPF_LDX_MEM_H, R4, R2, ETH_PROTO_OFFSET, 0)
+	a.passIf(BPF_JMP_JNE_K, R4, 0x0008)
+	a.emit(BPF_LDX_MEM_B, R4, R2, IP_VERSION_IHL_OFFSET, 0)
+	a.passIf(BPF_JMP_JNE_K, R4, 0x45)
+	a.emit(BPF_LDX_MEM_B, R4, R2, IP_PROTO_OFFSET, 0)
+	a.passIf(BPF_JMP_JNE_K, R4, 17)
+	a.emit(BPF_LDX_MEM_H, R4, R2, IP_FRAG_OFFSET, 0)
+	a.emit(BPF_ALU64_AND_K, R4, 0, 0, 0xff3f)
+	a.passIf(BPF_JMP_JNE_K, R4, 0)
+
+	// VXLAN on port, with a valid VNI equal to vni
+	a.emit(BPF_LDX_MEM_H, R4, R2, UDP_DPORT_OFFSET, 0)
+	a.passIf(BPF_JMP_JNE_K, R4, int32(port>>8|port&0xff<<8))
+	a.emit(BPF_LDX_MEM_B, R4, R2, VXLAN_FLAGS_OFFSET, 0)
+	a.emit(BPF_ALU64_AND_K, R4, 0, 0, VXLAN_FLAG_VNI)
+	a.passIf(BPF_JMP_JEQ_K, R4, 0)
+	a.emit(BPF_LDX_MEM_W, R4, R2, VXLAN_VNI_OFFSET, 0)
+	a.emit(BPF_ALU64_AND_K, R4, 0, 0, 0xffffff)
+	a.passIf(BPF_JMP_JNE_K, R4, int32(vni>>16&0xff|vni>>8&0xff<<8|vni&0xff<<16))
+
+	// key of both maps: the inner destination MAC, copied to fp-8
+	a.emit(BPF_LDX_MEM_W, R4, R2, INNER_ETH_OFFSET, 0)
+	a.emit(BPF_STX_MEM_W, R10, R4, -8, 0)
+	a.emit(BPF_LDX_MEM_H, R4, R2, INNER_ETH_OFFSET+4, 0)
+	a.emit(BPF_STX_MEM_H, R10, R4, -4, 0)
+
+	// pods selected by a NetworkPolicy stay on the stack path, where the policy chains see their traffic
+	a.emit(BPF_ALU64_MOV_X, R2, R10, 0, 0)
+	a.emit(BPF_ALU64_ADD_K, R2, 0, 0, -8)
+	a.loadMapFd(R1, isolatedMacs)
+	a.emit(BPF_JMP_CALL, 0, 0, 0, BPF_FUNC_MAP_LOOKUP_ELEM)
+	a.passIf(BPF_JMP_JNE_K, R0, 0)
+
+	a.emit(BPF_ALU64_MOV_X, R2, R10, 0, 0)
+	a.emit(BPF_ALU64_ADD_K, R2, 0, 0, -8)
+	a.loadMapFd(R1, podMacs)
+	a.emit(BPF_JMP_CALL, 0, 0, 0, BPF_FUNC_MAP_LOOKUP_ELEM)
+	a.passIf(BPF_JMP_JEQ_K, R0, 0)
+	a.emit(BPF_LDX_MEM_W, R7, R0, 0, 0)
+
+	a.emit(BPF_ALU64_MOV_X, R1, R6, 0, 0)
+	a.emit(BPF_ALU64_MOV_K, R2, 0, 0, INNER_ETH_OFFSET)
+	a.emit(BPF_JMP_CALL, 0, 0, 0, BPF_FUNC_XDP_ADJUST_HEAD)
+	a.passIf(BPF_JMP_JNE_K, R0, 0)
+
+	a.emit(BPF_ALU64_MOV_X, R1, R7, 0, 0)
+	a.emit(BPF_ALU64_MOV_K, R2, 0, 0, 0)
+	a.emit(BPF_JMP_CALL, 0, 0, 0, BPF_FUNC_REDIRECT)
+	a.emit(BPF_JMP_EXIT, 0, 0, 0, 0)
+
+	a.pass(XDP_PASS)
+	return a.insns
+}
+
+// forwardProgram assembles the netkit program run on the frames a pod sends: frames to the MAC of a pod
+// of another node (an IP of cluster outside of node) from a pod that is not in isolatedMacs are redirected
+// to the transmit path of vxlanIndex; every other frame is left to the pass policy.
+func forwardProgram(isolatedMacs int, cluster, node *net.IPNet, vxlanIndex int) []byte {
+	var a assembler
+
+	a.emit(BPF_ALU64_MOV_X, R6, R1, 0, 0)
+	a.emit(BPF_LDX_MEM_W, R2, R6, SKB_DATA_OFFSET, 0)
+	a.emit(BPF_LDX_MEM_W, R3, R6, SKB_DATA_END_OFFSET, 0)
+	a.emit(BPF_ALU64_MOV_X, R4, R2, 0, 0)
+	a.emit(BPF_ALU64_ADD_K, R4, 0, 0, ETH_HLEN)
+	a.toPass = append(a.toPass, a.n())
+	a.emit(BPF_JMP_JGT_X, R4, R3, 0, 0)
+
+	// the destination MAC of a pod holds its IP: in the cluster CIDR, and not in the node subnet
+	a.emit(BPF_LDX_MEM_H, R4, R2, 0, 0)
+	a.passIf(BPF_JMP_JNE_K, R4, POD_MAC_PREFIX)
+	a.emit(BPF_LDX_MEM_W, R4, R2, ETH_DST_IP_OFFSET, 0)
+	a.emit(BPF_ALU64_MOV_X, R5, R4, 0, 0)
+	a.emit(BPF_ALU_AND_K, R5, 0, 0, le32(cluster.Mask))
+	a.passIf(BPF_JMP32_JNE_K, R5, le32(cluster.IP.To4()))
+	a.emit(BPF_ALU64_MOV_X, R5, R4, 0, 0)
+	a.emit(BPF_ALU_AND_K, R5, 0, 0, le32(node.Mask))
+	a.passIf(BPF_JMP32_JEQ_K, R5, le32(node.IP.To4()))
+
+	// pods selected by a NetworkPolicy stay on the bridge path, where the policy chains see their traffic
+	a.emit(BPF_LDX_MEM_W, R4, R2, ETH_SRC_OFFSET, 0)
+	a.emit(BPF_STX_MEM_W, R10, R4, -8, 0)
+	a.emit(BPF_LDX_MEM_H, R4, R2, ETH_SRC_OFFSET+4, 0)
+	a.emit(BPF_STX_MEM_H, R10, R4, -4, 0)
+	a.emit(BPF_ALU64_MOV_X, R2, R10, 0, 0)
+	a.emit(BPF_ALU64_ADD_K, R2, 0, 0, -8)
+	a.loadMapFd(R1, isolatedMacs)
+	a.emit(BPF_JMP_CALL, 0, 0, 0, BPF_FUNC_MAP_LOOKUP_ELEM)
+	a.passIf(BPF_JMP_JNE_K, R0, 0)
+
+	a.emit(BPF_ALU64_MOV_K, R1, 0, 0, int32(vxlanIndex))
+	a.emit(BPF_ALU64_MOV_K, R2, 0, 0, 0)
+	a.emit(BPF_JMP_CALL, 0, 0, 0, BPF_FUNC_REDIRECT)
+	a.emit(BPF_JMP_EXIT, 0, 0, 0, 0)
+
+	a.pass(NETKIT_NEXT)
+	return a.insns
+}
+
+// le32 is the little-endian load of 4 bytes in network byte order, as compared by the programs
+func le32(b []byte) int32 {
+	return int32(binary.LittleEndian.Uint32(b))
+}
@@ -0,0 +1,4 @@
+package xdp
+
+// syscall does not export it
+const SYS_BPF = 321
@@ -0,0 +1,301 @@
+// Package xdp attaches the VXLAN decapsulation fast path to the underlay interface.
+//
+// Overlay traffic for local pods normally climbs IP, UDP, vxsknf and brsknf before reaching the
+// pod's host interface. The XDP program of this package recognizes VXLAN frames of the sknf VNI
+// whose inner destination is a local pod, strips the outer headers and redirects the inner frame
+// to the pod's host interface; every other frame takes the normal path.
+//
+// Pods are found through a map pinned in bpffs, keyed by pod MAC: sknf-app fills it from the
+// reconciled pods and sknf-cni keeps it up to date on ADD and DEL. Without the pin (XDP_DECAP
+// off), sknf-cni skips it.
+//
+// The package also holds the forwarding program of netkit pods (see forward.go), the same shortcut in
+// the other direction: frames for the pods of other nodes skip the bridge on their way to vxsknf.
+package xdp
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"syscall"
+
+	"github.com/felipeek/sknf/sknf-app/internal/nl"
+)
+
+// Must match sknf-cni/src/xdp.h
+const PIN_DIR = "/sys/fs/bpf/sknf"
+const POD_MAP_PIN_PATH = PIN_DIR + "/pod_macs"
+const ISOLATED_MAP_PIN_PATH = PIN_DIR + "/isolated_macs"
+const PROG_PIN_PATH = PIN_DIR + "/xdp_decap"
+
+const BPF_FS_PATH = "/sys/fs/bpf"
+const BPF_FS_MAGIC = 0xcafe4a11
+
+const PROG_NAME = "sknf_decap"
+
+// Upper bound on the pods of a node (the largest node subnet handed out by a /16 cluster CIDR is a /20)
+const MAP_MAX_ENTRIES = 4096
+const MAC_LEN = 6
+
+const MODE_OFF = "off"
+const MODE_GENERIC = "generic"
+const MODE_NATIVE = "native"
+
+// linux/if_link.h: IFLA_XDP_* (nested in IFLA_XDP) and XDP_FLAGS_*
+const IFLA_XDP = 43
+const IFLA_XDP_FD = 1
+const IFLA_XDP_FLAGS = 3
+const IFLA_XDP_EXPECTED_FD = 8
+const XDP_FLAGS_UPDATE_IF_NOEXIST = 1 << 0
+const XDP_FLAGS_SKB_MODE = 1 << 1
+const XDP_FLAGS_DRV_MODE = 1 << 2
+const XDP_FLAGS_REPLACE = 1 << 4
+
+type Config struct {
+	// MODE_OFF, MODE_GENERIC (any driver, after the skb is built) or MODE_NATIVE (in the driver)
+	Mode string
+	// Underlay of the VXLAN overlay, where the program is attached
+	HostPhysicalIf string
+	Vni            uint32
+	Port           uint16
+}
+
+// Isolation holds the pods selected by a NetworkPolicy, whose traffic must go through the policy chains:
+// the fast paths leave them to the normal path.
+type Isolation struct {
+	isolated int
+	applied  map[uint32]struct{}
+}
+
+// Setup attaches the fast path in cfg.Mode, or detaches the one of a previous run with MODE_OFF (the
+// returned Isolation is then nil). podLinks maps the IP of every pod found by reconcile to the index of its
+// host interface; the pod map is brought in line with it.
+func Setup(cfg Config, podLinks map[string]int32) (*Isolation, error) {
+	var flags uint32
+	switch cfg.Mode {
+	case MODE_OFF:
+		return nil, teardown(cfg.HostPhysicalIf)
+	case MODE_GENERIC:
+		flags = XDP_FLAGS_SKB_MODE
+	case MODE_NATIVE:
+		flags = XDP_FLAGS_DRV_MODE
+	default:
+		return nil, fmt.Errorf("invalid mode %q, expected %s, %s or %s", cfg.Mode, MODE_OFF, MODE_GENERIC, MODE_NATIVE)
+	}
+
+	phys, err := net.InterfaceByName(cfg.HostPhysicalIf)
+	if err != nil {
+		return nil, err
+	}
+
+	if err := mountBpffs(); err != nil {
+		return nil, err
+	}
+	if err := os.MkdirAll(PIN_DIR, 0o700); err != nil {
+		return nil, err
+	}
+
+	podMacs, err := openMap(POD_MAP_PIN_PATH, 4)
+	if err != nil {
+		return nil, err
+	}
+	defer syscall.Close(podMacs)
+	if err := syncPods(podMacs, podLinks); err != nil {
+		return nil, err
+	}
+	d, err := openIsolation()
+	if err != nil {
+		return nil, err
+	}
+
+	prog, err := loadProg(BPF_PROG_TYPE_XDP, 0, PROG_NAME, decapProgram(podMacs, d.isolated, cfg.Vni, cfg.Port))
+	if err != nil {
+		syscall.Close(d.isolated)
+		return nil, err
+	}
+	defer syscall.Close(prog)
+
+	if err := attach(phys.Index, prog, flags); err != nil {
+		syscall.Close(d.isolated)
+		return nil, fmt.Errorf("attaching to %s: %w", cfg.HostPhysicalIf, err)
+	}
+	return d, nil
+}
+
+// openIsolation opens the isolated pod map, shared by the fast paths. The isolated pods of the previous
+// run stay isolated until the first policy sync.
+func openIsolation() (*Isolation, error) {
+	isolated, err := openMap(ISOLATED_MAP_PIN_PATH, 1)
+	if err != nil {
+		return nil, err
+	}
+	applied, err := keys(isolated, MAC_LEN)
+	if err != nil {
+		syscall.Close(isolated)
+		return nil, err
+	}
+	d := &Isolation{isolated: isolated, applied: make(map[uint32]struct{}, len(applied))}
+	for _, mac := range applied {
+		d.applied[binary.BigEndian.Uint32(mac[2:])] = struct{}{}
+	}
+	return d, nil
+}
+
+// SetIsolated replaces the set of pods left to the normal path by their IPs (host byte order).
+func (d *Isolation) SetIsolated(ips map[uint32]struct{}) error {
+	for ip := range d.applied {
+		if _, ok := ips[ip]; !ok {
+			if err := deleteElem(d.isolated, nl.MacOf(binary.BigEndian.AppendUint32(nil, ip))); err != nil && err != syscall.ENOENT {
+				d.applied = nil
+				return fmt.Errorf("deleting isolated pod: %w", err)
+			}
+		}
+	}
+	for ip := range ips {
+		if _, ok := d.applied[ip]; ok {
+			continue
+		}
+		if err := updateElem(d.isolated, nl.MacOf(binary.BigEndian.AppendUint32(nil, ip)), []byte{1}); err != nil {
+			d.applied = nil
+			return fmt.Errorf("adding isolated pod: %w", err)
+		}
+	}
+	d.applied = ips
+	return nil
+}
+
+// attach replaces the program of a previous run (whatever its mode) with prog, refusing to replace a
+// program attached by someone else
+func attach(index int, prog int, flags uint32) error {
+	sk, err := nl.Open(syscall.NETLINK_ROUTE)
+	if err != nil {
+		return err
+	}
+	defer sk.Close()
+
+	old, err := getPinned(PROG_PIN_PATH)
+	if err != nil && err != syscall.ENOENT {
+		return fmt.Errorf("opening %s: %w", PROG_PIN_PATH, err)
+	}
+	if err == nil {
+		detach(sk, index, old)
+		syscall.Close(old)
+		os.Remove(PROG_PIN_PATH)
+	}
+
+	if err := setXdp(sk, index, prog, flags|XDP_FLAGS_UPDATE_IF_NOEXIST, -1); err != nil {
+		return err
+	}
+	return pin(prog, PROG_PIN_PATH)
+}
+
+// detach removes prog from the interface in both modes; only one of them can hold it
+func detach(sk *nl.Socket, index int, prog int) {
+	for _, mode := range []uint32{XDP_FLAGS_SKB_MODE, XDP_FLAGS_DRV_MODE} {
+		setXdp(sk, index, -1, mode|XDP_FLAGS_REPLACE, prog)
+	}
+}
+
+func setXdp(sk *nl.Socket, index int, fd int, flags uint32, expectedFd int) error {
+	req := nl.AppendNested(nl.IfInfoMsg(int32(index), 0), IFLA_XDP, func(b []byte) []byte {
+		b = nl.AppendAttr(b, IFLA_XDP_FD, nl.U32(uint32(int32(fd))))
+		b = nl.AppendAttr(b, IFLA_XDP_FLAGS, nl.U32(flags))
+		if flags&XDP_FLAGS_REPLACE != 0 {
+			b = nl.AppendAttr(b, IFLA_XDP_EXPECTED_FD, nl.U32(uint32(int32(expectedFd))))
+		}
+		return b
+	})
+	return sk.Request(syscall.RTM_SETLINK, 0, req)
+}
+
+// teardown detaches the program of a previous run and removes the pins, so that sknf-cni stops
+// maintaining the pod map
+func teardown(hostPhysicalIf string) error {
+	old, err := getPinned(PROG_PIN_PATH)
+	if err != nil && err != syscall.ENOENT {
+		return fmt.Errorf("opening %s: %w", PROG_PIN_PATH, err)
+	}
+	if err == nil {
+		defer syscall.Close(old)
+		if phys, err := net.InterfaceByName(hostPhysicalIf); err == nil {
+			sk, err := nl.Open(syscall.NETLINK_ROUTE)
+			if err != nil {
+				return err
+			}
+			detach(sk, phys.Index, old)
+			sk.Close()
+		}
+	}
+	for _, path := range []string{PROG_PIN_PATH, POD_MAP_PIN_PATH, ISOLATED_MAP_PIN_PATH} {
+		if err := os.Remove(path); err != nil && !errors.Is(err, os.ErrNotExist) {
+			return err
+		}
+	}
+	return nil
+}
+
+// openMap opens the map pinned at path, or creates and pins it
+func openMap(path string, valueSize uint32) (int, error) {
+	fd, err := getPinned(path)
+	if err == nil {
+		return fd, nil
+	}
+	if err != syscall.ENOENT {
+		return -1, fmt.Errorf("opening %s: %w", path, err)
+	}
+	if fd, err = createMap(MAC_LEN, valueSize, MAP_MAX_ENTRIES); err != nil {
+		return -1, err
+	}
+	if err := pin(fd, path); err != nil {
+		syscall.Close(fd)
+		return -1, err
+	}
+	return fd, nil
+}
+
+// syncPods makes the pod map hold exactly the pods in podLinks. An ADD racing with it may lose its
+// entry, which only sends the traffic of its pod through the normal path.
+func syncPods(fd int, podLinks map[string]int32) error {
+	want := make(map[string][]byte, len(podLinks))
+	for ip, index := range podLinks {
+		addr := net.ParseIP(ip).To4()
+		if addr == nil {
+			continue
+		}
+		want[string(nl.MacOf(addr))] = nl.U32(uint32(index))
+	}
+
+	have, err := keys(fd, MAC_LEN)
+	if err != nil {
+		return err
+	}
+	for _, k := range have {
+		if _, ok := want[string(k)]; !ok {
+			if err := deleteElem(fd, k); err != nil && err != syscall.ENOENT {
+				return fmt.Errorf("deleting stale pod: %w", err)
+			}
+		}
+	}
+	for k, v := range want {
+		if err := updateElem(fd, []byte(k), v); err != nil {
+			return fmt.Errorf("adding pod: %w", err)
+		}
+	}
+	return nil
+}
+
+func mountBpffs() error {
+	var st syscall.Statfs_t
+	if err := syscall.Statfs(BPF_FS_PATH, &st); err == nil && uint32(st.Type) == BPF_FS_MAGIC {
+		return nil
+	}
+	if err := os.MkdirAll(BPF_FS_PATH, 0o755); err != nil {
+		return err
+	}
+	if err := syscall.Mount("bpf", BPF_FS_PATH, "bpf", 0, "mode=0700"); err != nil {
+		return fmt.Errorf("mounting bpffs on %s: %w", BPF_FS_PATH, err)
+	}
+	return nil
+}
@@ -5,10 +5,21 @@ import (
 	"fmt"
 	"os"
 	"os/signal"
+	"strconv"
 	"strings"
 	"syscall"
+	"time"
 
+	"github.com/felipeek/sknf/sknf-app/internal/dns"
+	"github.com/felipeek/sknf/sknf-app/internal/link"
+	"github.com/felipeek/sknf/sknf-app/internal/metrics"
+	"github.com/felipeek/sknf/sknf-app/internal/policy"
+	"github.com/felipeek/sknf/sknf-app/internal/probe"
+	"github.com/felipeek/sknf/sknf-app/internal/proxy"
+	"github.com/felipeek/sknf/sknf-app/internal/reconcile"
+	"github.com/felipeek/sknf/sknf-app/internal/underlay"
 	"github.com/felipeek/sknf/sknf-app/internal/util"
+	"github.com/felipeek/sknf/sknf-app/internal/xdp"
 
 	metav1 "k8s.io/apimachinery/pkg/apis/meta/v1"
 	"k8s.io/client-go/kubernetes"
@@ -20,12 +31,38 @@ const CNI_PLUGIN_CONF_CONTAINER_PATH_ENV_KEY = "CNI_PLUGIN_CONF_PATH"
 const CLUSTER_CIDR_ENV_KEY = "CLUSTER_CIDR"
 const HOST_PHYSICAL_IF_ENV_KEY = "HOST_PHYSICAL_IF"
 const NODE_NAME_ENV_KEY = "NODE_NAME"
+const METRICS_ADDR_ENV_KEY = "METRICS_ADDR"
+const METRICS_INTERVAL_ENV_KEY = "METRICS_INTERVAL"
+const SERVICE_PROXY_ENV_KEY = "SERVICE_PROXY"
+const POD_INTERFACE_ENV_KEY = "POD_INTERFACE"
+const POD_ATTACH_ENV_KEY = "POD_ATTACH"
+const PROBE_MESH_ENV_KEY = "PROBE_MESH"
+const PROBE_INTERVAL_ENV_KEY = "PROBE_INTERVAL"
+const PROBE_FANOUT_ENV_KEY = "PROBE_FANOUT"
+const XDP_DECAP_ENV_KEY = "XDP_DECAP"
+const UNDERLAY_IFS_ENV_KEY = "UNDERLAY_IFS"
+const NODE_LOCAL_DNS_ENV_KEY = "NODE_LOCAL_DNS"
+const NODE_LOCAL_DNS_SERVICE_ENV_KEY = "NODE_LOCAL_DNS_SERVICE"
 
 const CNI_PLUGIN_BINARY_CONTAINER_PATH_DEFAULT = "sknf-cni/bin/sknf-cni"
 const CNI_PLUGIN_CONF_CONTAINER_PATH_DEFAULT = "sknf-cni/conf/sknf-conf.json"
 
 const CNI_PLUGIN_BINARY_HOST_PATH = "/host/opt/cni/bin/sknf-cni"
 const CNI_PLUGIN_CONF_HOST_PATH = "/host/etc/cni/net.d/sknf-conf.json"
+const CNI_PLUGIN_IPAM_STATE_HOST_PATH = "/host/tmp/sknf-cni-ips"
+const CNI_PLUGIN_READY_MARKER_HOST_PATH = "/host/tmp/sknf-cni-ready"
+
+// The boot id is not namespaced: this is the node's
+const BOOT_ID_PATH = "/proc/sys/kernel/random/boot_id"
+
+const METRICS_INTERVAL_DEFAULT = 15 * time.Second
+
+const POD_INTERFACE_AUTO = "auto"
+const POD_INTERFACE_NETKIT = "netkit"
+const POD_INTERFACE_VETH = "veth"
+
+const POD_ATTACH_BRIDGE = "bridge"
+const POD_ATTACH_ROUTED = "routed"
 
 func main() {
 	nodeName := os.Getenv(NODE_NAME_ENV_KEY)
@@ -33,6 +70,7 @@ func main() {
 	cniPluginConfContainerPath := os.Getenv(CNI_PLUGIN_CONF_CONTAINER_PATH_ENV_KEY)
 	clusterCidr := os.Getenv(CLUSTER_CIDR_ENV_KEY)
 	hostPhysicalIf := os.Getenv(HOST_PHYSICAL_IF_ENV_KEY)
+	metricsAddr := os.Getenv(METRICS_ADDR_ENV_KEY)
 
 	if nodeName == "" {
 		fmt.Fprintf(os.Stderr, "[sknf] Missing env var %s\n", NODE_NAME_ENV_KEY)
@@ -57,6 +95,63 @@ func main() {
 		cniPluginConfContainerPath = CNI_PLUGIN_CONF_CONTAINER_PATH_DEFAULT
 	}
 
+	metricsInterval := METRICS_INTERVAL_DEFAULT
+	if v := os.Getenv(METRICS_INTERVAL_ENV_KEY); v != "" {
+		d, err := time.ParseDuration(v)
+		if err != nil || d <= 0 {
+			fmt.Fprintf(os.Stderr, "[sknf] Invalid %s %q\n", METRICS_INTERVAL_ENV_KEY, v)
+			os.Exit(1)
+		}
+		metricsInterval = d
+	}
+
+	probeInterval := probe.PROBE_INTERVAL_DEFAULT
+	if v := os.Getenv(PROBE_INTERVAL_ENV_KEY); v != "" {
+		d, err := time.ParseDuration(v)
+		if err != nil || d <= 0 {
+			fmt.Fprintf(os.Stderr, "[sknf] Invalid %s %q\n", PROBE_INTERVAL_ENV_KEY, v)
+			os.Exit(1)
+		}
+		probeInterval = d
+	}
+
+	probeFanout := probe.PROBE_FANOUT_DEFAULT
+	if v := os.Getenv(PROBE_FANOUT_ENV_KEY); v != "" {
+		n, err := strconv.Atoi(v)
+		if err != nil || n <= 0 {
+			fmt.Fprintf(os.Stderr, "[sknf] Invalid %s %q\n", PROBE_FANOUT_ENV_KEY, v)
+			os.Exit(1)
+		}
+		probeFanout = n
+	}
+
+	podAttach := os.Getenv(POD_ATTACH_ENV_KEY)
+	if podAttach == "" {
+		podAttach = POD_ATTACH_BRIDGE
+	} else if podAttach != POD_ATTACH_BRIDGE && podAttach != POD_ATTACH_ROUTED {
+		fmt.Fprintf(os.Stderr, "[sknf] Invalid %s %q, expected %s or %s\n", POD_ATTACH_ENV_KEY, podAttach,
+			POD_ATTACH_BRIDGE, POD_ATTACH_ROUTED)
+		os.Exit(1)
+	}
+
+	podInterface, err := SelectPodInterface(os.Getenv(POD_INTERFACE_ENV_KEY))
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] %v\n", err)
+		os.Exit(1)
+	}
+
+	xdpDecap, err := SelectXdpDecap(os.Getenv(XDP_DECAP_ENV_KEY), podInterface)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] %v\n", err)
+		os.Exit(1)
+	}
+
+	underlayIfs, err := underlay.ParseIfs(os.Getenv(UNDERLAY_IFS_ENV_KEY), hostPhysicalIf)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Invalid %s: %v\n", UNDERLAY_IFS_ENV_KEY, err)
+		os.Exit(1)
+	}
+
 	// Load in-cluster configuration
 	cfg, err := rest.InClusterConfig()
 	if err != nil {
@@ -78,6 +173,7 @@ func main() {
 
 	fmt.Printf("Node name: %s\n", nodeName)
 	fmt.Printf("Pod CIDR: %s\n", podCidr)
+	fmt.Printf("Pod interface: %s (%s)\n", podInterface, podAttach)
 
 	err = util.Copy(cniPluginBinaryContainerPath, CNI_PLUGIN_BINARY_HOST_PATH, 0o755)
 	if err != nil {
@@ -93,7 +189,72 @@ func main() {
 		os.Exit(1)
 	}
 
-	cniPluginConfData := ReplaceVariables(cniPluginConfTemplate, podCidr, clusterCidr, hostPhysicalIf)
+	// the kubelet reports the node ready once the CNI configuration is installed, so existing pods and the
+	// IPAM state are reconciled before that
+	report, err := reconcile.Run(reconcile.Config{
+		Subnet:         podCidr,
+		ClusterCidr:    clusterCidr,
+		HostPhysicalIf: hostPhysicalIf,
+		IpamStatePath:  CNI_PLUGIN_IPAM_STATE_HOST_PATH,
+		RoutedPods:     podAttach == POD_ATTACH_ROUTED,
+	})
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure reconciling node network state: %v\n", err)
+		os.Exit(1)
+	}
+	for _, repair := range report.Repairs {
+		fmt.Printf("[sknf] Reconcile: %s\n", repair)
+	}
+	fmt.Printf("[sknf] Reconciled %d pods in %s\n", report.Pods, report.Duration)
+
+	// the pod map is filled from the reconciled pods before sknf-cni is told to maintain it. Pods with an
+	// ingress rate are left out, as sknf-cni does: a redirect would skip the tbf of their host interface.
+	decapLinks := make(map[string]int32, len(report.PodLinks))
+	for ip, index := range report.PodLinks {
+		if !report.ShapedLinks[index] {
+			decapLinks[ip] = index
+		}
+	}
+	decap, err := xdp.Setup(xdp.Config{
+		Mode:           xdpDecap,
+		HostPhysicalIf: hostPhysicalIf,
+		Vni:            reconcile.HOST_VXLAN_VNI_ID,
+		Port:           reconcile.HOST_VXLAN_PORT,
+	}, decapLinks)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure setting up the XDP decap fast path, disabled: %v\n", err)
+		xdpDecap = xdp.MODE_OFF
+	} else if decap != nil {
+		fmt.Printf("[sknf] XDP decap fast path attached to %s (%s)\n", hostPhysicalIf, xdpDecap)
+	}
+
+	// frames netkit pods send to the pods of other nodes skip the bridge, except for pods shaped on egress,
+	// whose frames must reach the redirect to their ifb (see the xdp package)
+	forward, err := xdp.SetupForward(xdp.ForwardConfig{
+		Enabled:     podInterface == POD_INTERFACE_NETKIT && podAttach == POD_ATTACH_BRIDGE,
+		Subnet:      podCidr,
+		ClusterCidr: clusterCidr,
+		VxlanIf:     reconcile.HOST_VXLAN_NAME,
+	}, report.NetkitLinks)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure setting up the netkit forwarding program, disabled: %v\n", err)
+	} else if forward != nil {
+		fmt.Println("[sknf] Netkit forwarding program attached to the pods not shaped on egress")
+	}
+
+	// vxsknf exists once the node is reconciled
+	underlayCfg := underlay.Config{
+		HostPhysicalIf: hostPhysicalIf,
+		Ifs:            underlayIfs,
+		VxlanIf:        reconcile.HOST_VXLAN_NAME,
+		VxlanPort:      reconcile.HOST_VXLAN_PORT,
+	}
+	if err := underlay.Setup(underlayCfg); err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure setting up the underlays, only %s is used: %v\n", hostPhysicalIf, err)
+		underlayIfs = nil
+	}
+
+	cniPluginConfData := ReplaceVariables(cniPluginConfTemplate, podCidr, clusterCidr, hostPhysicalIf, podInterface, podAttach, xdpDecap)
 
 	err = util.WriteStringToFile(CNI_PLUGIN_CONF_HOST_PATH, cniPluginConfData)
 	if err != nil {
@@ -101,23 +262,154 @@ func main() {
 		os.Exit(1)
 	}
 
-	fmt.Println("[sknf] Install complete; entering wait loop")
+	// sknf-cni answers STATUS with ready from now on, until the node reboots (see cmd_status in sknf-cni/src/cmd.c)
+	bootId, err := util.ReadFileToString(BOOT_ID_PATH)
+	if err == nil {
+		err = util.WriteStringToFile(CNI_PLUGIN_READY_MARKER_HOST_PATH, bootId)
+	}
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure writing readiness marker to %s: %v\n", CNI_PLUGIN_READY_MARKER_HOST_PATH, err)
+		os.Exit(1)
+	}
 
 	// Handle SIGTERM/SIGINT for clean shutdowns
 	ctx, stop := signal.NotifyContext(context.Background(), syscall.SIGTERM, syscall.SIGINT)
 	defer stop()
+
+	// re-installs the routes of underlays that come back up
+	if len(underlayIfs) > 0 {
+		go underlay.Watch(ctx, underlayCfg)
+	}
+
+	var metricsSources []metrics.Source
+
+	// the prober is attached to brsknf, which exists once the node is reconciled
+	if os.Getenv(PROBE_MESH_ENV_KEY) == "true" {
+		prober, err := probe.New(probe.Config{
+			NodeName:    nodeName,
+			Subnet:      podCidr,
+			ClusterCidr: clusterCidr,
+			Interval:    probeInterval,
+			Fanout:      probeFanout,
+		})
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure setting up the prober, probe mesh disabled: %v\n", err)
+		} else {
+			go probe.WatchNodes(ctx, clientset, prober)
+			go prober.Run(ctx)
+			metricsSources = append(metricsSources, prober)
+		}
+	}
+
+	// pods keep querying the DNS service ClusterIP, which the cache takes over on this node
+	var dnsCache *dns.Forwarder
+	if os.Getenv(NODE_LOCAL_DNS_ENV_KEY) == "true" {
+		service := os.Getenv(NODE_LOCAL_DNS_SERVICE_ENV_KEY)
+		if service == "" {
+			service = dns.SERVICE_DEFAULT
+		}
+		dnsCache, err = dns.Start(ctx, clientset, service, report.BridgeIP)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "[sknf] Failure setting up the node-local DNS cache, disabled: %v\n", err)
+		} else {
+			fmt.Printf("[sknf] Node-local DNS cache answering for %s\n", service)
+			metricsSources = append(metricsSources, dnsCache)
+		}
+	} else if err := dns.Teardown(); err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure removing the node-local DNS redirect: %v\n", err)
+	}
+
+	if metricsAddr != "" {
+		kernelCollector := metrics.NewKernelCollector(metrics.KernelConfig{
+			Subnet:        podCidr,
+			IpamStatePath: CNI_PLUGIN_IPAM_STATE_HOST_PATH,
+			Interval:      metricsInterval,
+			RoutedPods:    podAttach == POD_ATTACH_ROUTED,
+		})
+		go kernelCollector.Run(ctx)
+		go metrics.Serve(ctx, metricsAddr, append([]metrics.Source{kernelCollector}, metricsSources...)...)
+	}
+
+	// pods selected by a policy are left to the normal path, where the policy chains see their traffic
+	// both fast paths share the isolated pod map, so either one updates it
+	var isolation policy.IsolationSink
+	if decap != nil {
+		isolation = decap
+	} else if forward != nil {
+		isolation = forward
+	}
+	go policy.Run(ctx, clientset, nodeName, isolation)
+
+	// ClusterIP services are left to kube-proxy unless asked otherwise
+	if os.Getenv(SERVICE_PROXY_ENV_KEY) == "true" {
+		go proxy.Run(ctx, clientset)
+	}
+
+	fmt.Println("[sknf] Install complete; entering wait loop")
+
 	<-ctx.Done()
 	fmt.Println("[sknf] Received shutdown signal, exiting")
+	// pod DNS traffic goes back to the DNS service until the next start
+	if dnsCache != nil {
+		dnsCache.Close()
+	}
 }
 
-func ReplaceVariables(text, subnet, clusterCidr, hostPhysicalIf string) string {
+func ReplaceVariables(text, subnet, clusterCidr, hostPhysicalIf, podInterface, podAttach, xdpDecap string) string {
 	return strings.NewReplacer(
 		"{{SUBNET}}", subnet,
 		"{{CLUSTER_CIDR}}", clusterCidr,
 		"{{HOST_PHYSICAL_IF}}", hostPhysicalIf,
+		"{{POD_INTERFACE}}", podInterface,
+		"{{POD_ATTACH}}", podAttach,
+		"{{XDP_DECAP}}", xdpDecap,
 	).Replace(text)
 }
 
+// SelectXdpDecap resolves the XDP_DECAP setting: "off" (the default), "generic" or "native". Native
+// redirects need the target to implement ndo_xdp_xmit, which netkit does not, so netkit pods get generic.
+func SelectXdpDecap(setting, podInterface string) (string, error) {
+	switch setting {
+	case "", xdp.MODE_OFF:
+		return xdp.MODE_OFF, nil
+	case xdp.MODE_GENERIC:
+		return xdp.MODE_GENERIC, nil
+	case xdp.MODE_NATIVE:
+		if podInterface == POD_INTERFACE_NETKIT {
+			fmt.Println("[sknf] Native XDP cannot redirect to netkit pods, using generic XDP decap")
+			return xdp.MODE_GENERIC, nil
+		}
+		return xdp.MODE_NATIVE, nil
+	}
+	return "", fmt.Errorf("invalid %s %q, expected %s, %s or %s", XDP_DECAP_ENV_KEY, setting,
+		xdp.MODE_OFF, xdp.MODE_GENERIC, xdp.MODE_NATIVE)
+}
+
+// SelectPodInterface resolves the POD_INTERFACE setting to the kind of pair sknf-cni creates for pods.
+// "auto" (the default) and "netkit" use netkit pairs when the kernel supports them and veth otherwise;
+// "veth" skips the probe.
+func SelectPodInterface(setting string) (string, error) {
+	switch setting {
+	case POD_INTERFACE_VETH:
+		return POD_INTERFACE_VETH, nil
+	case "", POD_INTERFACE_AUTO, POD_INTERFACE_NETKIT:
+	default:
+		return "", fmt.Errorf("invalid %s %q, expected %s, %s or %s", POD_INTERFACE_ENV_KEY, setting,
+			POD_INTERFACE_AUTO, POD_INTERFACE_NETKIT, POD_INTERFACE_VETH)
+	}
+
+	supported, err := link.NetkitSupported()
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "[sknf] Failure probing netkit support, using veth: %v\n", err)
+		return POD_INTERFACE_VETH, nil
+	}
+	if !supported {
+		fmt.Println("[sknf] Kernel does not support netkit, using veth for pod interfaces")
+		return POD_INTERFACE_VETH, nil
+	}
+	return POD_INTERFACE_NETKIT, nil
+}
+
 func GetNodePodCidr(clientset *kubernetes.Clientset, nodeName string) (string, error) {
 	node, err := clientset.CoreV1().Nodes().Get(context.Background(), nodeName, metav1.GetOptions{})
 	if err != nil {
@@ -1,9 +1,15 @@
 #include "args.h"
 
+#include <arpa/inet.h>
 #include <json-c/json.h>
+#include <netinet/in.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
 #include <memory.h>
 #include "def.h"
+#include "io.h"
+#include "json_scan.h"
 
 #define CNI_COMMAND_ENV_VAR_NAME "CNI_COMMAND"
 #define CNI_CONTAINERID_ENV_VAR_NAME "CNI_CONTAINERID"
@@ -17,19 +23,411 @@
 #define SUBNET_STDIN_JSON_KEY "subnet"
 #define CLUSTER_CIDR_STDIN_JSON_KEY "clusterCidr"
 #define HOST_PHYSICAL_INTERFACE_STDIN_JSON_KEY "hostPhysicalInterface"
+#define POD_INTERFACE_STDIN_JSON_KEY "podInterface"
+#define POD_ATTACH_STDIN_JSON_KEY "podAttach"
+#define XDP_DECAP_STDIN_JSON_KEY "xdpDecap"
 #define PREV_RESULT_STDIN_JSON_KEY "prevResult"
+#define RUNTIME_CONFIG_STDIN_JSON_KEY "runtimeConfig"
+#define SYSCTLS_STDIN_JSON_KEY "sysctls"
+#define EGRESS_IPS_STDIN_JSON_KEY "egressIPs"
+#define EGRESS_PORT_RANGE_STDIN_JSON_KEY "egressPortRange"
+#define CONTAINERS_STDIN_JSON_KEY "containers"
+#define VALID_ATTACHMENTS_STDIN_JSON_KEY "cni.dev/valid-attachments"
+
+#define CONTAINER_ID_CONTAINER_JSON_KEY "containerId"
+#define NETNS_CONTAINER_JSON_KEY "netns"
+#define IF_NAME_CONTAINER_JSON_KEY "ifName"
+
+#define CONTAINER_ID_ATTACHMENT_JSON_KEY "containerID"
+#define IF_NAME_ATTACHMENT_JSON_KEY "ifname"
+
+#define IPS_RESULT_JSON_KEY "ips"
+#define ADDRESS_RESULT_JSON_KEY "address"
+
+#define BANDWIDTH_RUNTIME_CONFIG_JSON_KEY "bandwidth"
+#define INGRESS_RATE_BANDWIDTH_JSON_KEY "ingressRate"
+#define INGRESS_BURST_BANDWIDTH_JSON_KEY "ingressBurst"
+#define EGRESS_RATE_BANDWIDTH_JSON_KEY "egressRate"
+#define EGRESS_BURST_BANDWIDTH_JSON_KEY "egressBurst"
+
+#define PORT_MAPPINGS_RUNTIME_CONFIG_JSON_KEY "portMappings"
+#define HOST_PORT_PORT_MAPPING_JSON_KEY "hostPort"
+#define CONTAINER_PORT_PORT_MAPPING_JSON_KEY "containerPort"
+#define PROTOCOL_PORT_MAPPING_JSON_KEY "protocol"
+#define HOST_IP_PORT_MAPPING_JSON_KEY "hostIP"
+
+static FILE* mock_stdin_input() {
+	return fopen("conf/conf.json", "r");
+}
 
-// TODO: dynamic buffer
-#define INPUT_BUFFER_SIZE (64 * 1024)
-char input_buffer[INPUT_BUFFER_SIZE];
+// Parses a value sknf uses into a json-c object, owned by 'args' until args_free
+static struct json_object* parse_json_value(struct Args* args, struct JsonSpan value) {
+	if (args->json_value_count == ARGS_MAX_JSON_VALUES) {
+		fprintf(stderr, "Failure: too many JSON values\n");
+		return NULL;
+	}
 
-static void mock_stdin_input() {
-	FILE* f = fopen("conf/conf.json", "r");
-	fread(input_buffer, INPUT_BUFFER_SIZE, 1, f);
-	fclose(f);
+	struct json_tokener* tok = json_tokener_new();
+	if (!tok) {
+		fprintf(stderr, "Failure: unable to allocate JSON tokener\n");
+		return NULL;
+	}
+
+	struct json_object* obj = json_tokener_parse_ex(tok, value.start, (int)value.len);
+	if (json_tokener_get_error(tok) != json_tokener_success) {
+		fprintf(stderr, "Failure: invalid JSON value %.*s: %s\n", (int)value.len, value.start,
+			json_tokener_error_desc(json_tokener_get_error(tok)));
+		if (obj) json_object_put(obj);
+		obj = NULL;
+	}
+	json_tokener_free(tok);
+
+	if (obj) {
+		args->json_values[args->json_value_count++] = obj;
+	}
+	return obj;
 }
 
-static int args_validate_add_cmd(struct Args* args) {
+static int parse_bandwidth_value(struct json_object* bandwidth_obj, const char* key, unsigned long long* out) {
+	struct json_object* value_obj;
+	if (!json_object_object_get_ex(bandwidth_obj, key, &value_obj)) {
+		return 0;
+	}
+
+	int64_t value = json_object_get_int64(value_obj);
+	if (value < 0 || (unsigned long long)value > BANDWIDTH_MAX) {
+		fprintf(stderr, "Failure: invalid bandwidth %s %lld\n", key, (long long)value);
+		return 1;
+	}
+
+	*out = (unsigned long long)value;
+	return 0;
+}
+
+static int parse_bandwidth(struct json_object* runtime_config_obj, struct Bandwidth* bandwidth) {
+	struct json_object* bandwidth_obj;
+	if (!json_object_object_get_ex(runtime_config_obj, BANDWIDTH_RUNTIME_CONFIG_JSON_KEY, &bandwidth_obj)) {
+		return 0;
+	}
+
+	if (parse_bandwidth_value(bandwidth_obj, INGRESS_RATE_BANDWIDTH_JSON_KEY, &bandwidth->ingress_rate) ||
+		parse_bandwidth_value(bandwidth_obj, INGRESS_BURST_BANDWIDTH_JSON_KEY, &bandwidth->ingress_burst) ||
+		parse_bandwidth_value(bandwidth_obj, EGRESS_RATE_BANDWIDTH_JSON_KEY, &bandwidth->egress_rate) ||
+		parse_bandwidth_value(bandwidth_obj, EGRESS_BURST_BANDWIDTH_JSON_KEY, &bandwidth->egress_burst)) {
+		return 1;
+	}
+
+	// same rule as the reference bandwidth plugin: rate and burst go together
+	if ((bandwidth->ingress_rate == 0) != (bandwidth->ingress_burst == 0)) {
+		fprintf(stderr, "Failure: ingressRate and ingressBurst must be both set or both unset\n");
+		return 1;
+	}
+
+	if ((bandwidth->egress_rate == 0) != (bandwidth->egress_burst == 0)) {
+		fprintf(stderr, "Failure: egressRate and egressBurst must be both set or both unset\n");
+		return 1;
+	}
+
+	if ((bandwidth->ingress_rate > 0 && bandwidth->ingress_rate < BANDWIDTH_MIN_RATE) ||
+		(bandwidth->egress_rate > 0 && bandwidth->egress_rate < BANDWIDTH_MIN_RATE)) {
+		fprintf(stderr, "Failure: bandwidth rates must be at least %llu bits per second\n", BANDWIDTH_MIN_RATE);
+		return 1;
+	}
+
+	// the result reports these, so they are what gets applied
+	if (bandwidth->ingress_rate > 0 && bandwidth->ingress_burst < BANDWIDTH_MIN_BURST) {
+		bandwidth->ingress_burst = BANDWIDTH_MIN_BURST;
+	}
+	if (bandwidth->egress_rate > 0 && bandwidth->egress_burst < BANDWIDTH_MIN_BURST) {
+		bandwidth->egress_burst = BANDWIDTH_MIN_BURST;
+	}
+
+	return 0;
+}
+
+static int parse_port(struct json_object* mapping_obj, const char* key, unsigned short* out) {
+	struct json_object* port_obj;
+	if (!json_object_object_get_ex(mapping_obj, key, &port_obj)) {
+		fprintf(stderr, "Failure: port mapping without %s\n", key);
+		return 1;
+	}
+
+	int64_t port = json_object_get_int64(port_obj);
+	if (port <= 0 || port > 65535) {
+		fprintf(stderr, "Failure: invalid port mapping %s %lld\n", key, (long long)port);
+		return 1;
+	}
+
+	*out = (unsigned short)port;
+	return 0;
+}
+
+static int parse_port_mapping(struct json_object* mapping_obj, struct PortMapping* mapping) {
+	if (parse_port(mapping_obj, HOST_PORT_PORT_MAPPING_JSON_KEY, &mapping->host_port) ||
+		parse_port(mapping_obj, CONTAINER_PORT_PORT_MAPPING_JSON_KEY, &mapping->container_port)) {
+		return 1;
+	}
+
+	struct json_object* protocol_obj;
+	const char* protocol = "tcp";
+	if (json_object_object_get_ex(mapping_obj, PROTOCOL_PORT_MAPPING_JSON_KEY, &protocol_obj)) {
+		protocol = json_object_get_string(protocol_obj);
+	}
+
+	if (!strcasecmp(protocol, "tcp")) {
+		mapping->protocol = IPPROTO_TCP;
+	} else if (!strcasecmp(protocol, "udp")) {
+		mapping->protocol = IPPROTO_UDP;
+	} else if (!strcasecmp(protocol, "sctp")) {
+		mapping->protocol = IPPROTO_SCTP;
+	} else {
+		fprintf(stderr, "Failure: invalid port mapping protocol %s\n", protocol);
+		return 1;
+	}
+
+	// mappings are installed for every local address; binding to a single one is not supported
+	struct json_object* host_ip_obj;
+	if (json_object_object_get_ex(mapping_obj, HOST_IP_PORT_MAPPING_JSON_KEY, &host_ip_obj)) {
+		const char* host_ip = json_object_get_string(host_ip_obj);
+		if (host_ip && strcmp(host_ip, "") && strcmp(host_ip, "0.0.0.0")) {
+			fprintf(stderr, "Failure: port mapping %s is not supported\n", HOST_IP_PORT_MAPPING_JSON_KEY);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_port_mappings(struct json_object* runtime_config_obj, struct Args* args) {
+	struct json_object* mappings_obj;
+	if (!json_object_object_get_ex(runtime_config_obj, PORT_MAPPINGS_RUNTIME_CONFIG_JSON_KEY, &mappings_obj)) {
+		return 0;
+	}
+
+	if (json_object_get_type(mappings_obj) != json_type_array) {
+		fprintf(stderr, "Failure: %s must be an array\n", PORT_MAPPINGS_RUNTIME_CONFIG_JSON_KEY);
+		return 1;
+	}
+
+	size_t n = json_object_array_length(mappings_obj);
+	if (n > MAX_PORT_MAPPINGS) {
+		fprintf(stderr, "Failure: more than %d port mappings\n", MAX_PORT_MAPPINGS);
+		return 1;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (parse_port_mapping(json_object_array_get_idx(mappings_obj, i), &args->port_mappings[args->port_mapping_count++])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_egress_ips(struct json_object* ips_obj, struct Snat* snat) {
+	if (json_object_get_type(ips_obj) != json_type_array) {
+		fprintf(stderr, "Failure: %s must be an array\n", EGRESS_IPS_STDIN_JSON_KEY);
+		return 1;
+	}
+
+	size_t n = json_object_array_length(ips_obj);
+	if (n > MAX_EGRESS_IPS) {
+		fprintf(stderr, "Failure: more than %d egress IPs\n", MAX_EGRESS_IPS);
+		return 1;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		const char* ip = json_object_get_string(json_object_array_get_idx(ips_obj, i));
+		struct in_addr addr;
+		if (!ip || inet_pton(AF_INET, ip, &addr) != 1) {
+			fprintf(stderr, "Failure: invalid egress IP %s\n", ip ? ip : "(null)");
+			return 1;
+		}
+		snat->ips[snat->ip_count++] = ip;
+	}
+
+	return 0;
+}
+
+// "<min>-<max>", e.g. "1024-65535"
+static int parse_egress_port_range(struct json_object* range_obj, struct Snat* snat) {
+	const char* range = json_object_get_string(range_obj);
+	unsigned min, max;
+	char trailing;
+	if (!range || sscanf(range, "%u-%u%c", &min, &max, &trailing) != 2 || min == 0 || min > max || max > 65535) {
+		fprintf(stderr, "Failure: invalid %s %s\n", EGRESS_PORT_RANGE_STDIN_JSON_KEY, range ? range : "(null)");
+		return 1;
+	}
+
+	snat->port_min = (unsigned short)min;
+	snat->port_max = (unsigned short)max;
+	return 0;
+}
+
+static int parse_sysctls(struct json_object* sysctls_obj, struct Args* args) {
+	if (json_object_get_type(sysctls_obj) != json_type_object) {
+		fprintf(stderr, "Failure: %s must be an object\n", SYSCTLS_STDIN_JSON_KEY);
+		return 1;
+	}
+
+	json_object_object_foreach(sysctls_obj, name, value_obj) {
+		if (strncmp(name, "net.", 4) || strchr(name, '/')) {
+			fprintf(stderr, "Failure: sysctl %s is not a network namespace sysctl\n", name);
+			return 1;
+		}
+
+		if (args->sysctl_count == MAX_SYSCTLS) {
+			fprintf(stderr, "Failure: more than %d sysctls\n", MAX_SYSCTLS);
+			return 1;
+		}
+
+		args->sysctls[args->sysctl_count].name = name;
+		args->sysctls[args->sysctl_count].value = json_object_get_string(value_obj);
+		args->sysctl_count++;
+	}
+
+	return 0;
+}
+
+static const char* container_string(struct json_object* container_obj, const char* key) {
+	struct json_object* value_obj;
+	if (!json_object_object_get_ex(container_obj, key, &value_obj) || json_object_get_type(value_obj) != json_type_string) {
+		fprintf(stderr, "Failure: container without %s\n", key);
+		return NULL;
+	}
+	return json_object_get_string(value_obj);
+}
+
+static int parse_containers(struct json_object* containers_obj, struct Args* args) {
+	if (json_object_get_type(containers_obj) != json_type_array) {
+		fprintf(stderr, "Failure: %s must be an array\n", CONTAINERS_STDIN_JSON_KEY);
+		return 1;
+	}
+
+	size_t n = json_object_array_length(containers_obj);
+	if (n > MAX_BATCH_CONTAINERS) {
+		fprintf(stderr, "Failure: more than %d containers\n", MAX_BATCH_CONTAINERS);
+		return 1;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		struct json_object* container_obj = json_object_array_get_idx(containers_obj, i);
+		struct BatchContainer* container = &args->batch_containers[args->batch_container_count++];
+		container->containerid = container_string(container_obj, CONTAINER_ID_CONTAINER_JSON_KEY);
+		container->netns = container_string(container_obj, NETNS_CONTAINER_JSON_KEY);
+		container->ifname = container_string(container_obj, IF_NAME_CONTAINER_JSON_KEY);
+		if (!container->containerid || !container->netns || !container->ifname) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// The list can hold every attachment of the node, so it is not bounded like the containers of a batch
+static int parse_valid_attachments(struct json_object* attachments_obj, struct Args* args) {
+	if (json_object_get_type(attachments_obj) != json_type_array) {
+		fprintf(stderr, "Failure: %s must be an array\n", VALID_ATTACHMENTS_STDIN_JSON_KEY);
+		return 1;
+	}
+
+	size_t n = json_object_array_length(attachments_obj);
+	args->valid_attachments = malloc((n ? n : 1) * sizeof(struct Attachment));
+	if (!args->valid_attachments) {
+		fprintf(stderr, "Failure: out of memory parsing %s\n", VALID_ATTACHMENTS_STDIN_JSON_KEY);
+		return 1;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		struct json_object* attachment_obj = json_object_array_get_idx(attachments_obj, i);
+		struct Attachment* attachment = &args->valid_attachments[args->valid_attachment_count++];
+		attachment->containerid = container_string(attachment_obj, CONTAINER_ID_ATTACHMENT_JSON_KEY);
+		attachment->ifname = container_string(attachment_obj, IF_NAME_ATTACHMENT_JSON_KEY);
+		if (!attachment->containerid || !attachment->ifname) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Only 'ips' is parsed; the rest of prevResult (which may be large with chained plugins) is left as text
+static int parse_prev_result(struct Args* args, struct JsonSpan prev_result) {
+	struct JsonSpan ips;
+	struct JsonMember members[] = {
+		{ IPS_RESULT_JSON_KEY, &ips },
+	};
+
+	if (js_scan_object(prev_result, members, sizeof(members) / sizeof(members[0]))) {
+		fprintf(stderr, "Failure: malformed %s\n", PREV_RESULT_STDIN_JSON_KEY);
+		return 1;
+	}
+
+	args->prev_result = prev_result.start;
+	args->prev_result_len = prev_result.len;
+
+	if (!ips.start) {
+		return 0;
+	}
+
+	struct json_object* ips_obj = parse_json_value(args, ips);
+	struct json_object* address_obj;
+	if (!ips_obj) {
+		return 1;
+	}
+
+	if (json_object_get_type(ips_obj) != json_type_array ||
+		json_object_array_length(ips_obj) == 0) {
+		return 0;
+	}
+
+	if (json_object_object_get_ex(json_object_array_get_idx(ips_obj, 0), ADDRESS_RESULT_JSON_KEY, &address_obj)) {
+		args->prev_result_cidr = json_object_get_string(address_obj);
+	}
+
+	return 0;
+}
+
+static int parse_pod_interface(const char* value, enum PodInterface* pod_interface) {
+	if (value && !strcmp(value, "veth")) {
+		*pod_interface = POD_INTERFACE_VETH;
+	} else if (value && !strcmp(value, "netkit")) {
+		*pod_interface = POD_INTERFACE_NETKIT;
+	} else {
+		fprintf(stderr, "Failure: %s must be \"veth\" or \"netkit\"\n", POD_INTERFACE_STDIN_JSON_KEY);
+		return 1;
+	}
+	return 0;
+}
+
+static int parse_pod_attach(const char* value, enum PodAttach* pod_attach) {
+	if (value && !strcmp(value, "bridge")) {
+		*pod_attach = POD_ATTACH_BRIDGE;
+	} else if (value && !strcmp(value, "routed")) {
+		*pod_attach = POD_ATTACH_ROUTED;
+	} else {
+		fprintf(stderr, "Failure: %s must be \"bridge\" or \"routed\"\n", POD_ATTACH_STDIN_JSON_KEY);
+		return 1;
+	}
+	return 0;
+}
+
+static int parse_xdp_decap(const char* value, enum XdpDecap* xdp_decap) {
+	if (value && !strcmp(value, "off")) {
+		*xdp_decap = XDP_DECAP_OFF;
+	} else if (value && !strcmp(value, "generic")) {
+		*xdp_decap = XDP_DECAP_GENERIC;
+	} else if (value && !strcmp(value, "native")) {
+		*xdp_decap = XDP_DECAP_NATIVE;
+	} else {
+		fprintf(stderr, "Failure: %s must be \"off\", \"generic\" or \"native\"\n", XDP_DECAP_STDIN_JSON_KEY);
+		return 1;
+	}
+	return 0;
+}
+
+// Network configuration shared by ADD and ADD_BATCH
+static int args_validate_conf(struct Args* args) {
 	if (args->cni_version == NULL) {
 		fprintf(stderr, "Failure: missing CNI version\n");
 		return 1;
@@ -65,6 +463,19 @@ static int args_validate_add_cmd(struct Args* args) {
 		return 1;
 	}
 
+	if (args->cni_path == NULL) {
+		fprintf(stderr, "Failure: missing CNI path\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int args_validate_add_cmd(struct Args* args) {
+	if (args_validate_conf(args)) {
+		return 1;
+	}
+
 	if (args->cni_containerid == NULL) {
 		fprintf(stderr, "Failure: missing CNI containerid\n");
 		return 1;
@@ -80,67 +491,212 @@ static int args_validate_add_cmd(struct Args* args) {
 		return 1;
 	}
 
-	if (args->cni_path == NULL) {
-		fprintf(stderr, "Failure: missing CNI path\n");
+	return 0;
+}
+
+// The containers of a batch take the place of CNI_CONTAINERID, CNI_NETNS and CNI_IFNAME. Port mappings
+// would map the same hostPort to every container, so they are left to single ADDs.
+static int args_validate_add_batch_cmd(struct Args* args) {
+	if (args_validate_conf(args)) {
+		return 1;
+	}
+
+	if (args->batch_container_count == 0) {
+		fprintf(stderr, "Failure: missing %s\n", CONTAINERS_STDIN_JSON_KEY);
+		return 1;
+	}
+
+	if (args->port_mapping_count > 0) {
+		fprintf(stderr, "Failure: port mappings are not supported by %s\n", CNI_CMD_ADD_BATCH);
 		return 1;
 	}
 
 	return 0;
 }
 
+// STATUS checks the node against the network configuration
+static int args_validate_status_cmd(struct Args* args) {
+	return args_validate_conf(args);
+}
+
 static int args_validate_del_cmd(struct Args* args) {
 	return 0;
 }
 
+// CHECK looks the container up in the IPAM leases and the host interfaces
 static int args_validate_check_cmd(struct Args* args) {
+	if (args->cni_containerid == NULL) {
+		fprintf(stderr, "Failure: missing CNI containerid\n");
+		return 1;
+	}
+
+	if (args->cni_ifname == NULL) {
+		fprintf(stderr, "Failure: missing CNI ifname\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+// Without the list, every attachment of the node would be collected
+static int args_validate_gc_cmd(struct Args* args) {
+	if (args->valid_attachments == NULL) {
+		fprintf(stderr, "Failure: missing %s\n", VALID_ATTACHMENTS_STDIN_JSON_KEY);
+		return 1;
+	}
+
 	return 0;
 }
 
 int args_parse(struct Args* args) {
+	//FILE* input = mock_stdin_input();
+	FILE* input = stdin;
+
+	char* buf;
+	size_t len;
+	if (io_read_stream(input, &buf, &len)) {
+		fprintf(stderr, "Failure: unable to read stdin\n");
+		memset(args, 0, sizeof(struct Args));
+		return 1;
+	}
+
+	return args_parse_input(args, buf, len);
+}
+
+// Same as args_parse, with the plugin input already read; 'input' (malloc'd, NUL-terminated) is owned by
+// 'args' from now on and is modified in place.
+int args_parse_input(struct Args* args, char* input, size_t input_len) {
 	memset(args, 0, sizeof(struct Args));
+	args->input = input;
+	//fprintf(stderr, "%s\n", args->input);
+
+	struct JsonSpan cni_version;
+	struct JsonSpan name;
+	struct JsonSpan type;
+	struct JsonSpan subnet;
+	struct JsonSpan cluster_cidr;
+	struct JsonSpan host_physical_interface;
+	struct JsonSpan pod_interface;
+	struct JsonSpan pod_attach;
+	struct JsonSpan xdp_decap;
+	struct JsonSpan prev_result;
+	struct JsonSpan runtime_config;
+	struct JsonSpan sysctls;
+	struct JsonSpan egress_ips;
+	struct JsonSpan egress_port_range;
+	struct JsonSpan containers;
+	struct JsonSpan valid_attachments;
+
+	// one pass over the top-level members; only the values below are parsed
+	struct JsonMember members[] = {
+		{ CNI_VERSION_STDIN_JSON_KEY, &cni_version },
+		{ NAME_STDIN_JSON_KEY, &name },
+		{ TYPE_STDIN_JSON_KEY, &type },
+		{ SUBNET_STDIN_JSON_KEY, &subnet },
+		{ CLUSTER_CIDR_STDIN_JSON_KEY, &cluster_cidr },
+		{ HOST_PHYSICAL_INTERFACE_STDIN_JSON_KEY, &host_physical_interface },
+		{ POD_INTERFACE_STDIN_JSON_KEY, &pod_interface },
+		{ POD_ATTACH_STDIN_JSON_KEY, &pod_attach },
+		{ XDP_DECAP_STDIN_JSON_KEY, &xdp_decap },
+		{ PREV_RESULT_STDIN_JSON_KEY, &prev_result },
+		{ RUNTIME_CONFIG_STDIN_JSON_KEY, &runtime_config },
+		{ SYSCTLS_STDIN_JSON_KEY, &sysctls },
+		{ EGRESS_IPS_STDIN_JSON_KEY, &egress_ips },
+		{ EGRESS_PORT_RANGE_STDIN_JSON_KEY, &egress_port_range },
+		{ CONTAINERS_STDIN_JSON_KEY, &containers },
+		{ VALID_ATTACHMENTS_STDIN_JSON_KEY, &valid_attachments },
+	};
+
+	struct JsonSpan document = { args->input, input_len };
+	if (js_scan_object(document, members, sizeof(members) / sizeof(members[0]))) {
+		fprintf(stderr, "Failure: malformed JSON input\n");
+		args_free(args);
+		return 1;
+	}
 
-	size_t n = fread(input_buffer, 1, sizeof(input_buffer) - 1, stdin);
-	input_buffer[n] = '\0';
+	args->cni_version = js_string(&cni_version);
+	args->name = js_string(&name);
+	args->type = js_string(&type);
+	args->subnet = js_string(&subnet);
+	args->cluster_cidr = js_string(&cluster_cidr);
+	args->host_physical_interface = js_string(&host_physical_interface);
 
-	//mock_stdin_input();
-	//fprintf(stderr, "%s\n", input_buffer);
+	if (pod_interface.start) {
+		if (parse_pod_interface(js_string(&pod_interface), &args->pod_interface)) {
+			args_free(args);
+			return 1;
+		}
+	}
 
-	args->json_input = json_tokener_parse(input_buffer);
+	if (pod_attach.start) {
+		if (parse_pod_attach(js_string(&pod_attach), &args->pod_attach)) {
+			args_free(args);
+			return 1;
+		}
+	}
 
-	struct json_object* cni_version_obj;
-	struct json_object* name_obj;
-	struct json_object* type_obj;
-	struct json_object* subnet_obj;
-	struct json_object* cluster_cidr_obj;
-	struct json_object* host_physical_interface_obj;
-	struct json_object* prev_result_obj;
+	if (xdp_decap.start) {
+		if (parse_xdp_decap(js_string(&xdp_decap), &args->xdp_decap)) {
+			args_free(args);
+			return 1;
+		}
+	}
 
-	if (json_object_object_get_ex(args->json_input, CNI_VERSION_STDIN_JSON_KEY, &cni_version_obj)) {
-		args->cni_version = json_object_get_string(cni_version_obj);
+	if (prev_result.start) {
+		if (parse_prev_result(args, prev_result)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
-	if (json_object_object_get_ex(args->json_input, NAME_STDIN_JSON_KEY, &name_obj)) {
-		args->name = json_object_get_string(name_obj);
+	if (runtime_config.start) {
+		struct json_object* runtime_config_obj = parse_json_value(args, runtime_config);
+		if (!runtime_config_obj ||
+			parse_bandwidth(runtime_config_obj, &args->bandwidth) ||
+			parse_port_mappings(runtime_config_obj, args)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
-	if (json_object_object_get_ex(args->json_input, TYPE_STDIN_JSON_KEY, &type_obj)) {
-		args->type = json_object_get_string(type_obj);
+	if (sysctls.start) {
+		struct json_object* sysctls_obj = parse_json_value(args, sysctls);
+		if (!sysctls_obj || parse_sysctls(sysctls_obj, args)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
-	if (json_object_object_get_ex(args->json_input, SUBNET_STDIN_JSON_KEY, &subnet_obj)) {
-		args->subnet = json_object_get_string(subnet_obj);
+	if (egress_ips.start) {
+		struct json_object* egress_ips_obj = parse_json_value(args, egress_ips);
+		if (!egress_ips_obj || parse_egress_ips(egress_ips_obj, &args->snat)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
-	if (json_object_object_get_ex(args->json_input, CLUSTER_CIDR_STDIN_JSON_KEY, &cluster_cidr_obj)) {
-		args->cluster_cidr = json_object_get_string(cluster_cidr_obj);
+	if (egress_port_range.start) {
+		struct json_object* egress_port_range_obj = parse_json_value(args, egress_port_range);
+		if (!egress_port_range_obj || parse_egress_port_range(egress_port_range_obj, &args->snat)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
-	if (json_object_object_get_ex(args->json_input, HOST_PHYSICAL_INTERFACE_STDIN_JSON_KEY, &host_physical_interface_obj)) {
-		args->host_physical_interface = json_object_get_string(host_physical_interface_obj);
+	if (containers.start) {
+		struct json_object* containers_obj = parse_json_value(args, containers);
+		if (!containers_obj || parse_containers(containers_obj, args)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
-	if (json_object_object_get_ex(args->json_input, PREV_RESULT_STDIN_JSON_KEY, &prev_result_obj)) {
-		args->prev_result = prev_result_obj;
+	if (valid_attachments.start) {
+		struct json_object* valid_attachments_obj = parse_json_value(args, valid_attachments);
+		if (!valid_attachments_obj || parse_valid_attachments(valid_attachments_obj, args)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
 	args->cni_command = getenv(CNI_COMMAND_ENV_VAR_NAME);
@@ -155,8 +711,10 @@ int args_parse(struct Args* args) {
 		return 1;
 	}
 
-	if (strcmp(args->cni_version, CNI_VERSION)) {
-		fprintf(stderr, "Falure: unsupported CNI version, requires %s, received %s\n", CNI_VERSION, args->cni_version);
+	// VERSION is how runtimes find out which versions to speak, so it is answered whatever the request's
+	if (strcmp(args->cni_command, CNI_CMD_VERSION) && !args_cni_version_supported(args->cni_version)) {
+		fprintf(stderr, "Failure: unsupported CNI version %s, supported up to %s\n",
+			args->cni_version ? args->cni_version : "(none)", CNI_VERSION);
 		args_free(args);
 		return 1;
 	}
@@ -166,21 +724,46 @@ int args_parse(struct Args* args) {
 			args_free(args);
 			return 1;
 		}
+	} else if (!strcmp(args->cni_command, CNI_CMD_ADD_BATCH)) {
+		if (args_validate_add_batch_cmd(args)) {
+			args_free(args);
+			return 1;
+		}
 	} else if (!strcmp(args->cni_command, CNI_CMD_DEL)) {
 		if (args_validate_del_cmd(args)) {
 			args_free(args);
 			return 1;
 		}
+	} else if (!strcmp(args->cni_command, CNI_CMD_STATUS)) {
+		if (args_validate_status_cmd(args)) {
+			args_free(args);
+			return 1;
+		}
 	} else if (!strcmp(args->cni_command, CNI_CMD_CHECK)) {
 		if (args_validate_check_cmd(args)) {
 			args_free(args);
 			return 1;
 		}
+	} else if (!strcmp(args->cni_command, CNI_CMD_GC)) {
+		if (args_validate_gc_cmd(args)) {
+			args_free(args);
+			return 1;
+		}
 	}
 
 	return 0;
 }
 
+int args_cni_version_supported(const char* version) {
+	static const char* const supported[] = CNI_SUPPORTED_VERSIONS;
+	for (size_t i = 0; version && i < sizeof(supported) / sizeof(supported[0]); ++i) {
+		if (!strcmp(version, supported[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void args_print(const struct Args* args) {
 	fprintf(stderr, "cni version is %s\n", args->cni_version);
 	fprintf(stderr, "name is %s\n", args->name);
@@ -193,8 +776,15 @@ void args_print(const struct Args* args) {
 }
 
 void args_free(struct Args* args) {
-	if (args->json_input) {
-		json_object_put(args->json_input);
-		args->json_input = NULL;
+	for (int i = 0; i < args->json_value_count; ++i) {
+		json_object_put(args->json_values[i]);
 	}
+	args->json_value_count = 0;
+
+	free(args->valid_attachments);
+	args->valid_attachments = NULL;
+	args->valid_attachment_count = 0;
+
+	free(args->input);
+	args->input = NULL;
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #ifndef SKNF_ARGS_H
 #define SKNF_ARGS_H
 
+#include <stddef.h>
+#include "def.h"
+
+// Values of the input that are parsed into json-c objects (prevResult ips, runtimeConfig, ...)
+#define ARGS_MAX_JSON_VALUES 8
+
 struct Args {
 	const char* cni_version;
 	const char* name;
@@ -8,17 +14,37 @@ struct Args {
 	const char* subnet;
 	const char* cluster_cidr;
 	const char* host_physical_interface;
+	enum PodInterface pod_interface;
+	enum PodAttach pod_attach;
+	enum XdpDecap xdp_decap;
 	const char* cni_command;
 	const char* cni_containerid;
 	const char* cni_netns;
 	const char* cni_ifname;
 	const char* cni_path;
-	const void* prev_result;
+	const char* prev_result; // raw JSON text, passed through to the ADD result as is
+	size_t prev_result_len;
+	const char* prev_result_cidr; // address of the first IP in prevResult, if any
+	struct Bandwidth bandwidth;
+	struct Snat snat;
+	struct PortMapping port_mappings[MAX_PORT_MAPPINGS];
+	int port_mapping_count;
+	struct Sysctl sysctls[MAX_SYSCTLS];
+	int sysctl_count;
+	struct BatchContainer batch_containers[MAX_BATCH_CONTAINERS]; // ADD_BATCH only
+	int batch_container_count;
+	struct Attachment* valid_attachments; // GC only; malloc'd, NULL when the input has none
+	int valid_attachment_count;
 
-	void* json_input; // internal
+	// internal
+	char* input;
+	void* json_values[ARGS_MAX_JSON_VALUES];
+	int json_value_count;
 };
 
 int args_parse(struct Args* args);
+int args_parse_input(struct Args* args, char* input, size_t input_len);
+int args_cni_version_supported(const char* version);
 void args_print(const struct Args* args);
 void args_free(struct Args* args);
 
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include "capture.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "net.h"
+
+// Captures the traffic of one interface into pcapng, through an AF_PACKET TPACKET_V3 ring: the kernel fills
+// whole blocks of packets that are written out without a copy or a syscall per packet. The snaplen is applied
+// by the socket filter, so truncated bytes never take ring space.
+
+#define CAPTURE_SNAPLEN_DEFAULT 262144
+#define CAPTURE_RING_MB_DEFAULT 64
+#define CAPTURE_BLOCK_KB_DEFAULT 1024
+// a block is handed to userspace when full or after this long, so slow links still show up promptly
+#define CAPTURE_BLOCK_TIMEOUT_MS 64
+#define CAPTURE_FRAME_SIZE 2048
+#define CAPTURE_OUTPUT_BUFFER (4 << 20)
+#define CAPTURE_MAX_FILTER_LEN 4096
+
+// pcapng (draft-ietf-opsawg-pcapng)
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_SHB_USERAPPL 4
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_EPB_INBOUND 1
+#define PCAPNG_EPB_OUTBOUND 2
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_END_LEN 4
+
+#define PAD4(n) (((n) + 3) & ~3u)
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+	stop = 1;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: sknf-cni capture [-s snaplen] [-r ring-MiB] [-b block-KiB] [-f filter] [-c count] [-w file]\n"
+		"                         (-i interface | <container-id> <netns> [ifname])\n"
+		"  -s  bytes kept per packet (default %d)\n"
+		"  -r  ring size in MiB (default %d)\n"
+		"  -b  ring block size in KiB, a multiple of the page size (default %d)\n"
+		"  -f  classic BPF program, as printed by 'tcpdump -ddd <expression>'\n"
+		"  -c  stop after this many packets\n"
+		"  -w  pcapng output (default: stdout)\n"
+		"  -i  capture an interface by name instead of a pod's host end\n"
+		"<container-id>, <netns> and [ifname] are the CNI_CONTAINERID, CNI_NETNS and CNI_IFNAME (default eth0)\n"
+		"the pod was added with; its host end is named from them.\n",
+		CAPTURE_SNAPLEN_DEFAULT, CAPTURE_RING_MB_DEFAULT, CAPTURE_BLOCK_KB_DEFAULT);
+}
+
+// Reads 'tcpdump -ddd' output: the instruction count, then one "code jt jf k" line per instruction
+static int read_filter(const char* path, struct sock_filter** out, int* out_len) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "failure opening filter %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	int rc = 1;
+	int len;
+	struct sock_filter* prog = NULL;
+	if (fscanf(f, "%d", &len) != 1 || len <= 0 || len > CAPTURE_MAX_FILTER_LEN) {
+		fprintf(stderr, "invalid filter %s: expected an instruction count\n", path);
+		goto out;
+	}
+	prog = calloc(len, sizeof(struct sock_filter));
+	if (!prog) {
+		fprintf(stderr, "failure allocating filter\n");
+		goto out;
+	}
+	for (int i = 0; i < len; ++i) {
+		unsigned code, jt, jf, k;
+		if (fscanf(f, "%u %u %u %u", &code, &jt, &jf, &k) != 4 || code > 0xffff || jt > 0xff || jf > 0xff) {
+			fprintf(stderr, "invalid filter %s: bad instruction %d\n", path, i);
+			goto out;
+		}
+		prog[i] = (struct sock_filter){ .code = code, .jt = jt, .jf = jf, .k = k };
+	}
+
+	*out = prog;
+	*out_len = len;
+	prog = NULL;
+	rc = 0;
+out:
+	free(prog);
+	fclose(f);
+	return rc;
+}
+
+// The filter's return value is the number of bytes kept; clamping the accepting returns applies the snaplen.
+static int attach_filter(int fd, const char* filter_path, unsigned snaplen) {
+	struct sock_filter accept_all = BPF_STMT(BPF_RET | BPF_K, snaplen);
+	struct sock_filter* prog = &accept_all;
+	int len = 1;
+
+	if (filter_path) {
+		if (read_filter(filter_path, &prog, &len)) {
+			return 1;
+		}
+		for (int i = 0; i < len; ++i) {
+			if (prog[i].code == (BPF_RET | BPF_K) && prog[i].k > snaplen) {
+				prog[i].k = snaplen;
+			}
+		}
+	}
+
+	struct sock_fprog fprog = { .len = len, .filter = prog };
+	int rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+	if (rc) {
+		fprintf(stderr, "failure attaching filter: %s\n", strerror(errno));
+	}
+	if (prog != &accept_all) {
+		free(prog);
+	}
+	return rc ? 1 : 0;
+}
+
+static void write_option(FILE* out, uint16_t code, const void* data, uint16_t len) {
+	static const uint8_t zero[4];
+	fwrite(&code, 2, 1, out);
+	fwrite(&len, 2, 1, out);
+	fwrite(data, 1, len, out);
+	fwrite(zero, 1, PAD4(len) - len, out);
+}
+
+static void write_headers(FILE* out, const char* ifname, unsigned snaplen) {
+	static const char userappl[] = "sknf-cni capture";
+	uint32_t u32;
+
+	uint32_t shb_len = 4 + 4 + 4 + 2 + 2 + 8 + 4 + PAD4(sizeof(userappl)) + PCAPNG_OPT_END_LEN + 4;
+	u32 = PCAPNG_SHB; fwrite(&u32, 4, 1, out);
+	fwrite(&shb_len, 4, 1, out);
+	u32 = PCAPNG_BYTE_ORDER_MAGIC; fwrite(&u32, 4, 1, out);
+	uint16_t version[2] = { 1, 0 };
+	fwrite(version, 2, 2, out);
+	int64_t section_len = -1;
+	fwrite(&section_len, 8, 1, out);
+	write_option(out, PCAPNG_SHB_USERAPPL, userappl, sizeof(userappl));
+	write_option(out, PCAPNG_OPT_END, NULL, 0);
+	fwrite(&shb_len, 4, 1, out);
+
+	// nanosecond timestamps, as delivered by the ring
+	uint8_t tsresol = 9;
+	uint16_t name_len = strlen(ifname);
+	uint32_t idb_len = 4 + 4 + 2 + 2 + 4 + 4 + PAD4(name_len) + 4 + PAD4(1) + PCAPNG_OPT_END_LEN + 4;
+	u32 = PCAPNG_IDB; fwrite(&u32, 4, 1, out);
+	fwrite(&idb_len, 4, 1, out);
+	uint16_t linktype[2] = { PCAPNG_LINKTYPE_ETHERNET, 0 };
+	fwrite(linktype, 2, 2, out);
+	u32 = snaplen; fwrite(&u32, 4, 1, out);
+	write_option(out, PCAPNG_IF_NAME, ifname, name_len);
+	write_option(out, PCAPNG_IF_TSRESOL, &tsresol, 1);
+	write_option(out, PCAPNG_OPT_END, NULL, 0);
+	fwrite(&idb_len, 4, 1, out);
+}
+
+static void write_packet(FILE* out, const struct tpacket3_hdr* hdr) {
+	static const uint8_t zero[4];
+	const uint8_t* data = (const uint8_t*)hdr + hdr->tp_mac;
+	const struct sockaddr_ll* sll = (const struct sockaddr_ll*)((const uint8_t*)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+	uint32_t caplen = hdr->tp_snaplen;
+	uint32_t flags = sll->sll_pkttype == PACKET_OUTGOING ? PCAPNG_EPB_OUTBOUND : PCAPNG_EPB_INBOUND;
+	uint64_t ts = (uint64_t)hdr->tp_sec * 1000000000ull + hdr->tp_nsec;
+
+	uint32_t block[7] = {
+		PCAPNG_EPB,
+		4 + 4 + 4 + 4 + 4 + 4 + 4 + PAD4(caplen) + 4 + 4 + PCAPNG_OPT_END_LEN + 4,
+		0, // interface ID
+		(uint32_t)(ts >> 32),
+		(uint32_t)ts,
+		caplen,
+		hdr->tp_len,
+	};
+	fwrite(block, 4, 7, out);
+	fwrite(data, 1, caplen, out);
+	fwrite(zero, 1, PAD4(caplen) - caplen, out);
+	write_option(out, PCAPNG_EPB_FLAGS, &flags, 4);
+	write_option(out, PCAPNG_OPT_END, NULL, 0);
+	fwrite(&block[1], 4, 1, out);
+}
+
+// Captures from ifname until interrupted or until count packets were written (count 0: no limit)
+static int capture(const char* ifname, const char* filter_path, unsigned snaplen, size_t ring_size, size_t block_size,
+		unsigned long count, FILE* out) {
+	int rc = 1;
+	int fd = -1;
+	uint8_t* ring = MAP_FAILED;
+	unsigned long written = 0;
+
+	unsigned ifindex = if_nametoindex(ifname);
+	if (!ifindex) {
+		fprintf(stderr, "failure resolving interface %s: %s\n", ifname, strerror(errno));
+		goto out;
+	}
+
+	// protocol 0: nothing is queued until the filter and the ring are in place and the socket is bound
+	fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "failure creating packet socket: %s\n", strerror(errno));
+		goto out;
+	}
+
+	int version = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+		fprintf(stderr, "failure selecting TPACKET_V3: %s\n", strerror(errno));
+		goto out;
+	}
+
+	if (attach_filter(fd, filter_path, snaplen)) {
+		goto out;
+	}
+
+	struct tpacket_req3 req = {
+		.tp_block_size = block_size,
+		.tp_block_nr = ring_size / block_size,
+		.tp_frame_size = CAPTURE_FRAME_SIZE,
+		.tp_frame_nr = (block_size / CAPTURE_FRAME_SIZE) * (ring_size / block_size),
+		.tp_retire_blk_tov = CAPTURE_BLOCK_TIMEOUT_MS,
+	};
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		fprintf(stderr, "failure setting up a %u x %u bytes ring: %s\n", req.tp_block_nr, req.tp_block_size, strerror(errno));
+		goto out;
+	}
+
+	ring = mmap(NULL, (size_t)req.tp_block_nr * req.tp_block_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+	if (ring == MAP_FAILED) {
+		// MAP_LOCKED needs CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK; the ring works without it
+		ring = mmap(NULL, (size_t)req.tp_block_nr * req.tp_block_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (ring == MAP_FAILED) {
+		fprintf(stderr, "failure mapping the ring: %s\n", strerror(errno));
+		goto out;
+	}
+
+	struct sockaddr_ll sll = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_ALL),
+		.sll_ifindex = ifindex,
+	};
+	if (bind(fd, (struct sockaddr*)&sll, sizeof(sll))) {
+		fprintf(stderr, "failure binding to %s: %s\n", ifname, strerror(errno));
+		goto out;
+	}
+
+	write_headers(out, ifname, snaplen);
+	fprintf(stderr, "capturing on %s (%u blocks of %u KiB, snaplen %u)\n", ifname, req.tp_block_nr, req.tp_block_size >> 10, snaplen);
+
+	struct pollfd pfd = { .fd = fd, .events = POLLIN | POLLERR };
+	unsigned block_index = 0;
+	while (!stop && (!count || written < count)) {
+		struct tpacket_block_desc* block = (struct tpacket_block_desc*)(ring + (size_t)block_index * req.tp_block_size);
+		if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			// the ring is drained: write out what is buffered while waiting for the next block
+			if (fflush(out)) {
+				fprintf(stderr, "failure writing the capture: %s\n", strerror(errno));
+				goto out;
+			}
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+				fprintf(stderr, "failure polling the ring: %s\n", strerror(errno));
+				goto out;
+			}
+			continue;
+		}
+
+		const struct tpacket3_hdr* hdr = (const struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+		for (uint32_t i = 0; i < block->hdr.bh1.num_pkts && (!count || written < count); ++i) {
+			write_packet(out, hdr);
+			++written;
+			hdr = (const struct tpacket3_hdr*)((const uint8_t*)hdr + hdr->tp_next_offset);
+		}
+
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		block_index = (block_index + 1) % req.tp_block_nr;
+	}
+
+	if (fflush(out)) {
+		fprintf(stderr, "failure writing the capture: %s\n", strerror(errno));
+		goto out;
+	}
+
+	struct tpacket_stats_v3 stats;
+	socklen_t stats_len = sizeof(stats);
+	if (!getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &stats, &stats_len)) {
+		fprintf(stderr, "%lu packets written, %u received by the filter, %u dropped by the kernel\n",
+			written, stats.tp_packets, stats.tp_drops);
+	}
+	rc = 0;
+out:
+	if (ring != MAP_FAILED) munmap(ring, ring_size / block_size * block_size);
+	if (fd >= 0) close(fd);
+	return rc;
+}
+
+int capture_run(int argc, char** argv) {
+	unsigned snaplen = CAPTURE_SNAPLEN_DEFAULT;
+	size_t ring_mb = CAPTURE_RING_MB_DEFAULT;
+	size_t block_kb = CAPTURE_BLOCK_KB_DEFAULT;
+	const char* filter_path = NULL;
+	const char* output_path = NULL;
+	const char* ifname = NULL;
+	unsigned long count = 0;
+	char host_if_name[16];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:r:b:f:c:w:i:")) != -1) {
+		switch (opt) {
+			case 's': snaplen = strtoul(optarg, NULL, 10); break;
+			case 'r': ring_mb = strtoul(optarg, NULL, 10); break;
+			case 'b': block_kb = strtoul(optarg, NULL, 10); break;
+			case 'f': filter_path = optarg; break;
+			case 'c': count = strtoul(optarg, NULL, 10); break;
+			case 'w': output_path = optarg; break;
+			case 'i': ifname = optarg; break;
+			default: usage(); return 1;
+		}
+	}
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t block_size = block_kb << 10;
+	size_t ring_size = ring_mb << 20;
+	if (snaplen == 0 || block_size == 0 || block_size % page_size || ring_size < block_size) {
+		usage();
+		return 1;
+	}
+
+	if (ifname == NULL) {
+		int args_left = argc - optind;
+		if (args_left < 2 || args_left > 3) {
+			usage();
+			return 1;
+		}
+		net_host_if_name(host_if_name, argv[optind + 1], args_left == 3 ? argv[optind + 2] : "eth0", argv[optind]);
+		ifname = host_if_name;
+	} else if (optind != argc) {
+		usage();
+		return 1;
+	}
+
+	FILE* out = stdout;
+	if (output_path && strcmp(output_path, "-")) {
+		out = fopen(output_path, "wb");
+		if (!out) {
+			fprintf(stderr, "failure opening %s: %s\n", output_path, strerror(errno));
+			return 1;
+		}
+	}
+	setvbuf(out, NULL, _IOFBF, CAPTURE_OUTPUT_BUFFER);
+
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	// the reader of a piped capture (e.g. wireshark -k -i -) going away ends the capture
+	signal(SIGPIPE, SIG_IGN);
+
+	int rc = capture(ifname, filter_path, snaplen, ring_size, block_size, count, out);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return rc;
+}
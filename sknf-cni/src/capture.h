@@ -0,0 +1,6 @@
+#ifndef SKNF_CAPTURE_H
+#define SKNF_CAPTURE_H
+
+int capture_run(int argc, char** argv);
+
+#endif
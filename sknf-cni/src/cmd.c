@@ -1,16 +1,60 @@
 #include "cmd.h"
 
+#include <arpa/inet.h>
 #include <json-c/json.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ct.h"
 #include "def.h"
+#include "io.h"
 #include "ip.h"
 #include "net.h"
+#include "net_utils.h"
+#include "nft.h"
+#include "nlstat.h"
 #include "sys.h"
+#include "util.h"
+#include "xdp.h"
+
+// Written by sknf-app once the node is reconciled, holding the boot id of that time (see sknf-app/main.go)
+#define READY_MARKER_FILE_PATH "/tmp/sknf-cni-ready"
+#define BOOT_ID_FILE_PATH "/proc/sys/kernel/random/boot_id"
+
+// Serializes the response once; prevResult, if given, is appended as the raw text received on stdin
+// instead of being parsed and re-serialized.
+static void emit_response(struct json_object* json_response_obj, const struct Args* args) {
+	const char* body = json_object_to_json_string_ext(json_response_obj, JSON_C_TO_STRING_PLAIN);
+
+	if (args == NULL || args->prev_result == NULL) {
+		fprintf(stderr, "emit_response: emitting response: %s\n", body);
+		printf("%s\n", body);
+		return;
+	}
+
+	// the response always has members, so it ends with "...}"
+	size_t body_len = strlen(body);
+	fprintf(stderr, "emit_response: emitting response: %s (with %zu bytes of prevResult)\n", body, args->prev_result_len);
+	fwrite(body, 1, body_len - 1, stdout);
+	fputs(",\"prevResult\":", stdout);
+	fwrite(args->prev_result, 1, args->prev_result_len, stdout);
+	fputs("}\n", stdout);
+}
+
+// Results are in the version of the request; VERSION may come with any (or none)
+static const char* response_version(const struct Args* args) {
+	return args_cni_version_supported(args->cni_version) ? args->cni_version : CNI_VERSION;
+}
+
+// Before 1.0, every IP of a result carried its IP version
+static int has_ip_versions(const struct Args* args) {
+	return !strncmp(response_version(args), "0.", 2);
+}
 
 static void emit_add_response(const struct Args* args, const char* container_netif_cidr) {
 	struct json_object* json_response_obj = json_object_new_object();
 
-	json_object_object_add(json_response_obj, "cniVersion", json_object_new_string(CNI_VERSION));
+	json_object_object_add(json_response_obj, "cniVersion", json_object_new_string(response_version(args)));
 
 	// interfaces array
 	struct json_object* interfaces_arr = json_object_new_array();
@@ -22,51 +66,75 @@ static void emit_add_response(const struct Args* args, const char* container_net
 	// ips array
 	struct json_object* ips_arr = json_object_new_array();
 	struct json_object* ip_obj = json_object_new_object();
-	json_object_object_add(ip_obj, "version", json_object_new_string("4"));
+	if (has_ip_versions(args)) {
+		json_object_object_add(ip_obj, "version", json_object_new_string("4"));
+	}
 	json_object_object_add(ip_obj, "address", json_object_new_string(container_netif_cidr));
 	json_object_object_add(ip_obj, "interface", json_object_new_int(0));
 	json_object_array_add(ips_arr, ip_obj);
 	json_object_object_add(json_response_obj, "ips", ips_arr);
 
-	if (args->prev_result != NULL) {
-		json_object_object_add(json_response_obj, "prevResult", args->prev_result);
+	// report the shaping that was applied, in the same shape as runtimeConfig.bandwidth
+	const struct Bandwidth* bandwidth = &args->bandwidth;
+	if (bandwidth->ingress_rate > 0 || bandwidth->egress_rate > 0) {
+		struct json_object* bandwidth_obj = json_object_new_object();
+		if (bandwidth->ingress_rate > 0) {
+			json_object_object_add(bandwidth_obj, "ingressRate", json_object_new_int64((int64_t)bandwidth->ingress_rate));
+			json_object_object_add(bandwidth_obj, "ingressBurst", json_object_new_int64((int64_t)bandwidth->ingress_burst));
+		}
+		if (bandwidth->egress_rate > 0) {
+			json_object_object_add(bandwidth_obj, "egressRate", json_object_new_int64((int64_t)bandwidth->egress_rate));
+			json_object_object_add(bandwidth_obj, "egressBurst", json_object_new_int64((int64_t)bandwidth->egress_burst));
+		}
+		json_object_object_add(json_response_obj, "bandwidth", bandwidth_obj);
 	}
 
-	fprintf(stderr, "emit_response: emitting response: %s\n", json_object_to_json_string_ext(json_response_obj, JSON_C_TO_STRING_PLAIN));
-	printf("%s\n", json_object_to_json_string_ext(json_response_obj, JSON_C_TO_STRING_PLAIN));
+	emit_response(json_response_obj, args);
 	json_object_put(json_response_obj);
 }
 
 static void emit_version_response(const struct Args* args) {
 	struct json_object* json_response_obj = json_object_new_object();
 
-	json_object_object_add(json_response_obj, "cniVersion", json_object_new_string(CNI_VERSION));
+	json_object_object_add(json_response_obj, "cniVersion", json_object_new_string(response_version(args)));
+	static const char* const supported[] = CNI_SUPPORTED_VERSIONS;
 	struct json_object* supported_versions_array = json_object_new_array();
-	json_object_array_add(supported_versions_array, json_object_new_string(CNI_VERSION));
+	for (size_t i = 0; i < sizeof(supported) / sizeof(supported[0]); ++i) {
+		json_object_array_add(supported_versions_array, json_object_new_string(supported[i]));
+	}
 	json_object_object_add(json_response_obj, "supportedVersions", supported_versions_array);
 
-	fprintf(stderr, "emit_response: emitting response: %s\n", json_object_to_json_string_ext(json_response_obj, JSON_C_TO_STRING_PLAIN));
-	printf("%s\n", json_object_to_json_string_ext(json_response_obj, JSON_C_TO_STRING_PLAIN));
+	emit_response(json_response_obj, NULL);
 	json_object_put(json_response_obj);
 }
 
-static void emit_error_response(Err err) {
+static void emit_error_response(const struct Args* args, Err err) {
 	struct json_object* json_response_obj = json_object_new_object();
 
 	if (!err.initialized) {
 		ERR(&err, "An unknown error happened");
 	}
 
-	json_object_object_add(json_response_obj, "cniVersion", json_object_new_string(CNI_VERSION));
+	json_object_object_add(json_response_obj, "cniVersion", json_object_new_string(response_version(args)));
 	json_object_object_add(json_response_obj, "code", json_object_new_int(err.code));
 	json_object_object_add(json_response_obj, "msg", json_object_new_string(err.msg));
 	json_object_object_add(json_response_obj, "details", json_object_new_string(err.details));
 
-	fprintf(stderr, "emit_response: emitting response: %s\n", json_object_to_json_string_ext(json_response_obj, JSON_C_TO_STRING_PLAIN));
-	printf("%s\n", json_object_to_json_string_ext(json_response_obj, JSON_C_TO_STRING_PLAIN));
+	emit_response(json_response_obj, NULL);
 	json_object_put(json_response_obj);
 }
 
+// Conntrack entries of a released IP would be inherited by its next pod. Failing to flush them is only logged:
+// they expire on their own, and neither ADD nor DEL should fail on a node without ctnetlink.
+static void flush_conntrack(const char* const* pod_cidrs, int count) {
+	Err err;
+	ERR_INIT(&err);
+	unsigned long removed;
+	if (ct_flush_pod_ips(&err, pod_cidrs, count, &removed)) {
+		fprintf(stderr, "failure flushing conntrack entries of pod IPs, continuing: %s\n", err.msg);
+	}
+}
+
 int cmd_add(const struct Args* args) {
 	// TODO: Return error if interface already exists in container
 	Err err;
@@ -77,7 +145,7 @@ int cmd_add(const struct Args* args) {
 	// a packet that was emitted through kube-proxy (cluster-ip)
 	if (sys_enable_br_netfilter(&err)) {
 		fprintf(stderr, "failure enabling br_netfilter\n");
-		emit_error_response(err);
+		emit_error_response(args, err);
 		return 1;
 	}
 
@@ -85,19 +153,63 @@ int cmd_add(const struct Args* args) {
 	char container_netif_cidr[CIDR_BUFFER_LEN];
 	if (ip_bridge(&err, args->subnet, args->cluster_cidr, bridge_cidr)) {
 		fprintf(stderr, "failure retrieving bridge IP address\n");
-		emit_error_response(err);
+		emit_error_response(args, err);
 		return 1;
 	}
 
-	if (ip_container_acquire(&err, args->subnet, args->cluster_cidr, container_netif_cidr)) {
+	if (ip_container_acquire(&err, args->subnet, args->cluster_cidr, args->cni_containerid, args->cni_netns,
+			args->cni_ifname, container_netif_cidr)) {
 		fprintf(stderr, "failure acquiring an IP address for the container\n");
-		emit_error_response(err);
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	// a routed pod owns only its own address; the rest of the cluster is behind its gateway
+	if (args->pod_attach == POD_ATTACH_ROUTED && ip_host_cidr(&err, container_netif_cidr, container_netif_cidr)) {
+		fprintf(stderr, "failure building routed container address\n");
+		emit_error_response(args, err);
 		return 1;
 	}
 
-	if (net_attach_container(&err, args->cni_netns, args->cni_ifname, container_netif_cidr, args->cni_containerid, bridge_cidr, args->host_physical_interface)) {
+	flush_conntrack((const char* const[]){ container_netif_cidr }, 1);
+
+	if (net_attach_container(&err, args->cni_netns, args->cni_ifname, container_netif_cidr, args->cni_containerid, bridge_cidr, args->host_physical_interface, &args->bandwidth,
+			args->sysctls, args->sysctl_count, args->pod_interface, args->pod_attach, args->xdp_decap)) {
 		fprintf(stderr, "failure attaching container network\n");
-		emit_error_response(err);
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	// nftables state (masquerade, per-pod accounting, hostPorts) is committed in a single transaction
+	if (nft_attach_container(&err, args->host_physical_interface, args->cluster_cidr, args->subnet, container_netif_cidr,
+			&args->snat, args->port_mappings, args->port_mapping_count)) {
+		fprintf(stderr, "failure configuring nftables for container\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	char host_if_name[16];
+	net_host_if_name(host_if_name, args->cni_netns, args->cni_ifname, args->cni_containerid);
+
+	// a pod with an ingress rate stays on the stack path: the redirect would skip the tbf of its host interface
+	if (args->xdp_decap != XDP_DECAP_OFF && args->bandwidth.ingress_rate == 0) {
+		if (xdp_map_pods(&err, (const char* const[]){ container_netif_cidr }, (const char* const[]){ host_if_name }, 1)) {
+			fprintf(stderr, "failure adding container to the XDP decap fast path\n");
+			emit_error_response(args, err);
+			return 1;
+		}
+	}
+
+	// likewise on egress: the redirect would skip the ifb of a pod with an egress rate
+	if (args->pod_interface == POD_INTERFACE_NETKIT && args->bandwidth.egress_rate == 0 &&
+			xdp_attach_netkit_forward(&err, (const char* const[]){ host_if_name }, 1)) {
+		fprintf(stderr, "failure attaching the netkit forwarding program to the container\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	if (nlstat_check_budget(&err, args)) {
+		emit_error_response(args, err);
 		return 1;
 	}
 
@@ -105,24 +217,313 @@ int cmd_add(const struct Args* args) {
 	return 0;
 }
 
+// One result per container, in the order of the request: the ADD result, or the error, of each container
+static void emit_add_batch_response(const struct Args* args, char container_netif_cidrs[][CIDR_BUFFER_LEN], const Err* errs) {
+	struct json_object* json_response_obj = json_object_new_object();
+
+	json_object_object_add(json_response_obj, "cniVersion", json_object_new_string(response_version(args)));
+
+	struct json_object* results_arr = json_object_new_array();
+	for (int i = 0; i < args->batch_container_count; ++i) {
+		struct json_object* result_obj = json_object_new_object();
+		json_object_object_add(result_obj, "containerId", json_object_new_string(args->batch_containers[i].containerid));
+
+		if (errs[i].initialized) {
+			json_object_object_add(result_obj, "code", json_object_new_int(errs[i].code));
+			json_object_object_add(result_obj, "msg", json_object_new_string(errs[i].msg));
+			json_object_object_add(result_obj, "details", json_object_new_string(errs[i].details));
+		} else {
+			struct json_object* interfaces_arr = json_object_new_array();
+			struct json_object* iface_obj = json_object_new_object();
+			json_object_object_add(iface_obj, "name", json_object_new_string(args->batch_containers[i].ifname));
+			json_object_array_add(interfaces_arr, iface_obj);
+			json_object_object_add(result_obj, "interfaces", interfaces_arr);
+
+			struct json_object* ips_arr = json_object_new_array();
+			struct json_object* ip_obj = json_object_new_object();
+			if (has_ip_versions(args)) {
+				json_object_object_add(ip_obj, "version", json_object_new_string("4"));
+			}
+			json_object_object_add(ip_obj, "address", json_object_new_string(container_netif_cidrs[i]));
+			json_object_object_add(ip_obj, "interface", json_object_new_int(0));
+			json_object_array_add(ips_arr, ip_obj);
+			json_object_object_add(result_obj, "ips", ips_arr);
+		}
+
+		json_object_array_add(results_arr, result_obj);
+	}
+	json_object_object_add(json_response_obj, "results", results_arr);
+
+	emit_response(json_response_obj, NULL);
+	json_object_put(json_response_obj);
+}
+
+// ADD of every container of args->batch_containers, sharing what single ADDs repeat: node checks, one IPAM
+// lock, one netlink socket (with pipelined pair creations) and one nftables transaction. Node-wide failures
+// fail the whole batch; otherwise every container gets its own result. IPs of failed containers are not reused.
+int cmd_add_batch(const struct Args* args) {
+	Err err;
+	ERR_INIT(&err);
+
+	int count = args->batch_container_count;
+	static char container_netif_cidrs[MAX_BATCH_CONTAINERS][CIDR_BUFFER_LEN];
+	static Err errs[MAX_BATCH_CONTAINERS];
+	for (int i = 0; i < count; ++i) {
+		ERR_INIT(&errs[i]);
+	}
+
+	if (sys_enable_br_netfilter(&err)) {
+		fprintf(stderr, "failure enabling br_netfilter\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	char bridge_cidr[CIDR_BUFFER_LEN];
+	if (ip_bridge(&err, args->subnet, args->cluster_cidr, bridge_cidr)) {
+		fprintf(stderr, "failure retrieving bridge IP address\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	if (ip_container_acquire_many(&err, args->subnet, args->cluster_cidr, args->batch_containers, count,
+			container_netif_cidrs)) {
+		fprintf(stderr, "failure acquiring IP addresses for the containers\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	const char* acquired_cidrs[MAX_BATCH_CONTAINERS];
+	for (int i = 0; i < count; ++i) {
+		if (args->pod_attach == POD_ATTACH_ROUTED && ip_host_cidr(&err, container_netif_cidrs[i], container_netif_cidrs[i])) {
+			fprintf(stderr, "failure building routed container address\n");
+			emit_error_response(args, err);
+			return 1;
+		}
+		acquired_cidrs[i] = container_netif_cidrs[i];
+	}
+
+	flush_conntrack(acquired_cidrs, count);
+
+	if (net_attach_containers(&err, args->batch_containers, count, container_netif_cidrs, errs, bridge_cidr, args->host_physical_interface,
+			&args->bandwidth, args->sysctls, args->sysctl_count, args->pod_interface, args->pod_attach, args->xdp_decap)) {
+		fprintf(stderr, "failure attaching container networks\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	const char* attached_cidrs[MAX_BATCH_CONTAINERS];
+	static char attached_host_if_names[MAX_BATCH_CONTAINERS][16];
+	const char* attached_host_ifs[MAX_BATCH_CONTAINERS];
+	int attached_count = 0;
+	for (int i = 0; i < count; ++i) {
+		if (!errs[i].initialized) {
+			const struct BatchContainer* c = &args->batch_containers[i];
+			net_host_if_name(attached_host_if_names[attached_count], c->netns, c->ifname, c->containerid);
+			attached_host_ifs[attached_count] = attached_host_if_names[attached_count];
+			attached_cidrs[attached_count++] = container_netif_cidrs[i];
+		}
+	}
+
+	if (attached_count > 0 && nft_attach_containers(&err, args->host_physical_interface, args->cluster_cidr, args->subnet,
+			attached_cidrs, attached_count, &args->snat)) {
+		fprintf(stderr, "failure configuring nftables for containers\n");
+		for (int i = 0; i < count; ++i) {
+			if (!errs[i].initialized) {
+				errs[i] = err;
+			}
+		}
+	} else if (attached_count > 0 && args->xdp_decap != XDP_DECAP_OFF && args->bandwidth.ingress_rate == 0 &&
+			xdp_map_pods(&err, attached_cidrs, attached_host_ifs, attached_count)) {
+		fprintf(stderr, "failure adding containers to the XDP decap fast path\n");
+		for (int i = 0; i < count; ++i) {
+			if (!errs[i].initialized) {
+				errs[i] = err;
+			}
+		}
+	} else if (attached_count > 0 && args->pod_interface == POD_INTERFACE_NETKIT && args->bandwidth.egress_rate == 0 &&
+			xdp_attach_netkit_forward(&err, attached_host_ifs, attached_count)) {
+		fprintf(stderr, "failure attaching the netkit forwarding program to the containers\n");
+		for (int i = 0; i < count; ++i) {
+			if (!errs[i].initialized) {
+				errs[i] = err;
+			}
+		}
+	}
+
+	if (nlstat_check_budget(&err, args)) {
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	emit_add_batch_response(args, container_netif_cidrs, errs);
+
+	for (int i = 0; i < count; ++i) {
+		if (errs[i].initialized) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int cmd_del(const struct Args* args) {
 	Err err;
 	ERR_INIT(&err);
 
+	char host_if_name[16];
+	net_host_if_name(host_if_name, args->cni_netns, args->cni_ifname, args->cni_containerid);
+
+	// without a prevResult (e.g. the cached result was lost with the runtime state), the IP is the one of the lease
+	const char* container_cidr = args->prev_result_cidr;
+	char lease_cidr[CIDR_BUFFER_LEN];
+	if (container_cidr == NULL) {
+		if (ip_container_lease(&err, args->cni_containerid, args->cni_ifname, host_if_name, lease_cidr)) {
+			fprintf(stderr, "failure looking up container IP\n");
+			emit_error_response(args, err);
+			return 1;
+		}
+		container_cidr = lease_cidr[0] ? lease_cidr : NULL;
+	}
+
+	// before the host interface goes away, so that the fast path never redirects to a stale ifindex
+	if (args->xdp_decap != XDP_DECAP_OFF && container_cidr && xdp_unmap_pod(&err, container_cidr)) {
+		fprintf(stderr, "failure removing container from the XDP decap fast path, continuing: %s\n", err.msg);
+		ERR_INIT(&err);
+	}
+
 	if (net_detach_container(&err, args->cni_netns, args->cni_ifname, args->cni_containerid)) {
 		fprintf(stderr, "failure detaching container network\n");
-		emit_error_response(err);
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	// no prevResult and no lease: a retried DEL, or an IP handed out before the leases existed
+	if (container_cidr == NULL) {
+		fprintf(stderr, "no prevResult address nor lease, skipping nftables and conntrack cleanup\n");
+	} else if (nft_detach_container(&err, container_cidr, args->port_mappings, args->port_mapping_count)) {
+		fprintf(stderr, "failure cleaning up nftables for container\n");
+		emit_error_response(args, err);
+		return 1;
+	} else {
+		flush_conntrack((const char* const[]){ container_cidr }, 1);
+	}
+
+	// last, so that the IP is not handed out again while rules of this container may remain
+	if (ip_container_release(&err, args->cni_containerid, args->cni_ifname, host_if_name)) {
+		fprintf(stderr, "failure releasing container IP\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	if (nlstat_check_budget(&err, args)) {
+		emit_error_response(args, err);
 		return 1;
 	}
 
 	return 0;
 }
 
+// The marker of a previous boot is stale: the bridge, vxlan and nftables state it vouched for are gone
+static int node_bootstrapped(void) {
+	char marker[64];
+	char boot_id[64];
+	size_t marker_len;
+	size_t boot_id_len;
+	if (io_read_file_into(READY_MARKER_FILE_PATH, marker, sizeof(marker), &marker_len) ||
+			io_read_file_into(BOOT_ID_FILE_PATH, boot_id, sizeof(boot_id), &boot_id_len)) {
+		return 0;
+	}
+	return marker_len == boot_id_len && !memcmp(marker, boot_id, marker_len);
+}
+
+// Tells the runtime whether an ADD can succeed, so that pods wait for the node instead of failing and backing
+// off. Only cheap state is read: the readiness marker, the IPAM state and the flags of the underlay.
 int cmd_status(const struct Args* args) {
+	Err err;
+	ERR_INIT(&err);
+
+	if (!node_bootstrapped()) {
+		fprintf(stderr, "node network not bootstrapped: no %s for this boot\n", READY_MARKER_FILE_PATH);
+		ERRF(&err, "Node network not bootstrapped", "sknf-app has not reconciled the node since boot");
+		err.code = CNI_ERR_PLUGIN_NOT_AVAILABLE;
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	unsigned long available;
+	if (ip_available(&err, args->subnet, &available)) {
+		fprintf(stderr, "failure reading IPAM state\n");
+		err.code = CNI_ERR_PLUGIN_NOT_AVAILABLE;
+		emit_error_response(args, err);
+		return 1;
+	}
+	if (available == 0) {
+		fprintf(stderr, "IPAM exhausted: no free IP left in %s\n", args->subnet);
+		ERRF(&err, "IPAM exhausted", "no free IP left in %s", args->subnet);
+		err.code = CNI_ERR_PLUGIN_NOT_AVAILABLE;
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	// the overlay runs over the underlay: running pods lose the other nodes too
+	int running = 0;
+	if (nu_link_running(&err, args->host_physical_interface, &running) || !running) {
+		if (!err.initialized) {
+			fprintf(stderr, "underlay %s is down\n", args->host_physical_interface);
+			ERRF(&err, "Underlay interface down", "%s", args->host_physical_interface);
+		}
+		err.code = CNI_ERR_PLUGIN_NOT_AVAILABLE_LIMITED_CONNECTIVITY;
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	fprintf(stderr, "status: ready, %lu free IPs in %s\n", available, args->subnet);
 	return 0;
 }
 
+// Checks that the container still has what ADD gave it: the lease of its IP (the one of prevResult, when given)
+// and the host end of its pair
 int cmd_check(const struct Args* args) {
+	Err err;
+	ERR_INIT(&err);
+
+	char host_if_name[16];
+	net_host_if_name(host_if_name, args->cni_netns, args->cni_ifname, args->cni_containerid);
+
+	char lease_cidr[CIDR_BUFFER_LEN];
+	if (ip_container_lease(&err, args->cni_containerid, args->cni_ifname, host_if_name, lease_cidr)) {
+		fprintf(stderr, "failure looking up container IP\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+	if (lease_cidr[0] == '\0') {
+		fprintf(stderr, "container %s holds no IP lease\n", args->cni_containerid);
+		ERRF(&err, "Container holds no IP lease", "%s %s", args->cni_containerid, args->cni_ifname);
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	struct in_addr lease_addr;
+	struct in_addr result_addr;
+	int prefix;
+	if (args->prev_result_cidr && (util_cidr_parse(&err, lease_cidr, &lease_addr, &prefix) ||
+			util_cidr_parse(&err, args->prev_result_cidr, &result_addr, &prefix))) {
+		emit_error_response(args, err);
+		return 1;
+	}
+	if (args->prev_result_cidr && lease_addr.s_addr != result_addr.s_addr) {
+		fprintf(stderr, "container %s leases %s, prevResult has %s\n", args->cni_containerid, lease_cidr, args->prev_result_cidr);
+		ERRF(&err, "Container IP does not match prevResult", "lease %s, prevResult %s", lease_cidr, args->prev_result_cidr);
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	if (nlstat_if_nametoindex(host_if_name) == 0) {
+		fprintf(stderr, "host interface %s of container %s is missing\n", host_if_name, args->cni_containerid);
+		ERRF(&err, "Host interface of container missing", "%s", host_if_name);
+		emit_error_response(args, err);
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -131,6 +532,74 @@ int cmd_version(const struct Args* args) {
 	return 0;
 }
 
+// Collects what the attachments missing from cni.dev/valid-attachments left behind when their DEL never ran or
+// failed: the XDP pod map entry, the pair and ifb, the nftables state and the conntrack entries of each IP, and
+// last its lease, as DEL does. The runtime does not run GC concurrently with the ADD of an attachment it did not
+// list. A failure leaves the leases in place, so the next GC collects them again.
 int cmd_gc(const struct Args* args) {
-	return 0;
+	Err err;
+	ERR_INIT(&err);
+
+	struct IpLease* stale = NULL;
+	int count = 0;
+	if (ip_stale_leases(&err, args->valid_attachments, args->valid_attachment_count, &stale, &count)) {
+		fprintf(stderr, "failure listing stale IP leases\n");
+		emit_error_response(args, err);
+		return 1;
+	}
+
+	int rc = 1;
+	const char** cidrs = malloc((size_t)(count ? count : 1) * sizeof(*cidrs));
+	const char** host_ifs = malloc((size_t)(count ? count : 1) * sizeof(*host_ifs));
+	if (!cidrs || !host_ifs) {
+		ERR(&err, "Out of memory collecting stale attachments");
+		goto out;
+	}
+
+	int host_if_count = 0;
+	for (int i = 0; i < count; ++i) {
+		fprintf(stderr, "gc: collecting %s of %s %s\n", stale[i].cidr, stale[i].containerid, stale[i].ifname);
+		cidrs[i] = stale[i].cidr;
+		if (stale[i].host_if[0]) {
+			host_ifs[host_if_count++] = stale[i].host_if;
+		}
+
+		if (args->xdp_decap != XDP_DECAP_OFF && xdp_unmap_pod(&err, stale[i].cidr)) {
+			fprintf(stderr, "failure removing %s from the XDP decap fast path, continuing: %s\n", stale[i].cidr, err.msg);
+			ERR_INIT(&err);
+		}
+	}
+
+	if (count > 0 && net_delete_host_ifs(&err, host_ifs, host_if_count)) {
+		fprintf(stderr, "failure deleting stale container interfaces\n");
+		goto out;
+	}
+
+	if (count > 0 && nft_gc_containers(&err, cidrs, count)) {
+		fprintf(stderr, "failure cleaning up nftables for stale containers\n");
+		goto out;
+	}
+
+	if (count > 0) {
+		flush_conntrack(cidrs, count);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (ip_container_release(&err, stale[i].containerid, stale[i].ifname, stale[i].host_if[0] ? stale[i].host_if : NULL)) {
+			fprintf(stderr, "failure releasing IP of stale container %s\n", stale[i].containerid);
+			goto out;
+		}
+	}
+
+	fprintf(stderr, "gc: collected %d stale attachments\n", count);
+	rc = 0;
+
+out:
+	if (rc) {
+		emit_error_response(args, err);
+	}
+	free(cidrs);
+	free(host_ifs);
+	ip_free_leases(stale, count);
+	return rc;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "args.h"
 
 int cmd_add(const struct Args* args);
+int cmd_add_batch(const struct Args* args);
 int cmd_del(const struct Args* args);
 int cmd_status(const struct Args* args);
 int cmd_check(const struct Args* args);
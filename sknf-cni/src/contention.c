@@ -0,0 +1,42 @@
+#include "contention.h"
+
+#include <stdio.h>
+#include <time.h>
+
+struct Contention contention;
+
+// CLOCK_MONOTONIC is served by the vDSO, so timing adds no syscall to the netlink budgets
+uint64_t contention_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void contention_begin(void) {
+	contention.start_ns = contention_now_ns();
+	contention.netlink = CONTENTION_RTNETLINK;
+}
+
+void contention_wait(enum ContentionResource resource, uint64_t since_ns, int contended) {
+	struct ContentionWait* w = &contention.waits[resource];
+	w->waits++;
+	w->contended += contended != 0;
+	w->ns += contention_now_ns() - since_ns;
+}
+
+static unsigned long us(uint64_t ns) {
+	return (unsigned long)(ns / 1000);
+}
+
+// Prints the wall time of the command and its waits, in microseconds
+void contention_report(const struct Args* args) {
+	const struct ContentionWait* w = contention.waits;
+	fprintf(stderr, "contention: %s took %lu us, waited %lu us on %lu IPAM locks (%lu contended), %lu us on %lu rtnetlink replies, "
+		"%lu us on %lu conntrack replies, %lu us on %lu nftables commits, %lu node objects raced, %lu nftables commits rejected\n",
+		args->cni_command, us(contention_now_ns() - contention.start_ns),
+		us(w[CONTENTION_IPAM_LOCK].ns), w[CONTENTION_IPAM_LOCK].waits, w[CONTENTION_IPAM_LOCK].contended,
+		us(w[CONTENTION_RTNETLINK].ns), w[CONTENTION_RTNETLINK].waits,
+		us(w[CONTENTION_CONNTRACK].ns), w[CONTENTION_CONNTRACK].waits,
+		us(w[CONTENTION_NFTABLES].ns), w[CONTENTION_NFTABLES].waits,
+		contention.node_object_races, contention.nft_rejected);
+}
@@ -0,0 +1,40 @@
+#ifndef SKNF_CONTENTION_H
+#define SKNF_CONTENTION_H
+
+#include <stdint.h>
+#include "args.h"
+
+// Resources the invocations of a node share, where parallel pod starts serialize
+enum ContentionResource {
+	CONTENTION_IPAM_LOCK, // flock of the IPAM state
+	CONTENTION_RTNETLINK, // rtnetlink replies, held back by the rtnl_lock of the kernel
+	CONTENTION_CONNTRACK, // ctnetlink replies of the conntrack flush
+	CONTENTION_NFTABLES, // nftables transactions, serialized by the commit mutex of the netns
+	CONTENTION_RESOURCE_COUNT,
+};
+
+struct ContentionWait {
+	unsigned long waits;
+	unsigned long contended; // waits that could not be satisfied right away (only known for the IPAM lock)
+	uint64_t ns;
+};
+
+// Time the current command (one command per process) spent waiting on shared resources, reported with the
+// netlink traffic for scripts/stress-cni.sh. Netlink replies are charged to 'netlink', rtnetlink unless a
+// conntrack flush is running.
+struct Contention {
+	uint64_t start_ns;
+	enum ContentionResource netlink;
+	struct ContentionWait waits[CONTENTION_RESOURCE_COUNT];
+	unsigned long node_object_races; // brsknf or vxsknf created by a concurrent ADD in between our check and creation
+	unsigned long nft_rejected; // nftables transactions rejected (e.g. a hostPort taken by a concurrent ADD)
+};
+
+extern struct Contention contention;
+
+uint64_t contention_now_ns(void);
+void contention_begin(void);
+void contention_wait(enum ContentionResource resource, uint64_t since_ns, int contended);
+void contention_report(const struct Args* args);
+
+#endif
@@ -0,0 +1,401 @@
+#include "ct.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <netlink/netlink.h>
+#include <netlink/attr.h>
+#include <netlink/msg.h>
+#include <netlink/socket.h>
+#include <sys/uio.h>
+
+#include "contention.h"
+#include "nlstat.h"
+#include "util.h"
+
+// Dump filter flags of ctnetlink (net/netfilter/nf_conntrack_netlink.c, Linux 5.10+), which the uapi does not export
+#define CTA_FILTER_F_CTA_IP_SRC (1 << 0)
+
+// Deletions sharing a sendmsg. Only the last one of a window is acknowledged when it succeeds, but failures
+// always are, so the window has to fit the socket's (32KiB) receive buffer when every deletion fails.
+#define CT_DELETE_PIPELINE_DEPTH 32
+
+// CTA_TUPLE_ORIG of an IPv4 entry (addresses, ports or ICMP id/type/code, zone) is about 60 bytes
+#define CT_TUPLE_BUFFER_LEN 128
+
+// Entry to delete: its original tuple, plus the id and zone the kernel reported with it
+struct CtEntry {
+	unsigned char tuple[CT_TUPLE_BUFFER_LEN]; // CTA_TUPLE_ORIG, attribute header included
+	int has_id;
+	uint32_t id;
+	int has_zone;
+	uint16_t zone;
+};
+
+struct CtDump {
+	const uint32_t* ips; // pod IPs being flushed, network order
+	int ip_count;
+	uint32_t ip; // IP of the running dump
+	int dir; // direction of the running dump: CTA_TUPLE_ORIG or CTA_TUPLE_REPLY
+	struct CtEntry* entries;
+	int count;
+	int cap;
+	int failed;
+};
+
+struct CtDeleteAcks {
+	unsigned int last_seq;
+	int done;
+	unsigned long failed;
+	int error; // first failure other than ENOENT, as a (negative) errno
+};
+
+static int tuple_src(struct nlattr* tuple, uint32_t* src) {
+	struct nlattr* t[CTA_TUPLE_MAX + 1];
+	struct nlattr* ip[CTA_IP_MAX + 1];
+
+	if (nla_parse_nested(t, CTA_TUPLE_MAX, tuple, NULL) < 0 || !t[CTA_TUPLE_IP]) {
+		return 1;
+	}
+	if (nla_parse_nested(ip, CTA_IP_MAX, t[CTA_TUPLE_IP], NULL) < 0 || !ip[CTA_IP_V4_SRC]) {
+		return 1;
+	}
+	*src = nla_get_u32(ip[CTA_IP_V4_SRC]);
+	return 0;
+}
+
+static int is_pod_ip(const struct CtDump* dump, uint32_t ip) {
+	for (int i = 0; i < dump->ip_count; ++i) {
+		if (dump->ips[i] == ip) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int ct_dump_entry(struct nl_msg* msg, void* arg) {
+	struct CtDump* dump = arg;
+	struct nlattr* tb[CTA_MAX + 1];
+	uint32_t orig_src, dir_src;
+
+	if (nlmsg_parse(nlmsg_hdr(msg), sizeof(struct nfgenmsg), tb, CTA_MAX, NULL) < 0 || !tb[CTA_TUPLE_ORIG] || !tb[dump->dir]) {
+		return NL_SKIP;
+	}
+	if (tuple_src(tb[CTA_TUPLE_ORIG], &orig_src) || tuple_src(tb[dump->dir], &dir_src)) {
+		return NL_SKIP;
+	}
+
+	// kernels without dump filters send the whole table
+	if (dir_src != dump->ip) {
+		return NL_SKIP;
+	}
+	// collected by the dump of the original direction of a pod IP
+	if (dump->dir == CTA_TUPLE_REPLY && is_pod_ip(dump, orig_src)) {
+		return NL_SKIP;
+	}
+
+	int tuple_len = nla_total_size(nla_len(tb[CTA_TUPLE_ORIG]));
+	if (tuple_len > CT_TUPLE_BUFFER_LEN) {
+		fprintf(stderr, "skipping conntrack entry with a %d byte tuple\n", tuple_len);
+		return NL_SKIP;
+	}
+
+	if (dump->count == dump->cap) {
+		int cap = dump->cap ? dump->cap * 2 : 16;
+		struct CtEntry* entries = realloc(dump->entries, cap * sizeof(*entries));
+		if (!entries) {
+			dump->failed = 1;
+			return NL_STOP;
+		}
+		dump->entries = entries;
+		dump->cap = cap;
+	}
+
+	struct CtEntry* entry = &dump->entries[dump->count++];
+	memcpy(entry->tuple, tb[CTA_TUPLE_ORIG], tuple_len);
+	entry->has_id = tb[CTA_ID] != NULL;
+	entry->id = entry->has_id ? nla_get_u32(tb[CTA_ID]) : 0;
+	entry->has_zone = tb[CTA_ZONE] != NULL;
+	entry->zone = entry->has_zone ? nla_get_u16(tb[CTA_ZONE]) : 0;
+	return NL_OK;
+}
+
+static struct nl_msg* build_ct_msg(int type, int flags) {
+	struct nfgenmsg hdr = {
+		.nfgen_family = AF_INET,
+		.version = NFNETLINK_V0,
+		.res_id = 0,
+	};
+
+	struct nl_msg* msg = nlmsg_alloc_simple((NFNL_SUBSYS_CTNETLINK << 8) | type, flags);
+	if (!msg) {
+		return NULL;
+	}
+	if (nlmsg_append(msg, &hdr, sizeof(hdr), NLMSG_ALIGNTO) < 0) {
+		nlmsg_free(msg);
+		return NULL;
+	}
+	return msg;
+}
+
+// Dump of the entries whose tuple of direction 'dir' has 'ip' as source, filtered by the kernel
+static struct nl_msg* build_dump_msg(uint32_t ip, int dir) {
+	struct nl_msg* msg = build_ct_msg(IPCTNL_MSG_CT_GET, NLM_F_REQUEST | NLM_F_DUMP);
+	if (!msg) {
+		return NULL;
+	}
+
+	struct nlattr* tuple = nla_nest_start(msg, dir);
+	if (!tuple) goto nla_put_failure;
+	struct nlattr* tuple_ip = nla_nest_start(msg, CTA_TUPLE_IP);
+	if (!tuple_ip) goto nla_put_failure;
+	NLA_PUT_U32(msg, CTA_IP_V4_SRC, ip);
+	nla_nest_end(msg, tuple_ip);
+	nla_nest_end(msg, tuple);
+
+	struct nlattr* filter = nla_nest_start(msg, CTA_FILTER);
+	if (!filter) goto nla_put_failure;
+	NLA_PUT_U32(msg, dir == CTA_TUPLE_ORIG ? CTA_FILTER_ORIG_FLAGS : CTA_FILTER_REPLY_FLAGS, CTA_FILTER_F_CTA_IP_SRC);
+	nla_nest_end(msg, filter);
+	return msg;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+static struct nl_msg* build_delete_msg(const struct CtEntry* entry, int ack) {
+	struct nl_msg* msg = build_ct_msg(IPCTNL_MSG_CT_DELETE, NLM_F_REQUEST | (ack ? NLM_F_ACK : 0));
+	if (!msg) {
+		return NULL;
+	}
+
+	const struct nlattr* tuple = (const struct nlattr*)entry->tuple;
+	if (nla_put(msg, CTA_TUPLE_ORIG, nla_len(tuple), nla_data(tuple)) < 0) goto nla_put_failure;
+	// the id makes the kernel keep an entry that reuses the tuple since the dump
+	if (entry->has_id) NLA_PUT_U32(msg, CTA_ID, entry->id);
+	if (entry->has_zone) NLA_PUT_U16(msg, CTA_ZONE, entry->zone);
+	return msg;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+static int dump_entries(Err* err, struct nl_sock* sk, struct nl_cb* cb, struct CtDump* dump, uint32_t ip, int dir) {
+	int nl_err = 0;
+	struct nl_msg* msg = build_dump_msg(ip, dir);
+	if (!msg) {
+		fprintf(stderr, "failure building conntrack dump request\n");
+		ERR(err, "Failure building conntrack dump request");
+		return 1;
+	}
+
+	dump->ip = ip;
+	dump->dir = dir;
+	nl_err = nl_send_auto(sk, msg);
+	nlmsg_free(msg);
+	if (nl_err < 0) {
+		fprintf(stderr, "failure sending conntrack dump request: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure sending conntrack dump request", "%s", nl_geterror(nl_err));
+		return 1;
+	}
+
+	if ((nl_err = nl_recvmsgs(sk, cb)) < 0) {
+		fprintf(stderr, "failure reading conntrack dump: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure reading conntrack dump", "%s", nl_geterror(nl_err));
+		return 1;
+	}
+	if (dump->failed) {
+		fprintf(stderr, "failure allocating conntrack entries\n");
+		ERR(err, "Failure allocating conntrack entries");
+		return 1;
+	}
+	return 0;
+}
+
+static int ct_delete_ack(struct nl_msg* msg, void* arg) {
+	struct CtDeleteAcks* acks = arg;
+	if (nlmsg_hdr(msg)->nlmsg_seq != acks->last_seq) {
+		return NL_OK;
+	}
+	acks->done = 1;
+	return NL_STOP;
+}
+
+static int ct_delete_error(struct sockaddr_nl* nla, struct nlmsgerr* e, void* arg) {
+	struct CtDeleteAcks* acks = arg;
+	acks->failed++;
+	// ENOENT: the entry expired, or its tuple was reused, since the dump
+	if (e->error != -ENOENT && !acks->error) {
+		acks->error = e->error;
+	}
+	if (e->msg.nlmsg_seq == acks->last_seq) {
+		acks->done = 1;
+		return NL_STOP;
+	}
+	return NL_SKIP;
+}
+
+// Deletes up to CT_DELETE_PIPELINE_DEPTH entries with one sendmsg and returns how many the kernel removed
+static int delete_entries(Err* err, struct nl_sock* sk, const struct CtEntry* entries, int count, unsigned long* removed) {
+	int rc = 1;
+	int nl_err = 0;
+	struct nl_msg* msgs[CT_DELETE_PIPELINE_DEPTH] = { NULL };
+	struct iovec iov[CT_DELETE_PIPELINE_DEPTH];
+	struct nl_cb* cb = NULL;
+	size_t bytes = 0;
+
+	for (int i = 0; i < count; ++i) {
+		msgs[i] = build_delete_msg(&entries[i], i == count - 1);
+		if (!msgs[i]) {
+			fprintf(stderr, "failure building conntrack delete request\n");
+			ERR(err, "Failure building conntrack delete request");
+			goto out;
+		}
+		nl_complete_msg(sk, msgs[i]);
+		iov[i].iov_base = nlmsg_hdr(msgs[i]);
+		iov[i].iov_len = nlmsg_hdr(msgs[i])->nlmsg_len;
+		bytes += iov[i].iov_len;
+	}
+
+	struct CtDeleteAcks acks = {
+		.last_seq = nlmsg_hdr(msgs[count - 1])->nlmsg_seq,
+	};
+
+	// the clone keeps the nlstat instrumentation of the socket
+	cb = nl_cb_clone(nl_socket_get_cb(sk));
+	if (!cb) {
+		fprintf(stderr, "failure allocating netlink callbacks\n");
+		ERR(err, "Failure allocating netlink callbacks");
+		goto out;
+	}
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ct_delete_ack, &acks);
+	nl_cb_err(cb, NL_CB_CUSTOM, ct_delete_error, &acks);
+
+	nl_err = nl_send_iovec(sk, msgs[0], iov, count);
+	nlstat.syscalls++;
+	if (nl_err < 0) {
+		fprintf(stderr, "failure sending conntrack delete requests: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure sending conntrack delete requests", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+	nlstat_count_sent(bytes, count);
+
+	while (!acks.done) {
+		if ((nl_err = nl_recvmsgs(sk, cb)) < 0) {
+			fprintf(stderr, "failure reading conntrack delete acknowledgements: %s\n", nl_geterror(nl_err));
+			ERRF(err, "Failure reading conntrack delete acknowledgements", "%s", nl_geterror(nl_err));
+			goto out;
+		}
+	}
+
+	*removed += count - acks.failed;
+	if (acks.error) {
+		fprintf(stderr, "failure deleting conntrack entry: %s\n", strerror(-acks.error));
+		ERRF(err, "Failure deleting conntrack entry", "%s", strerror(-acks.error));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (cb) nl_cb_put(cb);
+	for (int i = 0; i < count; ++i) {
+		if (msgs[i]) nlmsg_free(msgs[i]);
+	}
+	return rc;
+}
+
+// Removes the conntrack entries of pod IPs that are released or handed out again, so that a new pod never
+// inherits the NAT bindings or the state of a flow of the previous owner of its IP. The kernel filters two dumps
+// per IP (the IP as source of the original tuple, for flows opened by the pod, and of the reply tuple, for flows
+// to the pod, DNATed ones included), and the matching entries are deleted in pipelined windows. Ctnetlink has no
+// filtered flush that reports what it removed, and kernels before 5.10 ignore dump filters, hence the per-entry
+// deletion and the check of every dumped tuple.
+int ct_flush_pod_ips(Err* err, const char* const* pod_cidrs, int count, unsigned long* removed) {
+	int rc = 1;
+	int nl_err = 0;
+	struct nl_sock* sk = NULL;
+	struct nl_cb* cb = NULL;
+	uint32_t ips[MAX_BATCH_CONTAINERS];
+	struct CtDump dump = {
+		.ips = ips,
+		.ip_count = count,
+	};
+
+	*removed = 0;
+	if (count > MAX_BATCH_CONTAINERS) {
+		fprintf(stderr, "too many pod IPs to flush from conntrack: %d\n", count);
+		ERRF(err, "Too many pod IPs to flush from conntrack", "%d", count);
+		return 1;
+	}
+	for (int i = 0; i < count; ++i) {
+		struct in_addr addr;
+		int prefix;
+		if (util_cidr_parse(err, pod_cidrs[i], &addr, &prefix)) {
+			return 1;
+		}
+		ips[i] = addr.s_addr;
+	}
+
+	sk = nl_socket_alloc();
+	if (!sk) {
+		fprintf(stderr, "error allocating netlink socket\n");
+		ERR(err, "Error allocating netlink socket");
+		goto out;
+	}
+	nlstat_instrument(sk);
+	if ((nl_err = nl_connect(sk, NETLINK_NETFILTER)) < 0) {
+		fprintf(stderr, "error creating/connecting to netlink socket: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Error creating/connecting to netlink socket", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+	// deletions ask for their acknowledgement themselves (see delete_entries); this also lifts the strict
+	// sequence check of libnl, which expects one acknowledgement per request
+	nl_socket_disable_auto_ack(sk);
+
+	// the clone keeps the nlstat instrumentation of the socket
+	cb = nl_cb_clone(nl_socket_get_cb(sk));
+	if (!cb) {
+		fprintf(stderr, "failure allocating netlink callbacks\n");
+		ERR(err, "Failure allocating netlink callbacks");
+		goto out;
+	}
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, ct_dump_entry, &dump);
+
+	contention.netlink = CONTENTION_CONNTRACK;
+	for (int i = 0; i < count; ++i) {
+		if (dump_entries(err, sk, cb, &dump, ips[i], CTA_TUPLE_ORIG) ||
+				dump_entries(err, sk, cb, &dump, ips[i], CTA_TUPLE_REPLY)) {
+			goto out;
+		}
+	}
+	nlstat.conntrack_entries += dump.count;
+
+	for (int i = 0; i < dump.count; i += CT_DELETE_PIPELINE_DEPTH) {
+		int n = dump.count - i < CT_DELETE_PIPELINE_DEPTH ? dump.count - i : CT_DELETE_PIPELINE_DEPTH;
+		if (delete_entries(err, sk, &dump.entries[i], n, removed)) {
+			goto out;
+		}
+	}
+
+	if (count == 1) {
+		fprintf(stderr, "conntrack: removed %lu entries of %s\n", *removed, pod_cidrs[0]);
+	} else {
+		fprintf(stderr, "conntrack: removed %lu entries of %d pod IPs\n", *removed, count);
+	}
+	rc = 0;
+
+out:
+	contention.netlink = CONTENTION_RTNETLINK;
+	free(dump.entries);
+	if (cb) nl_cb_put(cb);
+	if (sk) nl_socket_free(sk);
+	return rc;
+}
@@ -0,0 +1,9 @@
+#ifndef SKNF_CT_H
+#define SKNF_CT_H
+
+#include "def.h"
+#include "err.h"
+
+int ct_flush_pod_ips(Err* err, const char* const* pod_cidrs, int count, unsigned long* removed);
+
+#endif
@@ -7,9 +7,105 @@
 #define CNI_CMD_CHECK "CHECK"
 #define CNI_CMD_GC "GC"
 #define CNI_CMD_VERSION "VERSION"
+// sknf extension: ADD of every container listed under "containers" in the config, in one invocation
+#define CNI_CMD_ADD_BATCH "ADD_BATCH"
 
-#define CNI_VERSION "0.4.0"
+// Newest version of the CNI spec spoken by the plugin. Results are in the version of the request; 0.4.0 ones
+// still carry the per-IP "version" that 1.0 removed.
+#define CNI_VERSION "1.1.0"
+#define CNI_SUPPORTED_VERSIONS { "0.4.0", "1.0.0", "1.1.0" }
+
+// CNI error codes of STATUS: ADD cannot be served (50), and neither can the pods already running (51)
+#define CNI_ERR_PLUGIN_NOT_AVAILABLE 50
+#define CNI_ERR_PLUGIN_NOT_AVAILABLE_LIMITED_CONNECTIVITY 51
 
 #define CIDR_BUFFER_LEN 64
 
+// Traffic shaping requested through the 'bandwidth' capability (runtimeConfig).
+// Rates are in bits per second and bursts in bits, as in the CNI convention; 0 means unlimited.
+// 'ingress' is traffic entering the pod, 'egress' is traffic leaving it.
+// tbf takes rates and buckets as an int of bytes, so anything outside [BANDWIDTH_MIN_RATE, BANDWIDTH_MAX] is
+// rejected; bursts below BANDWIDTH_MIN_BURST (one full-sized frame, or tbf drops everything) are raised to it.
+struct Bandwidth {
+	unsigned long long ingress_rate;
+	unsigned long long ingress_burst;
+	unsigned long long egress_rate;
+	unsigned long long egress_burst;
+};
+
+#define BANDWIDTH_MIN_RATE 8ULL
+#define BANDWIDTH_MIN_BURST (1600ULL * 8)
+#define BANDWIDTH_MAX (2147483647ULL * 8)
+
+#define MAX_EGRESS_IPS 16
+
+// Source NAT of traffic leaving the cluster ('egressIPs' and 'egressPortRange' in the CNI config).
+// Without egress IPs, traffic is masqueraded behind the physical interface address; a zero port
+// range leaves the whole ephemeral range to the kernel.
+struct Snat {
+	const char* ips[MAX_EGRESS_IPS];
+	int ip_count;
+	unsigned short port_min;
+	unsigned short port_max;
+};
+
+#define MAX_PORT_MAPPINGS 32
+
+// Host port forwarded to the pod, requested through the 'portMappings' capability (runtimeConfig).
+// Ports are in host order; 'protocol' is an IPPROTO_* number.
+struct PortMapping {
+	unsigned short host_port;
+	unsigned short container_port;
+	unsigned char protocol;
+};
+
+// Kind of the pod interface pair ('podInterface' in the CNI config). netkit pairs need Linux 6.7+; sknf-app
+// probes for them at bootstrap and the plugin still falls back to veth when the kernel rejects them.
+enum PodInterface {
+	POD_INTERFACE_VETH,
+	POD_INTERFACE_NETKIT,
+};
+
+// How the host end of the pod pair is wired ('podAttach' in the CNI config). Bridged pods share brsknf's
+// L2 domain. Routed pods get a /32 address and a link-local gateway answered by proxy ARP on their host
+// end, which stays unbridged and is reached through a /32 host route.
+enum PodAttach {
+	POD_ATTACH_BRIDGE,
+	POD_ATTACH_ROUTED,
+};
+
+// XDP VXLAN decapsulation fast path attached by sknf-app to the physical interface ('xdpDecap' in the CNI
+// config). When on, pods are added to and removed from its pinned pod map. Native redirects into a veth
+// need a NAPI instance on the pod end, so GRO is enabled there.
+enum XdpDecap {
+	XDP_DECAP_OFF,
+	XDP_DECAP_GENERIC,
+	XDP_DECAP_NATIVE,
+};
+
+#define MAX_SYSCTLS 16
+
+// Sysctl applied inside the pod netns ('sysctls' in the CNI config), e.g. net.core.somaxconn.
+// Only net.* sysctls are namespaced, so nothing else is accepted.
+struct Sysctl {
+	const char* name;
+	const char* value;
+};
+
+#define MAX_BATCH_CONTAINERS 128
+
+// Container of an ADD_BATCH ('containers' in the config), standing for the CNI_CONTAINERID, CNI_NETNS and
+// CNI_IFNAME of a single ADD.
+struct BatchContainer {
+	const char* containerid;
+	const char* netns;
+	const char* ifname;
+};
+
+// Attachment the runtime still knows of, listed by GC under 'cni.dev/valid-attachments'
+struct Attachment {
+	const char* containerid;
+	const char* ifname;
+};
+
 #endif
\ No newline at end of file
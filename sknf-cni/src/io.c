@@ -64,6 +64,48 @@ int io_read_file_into(const char *path, char *buf, size_t bufsize, size_t *out_l
 	return rc;
 }
 
+/* Reads 'f' until EOF into a malloc'd, NUL-terminated buffer that grows as needed (the caller frees it) */
+int io_read_stream(FILE *f, char **out, size_t *out_len) {
+	size_t cap = 64 * 1024;
+	size_t total = 0;
+	char *buf = malloc(cap);
+	if (!buf) {
+		fprintf(stderr, "io_read_stream: malloc\n");
+		return -1;
+	}
+
+	for (;;) {
+		/* Reserve 1 byte for '\0' */
+		if (total == cap - 1) {
+			char *grown = realloc(buf, cap * 2);
+			if (!grown) {
+				fprintf(stderr, "io_read_stream: realloc\n");
+				free(buf);
+				return -1;
+			}
+			buf = grown;
+			cap *= 2;
+		}
+
+		size_t n = fread(buf + total, 1, cap - 1 - total, f);
+		total += n;
+
+		if (n == 0) {
+			if (feof(f)) break;
+			if (ferror(f)) {
+				fprintf(stderr, "io_read_stream: fread\n");
+				free(buf);
+				return -1;
+			}
+		}
+	}
+
+	buf[total] = '\0';
+	*out = buf;
+	if (out_len) *out_len = total;
+	return 0;
+}
+
 int io_write_text(const char *path, const char *buf) {
 	if (!path || !buf) {
 		fprintf(stderr, "io_write_text: invalid arguments\n");
@@ -3,13 +3,42 @@
 
 #include <stdio.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/file.h>
+#include <unistd.h>
 
+#include "contention.h"
+#include "net.h"
 #include "util.h"
 
 #define IP_INFO_FILE_PATH "/tmp/sknf-cni-ips"
+#define IP_INFO_LOCK_FILE_PATH "/tmp/sknf-cni-ips.lock"
+// One line per IP handed out: "<ip> <containerid> <ifname> <host interface>" while a container holds it, "<ip>"
+// alone once the DEL of that container released it. Released IPs up to the last one handed out are handed out
+// again first. Leases written before the host interface was recorded lack it.
+#define IP_LEASES_FILE_PATH "/tmp/sknf-cni-ips-leases"
+#define IP_LEASES_TMP_FILE_PATH "/tmp/.sknf-cni-ips-leases.tmp"
+// Container id and ifname of the leases sknf-app rebuilds for the pods it finds without one (see rebuildIpam in
+// sknf-app/internal/reconcile); they are released through their host interface
+#define IP_LEASE_UNKNOWN "-"
+
+struct Lease {
+	uint32_t ip; // host order
+	// NULL once released
+	const char* containerid;
+	const char* ifname;
+	const char* host_if; // NULL when not recorded
+};
+
+struct Leases {
+	char* buf;
+	struct Lease* leases;
+	int count;
+};
 
 static int get_first_allocable_ip(Err* err, const char* cidr, char out[CIDR_BUFFER_LEN]) {
 	struct in_addr addr;
@@ -62,9 +91,37 @@ int ip_bridge(Err* err, const char* node_cidr, const char* cluster_cidr, char ou
 	return 0;
 }
 
-// TODO: This function will not work properly if CNI plugin is invoked in multiple times in parallel, because we
-// don't lock on the file.
-int ip_container_acquire(Err* err, const char* node_cidr, const char* cluster_cidr, char out[CIDR_BUFFER_LEN]) {
+// Lock held around every read-modify-write of IP_INFO_FILE_PATH, so that parallel ADDs never hand out the same IP
+static int lock_ip_info(Err* err) {
+	int fd = open(IP_INFO_LOCK_FILE_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "lock_ip_info: failure opening '%s': %s\n", IP_INFO_LOCK_FILE_PATH, strerror(errno));
+		ERRF(err, "Failure opening IPAM lock", "'%s': %s", IP_INFO_LOCK_FILE_PATH, strerror(errno));
+		return -1;
+	}
+
+	// a failed non-blocking attempt tells a contended acquisition apart
+	uint64_t start_ns = contention_now_ns();
+	int contended = 0;
+	while (flock(fd, contended ? LOCK_EX : LOCK_EX | LOCK_NB)) {
+		if (errno == EINTR) continue;
+		if (errno == EWOULDBLOCK && !contended) {
+			contended = 1;
+			continue;
+		}
+		fprintf(stderr, "lock_ip_info: failure locking '%s': %s\n", IP_INFO_LOCK_FILE_PATH, strerror(errno));
+		ERRF(err, "Failure locking IPAM", "'%s': %s", IP_INFO_LOCK_FILE_PATH, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	contention_wait(CONTENTION_IPAM_LOCK, start_ns, contended);
+
+	return fd;
+}
+
+// Reads the first IP for containers, the last IP handed out (the bridge IP on a fresh node) and the end of the
+// allocable range, the IP reserved for the prober, all in host order. Called with the IPAM lock held.
+static int read_ip_info(Err* err, const char* node_cidr, uint32_t* first, uint32_t* last_acquired, uint32_t* end) {
 	size_t file_length = 0;
 	char last_acquired_cidr[CIDR_BUFFER_LEN];
 
@@ -102,6 +159,145 @@ int ip_container_acquire(Err* err, const char* node_cidr, const char* cluster_ci
 		return 1;
 	}
 
+	// Parse node CIDR
+	struct in_addr node_cidr_addr;
+	int node_cidr_prefix;
+	if (util_cidr_parse(err, node_cidr, &node_cidr_addr, &node_cidr_prefix)) {
+		fprintf(stderr, "ip_container_acquire: unable to parse node CIDR %s\n", node_cidr);
+		return 1;
+	}
+
+	// the last IP of the node CIDR is reserved for the sknf-app prober (see sknf-app/internal/probe)
+	uint32_t node_host_mask = node_cidr_prefix >= 32 ? 0 : 0xFFFFFFFFu >> node_cidr_prefix;
+	*first = ntohl(node_cidr_addr.s_addr) + 2;
+	*end = ntohl(node_cidr_addr.s_addr) | node_host_mask;
+	*last_acquired = ntohl(last_acquired_cidr_addr.s_addr);
+	return 0;
+}
+
+static void free_leases(struct Leases* leases) {
+	free(leases->buf);
+	free(leases->leases);
+}
+
+// Reads the leases, with room for 'extra' more. Lines that do not parse are dropped. Called with the IPAM lock held.
+static int read_leases(Err* err, int extra, struct Leases* out) {
+	memset(out, 0, sizeof(*out));
+	FILE* f = fopen(IP_LEASES_FILE_PATH, "rb");
+	if (!f && errno != ENOENT) {
+		fprintf(stderr, "read_leases: failure opening '%s': %s\n", IP_LEASES_FILE_PATH, strerror(errno));
+		ERRF(err, "Failure opening IPAM leases", "'%s': %s", IP_LEASES_FILE_PATH, strerror(errno));
+		return 1;
+	}
+	if (f) {
+		int rc = io_read_stream(f, &out->buf, NULL);
+		fclose(f);
+		if (rc) {
+			ERRF(err, "Failure reading IPAM leases", "'%s'", IP_LEASES_FILE_PATH);
+			return 1;
+		}
+	}
+
+	int lines = 0;
+	for (const char* c = out->buf; c && *c; ++c) {
+		lines += *c == '\n';
+	}
+	// the last line may lack its newline
+	out->leases = malloc((size_t)(lines + 1 + extra) * sizeof(struct Lease));
+	if (!out->leases) {
+		ERR(err, "Out of memory reading IPAM leases");
+		free_leases(out);
+		return 1;
+	}
+
+	char* save_line;
+	for (char* line = out->buf ? strtok_r(out->buf, "\n", &save_line) : NULL; line; line = strtok_r(NULL, "\n", &save_line)) {
+		char* save_field;
+		const char* ip = strtok_r(line, " ", &save_field);
+		struct Lease* lease = &out->leases[out->count];
+		struct in_addr addr;
+		if (!ip || inet_pton(AF_INET, ip, &addr) != 1) {
+			fprintf(stderr, "read_leases: dropping invalid lease '%s'\n", line);
+			continue;
+		}
+		lease->ip = ntohl(addr.s_addr);
+		lease->containerid = strtok_r(NULL, " ", &save_field);
+		lease->ifname = lease->containerid ? strtok_r(NULL, " ", &save_field) : NULL;
+		lease->host_if = lease->ifname ? strtok_r(NULL, " ", &save_field) : NULL;
+		if (lease->containerid && !lease->ifname) {
+			fprintf(stderr, "read_leases: dropping invalid lease of %s\n", ip);
+			continue;
+		}
+		++out->count;
+	}
+	return 0;
+}
+
+// Replaces the leases file, through a rename so that a failed write never leaves half of it
+static int write_leases(Err* err, const struct Leases* leases) {
+	char* text = NULL;
+	size_t text_len = 0;
+	FILE* f = open_memstream(&text, &text_len);
+	if (!f) {
+		ERR(err, "Out of memory writing IPAM leases");
+		return 1;
+	}
+	for (int i = 0; i < leases->count; ++i) {
+		const struct Lease* lease = &leases->leases[i];
+		struct in_addr addr = { .s_addr = htonl(lease->ip) };
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+		if (lease->containerid && lease->host_if) {
+			fprintf(f, "%s %s %s %s\n", ip, lease->containerid, lease->ifname, lease->host_if);
+		} else if (lease->containerid) {
+			fprintf(f, "%s %s %s\n", ip, lease->containerid, lease->ifname);
+		} else {
+			fprintf(f, "%s\n", ip);
+		}
+	}
+	if (fclose(f)) {
+		free(text);
+		ERR(err, "Out of memory writing IPAM leases");
+		return 1;
+	}
+
+	int rc = io_write_text(IP_LEASES_TMP_FILE_PATH, text);
+	free(text);
+	if (rc || rename(IP_LEASES_TMP_FILE_PATH, IP_LEASES_FILE_PATH)) {
+		fprintf(stderr, "write_leases: failure writing '%s'\n", IP_LEASES_FILE_PATH);
+		ERRF(err, "Failure writing IPAM leases", "'%s'", IP_LEASES_FILE_PATH);
+		return 1;
+	}
+	return 0;
+}
+
+// A released IP is handed out again only up to the last IP handed out: the IPs after it are handed out in
+// order, and overwrite their lease then
+static int lease_reusable(const struct Lease* lease, uint32_t first, uint32_t last_acquired) {
+	return !lease->containerid && lease->ip >= first && lease->ip <= last_acquired;
+}
+
+// A lease is held by the interface 'ifname' of the container, or by the host interface of its pair when the
+// container is not recorded (IP_LEASE_UNKNOWN)
+static int lease_held_by(const struct Lease* lease, const char* containerid, const char* ifname, const char* host_if) {
+	if (!lease->containerid) {
+		return 0;
+	}
+	if (!strcmp(lease->containerid, containerid) && !strcmp(lease->ifname, ifname)) {
+		return 1;
+	}
+	return host_if && lease->host_if && !strcmp(lease->host_if, host_if);
+}
+
+static int acquire_many(Err* err, const char* node_cidr, const char* cluster_cidr, const struct BatchContainer* containers,
+		int count, char out[][CIDR_BUFFER_LEN]) {
+	uint32_t first_ip_int;
+	uint32_t ip_int;
+	uint32_t end_ip_int;
+	if (read_ip_info(err, node_cidr, &first_ip_int, &ip_int, &end_ip_int)) {
+		return 1;
+	}
+
 	// Parse cluster CIDR
 	struct in_addr cluster_cidr_addr;
 	int cluster_cidr_prefix;
@@ -110,25 +306,284 @@ int ip_container_acquire(Err* err, const char* node_cidr, const char* cluster_ci
 		return 1;
 	}
 
-	uint32_t ip_int = ntohl(last_acquired_cidr_addr.s_addr);
-	++ip_int; // no subnet checking yet
-	last_acquired_cidr_addr.s_addr = htonl(ip_int);
+	struct Leases leases;
+	if (read_leases(err, count, &leases)) {
+		return 1;
+	}
+
+	int rc = 1;
+	char (*host_ifs)[16] = malloc((size_t)count * sizeof(*host_ifs));
+	if (!host_ifs) {
+		ERR(err, "Out of memory acquiring IPs");
+		goto out;
+	}
+
+	uint32_t reusable = 0;
+	for (int i = 0; i < leases.count; ++i) {
+		reusable += lease_reusable(&leases.leases[i], first_ip_int, ip_int);
+	}
+
+	// IPs past the node CIDR belong to the pods of another node
+	uint32_t fresh = ip_int < end_ip_int ? end_ip_int - ip_int - 1 : 0;
+	if ((uint64_t)reusable + fresh < (uint64_t)count) {
+		fprintf(stderr, "ip_container_acquire: IPAM exhausted, %d IPs requested from %s\n", count, node_cidr);
+		ERRF(err, "IPAM exhausted", "%d IPs requested from %s", count, node_cidr);
+		goto out;
+	}
+
+	// released IPs first, then the ones after the last IP handed out
+	int next_lease = 0;
+	int last_fresh = -1;
+	for (int i = 0; i < count; ++i) {
+		struct Lease* lease = NULL;
+		while (next_lease < leases.count && !lease_reusable(&leases.leases[next_lease], first_ip_int, ip_int)) {
+			++next_lease;
+		}
+		if (next_lease < leases.count) {
+			lease = &leases.leases[next_lease++];
+		} else {
+			++ip_int;
+			last_fresh = i;
+			// a lease left from a state sknf-app reset is overwritten
+			for (int j = 0; j < leases.count && !lease; ++j) {
+				if (leases.leases[j].ip == ip_int) {
+					lease = &leases.leases[j];
+				}
+			}
+			if (!lease) {
+				lease = &leases.leases[leases.count++];
+				lease->ip = ip_int;
+			}
+		}
+		net_host_if_name(host_ifs[i], containers[i].netns, containers[i].ifname, containers[i].containerid);
+		lease->containerid = containers[i].containerid;
+		lease->ifname = containers[i].ifname;
+		lease->host_if = host_ifs[i];
+
+		// serialize as <bridge-IP>/<clusterWideCidrPrefix> because the virtual L2 domain comprises the whole cluster
+		// this is necessary to ensure that the container will consider other containers/pods that are living in other nodes
+		// to be on-link in its L2 domain, thus dispatching these frames on-link
+		struct in_addr acquired_addr = { .s_addr = htonl(lease->ip) };
+		if (util_cidr_serialize(err, acquired_addr, cluster_cidr_prefix, out[i])) {
+			fprintf(stderr, "ip_container_acquire: unable to serialize node CIDR\n");
+			goto out;
+		}
+	}
+
+	// Persist the full CIDR of the last IP handed out
+	if (last_fresh >= 0 && io_write_text(IP_INFO_FILE_PATH, out[last_fresh]) != 0) {
+		fprintf(stderr, "ip_container_acquire: failed writing '%s'\n", out[last_fresh]);
+		ERRF(err, "ip_container_acquire: failed writing", "'%s'", out[last_fresh]);
+		goto out;
+	}
+	if (write_leases(err, &leases)) {
+		goto out;
+	}
+
+	rc = 0;
+out:
+	free(host_ifs);
+	free_leases(&leases);
+	return rc;
+}
+
+int ip_container_acquire(Err* err, const char* node_cidr, const char* cluster_cidr, const char* containerid,
+		const char* netns, const char* ifname, char out[CIDR_BUFFER_LEN]) {
+	const struct BatchContainer container = { .containerid = containerid, .netns = netns, .ifname = ifname };
+	return ip_container_acquire_many(err, node_cidr, cluster_cidr, &container, 1, (char (*)[CIDR_BUFFER_LEN])out);
+}
+
+// Acquires an IP for each of the 'count' containers with a single read and write of the IPAM state
+int ip_container_acquire_many(Err* err, const char* node_cidr, const char* cluster_cidr,
+		const struct BatchContainer* containers, int count, char out[][CIDR_BUFFER_LEN]) {
+	int lock_fd = lock_ip_info(err);
+	if (lock_fd < 0) {
+		return 1;
+	}
+
+	int rc = acquire_many(err, node_cidr, cluster_cidr, containers, count, out);
+
+	// closing the descriptor releases the lock
+	close(lock_fd);
+	return rc;
+}
+
+// Serializes the IP of a lease as a /32
+static int lease_cidr(Err* err, const struct Lease* lease, char out[CIDR_BUFFER_LEN]) {
+	struct in_addr addr = { .s_addr = htonl(lease->ip) };
+	return util_cidr_serialize(err, addr, 32, out);
+}
 
-	// serialize as <bridge-IP>/<clusterWideCidrPrefix> because the virtual L2 domain comprises the whole cluster
-	// this is necessary to ensure that the container will consider other containers/pods that are living in other nodes
-	// to be on-link in its L2 domain, thus dispatching these frames on-link
-	if (util_cidr_serialize(err, last_acquired_cidr_addr, cluster_cidr_prefix, out)) {
-		fprintf(stderr, "ip_container_acquire: unable to serialize node CIDR\n");
+// Looks up the IP held by the interface 'ifname' of the container (see lease_held_by), for a DEL without
+// prevResult; 'out' is left empty when it holds none
+int ip_container_lease(Err* err, const char* containerid, const char* ifname, const char* host_if,
+		char out[CIDR_BUFFER_LEN]) {
+	out[0] = '\0';
+	int lock_fd = lock_ip_info(err);
+	if (lock_fd < 0) {
 		return 1;
 	}
 
-	// Persist the full CIDR
-	// TODO: This is not bulletproof, if multiple CNI plugin invokations change the file simultaneously bad things will happen
-	if (io_write_text(IP_INFO_FILE_PATH, out) != 0) {
-		fprintf(stderr, "ip_container_acquire: failed writing '%s'\n", out);
-		ERRF(err, "ip_container_acquire: failed writing", "'%s'", out);
+	struct Leases leases;
+	int rc = read_leases(err, 0, &leases);
+	close(lock_fd);
+	if (rc) {
 		return 1;
 	}
 
+	for (int i = 0; i < leases.count; ++i) {
+		if (lease_held_by(&leases.leases[i], containerid, ifname, host_if)) {
+			rc = lease_cidr(err, &leases.leases[i], out);
+			break;
+		}
+	}
+
+	free_leases(&leases);
+	return rc;
+}
+
+// Lists the leases of the container interfaces missing from 'valid' (GC), without releasing them: the caller
+// cleans up after them first. Leases rebuilt by sknf-app without a container are left to their DEL.
+int ip_stale_leases(Err* err, const struct Attachment* valid, int valid_count, struct IpLease** out, int* count) {
+	*out = NULL;
+	*count = 0;
+	int lock_fd = lock_ip_info(err);
+	if (lock_fd < 0) {
+		return 1;
+	}
+
+	struct Leases leases;
+	int rc = read_leases(err, 0, &leases);
+	close(lock_fd);
+	if (rc) {
+		return 1;
+	}
+
+	*out = calloc((size_t)(leases.count ? leases.count : 1), sizeof(struct IpLease));
+	if (!*out) {
+		ERR(err, "Out of memory listing IPAM leases");
+		free_leases(&leases);
+		return 1;
+	}
+
+	for (int i = 0; i < leases.count; ++i) {
+		const struct Lease* lease = &leases.leases[i];
+		if (!lease->containerid || !strcmp(lease->containerid, IP_LEASE_UNKNOWN)) {
+			continue;
+		}
+		int listed = 0;
+		for (int j = 0; j < valid_count && !listed; ++j) {
+			listed = !strcmp(lease->containerid, valid[j].containerid) && !strcmp(lease->ifname, valid[j].ifname);
+		}
+		if (listed) {
+			continue;
+		}
+
+		struct IpLease* stale = &(*out)[*count];
+		stale->containerid = strdup(lease->containerid);
+		stale->ifname = strdup(lease->ifname);
+		snprintf(stale->host_if, sizeof(stale->host_if), "%s", lease->host_if ? lease->host_if : "");
+		++*count;
+		if (!stale->containerid || !stale->ifname) {
+			ERR(err, "Out of memory listing IPAM leases");
+			rc = 1;
+			break;
+		}
+		if (lease_cidr(err, lease, stale->cidr)) {
+			rc = 1;
+			break;
+		}
+	}
+
+	free_leases(&leases);
+	if (rc) {
+		ip_free_leases(*out, *count);
+		*out = NULL;
+		*count = 0;
+	}
+	return rc;
+}
+
+void ip_free_leases(struct IpLease* leases, int count) {
+	for (int i = 0; leases && i < count; ++i) {
+		free(leases[i].containerid);
+		free(leases[i].ifname);
+	}
+	free(leases);
+}
+
+// Releases the IPs held by the interface 'ifname' of the container (see lease_held_by), so that they can be
+// handed out again. The container id and interface name are what DEL gets, with or without a prevResult, and a
+// retried DEL finds no lease. IPs handed out before the leases existed are never released.
+int ip_container_release(Err* err, const char* containerid, const char* ifname, const char* host_if) {
+	int lock_fd = lock_ip_info(err);
+	if (lock_fd < 0) {
+		return 1;
+	}
+
+	struct Leases leases;
+	int rc = read_leases(err, 0, &leases);
+	if (rc) {
+		close(lock_fd);
+		return 1;
+	}
+
+	int released = 0;
+	for (int i = 0; i < leases.count; ++i) {
+		struct Lease* lease = &leases.leases[i];
+		if (lease_held_by(lease, containerid, ifname, host_if)) {
+			lease->containerid = NULL;
+			lease->ifname = NULL;
+			lease->host_if = NULL;
+			released = 1;
+		}
+	}
+	if (released) {
+		rc = write_leases(err, &leases);
+	}
+
+	free_leases(&leases);
+	close(lock_fd);
+	return rc;
+}
+
+// Number of IPs that can still be handed out from the node CIDR, released ones included
+int ip_available(Err* err, const char* node_cidr, unsigned long* available) {
+	int lock_fd = lock_ip_info(err);
+	if (lock_fd < 0) {
+		return 1;
+	}
+
+	uint32_t first_ip_int;
+	uint32_t last_ip_int;
+	uint32_t end_ip_int;
+	struct Leases leases;
+	int rc = read_ip_info(err, node_cidr, &first_ip_int, &last_ip_int, &end_ip_int) || read_leases(err, 0, &leases);
+	close(lock_fd);
+	if (rc) {
+		return 1;
+	}
+
+	*available = last_ip_int < end_ip_int ? end_ip_int - last_ip_int - 1 : 0;
+	for (int i = 0; i < leases.count; ++i) {
+		*available += lease_reusable(&leases.leases[i], first_ip_int, last_ip_int);
+	}
+	free_leases(&leases);
+	return 0;
+}
+
+// Serializes the IP of 'cidr' as a /32, the address of a routed pod
+int ip_host_cidr(Err* err, const char* cidr, char out[CIDR_BUFFER_LEN]) {
+	struct in_addr addr;
+	int prefix;
+	if (util_cidr_parse(err, cidr, &addr, &prefix)) {
+		fprintf(stderr, "ip_host_cidr: unable to parse CIDR %s\n", cidr);
+		return 1;
+	}
+
+	if (util_cidr_serialize(err, addr, 32, out)) {
+		fprintf(stderr, "ip_host_cidr: unable to serialize CIDR\n");
+		return 1;
+	}
 	return 0;
 }
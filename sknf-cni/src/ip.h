@@ -4,7 +4,25 @@
 #include "def.h"
 #include "err.h"
 
+// Lease of a container interface missing from the valid attachments of a GC (see ip_stale_leases)
+struct IpLease {
+	char cidr[CIDR_BUFFER_LEN]; // the IP, as a /32
+	char host_if[16]; // host end of the pair; empty for leases written before it was recorded
+	char* containerid;
+	char* ifname;
+};
+
 int ip_bridge(Err* err, const char* node_cidr, const char* cluster_cidr, char out[CIDR_BUFFER_LEN]);
-int ip_container_acquire(Err* err, const char* node_cidr, const char* cluster_cidr, char out[CIDR_BUFFER_LEN]);
+int ip_container_acquire(Err* err, const char* node_cidr, const char* cluster_cidr, const char* containerid,
+		const char* netns, const char* ifname, char out[CIDR_BUFFER_LEN]);
+int ip_container_acquire_many(Err* err, const char* node_cidr, const char* cluster_cidr,
+		const struct BatchContainer* containers, int count, char out[][CIDR_BUFFER_LEN]);
+int ip_container_lease(Err* err, const char* containerid, const char* ifname, const char* host_if,
+		char out[CIDR_BUFFER_LEN]);
+int ip_stale_leases(Err* err, const struct Attachment* valid, int valid_count, struct IpLease** out, int* count);
+void ip_free_leases(struct IpLease* leases, int count);
+int ip_container_release(Err* err, const char* containerid, const char* ifname, const char* host_if);
+int ip_available(Err* err, const char* node_cidr, unsigned long* available);
+int ip_host_cidr(Err* err, const char* cidr, char out[CIDR_BUFFER_LEN]);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "json_scan.h"
+
+#include <string.h>
+
+// Minimal JSON scanner used on the plugin input: it finds the members of an object in one pass
+// without building a DOM, so that large values sknf does not use (e.g. prevResult) are only skipped.
+// Values are not validated beyond their nesting; the ones sknf uses are parsed afterwards.
+
+static const char* skip_ws(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+		++p;
+	}
+	return p;
+}
+
+// 'p' points to the opening quote; returns the position after the closing quote, NULL if unterminated
+static const char* skip_string(const char* p, const char* end) {
+	for (++p; p < end; ++p) {
+		if (*p == '\\') {
+			++p;
+		} else if (*p == '"') {
+			return p + 1;
+		}
+	}
+	return NULL;
+}
+
+static const char* skip_value(const char* p, const char* end) {
+	if (p == end) {
+		return NULL;
+	}
+
+	if (*p == '"') {
+		return skip_string(p, end);
+	}
+
+	if (*p == '{' || *p == '[') {
+		int depth = 0;
+		while (p < end) {
+			if (*p == '"') {
+				p = skip_string(p, end);
+				if (!p) return NULL;
+				continue;
+			}
+			if (*p == '{' || *p == '[') {
+				++depth;
+			} else if (*p == '}' || *p == ']') {
+				if (--depth == 0) return p + 1;
+			}
+			++p;
+		}
+		return NULL;
+	}
+
+	// number, true, false or null
+	const char* start = p;
+	while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+		++p;
+	}
+	return p == start ? NULL : p;
+}
+
+// Fills the value of every member found in 'object' (the last one wins on duplicates) and clears the others
+int js_scan_object(struct JsonSpan object, struct JsonMember* members, int member_count) {
+	for (int i = 0; i < member_count; ++i) {
+		members[i].value->start = NULL;
+		members[i].value->len = 0;
+	}
+
+	if (!object.start) {
+		return 1;
+	}
+
+	const char* end = object.start + object.len;
+	const char* p = skip_ws(object.start, end);
+	if (p == end || *p != '{') {
+		return 1;
+	}
+
+	p = skip_ws(p + 1, end);
+	if (p < end && *p == '}') {
+		return 0;
+	}
+
+	for (;;) {
+		if (p == end || *p != '"') {
+			return 1;
+		}
+		const char* key = p + 1;
+		p = skip_string(p, end);
+		if (!p) {
+			return 1;
+		}
+		size_t key_len = (size_t)(p - 1 - key);
+
+		p = skip_ws(p, end);
+		if (p == end || *p != ':') {
+			return 1;
+		}
+		p = skip_ws(p + 1, end);
+
+		const char* value = p;
+		p = skip_value(p, end);
+		if (!p) {
+			return 1;
+		}
+
+		for (int i = 0; i < member_count; ++i) {
+			if (strlen(members[i].key) == key_len && !memcmp(members[i].key, key, key_len)) {
+				members[i].value->start = (char*)value;
+				members[i].value->len = (size_t)(p - value);
+			}
+		}
+
+		p = skip_ws(p, end);
+		if (p < end && *p == ',') {
+			p = skip_ws(p + 1, end);
+			continue;
+		}
+		if (p < end && *p == '}') {
+			return 0;
+		}
+		return 1;
+	}
+}
+
+static int hex4(const char* p, unsigned* out) {
+	unsigned v = 0;
+	for (int i = 0; i < 4; ++i) {
+		char c = p[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9') v |= (unsigned)(c - '0');
+		else if (c >= 'a' && c <= 'f') v |= (unsigned)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F') v |= (unsigned)(c - 'A' + 10);
+		else return 1;
+	}
+	*out = v;
+	return 0;
+}
+
+static char* put_utf8(char* out, unsigned cp) {
+	if (cp < 0x80) {
+		*out++ = (char)cp;
+	} else if (cp < 0x800) {
+		*out++ = (char)(0xc0 | (cp >> 6));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		*out++ = (char)(0xe0 | (cp >> 12));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	} else {
+		*out++ = (char)(0xf0 | (cp >> 18));
+		*out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	}
+	return out;
+}
+
+// Unescapes a string value in place (the result is never longer than its escaped form) and returns it
+// NUL-terminated; NULL if the value is absent, not a string or badly escaped. The span must not be
+// used again afterwards.
+const char* js_string(struct JsonSpan* value) {
+	if (!value->start || value->len < 2 || value->start[0] != '"' || value->start[value->len - 1] != '"') {
+		return NULL;
+	}
+
+	const char* in = value->start + 1;
+	const char* end = value->start + value->len - 1;
+	char* out = value->start;
+
+	while (in < end) {
+		if (*in != '\\') {
+			*out++ = *in++;
+			continue;
+		}
+
+		if (++in == end) {
+			return NULL;
+		}
+
+		switch (*in++) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '/': *out++ = '/'; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				unsigned cp;
+				if (end - in < 4 || hex4(in, &cp)) {
+					return NULL;
+				}
+				in += 4;
+
+				// surrogate pair
+				unsigned low;
+				if (cp >= 0xd800 && cp < 0xdc00 && end - in >= 6 && in[0] == '\\' && in[1] == 'u' &&
+					!hex4(in + 2, &low) && low >= 0xdc00 && low < 0xe000) {
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+					in += 6;
+				}
+
+				out = put_utf8(out, cp);
+				break;
+			}
+			default:
+				return NULL;
+		}
+	}
+
+	*out = '\0';
+	return value->start;
+}
@@ -0,0 +1,21 @@
+#ifndef SKNF_JSON_SCAN_H
+#define SKNF_JSON_SCAN_H
+
+#include <stddef.h>
+
+// Raw text of a JSON value inside the input document; 'start' is NULL when the value is absent.
+struct JsonSpan {
+	char* start;
+	size_t len;
+};
+
+// Member looked up by js_scan_object. Keys are compared verbatim (escaped keys never match).
+struct JsonMember {
+	const char* key;
+	struct JsonSpan* value;
+};
+
+int js_scan_object(struct JsonSpan object, struct JsonMember* members, int member_count);
+const char* js_string(struct JsonSpan* value);
+
+#endif
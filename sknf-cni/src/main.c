@@ -5,35 +5,84 @@
 
 #include "def.h"
 #include "args.h"
+#include "capture.h"
 #include "cmd.h"
+#include "contention.h"
+#include "nlstat.h"
+#include "trace.h"
 
-int main() {
-	struct Args args;
-	if (args_parse(&args)) {
-		fprintf(stderr, "Failure parsing arguments\n");
-		return 1;
-	}
-
+static int run(struct Args* args) {
 	fprintf(stderr, "Starting...\n");
 	fflush(stderr);
 
 	srand(time(NULL));
+	contention_begin();
 
-	if (!strcmp(args.cni_command, CNI_CMD_ADD)) {
-		return cmd_add(&args);
-	} else if (!strcmp(args.cni_command, CNI_CMD_DEL)) {
-		return cmd_del(&args);
-	} else if (!strcmp(args.cni_command, CNI_CMD_STATUS)) {
-		return cmd_status(&args);
-	} else if (!strcmp(args.cni_command, CNI_CMD_VERSION)) {
-		return cmd_version(&args);
-	} else if (!strcmp(args.cni_command, CNI_CMD_CHECK)) {
-		return cmd_check(&args);
-	} else if (!strcmp(args.cni_command, CNI_CMD_GC)) {
-		return cmd_gc(&args);
+	if (!strcmp(args->cni_command, CNI_CMD_ADD)) {
+		int rc = cmd_add(args);
+		contention_report(args);
+		nlstat_report(args);
+		return rc;
+	} else if (!strcmp(args->cni_command, CNI_CMD_ADD_BATCH)) {
+		int rc = cmd_add_batch(args);
+		contention_report(args);
+		nlstat_report(args);
+		return rc;
+	} else if (!strcmp(args->cni_command, CNI_CMD_DEL)) {
+		int rc = cmd_del(args);
+		contention_report(args);
+		nlstat_report(args);
+		return rc;
+	} else if (!strcmp(args->cni_command, CNI_CMD_STATUS)) {
+		return cmd_status(args);
+	} else if (!strcmp(args->cni_command, CNI_CMD_VERSION)) {
+		return cmd_version(args);
+	} else if (!strcmp(args->cni_command, CNI_CMD_CHECK)) {
+		return cmd_check(args);
+	} else if (!strcmp(args->cni_command, CNI_CMD_GC)) {
+		return cmd_gc(args);
 	} else {
-		fprintf(stderr, "failure: received unknown command %s\n", args.cni_command);
-		args_free(&args);
+		fprintf(stderr, "failure: received unknown command %s\n", args->cni_command);
+		args_free(args);
 		return 1;
 	}
-}
\ No newline at end of file
+}
+
+int main(int argc, char** argv) {
+	// runtimes invoke the plugin without arguments; "replay" is the dev-box driver for captured traces and
+	// "capture" records the packets of a pod
+	if (argc > 1 && !strcmp(argv[1], "replay")) {
+		return trace_replay(argc - 1, argv + 1);
+	}
+	if (argc > 1 && !strcmp(argv[1], "capture")) {
+		return capture_run(argc - 1, argv + 1);
+	}
+
+	struct Args args;
+	const char* trace_path = getenv(TRACE_ENV_VAR_NAME);
+	if (trace_path == NULL) {
+		if (args_parse(&args)) {
+			fprintf(stderr, "Failure parsing arguments\n");
+			return 1;
+		}
+		return run(&args);
+	}
+
+	struct TraceCapture capture;
+	char* input;
+	size_t input_len;
+	if (trace_capture_begin(&capture, trace_path, &input, &input_len)) {
+		return 1;
+	}
+
+	int rc;
+	if (args_parse_input(&args, input, input_len)) {
+		fprintf(stderr, "Failure parsing arguments\n");
+		rc = 1;
+	} else {
+		rc = run(&args);
+	}
+
+	trace_capture_end(&capture, rc);
+	return rc;
+}
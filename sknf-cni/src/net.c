@@ -23,7 +23,8 @@
 
 #include "util.h"
 #include "net_utils.h"
-#include "nft.h"
+#include "nlstat.h"
+#include "sys.h"
 
 #define HOST_VXLAN_VNI_ID 100
 #define HOST_VXLAN_GROUP "239.1.1.100"
@@ -39,6 +40,11 @@ static void generate_deterministic_host_if_name(Err* err, char buffer[16], const
 	snprintf(buffer, 16, "sknf%08x", h);
 }
 
+// The ifb shaping the egress of a pod takes the hash of its host veth: 'sknfb' + 8 hex chars
+static void generate_deterministic_host_ifb_name(char buffer[16], const char* host_veth_name) {
+	snprintf(buffer, 16, "sknfb%.8s", host_veth_name + strlen("sknf"));
+}
+
 static void generate_deterministic_container_if_temporary_name(Err* err, char buffer[16], const char* container_netns_name,
 		const char* container_netif_name, const char* container_id) {
 	unsigned h = 2166136261u; // FNV-1a offset basis
@@ -51,10 +57,14 @@ static void generate_deterministic_container_if_temporary_name(Err* err, char bu
 }
 
 static int configure_container_veth(Err* err, int container_netns_fd, const char* container_veth_name,
-		const char* container_veth_cidr, const char* bridge_cidr) {
+		const char* container_veth_cidr, const char* gateway_cidr, struct nl_addr* gateway_mac, int gateway_on_link,
+		const struct Sysctl* sysctls, int sysctl_count, int gro) {
 	int rc = 1;
 	int nl_err = 0;
 	int switched_ns = 0;
+	struct nl_sock* sk = NULL;
+	struct rtnl_link* link = NULL;
+	struct rtnl_addr* raddr = NULL;
 
 	int main_netns_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
 	if (main_netns_fd < 0) {
@@ -71,26 +81,26 @@ static int configure_container_veth(Err* err, int container_netns_fd, const char
 	switched_ns = 1;
 
 	// Create netlink socket in container's net ns
-	struct nl_sock* sk = nl_socket_alloc();
+	sk = nl_socket_alloc();
 	if (!sk) {
 		fprintf(stderr, "error allocating netlink socket\n");
 		ERR(err, "Error allocating netlink socket");
 		goto out;
 	}
+	nlstat_instrument(sk);
 	if ((nl_err = nl_connect(sk, NETLINK_ROUTE)) < 0) { // NETLINK_ROUTE is one of netlink protocols; used for interfaces, routing, etc.
 		fprintf(stderr, "error creating/connecting to netlink socket: %s\n", nl_geterror(nl_err));
 		ERRF(err, "Error creating/connecting to netlink socket", "%s", nl_geterror(nl_err));
 		goto out;
 	}
 
-	int ifidx = if_nametoindex(container_veth_name);
+	int ifidx = nlstat_if_nametoindex(container_veth_name);
 	if (ifidx == 0) {
 		fprintf(stderr, "failed to resolve ifindex for %s\n", container_veth_name);
 		ERRF(err, "Failed to resolve ifindex for container veth", "%s", container_veth_name);
 		goto out;
 	}
 
-	struct rtnl_link* link = NULL;
 	// fetches a reference (rtnl_link) to container's veth interface from kernel
 	if ((nl_err = rtnl_link_get_kernel(sk, ifidx, NULL, &link)) < 0) {
 		fprintf(stderr, "failure filling rtnl_link information from kernel: %s\n", nl_geterror(nl_err));
@@ -98,7 +108,18 @@ static int configure_container_veth(Err* err, int container_netns_fd, const char
 		goto out;
 	}
 
-	struct rtnl_addr* raddr = NULL;
+	// native XDP redirects of the decap fast path land on the pod end (see enum XdpDecap)
+	if (gro && nu_enable_gro(err, container_veth_name)) {
+		fprintf(stderr, "failure enabling GRO on container's veth\n");
+		goto out;
+	}
+
+	// pairs of a batch are created with their pod end down (see nu_create_pod_pairs)
+	if (!(rtnl_link_get_flags(link) & IFF_UP) && nu_enable_veth(err, sk, container_veth_name)) {
+		fprintf(stderr, "failure activating container's veth\n");
+		goto out;
+	}
+
 	if (nu_rtnl_addr_build(err, container_veth_cidr, ifidx, &raddr)) {
 		fprintf(stderr, "failure building container's veth rtnl_addr\n");
 		goto out;
@@ -110,11 +131,30 @@ static int configure_container_veth(Err* err, int container_netns_fd, const char
 		goto out;
 	}
 
-	if (nu_add_routing_rule(err, sk, "0.0.0.0/0", bridge_cidr, ifidx)) {
+	// a /32 address has no connected route, so the gateway has to be made reachable through the interface first
+	if (gateway_on_link && nu_add_device_route(err, sk, gateway_cidr, ifidx)) {
+		fprintf(stderr, "failed to add gateway route to container's net ns\n");
+		goto out;
+	}
+
+	if (nu_add_routing_rule(err, sk, "0.0.0.0/0", gateway_cidr, ifidx)) {
 		fprintf(stderr, "failed to add default gateway to container's net ns\n");
 		goto out;
 	}
 
+	// the gateway never moves, so its first use does not have to wait for ARP
+	if (nu_add_permanent_neigh(err, sk, ifidx, gateway_cidr, gateway_mac)) {
+		fprintf(stderr, "failed to add gateway neighbor to container's net ns\n");
+		goto out;
+	}
+
+	for (int i = 0; i < sysctl_count; i++) {
+		if (sys_set_sysctl(err, sysctls[i].name, sysctls[i].value)) {
+			fprintf(stderr, "failed to set sysctl in container's net ns\n");
+			goto out;
+		}
+	}
+
 	if (setns(main_netns_fd, CLONE_NEWNET)) {
 		fprintf(stderr, "failure re-associating thread to main net ns: %s\n", strerror(errno));
 		ERRF(err, "Failure re-associating thread to main net ns", "%s", strerror(errno));
@@ -138,26 +178,113 @@ out:
 	return rc;
 }
 
+// pod ingress is whatever the host veth transmits towards the pod
+static int limit_container_ingress(Err* err, struct nl_sock* sk, const char* host_veth_name, const struct Bandwidth* bandwidth) {
+	if (bandwidth->ingress_rate == 0) {
+		return 0;
+	}
+
+	int host_ifidx = nlstat_if_nametoindex(host_veth_name);
+	if (host_ifidx == 0) {
+		fprintf(stderr, "failed to resolve ifindex for %s\n", host_veth_name);
+		ERRF(err, "Failed to resolve ifindex for host veth", "%s", host_veth_name);
+		return 1;
+	}
+
+	if (nu_set_rate_limit(err, sk, host_ifidx, bandwidth->ingress_rate, bandwidth->ingress_burst)) {
+		fprintf(stderr, "failure limiting container's ingress bandwidth\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+// pod egress is whatever the host veth receives from the pod. It is shaped on the host, out of reach of a pod
+// with CAP_NET_ADMIN, by redirecting it to an ifb whose transmit queue has the tbf (as the reference bandwidth
+// plugin does); unlike a tbf on the pod's eth0, this drops the excess instead of backpressuring the pod's sockets
+static int limit_container_egress(Err* err, struct nl_sock* sk, const char* host_veth_name, const struct Bandwidth* bandwidth) {
+	if (bandwidth->egress_rate == 0) {
+		return 0;
+	}
+
+	int host_ifidx = nlstat_if_nametoindex(host_veth_name);
+	if (host_ifidx == 0) {
+		fprintf(stderr, "failed to resolve ifindex for %s\n", host_veth_name);
+		ERRF(err, "Failed to resolve ifindex for host veth", "%s", host_veth_name);
+		return 1;
+	}
+
+	char ifb_name[16];
+	generate_deterministic_host_ifb_name(ifb_name, host_veth_name);
+	if (nu_create_ifb(err, sk, ifb_name)) {
+		fprintf(stderr, "failure creating ifb for container's egress\n");
+		return 1;
+	}
+
+	int ifb_ifidx = nlstat_if_nametoindex(ifb_name);
+	if (ifb_ifidx == 0) {
+		fprintf(stderr, "failed to resolve ifindex for %s\n", ifb_name);
+		ERRF(err, "Failed to resolve ifindex for ifb", "%s", ifb_name);
+		return 1;
+	}
+
+	if (nu_set_rate_limit(err, sk, ifb_ifidx, bandwidth->egress_rate, bandwidth->egress_burst)) {
+		fprintf(stderr, "failure limiting container's egress bandwidth\n");
+		return 1;
+	}
+
+	if (nu_redirect_ingress(err, sk, host_ifidx, ifb_ifidx)) {
+		fprintf(stderr, "failure redirecting container's egress to %s\n", ifb_name);
+		return 1;
+	}
+
+	return 0;
+}
+
 static int setup_veth(Err* err, struct nl_sock* sk, int container_netns_fd, const char* container_veth_name,
-		const char* container_veth_tmp_name, const char* host_veth_name, const char* container_veth_cidr, const char* bridge_cidr) {
-	if (nu_create_veth(err, sk, container_netns_fd, container_veth_name, container_veth_tmp_name, host_veth_name)) {
+		const char* container_veth_tmp_name, const char* host_veth_name, const char* container_veth_cidr, const char* bridge_cidr,
+		const struct Bandwidth* bandwidth, const struct Sysctl* sysctls, int sysctl_count, enum PodInterface pod_interface,
+		enum PodAttach pod_attach, enum XdpDecap xdp_decap) {
+	int rc = 1;
+	struct nl_addr* gateway_mac = NULL;
+
+	if (nu_create_veth(err, sk, container_netns_fd, container_veth_name, container_veth_tmp_name, container_veth_cidr, host_veth_name,
+			pod_interface)) {
 		fprintf(stderr, "failure creating veth\n");
-		return 1;
+		goto out;
+	}
+
+	// the gateway of a bridged pod is the bridge; a routed pod's one is answered by its host veth
+	int routed = pod_attach == POD_ATTACH_ROUTED;
+	const char* gateway_cidr = routed ? ROUTED_GATEWAY_CIDR : bridge_cidr;
+	if (nu_get_link_addr(err, sk, routed ? host_veth_name : HOST_BRIDGE_NAME, &gateway_mac)) {
+		fprintf(stderr, "failure retrieving gateway MAC\n");
+		goto out;
 	}
 
-	if (configure_container_veth(err, container_netns_fd, container_veth_name, container_veth_cidr, bridge_cidr)) {
+	if (configure_container_veth(err, container_netns_fd, container_veth_name, container_veth_cidr, gateway_cidr, gateway_mac, routed,
+			sysctls, sysctl_count, xdp_decap == XDP_DECAP_NATIVE)) {
 		fprintf(stderr, "failure configuring container's veth\n");
-		return 1;
+		goto out;
 	}
 
 	if (nu_enable_veth(err, sk, host_veth_name)) {
 		fprintf(stderr, "failure creating veth\n");
-		return 1;
+		goto out;
 	}
 
-	return 0;
+	if (limit_container_ingress(err, sk, host_veth_name, bandwidth) || limit_container_egress(err, sk, host_veth_name, bandwidth)) {
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (gateway_mac) nl_addr_put(gateway_mac);
+	return rc;
 }
 
+// Enslaves the VXLAN interface and, unless it is NULL (routed pods), the host veth to the bridge
 static int attach_ifs_to_bridge(Err* err, struct nl_sock* sk, const char* host_veth_name) {
 	int rc = 1;
 	int nl_err = 0;
@@ -180,13 +307,6 @@ static int attach_ifs_to_bridge(Err* err, struct nl_sock* sk, const char* host_v
 		goto out;
 	}
 
-	// fetches a reference (rtnl_link) to host's veth interface from kernel
-	if ((nl_err = rtnl_link_get_kernel(sk, 0, host_veth_name, &veth_link)) < 0) {
-		fprintf(stderr, "failure filling host's veth information from kernel: %s\n", nl_geterror(nl_err));
-		ERRF(err, "Failure filling host's veth information from kernel", "%s", nl_geterror(nl_err));
-		goto out;
-	}
-
 	// create an rtnl_link to contain solely the desired change diff
 	changes_link = rtnl_link_alloc();
 	if (!changes_link) {
@@ -196,7 +316,7 @@ static int attach_ifs_to_bridge(Err* err, struct nl_sock* sk, const char* host_v
 	}
 
 	// fetches a reference (rtnl_link) to vxlan interface from kernel
-	rtnl_link_set_ifindex(changes_link, if_nametoindex(HOST_VXLAN_NAME));
+	rtnl_link_set_ifindex(changes_link, nlstat_if_nametoindex(HOST_VXLAN_NAME));
 	rtnl_link_set_master(changes_link, rtnl_link_get_ifindex(bridge_link));
 	if ((nl_err = rtnl_link_change(sk, vxlan_link, changes_link, 0)) < 0) {
 		fprintf(stderr, "failure enslaving vxlan to bridge: %s\n", nl_geterror(nl_err));
@@ -204,8 +324,19 @@ static int attach_ifs_to_bridge(Err* err, struct nl_sock* sk, const char* host_v
 		goto out;
 	}
 
-	// fetches a reference (rtnl_link) to veth interface from kernel
-	rtnl_link_set_ifindex(changes_link, if_nametoindex(host_veth_name));
+	if (host_veth_name == NULL) {
+		rc = 0;
+		goto out;
+	}
+
+	// fetches a reference (rtnl_link) to host's veth interface from kernel
+	if ((nl_err = rtnl_link_get_kernel(sk, 0, host_veth_name, &veth_link)) < 0) {
+		fprintf(stderr, "failure filling host's veth information from kernel: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure filling host's veth information from kernel", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	rtnl_link_set_ifindex(changes_link, nlstat_if_nametoindex(host_veth_name));
 	rtnl_link_set_master(changes_link, rtnl_link_get_ifindex(bridge_link));
 	if ((nl_err = rtnl_link_change(sk, veth_link, changes_link, 0)) < 0) {
 		fprintf(stderr, "failure enslaving host's veth to bridge: %s\n", nl_geterror(nl_err));
@@ -223,8 +354,60 @@ out:
 	return rc;
 }
 
+// Routed alternative to bridging the host veth: the pod IP gets a /32 host route through the veth, and proxy
+// ARP answers the pod's link-local gateway on the veth and the pod IP on the bridge, where bridged pods and
+// remote nodes (over the overlay) still look for it.
+static int route_to_container(Err* err, struct nl_sock* sk, const char* host_veth_name, const char* container_netif_cidr) {
+	int rc = 1;
+	struct nl_addr* container_mac = NULL;
+	char sysctl_name[64];
+
+	int ifidx = nlstat_if_nametoindex(host_veth_name);
+	if (ifidx == 0) {
+		fprintf(stderr, "failed to resolve ifindex for %s\n", host_veth_name);
+		ERRF(err, "Failed to resolve ifindex for host veth", "%s", host_veth_name);
+		goto out;
+	}
+
+	snprintf(sysctl_name, sizeof(sysctl_name), "net.ipv4.conf.%s.proxy_arp", host_veth_name);
+	if (sys_set_sysctl(err, sysctl_name, "1")) {
+		fprintf(stderr, "failure enabling proxy ARP on host's veth\n");
+		goto out;
+	}
+
+	snprintf(sysctl_name, sizeof(sysctl_name), "net.ipv4.conf.%s.proxy_arp", HOST_BRIDGE_NAME);
+	if (sys_set_sysctl(err, sysctl_name, "1")) {
+		fprintf(stderr, "failure enabling proxy ARP on bridge\n");
+		goto out;
+	}
+
+	if (nu_add_device_route(err, sk, container_netif_cidr, ifidx)) {
+		fprintf(stderr, "failure adding host route to container\n");
+		goto out;
+	}
+
+	// the pod MAC is derived from its IP, so the host does not have to ARP for it either
+	if (nu_mac_from_cidr(err, container_netif_cidr, &container_mac)) {
+		fprintf(stderr, "failure deriving container's veth MAC\n");
+		goto out;
+	}
+
+	if (nu_add_permanent_neigh(err, sk, ifidx, container_netif_cidr, container_mac)) {
+		fprintf(stderr, "failure adding container neighbor on host's veth\n");
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (container_mac) nl_addr_put(container_mac);
+	return rc;
+}
+
 int net_attach_container(Err* err, const char* container_netns_name, const char* container_netif_name,
-		const char* container_netif_cidr, const char* container_id, const char* bridge_cidr, const char* host_physical_if) {
+		const char* container_netif_cidr, const char* container_id, const char* bridge_cidr, const char* host_physical_if,
+		const struct Bandwidth* bandwidth, const struct Sysctl* sysctls, int sysctl_count, enum PodInterface pod_interface,
+		enum PodAttach pod_attach, enum XdpDecap xdp_decap) {
 	int rc = 1;
 	int nl_err = 0;
 
@@ -238,6 +421,7 @@ int net_attach_container(Err* err, const char* container_netns_name, const char*
 		ERR(err, "Error allocating netlink socket");
 		goto out;
 	}
+	nlstat_instrument(sk);
 	if ((nl_err = nl_connect(sk, NETLINK_ROUTE)) < 0) { // NETLINK_ROUTE is one of netlink protocols; used for interfaces, routing, etc.
 		fprintf(stderr, "error creating/connecting to netlink socket: %s\n", nl_geterror(nl_err));
 		ERRF(err, "Error creating/connecting to netlink socket", "%s", nl_geterror(nl_err));
@@ -267,27 +451,193 @@ int net_attach_container(Err* err, const char* container_netns_name, const char*
 		goto out;
 	}
 
-	if (setup_veth(err, sk, container_netns_fd, container_netif_name, container_if_tmp_name, host_if_name, container_netif_cidr, bridge_cidr)) {
+	if (setup_veth(err, sk, container_netns_fd, container_netif_name, container_if_tmp_name, host_if_name, container_netif_cidr, bridge_cidr, bandwidth,
+			sysctls, sysctl_count, pod_interface, pod_attach, xdp_decap)) {
 		fprintf(stderr, "failure creating veth\n");
 		goto out;
 	}
 
-	if (attach_ifs_to_bridge(err, sk, host_if_name)) {
+	if (pod_attach == POD_ATTACH_ROUTED) {
+		// the overlay still hangs off the bridge
+		if (attach_ifs_to_bridge(err, sk, NULL)) {
+			fprintf(stderr, "failure attaching vxlan to bridge\n");
+			goto out;
+		}
+
+		if (route_to_container(err, sk, host_if_name, container_netif_cidr)) {
+			fprintf(stderr, "failure routing to container\n");
+			goto out;
+		}
+	} else if (attach_ifs_to_bridge(err, sk, host_if_name)) {
 		fprintf(stderr, "failure attaching veth to bridge\n");
 		goto out;
 	}
 
-	// create nftables NAT rule to ensure packets leaving the cluster are NAT'd with host's physical IP as SRC IP
-	// (to ensure response is routable)
-	if (nft_nat_rule(err, host_physical_if, container_netif_cidr)) {
-		fprintf(stderr, "failure creating nft NAT rule\n");
+	rc = 0;
+
+out:
+	if (container_netns_fd >= 0) close(container_netns_fd);
+	if (sk) nl_socket_free(sk);
+	return rc;
+}
+
+// Configures a pod whose pair nu_create_pod_pairs created: the pod end is up in the pod netns and the host end
+// is up (and bridged, unless the pod is routed)
+static int finish_batch_container(Err* err, struct nl_sock* sk, int container_netns_fd, const char* container_netif_name,
+		const char* host_if_name, const char* container_netif_cidr, const char* bridge_cidr, struct nl_addr* bridge_mac,
+		const struct Bandwidth* bandwidth, const struct Sysctl* sysctls, int sysctl_count, enum PodAttach pod_attach,
+		enum XdpDecap xdp_decap) {
+	int rc = 1;
+	int gro = xdp_decap == XDP_DECAP_NATIVE;
+	struct nl_addr* host_if_mac = NULL;
+
+	if (pod_attach == POD_ATTACH_ROUTED) {
+		if (nu_get_link_addr(err, sk, host_if_name, &host_if_mac)) {
+			fprintf(stderr, "failure retrieving gateway MAC\n");
+			goto out;
+		}
+
+		if (configure_container_veth(err, container_netns_fd, container_netif_name, container_netif_cidr, ROUTED_GATEWAY_CIDR,
+				host_if_mac, 1, sysctls, sysctl_count, gro)) {
+			fprintf(stderr, "failure configuring container's veth\n");
+			goto out;
+		}
+
+		if (route_to_container(err, sk, host_if_name, container_netif_cidr)) {
+			fprintf(stderr, "failure routing to container\n");
+			goto out;
+		}
+	} else if (configure_container_veth(err, container_netns_fd, container_netif_name, container_netif_cidr, bridge_cidr,
+			bridge_mac, 0, sysctls, sysctl_count, gro)) {
+		fprintf(stderr, "failure configuring container's veth\n");
+		goto out;
+	}
+
+	if (limit_container_ingress(err, sk, host_if_name, bandwidth) || limit_container_egress(err, sk, host_if_name, bandwidth)) {
 		goto out;
 	}
 
 	rc = 0;
 
 out:
-	if (container_netns_fd >= 0) close(container_netns_fd);
+	if (host_if_mac) nl_addr_put(host_if_mac);
+	return rc;
+}
+
+// Batch counterpart of net_attach_container: node state is checked once, on a single netlink socket, and the
+// pairs of all containers are created with pipelined requests. Returns 1 only on node-wide failures; the
+// outcome of each container is in 'errs' (initialized on failure).
+int net_attach_containers(Err* err, const struct BatchContainer* containers, int count, char container_netif_cidrs[][CIDR_BUFFER_LEN],
+		Err* errs, const char* bridge_cidr, const char* host_physical_if, const struct Bandwidth* bandwidth, const struct Sysctl* sysctls,
+		int sysctl_count, enum PodInterface pod_interface, enum PodAttach pod_attach, enum XdpDecap xdp_decap) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct nl_sock* sk = NULL;
+	struct nl_addr* bridge_mac = NULL;
+	struct NuPodPair pairs[MAX_BATCH_CONTAINERS];
+	char host_if_names[MAX_BATCH_CONTAINERS][16];
+	int container_netns_fds[MAX_BATCH_CONTAINERS];
+	// containers whose pair is requested, as indexes into 'containers'
+	int requested[MAX_BATCH_CONTAINERS];
+	int requested_count = 0;
+
+	for (int i = 0; i < count; ++i) {
+		container_netns_fds[i] = -1;
+	}
+
+	sk = nl_socket_alloc();
+	if (!sk) {
+		fprintf(stderr, "error allocating netlink socket\n");
+		ERR(err, "Error allocating netlink socket");
+		goto out;
+	}
+	nlstat_instrument(sk);
+	if ((nl_err = nl_connect(sk, NETLINK_ROUTE)) < 0) {
+		fprintf(stderr, "error creating/connecting to netlink socket: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Error creating/connecting to netlink socket", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	if (nu_create_bridge(err, sk, bridge_cidr, HOST_BRIDGE_NAME)) {
+		fprintf(stderr, "failure creating bridge\n");
+		goto out;
+	}
+
+	if (nu_create_vxlan(err, sk, host_physical_if, HOST_VXLAN_NAME, HOST_VXLAN_GROUP, HOST_VXLAN_VNI_ID)) {
+		fprintf(stderr, "failure creating vxlan\n");
+		goto out;
+	}
+
+	if (attach_ifs_to_bridge(err, sk, NULL)) {
+		fprintf(stderr, "failure attaching vxlan to bridge\n");
+		goto out;
+	}
+
+	int bridge_ifidx = nlstat_if_nametoindex(HOST_BRIDGE_NAME);
+	if (bridge_ifidx == 0) {
+		fprintf(stderr, "failed to resolve ifindex for %s\n", HOST_BRIDGE_NAME);
+		ERRF(err, "Failed to resolve ifindex for bridge", "%s", HOST_BRIDGE_NAME);
+		goto out;
+	}
+
+	if (nu_get_link_addr(err, sk, HOST_BRIDGE_NAME, &bridge_mac)) {
+		fprintf(stderr, "failure retrieving gateway MAC\n");
+		goto out;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		const struct BatchContainer* c = &containers[i];
+
+		container_netns_fds[i] = open(c->netns, O_RDONLY | O_CLOEXEC);
+		if (container_netns_fds[i] < 0) {
+			fprintf(stderr, "failure opening target net namespace fd: %s\n", strerror(errno));
+			ERRF(&errs[i], "Failure opening target net namespace fd", "%s", strerror(errno));
+			continue;
+		}
+
+		struct NuPodPair* pair = &pairs[requested_count];
+		if (nu_mac_from_cidr(&errs[i], container_netif_cidrs[i], &pair->container_mac)) {
+			fprintf(stderr, "failure deriving container's veth MAC\n");
+			continue;
+		}
+
+		generate_deterministic_host_if_name(err, host_if_names[i], c->netns, c->ifname, c->containerid);
+		pair->host_name = host_if_names[i];
+		pair->container_name = c->ifname;
+		pair->container_netns_fd = container_netns_fds[i];
+		pair->master_ifidx = pod_attach == POD_ATTACH_ROUTED ? 0 : bridge_ifidx;
+		requested[requested_count++] = i;
+	}
+
+	if (nu_create_pod_pairs(err, sk, pairs, requested_count, pod_interface)) {
+		fprintf(stderr, "failure creating pod pairs\n");
+		goto out;
+	}
+
+	for (int j = 0; j < requested_count; ++j) {
+		int i = requested[j];
+		if (pairs[j].error < 0) {
+			ERRF(&errs[i], "Failure creating veth", "%s", nl_geterror(pairs[j].error));
+			continue;
+		}
+
+		if (finish_batch_container(&errs[i], sk, container_netns_fds[i], containers[i].ifname, host_if_names[i], container_netif_cidrs[i],
+				bridge_cidr, bridge_mac, bandwidth, sysctls, sysctl_count, pod_attach, xdp_decap)) {
+			fprintf(stderr, "failure attaching container network of %s\n", containers[i].containerid);
+		}
+	}
+
+	rc = 0;
+
+out:
+	for (int j = 0; j < requested_count; ++j) {
+		nl_addr_put(pairs[j].container_mac);
+	}
+	for (int i = 0; i < count; ++i) {
+		if (container_netns_fds[i] >= 0) close(container_netns_fds[i]);
+	}
+	if (bridge_mac) nl_addr_put(bridge_mac);
 	if (sk) nl_socket_free(sk);
 	return rc;
 }
@@ -305,6 +655,7 @@ int net_detach_container(Err* err, const char* container_netns_name, const char*
 		ERR(err, "Error allocating netlink socket");
 		goto out;
 	}
+	nlstat_instrument(sk);
 	if ((nl_err = nl_connect(sk, NETLINK_ROUTE)) < 0) { // NETLINK_ROUTE is one of netlink protocols; used for interfaces, routing, etc.
 		fprintf(stderr, "error creating/connecting to netlink socket: %s\n", nl_geterror(nl_err));
 		ERRF(err, "Error creating/connecting to netlink socket", "%s", nl_geterror(nl_err));
@@ -319,9 +670,56 @@ int net_detach_container(Err* err, const char* container_netns_name, const char*
 		goto out;
 	}
 
+	// the ifb of a pod with shaped egress outlives its veth
+	char host_ifb_name[16];
+	generate_deterministic_host_ifb_name(host_ifb_name, host_veth_name);
+	if (nu_delete_if_if_exists(err, sk, host_ifb_name)) {
+		fprintf(stderr, "failure deleting interface %s\n", host_ifb_name);
+		goto out;
+	}
+
 	rc = 0;
 
 out:
 	if (sk) nl_socket_free(sk);
 	return rc;
-}
\ No newline at end of file
+}
+
+// Deletes the pairs of containers gone without a DEL (GC) by their host end, with the ifb of a shaped egress.
+// Pairs already gone (e.g. with their netns) are not an error.
+int net_delete_host_ifs(Err* err, const char* const* host_if_names, int count) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct nl_sock* sk = nl_socket_alloc();
+	if (!sk) {
+		fprintf(stderr, "error allocating netlink socket\n");
+		ERR(err, "Error allocating netlink socket");
+		goto out;
+	}
+	nlstat_instrument(sk);
+	if ((nl_err = nl_connect(sk, NETLINK_ROUTE)) < 0) {
+		fprintf(stderr, "error creating/connecting to netlink socket: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Error creating/connecting to netlink socket", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		char host_ifb_name[16];
+		generate_deterministic_host_ifb_name(host_ifb_name, host_if_names[i]);
+		if (nu_delete_if_if_exists(err, sk, host_if_names[i]) || nu_delete_if_if_exists(err, sk, host_ifb_name)) {
+			fprintf(stderr, "failure deleting interfaces of %s\n", host_if_names[i]);
+			goto out;
+		}
+	}
+
+	rc = 0;
+
+out:
+	if (sk) nl_socket_free(sk);
+	return rc;
+}
+
+void net_host_if_name(char buffer[16], const char* container_netns_name, const char* container_netif_name, const char* container_id) {
+	generate_deterministic_host_if_name(NULL, buffer, container_netns_name, container_netif_name, container_id);
+}
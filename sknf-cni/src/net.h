@@ -1,13 +1,20 @@
 #ifndef SKNF_NET_H
 #define SKNF_NET_H
 
+#include "def.h"
 #include "err.h"
 
 #define HOST_BRIDGE_NAME "brsknf"
 #define HOST_VXLAN_NAME "vxsknf"
 #define HOST_VETH_PREFIX "vethsknf-"
+// Gateway of routed pods; never assigned to any interface, the host veth answers ARP for it
+#define ROUTED_GATEWAY_CIDR "169.254.1.1/32"
 
-int net_attach_container(Err* err, const char* container_netns_name, const char* container_netif_name, const char* container_netif_cidr, const char* container_id, const char* bridge_cidr, const char* host_physical_if);
+int net_attach_container(Err* err, const char* container_netns_name, const char* container_netif_name, const char* container_netif_cidr, const char* container_id, const char* bridge_cidr, const char* host_physical_if, const struct Bandwidth* bandwidth, const struct Sysctl* sysctls, int sysctl_count, enum PodInterface pod_interface, enum PodAttach pod_attach, enum XdpDecap xdp_decap);
+int net_attach_containers(Err* err, const struct BatchContainer* containers, int count, char container_netif_cidrs[][CIDR_BUFFER_LEN], Err* errs, const char* bridge_cidr, const char* host_physical_if, const struct Bandwidth* bandwidth, const struct Sysctl* sysctls, int sysctl_count, enum PodInterface pod_interface, enum PodAttach pod_attach, enum XdpDecap xdp_decap);
 int net_detach_container(Err* err, const char* container_netns_name, const char* container_netif_name, const char* container_id);
+int net_delete_host_ifs(Err* err, const char* const* host_if_names, int count);
+// Name of the host end of a pod's pair, as created by net_attach_container
+void net_host_if_name(char buffer[16], const char* container_netns_name, const char* container_netif_name, const char* container_id);
 
 #endif
@@ -1,8 +1,16 @@
 #define _GNU_SOURCE
 #include "net_utils.h"
 
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
+#include <linux/ethtool.h>
+#include <linux/if_ether.h>
 #include <linux/if_link.h>
+#include <linux/sockios.h>
+#include <linux/tc_act/tc_mirred.h>
+#include <linux/pkt_sched.h>
+#include <linux/veth.h>
 #include <net/if.h>
 #include <netlink/netlink.h>
 #include <netlink/socket.h>
@@ -12,10 +20,56 @@
 #include <netlink/route/link/veth.h>
 #include <netlink/route/link/vxlan.h>
 #include <netlink/route/addr.h>
+#include <netlink/route/neighbour.h>
+#include <netlink/route/qdisc.h>
+#include <netlink/route/qdisc/tbf.h>
+#include <netlink/route/classifier.h>
+#include <netlink/route/cls/u32.h>
+#include <netlink/route/action.h>
+#include <netlink/route/act/mirred.h>
 #include <netlink/addr.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
+#include "contention.h"
+#include "nlstat.h"
 #include "util.h"
 
+// Same queueing latency budget the reference bandwidth plugin uses to size the tbf queue
+#define RATE_LIMIT_LATENCY_USEC (25 * 1000)
+
+// Pod pairs whose creation requests share a sendmsg. The kernel queues every acknowledgement before sendmsg
+// returns, so the window has to fit the socket's (32KiB) receive buffer, error acks with the request included.
+#define POD_PAIR_PIPELINE_DEPTH 16
+
+// MACs are derived from IPs as 0a:58:<ipv4>; 0x0a is a locally administered unicast octet
+#define MAC_PREFIX_0 0x0a
+#define MAC_PREFIX_1 0x58
+#define MAC_LEN 6
+
+// netkit uapi (linux/if_link.h, Linux 6.7+) for builds against older kernel headers
+#ifndef IFLA_NETKIT_MAX
+enum {
+	IFLA_NETKIT_UNSPEC,
+	IFLA_NETKIT_PEER_INFO,
+	IFLA_NETKIT_PRIMARY,
+	IFLA_NETKIT_POLICY,
+	IFLA_NETKIT_PEER_POLICY,
+	IFLA_NETKIT_MODE,
+};
+enum netkit_action {
+	NETKIT_NEXT = -1,
+	NETKIT_PASS = 0,
+	NETKIT_DROP = 2,
+	NETKIT_REDIRECT = 7,
+};
+enum netkit_mode {
+	NETKIT_L2,
+	NETKIT_L3,
+};
+#endif
+
 // This function allocates an rtnl_addr (out) that must be released by the caller
 int nu_rtnl_addr_build(Err* err, const char* cidr, int ifidx, struct rtnl_addr** out) {
 	int rc = 1;
@@ -67,6 +121,114 @@ out:
 	return rc;
 }
 
+// Derives the MAC of an interface from the IP of 'cidr', so that the same IP always comes back
+// with the same MAC and the neighbor/FDB entries pointing at it stay valid.
+// This function allocates an nl_addr (out) that must be released by the caller
+int nu_mac_from_cidr(Err* err, const char* cidr, struct nl_addr** out) {
+	struct in_addr addr;
+	int prefix;
+
+	if (util_cidr_parse(err, cidr, &addr, &prefix)) {
+		fprintf(stderr, "unable to parse CIDR %s\n", cidr);
+		return 1;
+	}
+
+	unsigned char mac[MAC_LEN] = {MAC_PREFIX_0, MAC_PREFIX_1};
+	memcpy(mac + 2, &addr.s_addr, sizeof(addr.s_addr));
+
+	*out = nl_addr_build(AF_LLC, mac, MAC_LEN);
+	if (!*out) {
+		fprintf(stderr, "nl_addr_build failed\n");
+		ERR(err, "Nl_addr_build failed");
+		return 1;
+	}
+
+	return 0;
+}
+
+// This function allocates an nl_addr (out) with the MAC of 'ifname' that must be released by the caller
+int nu_get_link_addr(Err* err, struct nl_sock* sk, const char* ifname, struct nl_addr** out) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct rtnl_link* link = NULL;
+	if ((nl_err = rtnl_link_get_kernel(sk, 0, ifname, &link)) < 0) {
+		fprintf(stderr, "failure filling rtnl_link information from kernel: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure filling rtnl_link information from kernel", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	struct nl_addr* addr = rtnl_link_get_addr(link);
+	if (!addr) {
+		fprintf(stderr, "%s has no link-layer address\n", ifname);
+		ERRF(err, "Interface has no link-layer address", "%s", ifname);
+		goto out;
+	}
+
+	*out = nl_addr_clone(addr);
+	if (!*out) {
+		fprintf(stderr, "nl_addr_clone failed\n");
+		ERR(err, "Nl_addr_clone failed");
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (link) rtnl_link_put(link);
+	return rc;
+}
+
+// Installs a permanent neighbor entry for the IP of 'cidr' on 'ifidx', so that the first packet
+// sent to it does not wait for ARP.
+int nu_add_permanent_neigh(Err* err, struct nl_sock* sk, int ifidx, const char* cidr, struct nl_addr* lladdr) {
+	int rc = 1;
+	int nl_err = 0;
+	struct in_addr addr;
+	int prefix;
+
+	struct rtnl_neigh* neigh = NULL;
+	struct nl_addr* dst = NULL;
+
+	if (util_cidr_parse(err, cidr, &addr, &prefix)) {
+		fprintf(stderr, "unable to parse CIDR %s\n", cidr);
+		goto out;
+	}
+
+	dst = nl_addr_build(AF_INET, &addr, sizeof(addr));
+	if (!dst) {
+		fprintf(stderr, "nl_addr_build failed\n");
+		ERR(err, "Nl_addr_build failed");
+		goto out;
+	}
+
+	neigh = rtnl_neigh_alloc();
+	if (!neigh) {
+		fprintf(stderr, "rtnl_neigh_alloc failed\n");
+		ERR(err, "Rtnl_neigh_alloc failed");
+		goto out;
+	}
+
+	rtnl_neigh_set_ifindex(neigh, ifidx);
+	rtnl_neigh_set_family(neigh, AF_INET);
+	rtnl_neigh_set_dst(neigh, dst);
+	rtnl_neigh_set_lladdr(neigh, lladdr);
+	rtnl_neigh_set_state(neigh, NUD_PERMANENT);
+
+	if ((nl_err = rtnl_neigh_add(sk, neigh, NLM_F_CREATE | NLM_F_REPLACE)) < 0) {
+		fprintf(stderr, "failed to add neighbor: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failed to add neighbor", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (neigh) rtnl_neigh_put(neigh);
+	if (dst)   nl_addr_put(dst);
+	return rc;
+}
+
 int nu_add_routing_rule(Err* err, struct nl_sock* sk,
 							   const char* cidr, const char* next_ip,
 							   int via_ifidx)
@@ -140,11 +302,73 @@ out:
 	return rc;
 }
 
+// Adds a link-scope route to 'cidr' through 'ifidx', without a gateway (e.g. 'ip route add <cidr> dev <if>')
+int nu_add_device_route(Err* err, struct nl_sock* sk, const char* cidr, int ifidx) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct rtnl_route* route = NULL;
+	struct nl_addr* dst = NULL;
+	struct rtnl_nexthop* nh = NULL;
+
+	route = rtnl_route_alloc();
+	if (!route) {
+		fprintf(stderr, "failed to alloc rtnl_route\n");
+		ERR(err, "Failed to alloc rtnl_route");
+		goto out;
+	}
+
+	rtnl_route_set_family(route, AF_INET);
+	rtnl_route_set_table(route, RT_TABLE_MAIN);
+	rtnl_route_set_protocol(route, RTPROT_STATIC);
+	rtnl_route_set_scope(route, RT_SCOPE_LINK);
+	rtnl_route_set_type(route, RTN_UNICAST);
+
+	if ((nl_err = nl_addr_parse(cidr, AF_INET, &dst)) < 0) {
+		fprintf(stderr, "nl_addr_parse failed for %s: %s\n", cidr, nl_geterror(nl_err));
+		ERRF(err, "Nl_addr_parse failed for CIDR", "%s: %s", cidr, nl_geterror(nl_err));
+		goto out;
+	}
+
+	if ((nl_err = rtnl_route_set_dst(route, dst)) < 0) {
+		fprintf(stderr, "failed to set route dst: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failed to set route dst", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	nh = rtnl_route_nh_alloc();
+	if (!nh) {
+		fprintf(stderr, "failed to alloc rtnl_nexthop\n");
+		ERR(err, "Failed to alloc rtnl_nexthop");
+		goto out;
+	}
+
+	rtnl_route_nh_set_ifindex(nh, ifidx);
+
+	// After this call, the route owns 'nh'; no need to free 'nh'
+	rtnl_route_add_nexthop(route, nh);
+	nh = NULL;
+
+	if ((nl_err = rtnl_route_add(sk, route, NLM_F_CREATE | NLM_F_REPLACE)) < 0) {
+		fprintf(stderr, "failed to add route: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failed to add route", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (nh)    rtnl_route_nh_free(nh);
+	if (route) rtnl_route_put(route);
+	if (dst)   nl_addr_put(dst);
+	return rc;
+}
+
 int nu_create_bridge(Err* err, struct nl_sock* sk, const char* bridge_cidr, const char* bridge_name) {
 	int rc = 1;
 	int nl_err = 0;
 
-	int existing_ifidx = if_nametoindex(bridge_name);
+	int existing_ifidx = nlstat_if_nametoindex(bridge_name);
 	if (existing_ifidx != 0) {
 		fprintf(stderr, "bridge already exists (ifidx=%d; name=%s)\n", existing_ifidx, bridge_name);
 		return 0;
@@ -152,6 +376,7 @@ int nu_create_bridge(Err* err, struct nl_sock* sk, const char* bridge_cidr, cons
 
 	struct rtnl_link* bridge_link = NULL;
 	struct rtnl_addr* raddr = NULL;
+	struct nl_addr* mac = NULL;
 
 	bridge_link = rtnl_link_alloc();
 	if (!bridge_link) {
@@ -164,13 +389,27 @@ int nu_create_bridge(Err* err, struct nl_sock* sk, const char* bridge_cidr, cons
 	rtnl_link_set_type(bridge_link, "bridge");
 	rtnl_link_set_flags(bridge_link, IFF_UP);
 
-	if ((nl_err = rtnl_link_add(sk, bridge_link, NLM_F_CREATE)) < 0) {
+	// a bridge without an assigned MAC takes the lowest MAC among its ports, which changes as pods come and go
+	if (nu_mac_from_cidr(err, bridge_cidr, &mac)) {
+		fprintf(stderr, "failure deriving bridge's MAC\n");
+		goto out;
+	}
+	rtnl_link_set_addr(bridge_link, mac);
+
+	// exclusive, so that of two ADDs racing to create the bridge only one configures it
+	if ((nl_err = rtnl_link_add(sk, bridge_link, NLM_F_CREATE | NLM_F_EXCL)) == -NLE_EXIST) {
+		fprintf(stderr, "bridge created by a concurrent ADD (name=%s)\n", bridge_name);
+		contention.node_object_races++;
+		rc = 0;
+		goto out;
+	}
+	if (nl_err < 0) {
 		fprintf(stderr, "failure creating bridge: %s\n", nl_geterror(nl_err));
 		ERRF(err, "Failure creating bridge", "%s", nl_geterror(nl_err));
 		goto out;
 	}
 
-	int ifidx = if_nametoindex(bridge_name);
+	int ifidx = nlstat_if_nametoindex(bridge_name);
 	if (ifidx == 0) {
 		fprintf(stderr, "failed to resolve ifindex for %s after creation\n", bridge_name);
 		ERRF(err, "Failed to resolve ifindex for bridge", "%s", bridge_name);
@@ -191,6 +430,7 @@ int nu_create_bridge(Err* err, struct nl_sock* sk, const char* bridge_cidr, cons
 	rc = 0;
 
 out:
+	if (mac) nl_addr_put(mac);
 	if (raddr) rtnl_addr_put(raddr);
 	if (bridge_link) rtnl_link_put(bridge_link);
 	return rc;
@@ -202,7 +442,7 @@ int nu_create_vxlan(Err* err, struct nl_sock* sk, const char* underlay_if,
     int rc = 1;
     int nl_err = 0;
 
-    int existing_ifidx = if_nametoindex(vxlan_name);
+    int existing_ifidx = nlstat_if_nametoindex(vxlan_name);
     if (existing_ifidx != 0) {
         fprintf(stderr, "vxlan already exists (ifidx=%d)\n", existing_ifidx);
         return 0;
@@ -230,7 +470,7 @@ int nu_create_vxlan(Err* err, struct nl_sock* sk, const char* underlay_if,
     rtnl_link_vxlan_set_port(vxlan_link, 4789);
     rtnl_link_set_flags(vxlan_link, IFF_UP);
 
-    int ifindex = if_nametoindex(underlay_if);
+    int ifindex = nlstat_if_nametoindex(underlay_if);
     if (ifindex == 0) {
         fprintf(stderr, "failed to resolve ifindex for %s\n", underlay_if);
         ERRF(err, "Failed to resolve ifindex", "%s", underlay_if);
@@ -238,7 +478,13 @@ int nu_create_vxlan(Err* err, struct nl_sock* sk, const char* underlay_if,
     }
     rtnl_link_vxlan_set_link(vxlan_link, ifindex);
 
-    if ((nl_err = rtnl_link_add(sk, vxlan_link, NLM_F_CREATE)) < 0) {
+    if ((nl_err = rtnl_link_add(sk, vxlan_link, NLM_F_CREATE | NLM_F_EXCL)) == -NLE_EXIST) {
+        fprintf(stderr, "vxlan created by a concurrent ADD\n");
+        contention.node_object_races++;
+        rc = 0;
+        goto out;
+    }
+    if (nl_err < 0) {
         fprintf(stderr, "failure creating vxlan: %s\n", nl_geterror(nl_err));
         ERRF(err, "Failure creating vxlan", "%s", nl_geterror(nl_err));
         goto out;
@@ -252,26 +498,90 @@ out:
     return rc;
 }
 
+// libnl has no netkit support, so the RTM_NEWLINK request is built by hand. The pair is created in L2 mode,
+// so that the primary can be enslaved to the bridge like a veth, and with the default PASS policy on both
+// ends: without a BPF program attached, packets leaving one end are received by the stack of the other.
+static int create_netkit_pair(struct nl_sock* sk, const char* primary_name, const char* peer_name) {
+	int nl_err = -NLE_NOMEM;
+	struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+
+	struct nl_msg* msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL);
+	if (!msg) {
+		return -NLE_NOMEM;
+	}
+
+	if (nlmsg_append(msg, &ifi, sizeof(ifi), NLMSG_ALIGNTO) < 0) goto out;
+	NLA_PUT_STRING(msg, IFLA_IFNAME, primary_name);
+
+	struct nlattr* linkinfo = nla_nest_start(msg, IFLA_LINKINFO);
+	if (!linkinfo) goto out;
+	NLA_PUT_STRING(msg, IFLA_INFO_KIND, "netkit");
+
+	struct nlattr* data = nla_nest_start(msg, IFLA_INFO_DATA);
+	if (!data) goto out;
+	NLA_PUT_U32(msg, IFLA_NETKIT_MODE, NETKIT_L2);
+	NLA_PUT_U32(msg, IFLA_NETKIT_POLICY, NETKIT_PASS);
+	NLA_PUT_U32(msg, IFLA_NETKIT_PEER_POLICY, NETKIT_PASS);
+
+	struct nlattr* peer = nla_nest_start(msg, IFLA_NETKIT_PEER_INFO);
+	if (!peer) goto out;
+	if (nlmsg_append(msg, &ifi, sizeof(ifi), NLMSG_ALIGNTO) < 0) goto out;
+	NLA_PUT_STRING(msg, IFLA_IFNAME, peer_name);
+	nla_nest_end(msg, peer);
+
+	nla_nest_end(msg, data);
+	nla_nest_end(msg, linkinfo);
+
+	// nl_send_sync releases the message
+	nl_err = nl_send_sync(sk, msg);
+	return nl_err < 0 ? nl_err : 0;
+
+nla_put_failure:
+out:
+	nlmsg_free(msg);
+	return nl_err;
+}
+
+// Creates the pod interface pair: a netkit pair when 'pod_interface' asks for it and the kernel supports it
+// (otherwise a veth pair), with the host end named 'host_veth_name' and the container end moved into the pod netns.
 int nu_create_veth(Err* err, struct nl_sock* sk, int container_netns_fd,
                    const char* container_veth_name,
                    const char* container_veth_tmp_name,
-                   const char* host_veth_name)
+                   const char* container_veth_cidr,
+                   const char* host_veth_name,
+                   enum PodInterface pod_interface)
 {
 	int rc = 1;
 	int nl_err = 0;
 
 	struct rtnl_link* container_veth_link = NULL;
 	struct rtnl_link* container_veth_changes_link = NULL;
+	struct nl_addr* mac = NULL;
+
+	// We give container's end a temporary name to ensure it does not conflict with host interfaces
+	if (pod_interface == POD_INTERFACE_NETKIT) {
+		nl_err = create_netkit_pair(sk, host_veth_name, container_veth_tmp_name);
+		if (nl_err == -NLE_OPNOTSUPP) {
+			// kernel older than 6.7 or built without netkit; sknf-app normally probes this at bootstrap
+			fprintf(stderr, "netkit is not supported by the kernel, falling back to veth\n");
+			pod_interface = POD_INTERFACE_VETH;
+		} else if (nl_err < 0) {
+			fprintf(stderr, "failure creating netkit pair: %s\n", nl_geterror(nl_err));
+			ERRF(err, "Failure creating netkit pair", "%s", nl_geterror(nl_err));
+			goto out;
+		}
+	}
 
 	// Create veth pair
-	// We give container's veth a temporary name to ensure it does not conflict with host interfaces
-	if ((nl_err = rtnl_link_veth_add(sk, host_veth_name, container_veth_tmp_name, getpid())) < 0) {
-		fprintf(stderr, "failure creating veth: %s\n", nl_geterror(nl_err));
-		ERRF(err, "Failure creating veth", "%s", nl_geterror(nl_err));
-		goto out;
+	if (pod_interface == POD_INTERFACE_VETH) {
+		if ((nl_err = rtnl_link_veth_add(sk, host_veth_name, container_veth_tmp_name, getpid())) < 0) {
+			fprintf(stderr, "failure creating veth: %s\n", nl_geterror(nl_err));
+			ERRF(err, "Failure creating veth", "%s", nl_geterror(nl_err));
+			goto out;
+		}
 	}
 
-	int ifidx = if_nametoindex(container_veth_tmp_name);
+	int ifidx = nlstat_if_nametoindex(container_veth_tmp_name);
 	if (ifidx == 0) {
 		fprintf(stderr, "failed to resolve ifindex for %s\n", container_veth_tmp_name);
 		ERRF(err, "Failed to resolve ifindex for %s", "%s", container_veth_tmp_name);
@@ -299,6 +609,13 @@ int nu_create_veth(Err* err, struct nl_sock* sk, int container_netns_fd,
 	rtnl_link_set_name(container_veth_changes_link, container_veth_name);
 	rtnl_link_set_flags(container_veth_changes_link, IFF_UP);
 
+	// pod IPs are reused; a stable MAC keeps remote neighbor and FDB entries valid when they are
+	if (nu_mac_from_cidr(err, container_veth_cidr, &mac)) {
+		fprintf(stderr, "failure deriving container's veth MAC\n");
+		goto out;
+	}
+	rtnl_link_set_addr(container_veth_changes_link, mac);
+
 	// apply changes (to change container's veth network namespace)
 	if ((nl_err = rtnl_link_change(sk, container_veth_link, container_veth_changes_link, 0)) < 0) {
 		fprintf(stderr, "failure moving veth to container network namespace: %s\n", nl_geterror(nl_err));
@@ -309,11 +626,190 @@ int nu_create_veth(Err* err, struct nl_sock* sk, int container_netns_fd,
 	rc = 0;
 
 out:
+	if (mac)                         nl_addr_put(mac);
 	if (container_veth_changes_link) rtnl_link_put(container_veth_changes_link);
 	if (container_veth_link)         rtnl_link_put(container_veth_link);
 	return rc;
 }
 
+// Builds the RTM_NEWLINK of a pod pair in its final state: the host end up and enslaved to 'master_ifidx' (if
+// any), the pod end named, addressed and created directly in the pod netns. The pod end stays down: a veth
+// can not be opened before its peer is registered (ENOTCONN), so configure_container_veth brings it up.
+static struct nl_msg* build_pod_pair_msg(const struct NuPodPair* pair, enum PodInterface pod_interface) {
+	struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC, .ifi_flags = IFF_UP, .ifi_change = IFF_UP };
+	struct ifinfomsg peer_ifi = { .ifi_family = AF_UNSPEC };
+
+	struct nl_msg* msg = nlmsg_alloc_simple(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL);
+	if (!msg) {
+		return NULL;
+	}
+
+	if (nlmsg_append(msg, &ifi, sizeof(ifi), NLMSG_ALIGNTO) < 0) goto out;
+	NLA_PUT_STRING(msg, IFLA_IFNAME, pair->host_name);
+	if (pair->master_ifidx > 0) {
+		NLA_PUT_U32(msg, IFLA_MASTER, pair->master_ifidx);
+	}
+
+	struct nlattr* linkinfo = nla_nest_start(msg, IFLA_LINKINFO);
+	if (!linkinfo) goto out;
+	int netkit = pod_interface == POD_INTERFACE_NETKIT;
+	NLA_PUT_STRING(msg, IFLA_INFO_KIND, netkit ? "netkit" : "veth");
+
+	struct nlattr* data = nla_nest_start(msg, IFLA_INFO_DATA);
+	if (!data) goto out;
+	if (netkit) {
+		// same modes and policies as create_netkit_pair
+		NLA_PUT_U32(msg, IFLA_NETKIT_MODE, NETKIT_L2);
+		NLA_PUT_U32(msg, IFLA_NETKIT_POLICY, NETKIT_PASS);
+		NLA_PUT_U32(msg, IFLA_NETKIT_PEER_POLICY, NETKIT_PASS);
+	}
+
+	struct nlattr* peer = nla_nest_start(msg, netkit ? IFLA_NETKIT_PEER_INFO : VETH_INFO_PEER);
+	if (!peer) goto out;
+	if (nlmsg_append(msg, &peer_ifi, sizeof(peer_ifi), NLMSG_ALIGNTO) < 0) goto out;
+	NLA_PUT_STRING(msg, IFLA_IFNAME, pair->container_name);
+	NLA_PUT_U32(msg, IFLA_NET_NS_FD, pair->container_netns_fd);
+	NLA_PUT_ADDR(msg, IFLA_ADDRESS, pair->container_mac);
+	nla_nest_end(msg, peer);
+
+	nla_nest_end(msg, data);
+	nla_nest_end(msg, linkinfo);
+	return msg;
+
+nla_put_failure:
+out:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+struct PodPairAcks {
+	struct NuPodPair* pairs;
+	int count;
+	unsigned int first_seq;
+	int pending;
+};
+
+static int pod_pair_ack(struct nl_msg* msg, void* arg) {
+	struct PodPairAcks* acks = arg;
+	acks->pending--;
+	return NL_OK;
+}
+
+static int pod_pair_error(struct sockaddr_nl* nla, struct nlmsgerr* e, void* arg) {
+	struct PodPairAcks* acks = arg;
+	unsigned int i = e->msg.nlmsg_seq - acks->first_seq;
+	if (i < (unsigned int)acks->count) {
+		acks->pairs[i].error = -nl_syserr2nlerr(-e->error);
+	}
+	acks->pending--;
+	return NL_SKIP;
+}
+
+// Sends the requests of up to POD_PAIR_PIPELINE_DEPTH pairs in one sendmsg (rtnetlink handles every message
+// of it, in order) and then reads their acknowledgements.
+static int send_pod_pairs(Err* err, struct nl_sock* sk, struct NuPodPair* pairs, int count, enum PodInterface pod_interface) {
+	int rc = 1;
+	int nl_err = 0;
+	struct nl_msg* msgs[POD_PAIR_PIPELINE_DEPTH] = { NULL };
+	struct iovec iov[POD_PAIR_PIPELINE_DEPTH];
+	struct nl_cb* cb = NULL;
+	size_t bytes = 0;
+
+	for (int i = 0; i < count; ++i) {
+		msgs[i] = build_pod_pair_msg(&pairs[i], pod_interface);
+		if (!msgs[i]) {
+			fprintf(stderr, "failure building pod pair request\n");
+			ERR(err, "Failure building pod pair request");
+			goto out;
+		}
+		nl_complete_msg(sk, msgs[i]);
+		iov[i].iov_base = nlmsg_hdr(msgs[i]);
+		iov[i].iov_len = nlmsg_hdr(msgs[i])->nlmsg_len;
+		bytes += iov[i].iov_len;
+	}
+
+	struct PodPairAcks acks = {
+		.pairs = pairs,
+		.count = count,
+		.first_seq = nlmsg_hdr(msgs[0])->nlmsg_seq,
+		.pending = count,
+	};
+
+	// the clone keeps the nlstat instrumentation of the socket
+	cb = nl_cb_clone(nl_socket_get_cb(sk));
+	if (!cb) {
+		fprintf(stderr, "failure allocating netlink callbacks\n");
+		ERR(err, "Failure allocating netlink callbacks");
+		goto out;
+	}
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, pod_pair_ack, &acks);
+	nl_cb_err(cb, NL_CB_CUSTOM, pod_pair_error, &acks);
+
+	nl_err = nl_send_iovec(sk, msgs[0], iov, count);
+	nlstat.syscalls++;
+	if (nl_err < 0) {
+		fprintf(stderr, "failure sending pod pair requests: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure sending pod pair requests", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+	nlstat_count_sent(bytes, count);
+
+	while (acks.pending > 0) {
+		if ((nl_err = nl_recvmsgs(sk, cb)) < 0) {
+			fprintf(stderr, "failure reading pod pair acknowledgements: %s\n", nl_geterror(nl_err));
+			ERRF(err, "Failure reading pod pair acknowledgements", "%s", nl_geterror(nl_err));
+			goto out;
+		}
+	}
+
+	rc = 0;
+
+out:
+	if (cb) nl_cb_put(cb);
+	for (int i = 0; i < count; ++i) {
+		if (msgs[i]) nlmsg_free(msgs[i]);
+	}
+	return rc;
+}
+
+// Batch counterpart of nu_create_veth: one request per pair instead of a create, a move to the pod netns and
+// an enable, pipelined. Returns 1 only when the requests could not be exchanged; the outcome of each pair is
+// in its 'error'.
+int nu_create_pod_pairs(Err* err, struct nl_sock* sk, struct NuPodPair* pairs, int count, enum PodInterface pod_interface) {
+	int start = 0;
+	for (int i = 0; i < count; ++i) {
+		pairs[i].error = 0;
+	}
+
+	// the first pair goes alone, to fall back to veth before the rest is sent
+	if (pod_interface == POD_INTERFACE_NETKIT && count > 0) {
+		if (send_pod_pairs(err, sk, pairs, 1, pod_interface)) {
+			return 1;
+		}
+		if (pairs[0].error == -NLE_OPNOTSUPP) {
+			fprintf(stderr, "netkit is not supported by the kernel, falling back to veth\n");
+			pod_interface = POD_INTERFACE_VETH;
+			pairs[0].error = 0;
+		} else {
+			start = 1;
+		}
+	}
+
+	for (int i = start; i < count; i += POD_PAIR_PIPELINE_DEPTH) {
+		int n = count - i < POD_PAIR_PIPELINE_DEPTH ? count - i : POD_PAIR_PIPELINE_DEPTH;
+		if (send_pod_pairs(err, sk, &pairs[i], n, pod_interface)) {
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (pairs[i].error < 0) {
+			fprintf(stderr, "failure creating pod pair %s: %s\n", pairs[i].host_name, nl_geterror(pairs[i].error));
+		}
+	}
+	return 0;
+}
+
 int nu_enable_veth(Err* err, struct nl_sock* sk, const char* veth_name)
 {
 	int rc = 1;
@@ -353,6 +849,60 @@ out:
 	return rc;
 }
 
+// GRO on a veth end also gives it a NAPI instance, which native XDP redirects into its peer need
+int nu_enable_gro(Err* err, const char* ifname) {
+	int rc = 1;
+	struct ethtool_value value = { .cmd = ETHTOOL_SGRO, .data = 1 };
+	struct ifreq ifr = { .ifr_data = (char*)&value };
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "failure opening ethtool socket: %s\n", strerror(errno));
+		ERRF(err, "Failure opening ethtool socket", "%s", strerror(errno));
+		goto out;
+	}
+
+	if (ioctl(fd, SIOCETHTOOL, &ifr)) {
+		fprintf(stderr, "failure enabling GRO on %s: %s\n", ifname, strerror(errno));
+		ERRF(err, "Failure enabling GRO", "%s: %s", ifname, strerror(errno));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (fd >= 0) close(fd);
+	return rc;
+}
+
+// An interface runs when it is up and has a carrier
+int nu_link_running(Err* err, const char* ifname, int* running) {
+	int rc = 1;
+	struct ifreq ifr = { 0 };
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "failure opening ioctl socket: %s\n", strerror(errno));
+		ERRF(err, "Failure opening ioctl socket", "%s", strerror(errno));
+		goto out;
+	}
+
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr)) {
+		fprintf(stderr, "failure reading flags of %s: %s\n", ifname, strerror(errno));
+		ERRF(err, "Failure reading interface flags", "%s: %s", ifname, strerror(errno));
+		goto out;
+	}
+
+	*running = (ifr.ifr_flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING);
+	rc = 0;
+
+out:
+	if (fd >= 0) close(fd);
+	return rc;
+}
+
 int nu_delete_if(Err* err, struct nl_sock* sk, const char* ifname) {
 	int rc = 1;
 	int nl_err = 0;
@@ -378,3 +928,197 @@ out:
 	if (link) rtnl_link_put(link);
 	return rc;
 }
+
+// Deletes 'ifname' by name, in a single request; an interface that does not exist is not an error
+int nu_delete_if_if_exists(Err* err, struct nl_sock* sk, const char* ifname) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct rtnl_link* link = rtnl_link_alloc();
+	if (!link) {
+		fprintf(stderr, "failure allocating rtnl_link\n");
+		ERR(err, "Failure allocating rtnl_link");
+		goto out;
+	}
+	rtnl_link_set_name(link, ifname);
+
+	if ((nl_err = rtnl_link_delete(sk, link)) < 0 && nl_err != -NLE_NODEV && nl_err != -NLE_OBJ_NOTFOUND) {
+		fprintf(stderr, "failure deleting %s: %s\n", ifname, nl_geterror(nl_err));
+		ERRF(err, "Failure deleting interface", "%s: %s", ifname, nl_geterror(nl_err));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (link) rtnl_link_put(link);
+	return rc;
+}
+
+// Installs a tbf root qdisc on 'ifidx', shaping everything the interface transmits to 'rate_bps'.
+// Packets beyond the burst wait in the tbf queue and are dropped once it is full, so TCP flows back off
+// from the losses. The rate and burst must be within the bounds of def.h, which parse_bandwidth enforces.
+int nu_set_rate_limit(Err* err, struct nl_sock* sk, int ifidx, unsigned long long rate_bps, unsigned long long burst_bits) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct rtnl_qdisc* qdisc = NULL;
+
+	qdisc = rtnl_qdisc_alloc();
+	if (!qdisc) {
+		fprintf(stderr, "failure allocating rtnl_qdisc\n");
+		ERR(err, "Failure allocating rtnl_qdisc");
+		goto out;
+	}
+
+	rtnl_tc_set_ifindex(TC_CAST(qdisc), ifidx);
+	rtnl_tc_set_parent(TC_CAST(qdisc), TC_H_ROOT);
+	rtnl_tc_set_handle(TC_CAST(qdisc), TC_HANDLE(1, 0));
+	if ((nl_err = rtnl_tc_set_kind(TC_CAST(qdisc), "tbf")) < 0) {
+		fprintf(stderr, "failure setting qdisc kind: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure setting qdisc kind", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	// libnl takes the rate and the bucket as an int of bytes
+	rtnl_qdisc_tbf_set_rate(qdisc, (int)(rate_bps / 8), (int)(burst_bits / 8), 0);
+	if ((nl_err = rtnl_qdisc_tbf_set_limit_by_latency(qdisc, RATE_LIMIT_LATENCY_USEC)) < 0) {
+		fprintf(stderr, "failure setting tbf limit: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure setting tbf limit", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	if ((nl_err = rtnl_qdisc_add(sk, qdisc, NLM_F_CREATE | NLM_F_REPLACE)) < 0) {
+		fprintf(stderr, "failure adding tbf qdisc to ifidx %d: %s\n", ifidx, nl_geterror(nl_err));
+		ERRF(err, "Failure adding tbf qdisc", "ifidx %d: %s", ifidx, nl_geterror(nl_err));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (qdisc) rtnl_qdisc_put(qdisc);
+	return rc;
+}
+
+// Creates an ifb device, which transmits back whatever is redirected to it, so that traffic an interface
+// receives can be shaped on a transmit queue. It is created up; one left behind by an earlier ADD is kept.
+int nu_create_ifb(Err* err, struct nl_sock* sk, const char* ifname) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct rtnl_link* link = rtnl_link_alloc();
+	if (!link) {
+		fprintf(stderr, "failure allocating rtnl_link\n");
+		ERR(err, "Failure allocating rtnl_link");
+		goto out;
+	}
+
+	if ((nl_err = rtnl_link_set_type(link, "ifb")) < 0) {
+		fprintf(stderr, "failure setting link type: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure setting link type", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+	rtnl_link_set_name(link, ifname);
+	rtnl_link_set_flags(link, IFF_UP);
+
+	if ((nl_err = rtnl_link_add(sk, link, NLM_F_CREATE)) < 0) {
+		fprintf(stderr, "failure creating ifb %s: %s\n", ifname, nl_geterror(nl_err));
+		ERRF(err, "Failure creating ifb", "%s: %s", ifname, nl_geterror(nl_err));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (link) rtnl_link_put(link);
+	return rc;
+}
+
+// Redirects everything 'ifidx' receives to the transmit queue of 'target_ifidx': an ingress qdisc with a u32
+// filter matching every packet and a mirred action ('tc filter add ... u32 match u32 0 0 action mirred egress
+// redirect'). u32 rather than matchall, which distribution kernels do not all ship.
+int nu_redirect_ingress(Err* err, struct nl_sock* sk, int ifidx, int target_ifidx) {
+	int rc = 1;
+	int nl_err = 0;
+
+	struct rtnl_qdisc* qdisc = NULL;
+	struct rtnl_cls* cls = NULL;
+	struct rtnl_act* act = NULL;
+
+	qdisc = rtnl_qdisc_alloc();
+	if (!qdisc) {
+		fprintf(stderr, "failure allocating rtnl_qdisc\n");
+		ERR(err, "Failure allocating rtnl_qdisc");
+		goto out;
+	}
+
+	rtnl_tc_set_ifindex(TC_CAST(qdisc), ifidx);
+	rtnl_tc_set_parent(TC_CAST(qdisc), TC_H_INGRESS);
+	rtnl_tc_set_handle(TC_CAST(qdisc), TC_HANDLE(0xffff, 0));
+	if ((nl_err = rtnl_tc_set_kind(TC_CAST(qdisc), "ingress")) < 0) {
+		fprintf(stderr, "failure setting qdisc kind: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure setting qdisc kind", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	if ((nl_err = rtnl_qdisc_add(sk, qdisc, NLM_F_CREATE | NLM_F_REPLACE)) < 0) {
+		fprintf(stderr, "failure adding ingress qdisc to ifidx %d: %s\n", ifidx, nl_geterror(nl_err));
+		ERRF(err, "Failure adding ingress qdisc", "ifidx %d: %s", ifidx, nl_geterror(nl_err));
+		goto out;
+	}
+
+	act = rtnl_act_alloc();
+	if (!act) {
+		fprintf(stderr, "failure allocating rtnl_act\n");
+		ERR(err, "Failure allocating rtnl_act");
+		goto out;
+	}
+
+	if ((nl_err = rtnl_tc_set_kind(TC_CAST(act), "mirred")) < 0) {
+		fprintf(stderr, "failure setting action kind: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure setting action kind", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+	rtnl_mirred_set_action(act, TCA_EGRESS_REDIR);
+	rtnl_mirred_set_policy(act, TC_ACT_STOLEN);
+	rtnl_mirred_set_ifindex(act, target_ifidx);
+
+	cls = rtnl_cls_alloc();
+	if (!cls) {
+		fprintf(stderr, "failure allocating rtnl_cls\n");
+		ERR(err, "Failure allocating rtnl_cls");
+		goto out;
+	}
+
+	rtnl_tc_set_ifindex(TC_CAST(cls), ifidx);
+	rtnl_tc_set_parent(TC_CAST(cls), TC_HANDLE(0xffff, 0));
+	rtnl_cls_set_prio(cls, 1);
+	rtnl_cls_set_protocol(cls, ETH_P_ALL);
+	if ((nl_err = rtnl_tc_set_kind(TC_CAST(cls), "u32")) < 0) {
+		fprintf(stderr, "failure setting classifier kind: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure setting classifier kind", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	if ((nl_err = rtnl_u32_add_key_uint32(cls, 0, 0, 0, 0)) < 0 || (nl_err = rtnl_u32_set_cls_terminal(cls)) < 0 ||
+			(nl_err = rtnl_u32_add_action(cls, act)) < 0) {
+		fprintf(stderr, "failure building redirect filter: %s\n", nl_geterror(nl_err));
+		ERRF(err, "Failure building redirect filter", "%s", nl_geterror(nl_err));
+		goto out;
+	}
+
+	if ((nl_err = rtnl_cls_add(sk, cls, NLM_F_CREATE | NLM_F_EXCL)) < 0) {
+		fprintf(stderr, "failure adding redirect filter to ifidx %d: %s\n", ifidx, nl_geterror(nl_err));
+		ERRF(err, "Failure adding redirect filter", "ifidx %d: %s", ifidx, nl_geterror(nl_err));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (act) rtnl_act_put(act);
+	if (cls) rtnl_cls_put(cls);
+	if (qdisc) rtnl_qdisc_put(qdisc);
+	return rc;
+}
@@ -3,18 +3,42 @@
 
 #include <netlink/route/link.h>
 #include <netlink/route/addr.h>
+#include "def.h"
 #include "err.h"
 
 int nu_rtnl_addr_build(Err* err, const char* cidr, int ifidx, struct rtnl_addr** out);
+int nu_mac_from_cidr(Err* err, const char* cidr, struct nl_addr** out);
+int nu_get_link_addr(Err* err, struct nl_sock* sk, const char* ifname, struct nl_addr** out);
+int nu_add_permanent_neigh(Err* err, struct nl_sock* sk, int ifidx, const char* cidr, struct nl_addr* lladdr);
 int nu_add_routing_rule(Err* err, struct nl_sock* sk, const char* cidr, const char* next_ip, int via_ifidx);
+int nu_add_device_route(Err* err, struct nl_sock* sk, const char* cidr, int ifidx);
 int nu_create_bridge(Err* err, struct nl_sock* sk, const char* bridge_cidr, const char* bridge_name);
 int nu_create_vxlan(Err* err, struct nl_sock* sk, const char* underlay_if,
                     const char* vxlan_name, const char* vxlan_group, int vni_id);
 int nu_create_veth(Err* err, struct nl_sock* sk, int container_netns_fd,
                    const char* container_veth_name,
                    const char* container_veth_tmp_name,
-                   const char* host_veth_name);
+                   const char* container_veth_cidr,
+                   const char* host_veth_name,
+                   enum PodInterface pod_interface);
+// Pod pair of nu_create_pod_pairs
+struct NuPodPair {
+	const char* host_name;
+	const char* container_name;
+	int container_netns_fd;
+	struct nl_addr* container_mac;
+	int master_ifidx; // bridge of the host end, 0 to leave it unbridged
+	int error; // set by nu_create_pod_pairs: 0 or a (negative) libnl error
+};
+
+int nu_create_pod_pairs(Err* err, struct nl_sock* sk, struct NuPodPair* pairs, int count, enum PodInterface pod_interface);
 int nu_enable_veth(Err* err, struct nl_sock* sk, const char* veth_name);
+int nu_enable_gro(Err* err, const char* ifname);
+int nu_link_running(Err* err, const char* ifname, int* running);
 int nu_delete_if(Err* err, struct nl_sock* sk, const char* ifname);
+int nu_delete_if_if_exists(Err* err, struct nl_sock* sk, const char* ifname);
+int nu_set_rate_limit(Err* err, struct nl_sock* sk, int ifidx, unsigned long long rate_bps, unsigned long long burst_bits);
+int nu_create_ifb(Err* err, struct nl_sock* sk, const char* ifname);
+int nu_redirect_ingress(Err* err, struct nl_sock* sk, int ifidx, int target_ifidx);
 
 #endif
\ No newline at end of file
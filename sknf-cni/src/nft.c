@@ -6,7 +6,9 @@
 #include <libmnl/libmnl.h>
 #include <libnftnl/chain.h>
 #include <libnftnl/expr.h>
+#include <libnftnl/object.h>
 #include <libnftnl/rule.h>
+#include <libnftnl/set.h>
 #include <libnftnl/table.h>
 #include <netinet/in.h>
 #include <stdbool.h>
@@ -14,192 +16,1181 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
+#include <linux/netfilter/nf_nat.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/rtnetlink.h>
 
+#include "contention.h"
 #include "err.h"
+#include "nlstat.h"
 #include "util.h"
 
 #define SKNF_NFTABLES_TABLE_NAME "sknf"
 #define SKNF_NFTABLES_POSTROUTING_CHAIN_NAME "POSTROUTING"
+#define SKNF_NFTABLES_ACCOUNTING_CHAIN_NAME "ACCOUNTING"
+#define SKNF_NFTABLES_HOSTPORTS_PREROUTING_CHAIN_NAME "HOSTPORTS_PREROUTING"
+#define SKNF_NFTABLES_HOSTPORTS_OUTPUT_CHAIN_NAME "HOSTPORTS_OUTPUT"
 
-// iptables -t nat -A POSTROUTING -s <podCIDR> -o eth0 -j MASQUERADE
-int nft_nat_rule(Err* err, const char* ifname, const char* cidr) {
-	struct in_addr addr;
-	int prefix;
+// Map of the hostPorts of every pod of the node: l4proto . hostPort -> podIP . containerPort
+#define SKNF_NFTABLES_HOSTPORTS_MAP_NAME "hostports"
 
-	int rc = 1; // assume failure
-	struct mnl_socket* sk = NULL;
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	struct mnl_nlmsg_batch* batch = NULL;
-	int batch_stopped = 0; // track whether we called mnl_nlmsg_batch_stop
-	uint32_t seq = 0;
+// Object maps (pod IP -> named counter) used by the ACCOUNTING chain.
+// Counter objects are named "<direction>-<pod IP>", e.g. "egress-10.250.0.5" (read by sknf-app metrics).
+#define SKNF_NFTABLES_EGRESS_MAP_NAME "pod_egress"
+#define SKNF_NFTABLES_INGRESS_MAP_NAME "pod_ingress"
+#define SKNF_NFTABLES_CROSSNODE_MAP_NAME "pod_crossnode"
+#define SKNF_NFTABLES_EGRESS_COUNTER_PREFIX "egress-"
+#define SKNF_NFTABLES_INGRESS_COUNTER_PREFIX "ingress-"
+#define SKNF_NFTABLES_CROSSNODE_COUNTER_PREFIX "crossnode-"
+#define SKNF_NFTABLES_COUNTER_NAME_LEN 64
 
-	if (util_cidr_parse(err, cidr, &addr, &prefix)) {
-		fprintf(stderr, "unable to parse CIDR %s\n", cidr);
-		return 1;
-	}
-	uint32_t mask = (prefix == 0) ? 0 : htonl(0xFFFFFFFFu << (32 - prefix));
-	uint32_t net_be = addr.s_addr;
+// nftables datatype ids (see nft's datatype.h); concatenations are encoded 6 bits per type
+#define NFT_DATATYPE_IPADDR 7
+#define NFT_DATATYPE_INET_PROTOCOL 12
+#define NFT_DATATYPE_INET_SERVICE 13
+#define NFT_DATATYPE_CONCAT(a, b) (((a) << 6) | (b))
+
+// each member of a concatenation takes a whole 32-bit register
+#define NFT_CONCAT_FIELD_LEN 4
+
+#define NFT_BATCH_BUFFER_SIZE (64 * 1024)
+// room for the objects of one more pod in a batch (6 messages of about 100 bytes)
+#define NFT_BATCH_POD_BUFFER_SIZE 1024
+
+// Acks are queued on the socket while the kernel processes the batch, before the first one is read. Up to
+// NFT_BATCH_DEFAULT_RCVBUF_ACKS fit the default receive buffer; beyond that it is grown by
+// NFT_BATCH_ACK_RCVBUF bytes (an ack skb) per acked message, as nft does for large transactions.
+#define NFT_BATCH_DEFAULT_RCVBUF_ACKS 64
+#define NFT_BATCH_ACK_RCVBUF 1024
+
+#define IPV4_SADDR_OFFSET 12
+#define IPV4_DADDR_OFFSET 16
+#define TH_DPORT_OFFSET 2
 
-	sk = mnl_socket_open(NETLINK_NETFILTER);
-	if (!sk) {
+#define LOOPBACK_NET 0x7f000000
+#define LOOPBACK_MASK 0xff000000
+
+// registers holding the SNAT port range, next to the address in NFT_REG_1
+#define SNAT_REG_PORT_MIN NFT_REG_2
+#define SNAT_REG_PORT_MAX NFT_REG_3
+#define SNAT_HASH_SEED 0x736b6e66
+
+// A single nftables transaction: every message added to it is committed atomically by nft_batch_commit.
+struct NftBatch {
+	struct mnl_socket* sk;
+	char* buf;
+	struct mnl_nlmsg_batch* batch;
+	uint32_t seq;
+	uint32_t last_ack_seq;
+	uint32_t portid;
+	size_t size;
+	int overflow;
+	uint32_t set_id;
+	unsigned long messages; // messages of the batch, for nlstat
+	unsigned long acks; // messages of the batch with NLM_F_ACK
+	int error; // errno of the first message rejected by nft_batch_commit
+};
+
+static int nft_batch_init(Err* err, struct NftBatch* b, size_t size) {
+	memset(b, 0, sizeof(*b));
+
+	b->sk = mnl_socket_open(NETLINK_NETFILTER);
+	if (!b->sk) {
 		fprintf(stderr, "failure opening mnl_socket: %s\n", strerror(errno));
 		ERRF(err, "Failure opening mnl_socket", "%s", strerror(errno));
-		goto out;
+		return 1;
 	}
 
-	if (mnl_socket_bind(sk, 0, MNL_SOCKET_AUTOPID) < 0) {
+	if (mnl_socket_bind(b->sk, 0, MNL_SOCKET_AUTOPID) < 0) {
 		fprintf(stderr, "failure binding to mnl_socket: %s\n", strerror(errno));
 		ERRF(err, "Failure binding to mnl_socket", "%s", strerror(errno));
-		goto out;
+		return 1;
 	}
 
-	int portid = mnl_socket_get_portid(sk);
+	b->portid = mnl_socket_get_portid(b->sk);
+	nlstat.sockets++;
+
+	b->size = size;
+	b->buf = malloc(size);
+	if (!b->buf) {
+		fprintf(stderr, "failure allocating nft batch buffer\n");
+		ERR(err, "Failure allocating nft batch buffer");
+		return 1;
+	}
+
+	b->batch = mnl_nlmsg_batch_start(b->buf, size);
+	nftnl_batch_begin(mnl_nlmsg_batch_current(b->batch), ++b->seq);
+	mnl_nlmsg_batch_next(b->batch);
+	return 0;
+}
+
+static void nft_batch_free(struct NftBatch* b) {
+	if (b->batch) mnl_nlmsg_batch_stop(b->batch);
+	if (b->buf) free(b->buf);
+	if (b->sk) mnl_socket_close(b->sk);
+	memset(b, 0, sizeof(*b));
+}
+
+// Returns the header of the next message in the batch; 'ack' messages are tracked so that
+// nft_batch_commit knows which acknowledgement closes the transaction.
+static struct nlmsghdr* nft_batch_msg(struct NftBatch* b, uint16_t type, uint16_t flags) {
+	uint32_t seq = ++b->seq;
+	if (flags & NLM_F_ACK) {
+		b->last_ack_seq = seq;
+		b->acks++;
+	}
+	b->messages++;
+	return nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(b->batch), type, NFPROTO_IPV4, flags, seq);
+}
+
+static void nft_batch_next(struct NftBatch* b) {
+	if (!mnl_nlmsg_batch_next(b->batch)) {
+		b->overflow = 1;
+	}
+}
+
+static int nft_batch_commit(Err* err, struct NftBatch* b) {
+	nftnl_batch_end(mnl_nlmsg_batch_current(b->batch), ++b->seq);
+	nft_batch_next(b);
+
+	if (b->overflow) {
+		fprintf(stderr, "nft batch exceeds %zu bytes\n", b->size);
+		ERRF(err, "Nft batch too large", "exceeds %zu bytes", b->size);
+		return 1;
+	}
+
+	// SO_RCVBUFFORCE goes past rmem_max (with CAP_NET_ADMIN, which the plugin runs with)
+	if (b->acks > NFT_BATCH_DEFAULT_RCVBUF_ACKS) {
+		int rcvbuf = (int)(b->acks * NFT_BATCH_ACK_RCVBUF);
+		if (setsockopt(mnl_socket_get_fd(b->sk), SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) &&
+			setsockopt(mnl_socket_get_fd(b->sk), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))) {
+			fprintf(stderr, "failure growing nft socket receive buffer: %s\n", strerror(errno));
+			ERRF(err, "Failure growing nft socket receive buffer", "%s", strerror(errno));
+			return 1;
+		}
+		nlstat.syscalls++;
+	}
+
+	// from the send to the last ack: the transaction, and the wait on the commit mutex behind concurrent ones
+	uint64_t start_ns = contention_now_ns();
+	if (mnl_socket_sendto(b->sk, mnl_nlmsg_batch_head(b->batch), mnl_nlmsg_batch_size(b->batch)) < 0) {
+		fprintf(stderr, "failure sending batch to configure nftables: %s\n", strerror(errno));
+		ERRF(err, "Failure sending batch to configure nftables", "%s", strerror(errno));
+		return 1;
+	}
+	nlstat.syscalls++;
+	// batch begin and end included
+	nlstat_count_sent(mnl_nlmsg_batch_size(b->batch), b->messages + 2);
+
+	// The kernel answers every NLM_F_ACK message (with an error or an ack), even when the transaction is aborted,
+	// so keep reading until the last one arrives and report the first error.
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int first_error = 0;
+	int done = (b->last_ack_seq == 0);
+	while (!done) {
+		int ret = mnl_socket_recvfrom(b->sk, buf, sizeof(buf));
+		nlstat.syscalls++;
+		if (ret < 0) {
+			fprintf(stderr, "received error when consuming nft acks: %s\n", strerror(errno));
+			ERRF(err, "Received error when consuming nft acks", "%s", strerror(errno));
+			return 1;
+		}
+		nlstat_count_received(ret, 0);
+
+		const struct nlmsghdr* nlh = (const struct nlmsghdr*)buf;
+		while (mnl_nlmsg_ok(nlh, ret)) {
+			nlstat_count_received(0, 1);
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr* nl_err = mnl_nlmsg_get_payload(nlh);
+				if (nl_err->error != 0 && first_error == 0) {
+					first_error = -nl_err->error;
+				}
+				if (nlh->nlmsg_seq == b->last_ack_seq) {
+					done = 1;
+				}
+			}
+			nlh = mnl_nlmsg_next(nlh, &ret);
+		}
+	}
 
-	batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
-	nftnl_batch_begin(mnl_nlmsg_batch_current(batch), ++seq);
-	mnl_nlmsg_batch_next(batch);
+	contention_wait(CONTENTION_NFTABLES, start_ns, 0);
 
-	// table
+	if (first_error != 0) {
+		contention.nft_rejected++;
+		b->error = first_error;
+		fprintf(stderr, "nftables transaction rejected: %s\n", strerror(first_error));
+		ERRF(err, "Nftables transaction rejected", "%s", strerror(first_error));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int nft_batch_add_table(Err* err, struct NftBatch* b) {
 	struct nftnl_table* t = nftnl_table_alloc();
 	if (!t) {
 		fprintf(stderr, "failure allocating nftnl_table\n");
 		ERR(err, "Failure allocating nftnl_table");
-		goto out;
+		return 1;
 	}
 	nftnl_table_set_str(t, NFTNL_TABLE_NAME, SKNF_NFTABLES_TABLE_NAME);
 	nftnl_table_set_u32(t, NFTNL_TABLE_FAMILY, NFPROTO_IPV4);
 
-	struct nlmsghdr* nlh = nftnl_table_nlmsg_build_hdr(
-		mnl_nlmsg_batch_current(batch), NFT_MSG_NEWTABLE, NFPROTO_IPV4,
-		NLM_F_CREATE | NLM_F_ACK, ++seq
-	);
-	int table_seq = seq;
+	struct nlmsghdr* nlh = nft_batch_msg(b, NFT_MSG_NEWTABLE, NLM_F_CREATE | NLM_F_ACK);
 	nftnl_table_nlmsg_build_payload(nlh, t);
-	mnl_nlmsg_batch_next(batch);
+	nft_batch_next(b);
 	nftnl_table_free(t);
+	return 0;
+}
 
-	// chain
+static int nft_batch_add_base_chain(Err* err, struct NftBatch* b, const char* name, const char* type, uint32_t hooknum, int32_t prio) {
 	struct nftnl_chain* c = nftnl_chain_alloc();
 	if (!c) {
 		fprintf(stderr, "failure allocating nftnl_chain\n");
 		ERR(err, "Failure allocating nftnl_chain");
-		goto out;
+		return 1;
 	}
 	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, SKNF_NFTABLES_TABLE_NAME);
-	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, SKNF_NFTABLES_POSTROUTING_CHAIN_NAME);
-	nftnl_chain_set_str(c, NFTNL_CHAIN_TYPE, "nat");
-	nftnl_chain_set_u32(c, NFTNL_CHAIN_HOOKNUM, NF_INET_POST_ROUTING);
-	nftnl_chain_set_s32(c, NFTNL_CHAIN_PRIO, NF_IP_PRI_NAT_SRC);
-
-	nlh = nftnl_chain_nlmsg_build_hdr(
-		mnl_nlmsg_batch_current(batch), NFT_MSG_NEWCHAIN, NFPROTO_IPV4,
-		NLM_F_CREATE | NLM_F_ACK, ++seq
-	);
+	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, name);
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TYPE, type);
+	nftnl_chain_set_u32(c, NFTNL_CHAIN_HOOKNUM, hooknum);
+	nftnl_chain_set_s32(c, NFTNL_CHAIN_PRIO, prio);
+
+	struct nlmsghdr* nlh = nft_batch_msg(b, NFT_MSG_NEWCHAIN, NLM_F_CREATE | NLM_F_ACK);
 	nftnl_chain_nlmsg_build_payload(nlh, c);
-	mnl_nlmsg_batch_next(batch);
+	nft_batch_next(b);
 	nftnl_chain_free(c);
+	return 0;
+}
 
-	// rule
+// Deletes every rule of a chain; used so that the node-wide rules are replaced (not appended) on each ADD
+static int nft_batch_flush_chain(Err* err, struct NftBatch* b, const char* chain) {
 	struct nftnl_rule* r = nftnl_rule_alloc();
 	if (!r) {
 		fprintf(stderr, "failure allocating nftnl_rule\n");
 		ERR(err, "Failure allocating nftnl_rule");
-		goto out;
+		return 1;
 	}
 	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, SKNF_NFTABLES_TABLE_NAME);
-	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, SKNF_NFTABLES_POSTROUTING_CHAIN_NAME);
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
 
-	// meta oifname -> reg1 ; cmp reg1 == "<ifname>"
-	{
-		struct nftnl_expr *e_meta = nftnl_expr_alloc("meta");
-		nftnl_expr_set_u32(e_meta, NFTNL_EXPR_META_KEY, NFT_META_OIFNAME);
-		nftnl_expr_set_u32(e_meta, NFTNL_EXPR_META_DREG, NFT_REG_1);
-		nftnl_rule_add_expr(r, e_meta);
+	struct nlmsghdr* nlh = nft_batch_msg(b, NFT_MSG_DELRULE, NLM_F_ACK);
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	nft_batch_next(b);
+	nftnl_rule_free(r);
+	return 0;
+}
 
-		struct nftnl_expr *e_cmp = nftnl_expr_alloc("cmp");
-		nftnl_expr_set_u32(e_cmp, NFTNL_EXPR_CMP_SREG, NFT_REG_1);
-		nftnl_expr_set_u32(e_cmp, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
-		nftnl_expr_set_str(e_cmp, NFTNL_EXPR_CMP_DATA, ifname);
-		nftnl_rule_add_expr(r, e_cmp);
+// Appends rule 'r' (whose expressions were already added) to 'chain' and releases it
+static void nft_batch_add_rule(struct NftBatch* b, const char* chain, struct nftnl_rule* r) {
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, SKNF_NFTABLES_TABLE_NAME);
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+
+	struct nlmsghdr* nlh = nft_batch_msg(b, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK);
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	nft_batch_next(b);
+	nftnl_rule_free(r);
+}
+
+// Creates (if missing) a map from IPv4 address to a named counter
+static int nft_batch_add_counter_map(Err* err, struct NftBatch* b, const char* name) {
+	struct nftnl_set* s = nftnl_set_alloc();
+	if (!s) {
+		fprintf(stderr, "failure allocating nftnl_set\n");
+		ERR(err, "Failure allocating nftnl_set");
+		return 1;
 	}
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, SKNF_NFTABLES_TABLE_NAME);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, name);
+	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+	nftnl_set_set_u32(s, NFTNL_SET_ID, ++b->set_id);
+	nftnl_set_set_u32(s, NFTNL_SET_FLAGS, NFT_SET_OBJECT);
+	nftnl_set_set_u32(s, NFTNL_SET_KEY_TYPE, NFT_DATATYPE_IPADDR);
+	nftnl_set_set_u32(s, NFTNL_SET_KEY_LEN, sizeof(uint32_t));
+	nftnl_set_set_u32(s, NFTNL_SET_OBJ_TYPE, NFT_OBJECT_COUNTER);
+
+	struct nlmsghdr* nlh = nft_batch_msg(b, NFT_MSG_NEWSET, NLM_F_CREATE | NLM_F_ACK);
+	nftnl_set_nlmsg_build_payload(nlh, s);
+	nft_batch_next(b);
+	nftnl_set_free(s);
+	return 0;
+}
 
-	// payload load saddr -> reg1
+// Creates (if missing) the hostports map
+static int nft_batch_add_hostports_map(Err* err, struct NftBatch* b) {
+	struct nftnl_set* s = nftnl_set_alloc();
+	if (!s) {
+		fprintf(stderr, "failure allocating nftnl_set\n");
+		ERR(err, "Failure allocating nftnl_set");
+		return 1;
+	}
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, SKNF_NFTABLES_TABLE_NAME);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, SKNF_NFTABLES_HOSTPORTS_MAP_NAME);
+	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+	nftnl_set_set_u32(s, NFTNL_SET_ID, ++b->set_id);
+	nftnl_set_set_u32(s, NFTNL_SET_FLAGS, NFT_SET_MAP);
+	nftnl_set_set_u32(s, NFTNL_SET_KEY_TYPE, NFT_DATATYPE_CONCAT(NFT_DATATYPE_INET_PROTOCOL, NFT_DATATYPE_INET_SERVICE));
+	nftnl_set_set_u32(s, NFTNL_SET_KEY_LEN, 2 * NFT_CONCAT_FIELD_LEN);
+	nftnl_set_set_u32(s, NFTNL_SET_DATA_TYPE, NFT_DATATYPE_CONCAT(NFT_DATATYPE_IPADDR, NFT_DATATYPE_INET_SERVICE));
+	nftnl_set_set_u32(s, NFTNL_SET_DATA_LEN, 2 * NFT_CONCAT_FIELD_LEN);
+
+	struct nlmsghdr* nlh = nft_batch_msg(b, NFT_MSG_NEWSET, NLM_F_CREATE | NLM_F_ACK);
+	nftnl_set_nlmsg_build_payload(nlh, s);
+	nft_batch_next(b);
+	nftnl_set_free(s);
+	return 0;
+}
+
+static int nft_batch_counter(Err* err, struct NftBatch* b, uint16_t type, uint16_t flags, const char* name) {
+	struct nftnl_obj* o = nftnl_obj_alloc();
+	if (!o) {
+		fprintf(stderr, "failure allocating nftnl_obj\n");
+		ERR(err, "Failure allocating nftnl_obj");
+		return 1;
+	}
+	nftnl_obj_set_str(o, NFTNL_OBJ_TABLE, SKNF_NFTABLES_TABLE_NAME);
+	nftnl_obj_set_str(o, NFTNL_OBJ_NAME, name);
+	nftnl_obj_set_u32(o, NFTNL_OBJ_FAMILY, NFPROTO_IPV4);
+	nftnl_obj_set_u32(o, NFTNL_OBJ_TYPE, NFT_OBJECT_COUNTER);
+
+	struct nlmsghdr* nlh = nft_batch_msg(b, type, flags | NLM_F_ACK);
+	nftnl_obj_nlmsg_build_payload(nlh, o);
+	nft_batch_next(b);
+	nftnl_obj_free(o);
+	return 0;
+}
+
+// Adds or deletes the element '<ip> : <counter>' of a counter map
+static int nft_batch_counter_map_elem(Err* err, struct NftBatch* b, uint16_t type, uint16_t flags,
+		const char* map, uint32_t ip_be, const char* counter) {
+	struct nftnl_set* s = nftnl_set_alloc();
+	if (!s) {
+		fprintf(stderr, "failure allocating nftnl_set\n");
+		ERR(err, "Failure allocating nftnl_set");
+		return 1;
+	}
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, SKNF_NFTABLES_TABLE_NAME);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, map);
+	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+
+	struct nftnl_set_elem* e = nftnl_set_elem_alloc();
+	if (!e) {
+		fprintf(stderr, "failure allocating nftnl_set_elem\n");
+		ERR(err, "Failure allocating nftnl_set_elem");
+		nftnl_set_free(s);
+		return 1;
+	}
+	nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, &ip_be, sizeof(ip_be));
+	if (type == NFT_MSG_NEWSETELEM) {
+		nftnl_set_elem_set_str(e, NFTNL_SET_ELEM_OBJREF, counter);
+	}
+	nftnl_set_elem_add(s, e);
+
+	struct nlmsghdr* nlh = nft_batch_msg(b, type, flags | NLM_F_ACK);
+	nftnl_set_elems_nlmsg_build_payload(nlh, s);
+	nft_batch_next(b);
+	nftnl_set_free(s);
+	return 0;
+}
+
+// Adds or deletes the element '<proto> . <hostPort> : <pod IP> . <containerPort>' of the hostports map.
+// Adding an element whose key is already mapped to another pod fails with EBUSY.
+static int nft_batch_hostport_elem(Err* err, struct NftBatch* b, uint16_t type, uint16_t flags,
+		const struct PortMapping* mapping, uint32_t ip_be) {
+	struct nftnl_set* s = nftnl_set_alloc();
+	if (!s) {
+		fprintf(stderr, "failure allocating nftnl_set\n");
+		ERR(err, "Failure allocating nftnl_set");
+		return 1;
+	}
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, SKNF_NFTABLES_TABLE_NAME);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, SKNF_NFTABLES_HOSTPORTS_MAP_NAME);
+	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+
+	struct nftnl_set_elem* e = nftnl_set_elem_alloc();
+	if (!e) {
+		fprintf(stderr, "failure allocating nftnl_set_elem\n");
+		ERR(err, "Failure allocating nftnl_set_elem");
+		nftnl_set_free(s);
+		return 1;
+	}
+
+	// concatenation members are padded to NFT_CONCAT_FIELD_LEN bytes
+	uint8_t key[2 * NFT_CONCAT_FIELD_LEN] = { 0 };
+	uint16_t host_port_be = htons(mapping->host_port);
+	key[0] = mapping->protocol;
+	memcpy(&key[NFT_CONCAT_FIELD_LEN], &host_port_be, sizeof(host_port_be));
+	nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, key, sizeof(key));
+
+	if (type == NFT_MSG_NEWSETELEM) {
+		uint8_t data[2 * NFT_CONCAT_FIELD_LEN] = { 0 };
+		uint16_t container_port_be = htons(mapping->container_port);
+		memcpy(&data[0], &ip_be, sizeof(ip_be));
+		memcpy(&data[NFT_CONCAT_FIELD_LEN], &container_port_be, sizeof(container_port_be));
+		nftnl_set_elem_set(e, NFTNL_SET_ELEM_DATA, data, sizeof(data));
+	}
+	nftnl_set_elem_add(s, e);
+
+	struct nlmsghdr* nlh = nft_batch_msg(b, type, flags | NLM_F_ACK);
+	nftnl_set_elems_nlmsg_build_payload(nlh, s);
+	nft_batch_next(b);
+	nftnl_set_free(s);
+	return 0;
+}
+
+// payload load <offset> -> reg1 ; reg1 &= mask ; cmp reg1 <op> net&mask
+static void add_prefix_match(struct nftnl_rule* r, uint32_t offset, uint32_t net_be, uint32_t mask_be, uint32_t op) {
 	{
 		struct nftnl_expr *e = nftnl_expr_alloc("payload");
 		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
-		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET, 12);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET, offset);
 		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_LEN, 4);
 		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG_1);
 		nftnl_rule_add_expr(r, e);
 	}
 
-	// bitwise AND with mask
 	{
 		uint32_t zero = 0;
 		struct nftnl_expr *e = nftnl_expr_alloc("bitwise");
 		nftnl_expr_set_u32(e, NFTNL_EXPR_BITWISE_SREG, NFT_REG_1);
 		nftnl_expr_set_u32(e, NFTNL_EXPR_BITWISE_DREG, NFT_REG_1);
 		nftnl_expr_set_u32(e, NFTNL_EXPR_BITWISE_LEN, 4);
-		nftnl_expr_set_data(e, NFTNL_EXPR_BITWISE_MASK, &mask, sizeof(mask));
+		nftnl_expr_set_data(e, NFTNL_EXPR_BITWISE_MASK, &mask_be, sizeof(mask_be));
 		nftnl_expr_set_data(e, NFTNL_EXPR_BITWISE_XOR, &zero, sizeof(zero));
 		nftnl_rule_add_expr(r, e);
 	}
 
-	// compare reg1 == net&mask
 	{
-		uint32_t net_and_mask = net_be & mask;
+		uint32_t net_and_mask = net_be & mask_be;
 		struct nftnl_expr *e = nftnl_expr_alloc("cmp");
 		nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG, NFT_REG_1);
-		nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, op);
 		nftnl_expr_set_data(e, NFTNL_EXPR_CMP_DATA, &net_and_mask, sizeof(net_and_mask));
 		nftnl_rule_add_expr(r, e);
 	}
+}
+
+// payload load <offset> -> reg1 ; counter name reg1 map @<map>
+static void add_counter_map_lookup(struct nftnl_rule* r, uint32_t offset, const char* map) {
+	{
+		struct nftnl_expr *e = nftnl_expr_alloc("payload");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET, offset);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_LEN, 4);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG_1);
+		nftnl_rule_add_expr(r, e);
+	}
 
-	// action: masquerade
 	{
+		struct nftnl_expr *e = nftnl_expr_alloc("objref");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_OBJREF_SET_SREG, NFT_REG_1);
+		nftnl_expr_set_str(e, NFTNL_EXPR_OBJREF_SET_NAME, map);
+		nftnl_rule_add_expr(r, e);
+	}
+}
+
+static int cidr_to_net_mask(Err* err, const char* cidr, uint32_t* net_be, uint32_t* mask_be) {
+	struct in_addr addr;
+	int prefix;
+	if (util_cidr_parse(err, cidr, &addr, &prefix)) {
+		fprintf(stderr, "unable to parse CIDR %s\n", cidr);
+		return 1;
+	}
+	*mask_be = (prefix == 0) ? 0 : htonl(0xFFFFFFFFu << (32 - prefix));
+	*net_be = addr.s_addr & *mask_be;
+	return 0;
+}
+
+static struct nftnl_rule* alloc_rule(Err* err) {
+	struct nftnl_rule* r = nftnl_rule_alloc();
+	if (!r) {
+		fprintf(stderr, "failure allocating nftnl_rule\n");
+		ERR(err, "Failure allocating nftnl_rule");
+	}
+	return r;
+}
+
+// meta oifname -> reg1 ; cmp reg1 == "<ifname>" ; ip saddr <clusterCIDR>
+static void add_egress_match(struct nftnl_rule* r, const char* ifname, uint32_t cluster_net, uint32_t cluster_mask) {
+	{
+		struct nftnl_expr *e_meta = nftnl_expr_alloc("meta");
+		nftnl_expr_set_u32(e_meta, NFTNL_EXPR_META_KEY, NFT_META_OIFNAME);
+		nftnl_expr_set_u32(e_meta, NFTNL_EXPR_META_DREG, NFT_REG_1);
+		nftnl_rule_add_expr(r, e_meta);
+
+		struct nftnl_expr *e_cmp = nftnl_expr_alloc("cmp");
+		nftnl_expr_set_u32(e_cmp, NFTNL_EXPR_CMP_SREG, NFT_REG_1);
+		nftnl_expr_set_u32(e_cmp, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+		nftnl_expr_set_str(e_cmp, NFTNL_EXPR_CMP_DATA, ifname);
+		nftnl_rule_add_expr(r, e_cmp);
+	}
+
+	add_prefix_match(r, IPV4_SADDR_OFFSET, cluster_net, cluster_mask, NFT_CMP_EQ);
+}
+
+// immediate <min> -> reg2 ; immediate <max> -> reg3 (ports in network order, as nat expects them)
+static void add_port_range_load(struct nftnl_rule* r, const struct Snat* snat) {
+	uint16_t ports[2] = { htons(snat->port_min), htons(snat->port_max) };
+	for (int i = 0; i < 2; ++i) {
+		struct nftnl_expr *e = nftnl_expr_alloc("immediate");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_IMM_DREG, SNAT_REG_PORT_MIN + i);
+		nftnl_expr_set_data(e, NFTNL_EXPR_IMM_DATA, &ports[i], sizeof(ports[i]));
+		nftnl_rule_add_expr(r, e);
+	}
+}
+
+// Source NAT of traffic leaving the cluster through <ifname>. Ports are picked fully at random
+// (instead of the kernel's sequential search from a hash of the tuple), which avoids the long
+// probing and clashes that show up when a few pods open many connections to the same destination.
+//
+//   without egress IPs:  oifname <ifname> ip saddr <clusterCIDR> masquerade random-fully [to :<ports>]
+//   with N egress IPs:   oifname <ifname> ip saddr <clusterCIDR> jhash ip saddr mod N == i snat to <ip i>[:<ports>] random-fully
+//
+// Hashing the pod address keeps each pod behind one egress IP while spreading pods over the pool.
+static int add_snat_rules(Err* err, struct NftBatch* b, const char* ifname, const char* cluster_cidr, const struct Snat* snat) {
+	uint32_t net_be, mask;
+	if (cidr_to_net_mask(err, cluster_cidr, &net_be, &mask)) {
+		return 1;
+	}
+
+	int has_ports = snat->port_min != 0;
+
+	if (snat->ip_count == 0) {
+		struct nftnl_rule* r = alloc_rule(err);
+		if (!r) {
+			return 1;
+		}
+
+		add_egress_match(r, ifname, net_be, mask);
+		if (has_ports) {
+			add_port_range_load(r, snat);
+		}
+
 		struct nftnl_expr *e = nftnl_expr_alloc("masq");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_MASQ_FLAGS, NF_NAT_RANGE_PROTO_RANDOM_FULLY);
+		if (has_ports) {
+			nftnl_expr_set_u32(e, NFTNL_EXPR_MASQ_REG_PROTO_MIN, SNAT_REG_PORT_MIN);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_MASQ_REG_PROTO_MAX, SNAT_REG_PORT_MAX);
+		}
 		nftnl_rule_add_expr(r, e);
+
+		nft_batch_add_rule(b, SKNF_NFTABLES_POSTROUTING_CHAIN_NAME, r);
+		return 0;
 	}
 
-	nlh = nftnl_rule_nlmsg_build_hdr(
-		mnl_nlmsg_batch_current(batch), NFT_MSG_NEWRULE, NFPROTO_IPV4,
-		NLM_F_CREATE | NLM_F_ACK, ++seq
-	);
-	nftnl_rule_nlmsg_build_payload(nlh, r);
-	mnl_nlmsg_batch_next(batch);
-	nftnl_rule_free(r);
+	for (int i = 0; i < snat->ip_count; ++i) {
+		struct in_addr egress_ip;
+		if (inet_pton(AF_INET, snat->ips[i], &egress_ip) != 1) {
+			fprintf(stderr, "invalid egress IP %s\n", snat->ips[i]);
+			ERRF(err, "Invalid egress IP", "%s", snat->ips[i]);
+			return 1;
+		}
 
-	nftnl_batch_end(mnl_nlmsg_batch_current(batch), ++seq);
-	mnl_nlmsg_batch_next(batch);
+		struct nftnl_rule* r = alloc_rule(err);
+		if (!r) {
+			return 1;
+		}
 
-	if (mnl_socket_sendto(sk, mnl_nlmsg_batch_head(batch), mnl_nlmsg_batch_size(batch)) < 0) {
-		fprintf(stderr, "failure sending batch to configure nftables: %s\n", strerror(errno));
-		ERRF(err, "Failure sending batch to configure nftables", "%s", strerror(errno));
+		add_egress_match(r, ifname, net_be, mask);
+
+		// the last rule takes whatever the previous ones did not, so it needs no hash
+		if (i < snat->ip_count - 1) {
+			struct nftnl_expr *e = nftnl_expr_alloc("payload");
+			nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET, IPV4_SADDR_OFFSET);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_LEN, 4);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG_1);
+			nftnl_rule_add_expr(r, e);
+
+			e = nftnl_expr_alloc("hash");
+			nftnl_expr_set_u32(e, NFTNL_EXPR_HASH_TYPE, NFT_HASH_JENKINS);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_HASH_SREG, NFT_REG_1);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_HASH_DREG, NFT_REG_1);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_HASH_LEN, 4);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_HASH_MODULUS, snat->ip_count);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_HASH_SEED, SNAT_HASH_SEED);
+			nftnl_rule_add_expr(r, e);
+
+			uint32_t slot = i;
+			e = nftnl_expr_alloc("cmp");
+			nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG, NFT_REG_1);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+			nftnl_expr_set_data(e, NFTNL_EXPR_CMP_DATA, &slot, sizeof(slot));
+			nftnl_rule_add_expr(r, e);
+		}
+
+		{
+			struct nftnl_expr *e = nftnl_expr_alloc("immediate");
+			nftnl_expr_set_u32(e, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
+			nftnl_expr_set_data(e, NFTNL_EXPR_IMM_DATA, &egress_ip.s_addr, sizeof(egress_ip.s_addr));
+			nftnl_rule_add_expr(r, e);
+		}
+
+		if (has_ports) {
+			add_port_range_load(r, snat);
+		}
+
+		{
+			struct nftnl_expr *e = nftnl_expr_alloc("nat");
+			nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_TYPE, NFT_NAT_SNAT);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_FAMILY, NFPROTO_IPV4);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG_1);
+			nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_FLAGS, NF_NAT_RANGE_PROTO_RANDOM_FULLY);
+			if (has_ports) {
+				nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_PROTO_MIN, SNAT_REG_PORT_MIN);
+				nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_PROTO_MAX, SNAT_REG_PORT_MAX);
+			}
+			nftnl_rule_add_expr(r, e);
+		}
+
+		nft_batch_add_rule(b, SKNF_NFTABLES_POSTROUTING_CHAIN_NAME, r);
+	}
+
+	return 0;
+}
+
+// A single map lookup per packet, whatever the number of hostPorts on the node:
+//   fib daddr type local [ip daddr != 127.0.0.0/8] dnat to meta l4proto . th dport map @hostports
+// Loopback destinations are left alone in OUTPUT, since a pod cannot answer to 127.0.0.1.
+static int add_hostports_rule(Err* err, struct NftBatch* b, const char* chain, int skip_loopback) {
+	struct nftnl_rule* r = alloc_rule(err);
+	if (!r) {
+		return 1;
+	}
+
+	{
+		struct nftnl_expr *e = nftnl_expr_alloc("fib");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_FIB_FLAGS, NFTA_FIB_F_DADDR);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_FIB_RESULT, NFT_FIB_RESULT_ADDRTYPE);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_FIB_DREG, NFT_REG_1);
+		nftnl_rule_add_expr(r, e);
+
+		uint32_t local = RTN_LOCAL;
+		e = nftnl_expr_alloc("cmp");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG, NFT_REG_1);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+		nftnl_expr_set_data(e, NFTNL_EXPR_CMP_DATA, &local, sizeof(local));
+		nftnl_rule_add_expr(r, e);
+	}
+
+	if (skip_loopback) {
+		add_prefix_match(r, IPV4_DADDR_OFFSET, htonl(LOOPBACK_NET), htonl(LOOPBACK_MASK), NFT_CMP_NEQ);
+	}
+
+	{
+		struct nftnl_expr *e = nftnl_expr_alloc("meta");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_META_KEY, NFT_META_L4PROTO);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_META_DREG, NFT_REG32_00);
+		nftnl_rule_add_expr(r, e);
+
+		e = nftnl_expr_alloc("payload");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET, TH_DPORT_OFFSET);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_LEN, sizeof(uint16_t));
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG32_01);
+		nftnl_rule_add_expr(r, e);
+	}
+
+	{
+		// the pod address lands in reg32_00 and the port in reg32_01
+		struct nftnl_expr *e = nftnl_expr_alloc("lookup");
+		nftnl_expr_set_str(e, NFTNL_EXPR_LOOKUP_SET, SKNF_NFTABLES_HOSTPORTS_MAP_NAME);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SREG, NFT_REG32_00);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_DREG, NFT_REG32_00);
+		nftnl_rule_add_expr(r, e);
+
+		e = nftnl_expr_alloc("nat");
+		nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_TYPE, NFT_NAT_DNAT);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_FAMILY, NFPROTO_IPV4);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG32_00);
+		nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_PROTO_MIN, NFT_REG32_01);
+		nftnl_rule_add_expr(r, e);
+	}
+
+	nft_batch_add_rule(b, chain, r);
+	return 0;
+}
+
+// Three rules, each a single hash lookup, so the per-packet cost does not depend on the number of pods:
+//   ip daddr != <clusterCIDR> counter name ip saddr map @pod_egress
+//   ip daddr <clusterCIDR> ip daddr != <nodeSubnet> counter name ip saddr map @pod_crossnode
+//   counter name ip daddr map @pod_ingress
+// Source/destination addresses that are not local pods simply miss the map and are not counted.
+static int add_accounting_rules(Err* err, struct NftBatch* b, const char* cluster_cidr, const char* node_subnet) {
+	uint32_t cluster_net, cluster_mask, node_net, node_mask;
+	if (cidr_to_net_mask(err, cluster_cidr, &cluster_net, &cluster_mask) ||
+		cidr_to_net_mask(err, node_subnet, &node_net, &node_mask)) {
+		return 1;
+	}
+
+	struct nftnl_rule* r = alloc_rule(err);
+	if (!r) return 1;
+	add_prefix_match(r, IPV4_DADDR_OFFSET, cluster_net, cluster_mask, NFT_CMP_NEQ);
+	add_counter_map_lookup(r, IPV4_SADDR_OFFSET, SKNF_NFTABLES_EGRESS_MAP_NAME);
+	nft_batch_add_rule(b, SKNF_NFTABLES_ACCOUNTING_CHAIN_NAME, r);
+
+	r = alloc_rule(err);
+	if (!r) return 1;
+	add_prefix_match(r, IPV4_DADDR_OFFSET, cluster_net, cluster_mask, NFT_CMP_EQ);
+	add_prefix_match(r, IPV4_DADDR_OFFSET, node_net, node_mask, NFT_CMP_NEQ);
+	add_counter_map_lookup(r, IPV4_SADDR_OFFSET, SKNF_NFTABLES_CROSSNODE_MAP_NAME);
+	nft_batch_add_rule(b, SKNF_NFTABLES_ACCOUNTING_CHAIN_NAME, r);
+
+	r = alloc_rule(err);
+	if (!r) return 1;
+	add_counter_map_lookup(r, IPV4_DADDR_OFFSET, SKNF_NFTABLES_INGRESS_MAP_NAME);
+	nft_batch_add_rule(b, SKNF_NFTABLES_ACCOUNTING_CHAIN_NAME, r);
+
+	return 0;
+}
+
+// Table and maps shared by every pod. All creations are idempotent.
+static int add_node_objects(Err* err, struct NftBatch* b) {
+	if (nft_batch_add_table(err, b) ||
+		nft_batch_add_counter_map(err, b, SKNF_NFTABLES_EGRESS_MAP_NAME) ||
+		nft_batch_add_counter_map(err, b, SKNF_NFTABLES_INGRESS_MAP_NAME) ||
+		nft_batch_add_counter_map(err, b, SKNF_NFTABLES_CROSSNODE_MAP_NAME) ||
+		nft_batch_add_hostports_map(err, b)) {
+		return 1;
+	}
+	return 0;
+}
+
+static const struct {
+	const char* map;
+	const char* counter_prefix;
+} pod_counters[] = {
+	{ SKNF_NFTABLES_EGRESS_MAP_NAME, SKNF_NFTABLES_EGRESS_COUNTER_PREFIX },
+	{ SKNF_NFTABLES_INGRESS_MAP_NAME, SKNF_NFTABLES_INGRESS_COUNTER_PREFIX },
+	{ SKNF_NFTABLES_CROSSNODE_MAP_NAME, SKNF_NFTABLES_CROSSNODE_COUNTER_PREFIX },
+};
+
+static int add_pod_counters(Err* err, struct NftBatch* b, const char* container_cidr) {
+	struct in_addr addr;
+	int prefix;
+	if (util_cidr_parse(err, container_cidr, &addr, &prefix)) {
+		fprintf(stderr, "unable to parse CIDR %s\n", container_cidr);
+		return 1;
+	}
+
+	char ip_only[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &addr, ip_only, sizeof(ip_only));
+
+	for (size_t i = 0; i < sizeof(pod_counters) / sizeof(pod_counters[0]); ++i) {
+		char counter_name[SKNF_NFTABLES_COUNTER_NAME_LEN];
+		snprintf(counter_name, sizeof(counter_name), "%s%s", pod_counters[i].counter_prefix, ip_only);
+
+		if (nft_batch_counter(err, b, NFT_MSG_NEWOBJ, NLM_F_CREATE, counter_name) ||
+			nft_batch_counter_map_elem(err, b, NFT_MSG_NEWSETELEM, NLM_F_CREATE, pod_counters[i].map, addr.s_addr, counter_name)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Deletion is written as "add, then delete" inside the same transaction, so that DEL never
+// fails because a previous (partial) DEL already removed some of the objects.
+static int delete_pod_counters(Err* err, struct NftBatch* b, const char* container_cidr) {
+	if (add_pod_counters(err, b, container_cidr)) {
+		return 1;
+	}
+
+	struct in_addr addr;
+	int prefix;
+	if (util_cidr_parse(err, container_cidr, &addr, &prefix)) {
+		fprintf(stderr, "unable to parse CIDR %s\n", container_cidr);
+		return 1;
+	}
+
+	char ip_only[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &addr, ip_only, sizeof(ip_only));
+
+	for (size_t i = 0; i < sizeof(pod_counters) / sizeof(pod_counters[0]); ++i) {
+		char counter_name[SKNF_NFTABLES_COUNTER_NAME_LEN];
+		snprintf(counter_name, sizeof(counter_name), "%s%s", pod_counters[i].counter_prefix, ip_only);
+
+		// the element holds a reference to the counter, so it must go first
+		if (nft_batch_counter_map_elem(err, b, NFT_MSG_DELSETELEM, 0, pod_counters[i].map, addr.s_addr, NULL) ||
+			nft_batch_counter(err, b, NFT_MSG_DELOBJ, 0, counter_name)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int add_pod_hostports(Err* err, struct NftBatch* b, const char* container_cidr,
+		const struct PortMapping* port_mappings, int port_mapping_count) {
+	struct in_addr addr;
+	int prefix;
+	if (util_cidr_parse(err, container_cidr, &addr, &prefix)) {
+		fprintf(stderr, "unable to parse CIDR %s\n", container_cidr);
+		return 1;
+	}
+
+	for (int i = 0; i < port_mapping_count; ++i) {
+		if (nft_batch_hostport_elem(err, b, NFT_MSG_NEWSETELEM, NLM_F_CREATE, &port_mappings[i], addr.s_addr)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Same "add, then delete" as delete_pod_counters. The add fails with EBUSY when the hostPort was
+// already handed over to another pod, in which case the element is not ours to delete.
+static int delete_pod_hostports(Err* err, struct NftBatch* b, const char* container_cidr,
+		const struct PortMapping* port_mappings, int port_mapping_count) {
+	if (add_pod_hostports(err, b, container_cidr, port_mappings, port_mapping_count)) {
+		return 1;
+	}
+
+	for (int i = 0; i < port_mapping_count; ++i) {
+		if (nft_batch_hostport_elem(err, b, NFT_MSG_DELSETELEM, 0, &port_mappings[i], 0)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int attach_containers(Err* err, const char* host_physical_if, const char* cluster_cidr, const char* node_subnet,
+		const char* const* container_cidrs, int count, const struct Snat* snat, const struct PortMapping* port_mappings, int port_mapping_count) {
+	int rc = 1;
+	struct NftBatch b;
+
+	if (nft_batch_init(err, &b, NFT_BATCH_BUFFER_SIZE + (size_t)count * NFT_BATCH_POD_BUFFER_SIZE)) {
 		goto out;
 	}
 
-	mnl_nlmsg_batch_stop(batch);
-	batch_stopped = 1;
+	if (add_node_objects(err, &b)) {
+		goto out;
+	}
 
-	int ret = mnl_socket_recvfrom(sk, buf, sizeof(buf));
-	while (ret > 0) {
-		ret = mnl_cb_run(buf, ret, table_seq, portid, NULL, NULL);
-		if (ret <= 0) break;
+	// node-wide chains; their rules are replaced (not appended) on every ADD, in the same transaction
+	if (nft_batch_add_base_chain(err, &b, SKNF_NFTABLES_POSTROUTING_CHAIN_NAME, "nat", NF_INET_POST_ROUTING, NF_IP_PRI_NAT_SRC) ||
+		nft_batch_add_base_chain(err, &b, SKNF_NFTABLES_ACCOUNTING_CHAIN_NAME, "filter", NF_INET_FORWARD, NF_IP_PRI_MANGLE) ||
+		nft_batch_add_base_chain(err, &b, SKNF_NFTABLES_HOSTPORTS_PREROUTING_CHAIN_NAME, "nat", NF_INET_PRE_ROUTING, NF_IP_PRI_NAT_DST) ||
+		nft_batch_add_base_chain(err, &b, SKNF_NFTABLES_HOSTPORTS_OUTPUT_CHAIN_NAME, "nat", NF_INET_LOCAL_OUT, NF_IP_PRI_NAT_DST) ||
+		nft_batch_flush_chain(err, &b, SKNF_NFTABLES_POSTROUTING_CHAIN_NAME) ||
+		nft_batch_flush_chain(err, &b, SKNF_NFTABLES_ACCOUNTING_CHAIN_NAME) ||
+		nft_batch_flush_chain(err, &b, SKNF_NFTABLES_HOSTPORTS_PREROUTING_CHAIN_NAME) ||
+		nft_batch_flush_chain(err, &b, SKNF_NFTABLES_HOSTPORTS_OUTPUT_CHAIN_NAME)) {
+		goto out;
+	}
+
+	// ensure packets leaving the cluster are NAT'd with a node address as SRC IP (to ensure response is routable)
+	if (add_snat_rules(err, &b, host_physical_if, cluster_cidr, snat)) {
+		fprintf(stderr, "failure building nft NAT rule\n");
+		goto out;
+	}
+
+	if (add_accounting_rules(err, &b, cluster_cidr, node_subnet)) {
+		fprintf(stderr, "failure building nft accounting rules\n");
+		goto out;
+	}
+
+	if (add_hostports_rule(err, &b, SKNF_NFTABLES_HOSTPORTS_PREROUTING_CHAIN_NAME, 0) ||
+		add_hostports_rule(err, &b, SKNF_NFTABLES_HOSTPORTS_OUTPUT_CHAIN_NAME, 1)) {
+		fprintf(stderr, "failure building nft hostport rules\n");
+		goto out;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (add_pod_counters(err, &b, container_cidrs[i])) {
+			fprintf(stderr, "failure building nft pod counters\n");
+			goto out;
+		}
+
+		if (add_pod_hostports(err, &b, container_cidrs[i], port_mappings, port_mapping_count)) {
+			fprintf(stderr, "failure building nft pod hostports\n");
+			goto out;
+		}
+	}
+
+	if (nft_batch_commit(err, &b)) {
+		if (b.error == EBUSY) {
+			ERR(err, "HostPort already allocated to another pod");
+		}
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	nft_batch_free(&b);
+	return rc;
+}
+
+int nft_attach_container(Err* err, const char* host_physical_if, const char* cluster_cidr, const char* node_subnet,
+		const char* container_cidr, const struct Snat* snat, const struct PortMapping* port_mappings, int port_mapping_count) {
+	return attach_containers(err, host_physical_if, cluster_cidr, node_subnet, &container_cidr, 1, snat, port_mappings,
+		port_mapping_count);
+}
+
+// Node-wide state and the counters of every container, in a single transaction: it is all or nothing
+int nft_attach_containers(Err* err, const char* host_physical_if, const char* cluster_cidr, const char* node_subnet,
+		const char* const* container_cidrs, int count, const struct Snat* snat) {
+	return attach_containers(err, host_physical_if, cluster_cidr, node_subnet, container_cidrs, count, snat, NULL, 0);
+}
+
+static int detach_container(Err* err, const char* container_cidr, const struct PortMapping* port_mappings,
+		int port_mapping_count, int* error) {
+	int rc = 1;
+	struct NftBatch b;
+
+	if (nft_batch_init(err, &b, NFT_BATCH_BUFFER_SIZE)) {
+		goto out;
+	}
+
+	if (add_node_objects(err, &b)) {
+		goto out;
+	}
+
+	if (delete_pod_counters(err, &b, container_cidr)) {
+		fprintf(stderr, "failure building nft pod counters removal\n");
+		goto out;
+	}
+
+	if (delete_pod_hostports(err, &b, container_cidr, port_mappings, port_mapping_count)) {
+		fprintf(stderr, "failure building nft pod hostports removal\n");
+		goto out;
+	}
+
+	if (nft_batch_commit(err, &b)) {
+		*error = b.error;
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	nft_batch_free(&b);
+	return rc;
+}
+
+int nft_detach_container(Err* err, const char* container_cidr, const struct PortMapping* port_mappings, int port_mapping_count) {
+	int error = 0;
+	if (!detach_container(err, container_cidr, port_mappings, port_mapping_count, &error)) {
+		return 0;
+	}
+
+	// a hostPort of this pod is now mapped to another pod (e.g. a repeated DEL after a reschedule)
+	if (error == EBUSY && port_mapping_count > 0) {
+		fprintf(stderr, "hostports of %s were reassigned, leaving them in place\n", container_cidr);
+		ERR_INIT(err);
+		return detach_container(err, container_cidr, NULL, 0, &error);
+	}
+
+	return 1;
+}
+// Elements of the hostports map that map to one of 'ips_be', found by dump_hostports
+struct HostportsDump {
+	const uint32_t* ips_be;
+	int ip_count;
+	struct PortMapping* mappings;
+	uint32_t* mapping_ips_be;
+	int count;
+	int capacity;
+	int oom;
+};
+
+static int hostports_elem_cb(struct nftnl_set_elem* e, void* data) {
+	struct HostportsDump* d = data;
+	uint32_t key_len = 0;
+	uint32_t value_len = 0;
+	const uint8_t* key = nftnl_set_elem_get(e, NFTNL_SET_ELEM_KEY, &key_len);
+	const uint8_t* value = nftnl_set_elem_get(e, NFTNL_SET_ELEM_DATA, &value_len);
+	if (!key || !value || key_len != 2 * NFT_CONCAT_FIELD_LEN || value_len != 2 * NFT_CONCAT_FIELD_LEN) {
+		return 0;
+	}
+
+	uint32_t ip_be;
+	memcpy(&ip_be, value, sizeof(ip_be));
+	for (int i = 0; i < d->ip_count; ++i) {
+		if (d->ips_be[i] != ip_be) {
+			continue;
+		}
+		if (d->count == d->capacity) {
+			int capacity = d->capacity ? 2 * d->capacity : 16;
+			struct PortMapping* mappings = realloc(d->mappings, (size_t)capacity * sizeof(*mappings));
+			if (!mappings) {
+				d->oom = 1;
+				return 0;
+			}
+			d->mappings = mappings;
+			uint32_t* mapping_ips_be = realloc(d->mapping_ips_be, (size_t)capacity * sizeof(*mapping_ips_be));
+			if (!mapping_ips_be) {
+				d->oom = 1;
+				return 0;
+			}
+			d->mapping_ips_be = mapping_ips_be;
+			d->capacity = capacity;
+		}
+
+		uint16_t host_port_be;
+		uint16_t container_port_be;
+		memcpy(&host_port_be, &key[NFT_CONCAT_FIELD_LEN], sizeof(host_port_be));
+		memcpy(&container_port_be, &value[NFT_CONCAT_FIELD_LEN], sizeof(container_port_be));
+		d->mappings[d->count] = (struct PortMapping){
+			.host_port = ntohs(host_port_be),
+			.container_port = ntohs(container_port_be),
+			.protocol = key[0],
+		};
+		d->mapping_ips_be[d->count++] = ip_be;
+		break;
+	}
+	return 0;
+}
+
+static int hostports_msg_cb(const struct nlmsghdr* nlh, void* data) {
+	nlstat_count_received(0, 1);
+	struct nftnl_set* s = nftnl_set_alloc();
+	if (!s) {
+		return MNL_CB_ERROR;
+	}
+	if (nftnl_set_elems_nlmsg_parse(nlh, s) < 0) {
+		nftnl_set_free(s);
+		return MNL_CB_ERROR;
+	}
+	nftnl_set_elem_foreach(s, hostports_elem_cb, data);
+	nftnl_set_free(s);
+	return MNL_CB_OK;
+}
+
+// Reads the hostports map with a single dump, on a socket of its own. A missing map has no elements.
+static int dump_hostports(Err* err, struct HostportsDump* d) {
+	int rc = 1;
+	struct nftnl_set* s = NULL;
+
+	struct mnl_socket* sk = mnl_socket_open(NETLINK_NETFILTER);
+	if (!sk || mnl_socket_bind(sk, 0, MNL_SOCKET_AUTOPID) < 0) {
+		fprintf(stderr, "failure opening mnl_socket: %s\n", strerror(errno));
+		ERRF(err, "Failure opening mnl_socket", "%s", strerror(errno));
+		goto out;
+	}
+	nlstat.sockets++;
+
+	s = nftnl_set_alloc();
+	if (!s) {
+		fprintf(stderr, "failure allocating nftnl_set\n");
+		ERR(err, "Failure allocating nftnl_set");
+		goto out;
+	}
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, SKNF_NFTABLES_TABLE_NAME);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, SKNF_NFTABLES_HOSTPORTS_MAP_NAME);
+	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+
+	char buf[MNL_SOCKET_DUMP_SIZE];
+	uint32_t seq = 1;
+	struct nlmsghdr* nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETSETELEM, NFPROTO_IPV4, NLM_F_DUMP, seq);
+	nftnl_set_elems_nlmsg_build_payload(nlh, s);
+	if (mnl_socket_sendto(sk, nlh, nlh->nlmsg_len) < 0) {
+		fprintf(stderr, "failure requesting the hostports map: %s\n", strerror(errno));
+		ERRF(err, "Failure requesting the hostports map", "%s", strerror(errno));
+		goto out;
+	}
+	nlstat.syscalls++;
+	nlstat_count_sent(nlh->nlmsg_len, 1);
+
+	int ret;
+	do {
 		ret = mnl_socket_recvfrom(sk, buf, sizeof(buf));
+		nlstat.syscalls++;
+		if (ret < 0) {
+			fprintf(stderr, "failure reading the hostports map: %s\n", strerror(errno));
+			ERRF(err, "Failure reading the hostports map", "%s", strerror(errno));
+			goto out;
+		}
+		nlstat_count_received(ret, 0);
+		ret = mnl_cb_run(buf, ret, seq, mnl_socket_get_portid(sk), hostports_msg_cb, d);
+	} while (ret > 0);
+	if (ret < 0 && errno != ENOENT) {
+		fprintf(stderr, "failure reading the hostports map: %s\n", strerror(errno));
+		ERRF(err, "Failure reading the hostports map", "%s", strerror(errno));
+		goto out;
 	}
-	if (ret == -1) {
-		fprintf(stderr, "received error when consuming nft acks: %s\n", strerror(errno));
-		ERRF(err, "Received error when consuming nft acks", "%s", strerror(errno));
+	if (d->oom) {
+		ERR(err, "Out of memory reading the hostports map");
 		goto out;
 	}
 
 	rc = 0;
 
 out:
-	if (batch && !batch_stopped) mnl_nlmsg_batch_stop(batch);
+	if (s) nftnl_set_free(s);
 	if (sk) mnl_socket_close(sk);
 	return rc;
-}
\ No newline at end of file
+}
+
+// Deletes the nftables state of containers gone without a DEL (GC), whose port mappings are unknown: their
+// counters, and the hostports elements mapping to their IPs. Those are deleted with the same "add, then
+// delete" as delete_pod_hostports, so a hostPort handed over to another pod since the dump fails the GC.
+int nft_gc_containers(Err* err, const char* const* container_cidrs, int count) {
+	int rc = 1;
+	struct NftBatch b;
+	memset(&b, 0, sizeof(b));
+	struct HostportsDump d;
+	memset(&d, 0, sizeof(d));
+
+	uint32_t* ips_be = malloc((size_t)(count ? count : 1) * sizeof(*ips_be));
+	if (!ips_be) {
+		ERR(err, "Out of memory collecting nftables state");
+		goto out;
+	}
+	for (int i = 0; i < count; ++i) {
+		struct in_addr addr;
+		int prefix;
+		if (util_cidr_parse(err, container_cidrs[i], &addr, &prefix)) {
+			fprintf(stderr, "unable to parse CIDR %s\n", container_cidrs[i]);
+			goto out;
+		}
+		ips_be[i] = addr.s_addr;
+	}
+	d.ips_be = ips_be;
+	d.ip_count = count;
+
+	if (dump_hostports(err, &d)) {
+		goto out;
+	}
+
+	if (nft_batch_init(err, &b, NFT_BATCH_BUFFER_SIZE + (size_t)(count + d.count) * NFT_BATCH_POD_BUFFER_SIZE)) {
+		goto out;
+	}
+
+	if (add_node_objects(err, &b)) {
+		goto out;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (delete_pod_counters(err, &b, container_cidrs[i])) {
+			fprintf(stderr, "failure building nft pod counters removal\n");
+			goto out;
+		}
+	}
+
+	for (int i = 0; i < d.count; ++i) {
+		if (nft_batch_hostport_elem(err, &b, NFT_MSG_NEWSETELEM, NLM_F_CREATE, &d.mappings[i], d.mapping_ips_be[i]) ||
+			nft_batch_hostport_elem(err, &b, NFT_MSG_DELSETELEM, 0, &d.mappings[i], 0)) {
+			fprintf(stderr, "failure building nft pod hostports removal\n");
+			goto out;
+		}
+	}
+
+	if (nft_batch_commit(err, &b)) {
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	nft_batch_free(&b);
+	free(d.mappings);
+	free(d.mapping_ips_be);
+	free(ips_be);
+	return rc;
+}
@@ -1,8 +1,14 @@
 #ifndef SKNF_NFT_H
 #define SKNF_NFT_H
 
+#include "def.h"
 #include "err.h"
 
-int nft_nat_rule(Err* err, const char* ifname, const char* cidr);
+int nft_attach_container(Err* err, const char* host_physical_if, const char* cluster_cidr, const char* node_subnet,
+		const char* container_cidr, const struct Snat* snat, const struct PortMapping* port_mappings, int port_mapping_count);
+int nft_attach_containers(Err* err, const char* host_physical_if, const char* cluster_cidr, const char* node_subnet,
+		const char* const* container_cidrs, int count, const struct Snat* snat);
+int nft_detach_container(Err* err, const char* container_cidr, const struct PortMapping* port_mappings, int port_mapping_count);
+int nft_gc_containers(Err* err, const char* const* container_cidrs, int count);
 
 #endif
\ No newline at end of file
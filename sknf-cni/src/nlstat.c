@@ -0,0 +1,159 @@
+#include "nlstat.h"
+
+#include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <netlink/netlink.h>
+#include <netlink/handlers.h>
+#include <netlink/msg.h>
+#include <netlink/socket.h>
+
+#include "contention.h"
+#include "def.h"
+
+// When set, a command over its budget fails (for replays and pre-release runs, never on nodes)
+#define NLSTAT_STRICT_ENV_VAR_NAME "SKNF_CNI_NL_STRICT"
+
+// if_nametoindex opens a socket, issues SIOCGIFINDEX and closes it
+#define IF_NAMETOINDEX_SYSCALLS 3
+
+// Recorded budgets (messages in both directions, syscalls) of a pod without options, plus what each
+// option adds. ADD is the first one of a node (bridge and vxlan created): 43 messages and 67 syscalls of
+// rtnetlink, plus a 27 message nftables batch whose 25 acks are read one per recvfrom. DEL is 7 messages
+// and 7 syscalls of rtnetlink (the ifb of a shaped egress is deleted whether the pod has one or not), plus a 19
+// message batch. ADD_BATCH is 17 messages and 36 syscalls of node
+// checks, the same batch as ADD plus the receive buffer growth, and per container 16 messages and 18 syscalls
+// of rtnetlink (with a sendmsg per 16 pairs) and 6 more acked nftables messages. Every pod IP also gets two
+// filtered conntrack dumps (4 messages, 4 syscalls, included above), and each entry they return costs its dump
+// message, its deletion and a possible error, with a sendmsg per 32 deletions. Nftables objects are the port
+// mappings and egress IPs. A shaped ingress is a tbf on the host veth, a shaped egress an ifb with a tbf plus the
+// ingress qdisc and filter redirecting the host veth to it. Update the budgets together with any change to the
+// netlink calls of a command.
+struct NlBudget {
+	const char* command;
+	unsigned long messages;
+	unsigned long syscalls;
+	unsigned long messages_per_nft_object;
+	unsigned long syscalls_per_nft_object;
+	unsigned long messages_per_shaped_ingress;
+	unsigned long syscalls_per_shaped_ingress;
+	unsigned long messages_per_shaped_egress;
+	unsigned long syscalls_per_shaped_egress;
+	unsigned long messages_per_container;
+	unsigned long syscalls_per_container;
+	unsigned long messages_per_conntrack_entry;
+	unsigned long syscalls_per_conntrack_entry;
+};
+
+static const struct NlBudget budgets[] = {
+	{ CNI_CMD_ADD, 99, 97, 2, 1, 2, 5, 8, 14, 0, 0, 3, 1 },
+	{ CNI_CMD_DEL, 47, 29, 4, 2, 0, 0, 0, 0, 0, 0, 3, 1 },
+	{ CNI_CMD_ADD_BATCH, 57, 57, 2, 1, 2, 5, 8, 14, 32, 29, 3, 1 },
+};
+
+struct NlStat nlstat;
+
+static int count_send(struct nl_sock* sk, struct nl_msg* msg) {
+	// same as nl_send, which would call back into this override
+	struct nlmsghdr* hdr = nlmsg_hdr(msg);
+	struct iovec iov = { .iov_base = hdr, .iov_len = hdr->nlmsg_len };
+
+	int rc = nl_send_iovec(sk, msg, &iov, 1);
+	nlstat.syscalls++;
+	if (rc >= 0) {
+		nlstat_count_sent(hdr->nlmsg_len, 1);
+	}
+	return rc;
+}
+
+static int count_recv(struct nl_sock* sk, struct sockaddr_nl* nla, unsigned char** buf, struct ucred** creds) {
+	uint64_t start_ns = contention_now_ns();
+	int n = nl_recv(sk, nla, buf, creds);
+	contention_wait(contention.netlink, start_ns, 0);
+	nlstat.syscalls++;
+	if (n > 0) {
+		nlstat.bytes_received += (unsigned long)n;
+	}
+	return n;
+}
+
+static int count_msg_in(struct nl_msg* msg, void* arg) {
+	nlstat.messages_received++;
+	return NL_OK;
+}
+
+void nlstat_instrument(struct nl_sock* sk) {
+	struct nl_cb* cb = nl_socket_get_cb(sk);
+	nl_cb_overwrite_send(cb, count_send);
+	nl_cb_overwrite_recv(cb, count_recv);
+	nl_cb_set(cb, NL_CB_MSG_IN, NL_CB_CUSTOM, count_msg_in, NULL);
+	nl_cb_put(cb);
+	nlstat.sockets++;
+}
+
+void nlstat_count_sent(size_t bytes, unsigned long messages) {
+	nlstat.messages_sent += messages;
+	nlstat.bytes_sent += bytes;
+}
+
+void nlstat_count_received(size_t bytes, unsigned long messages) {
+	nlstat.messages_received += messages;
+	nlstat.bytes_received += bytes;
+}
+
+unsigned nlstat_if_nametoindex(const char* ifname) {
+	nlstat.syscalls += IF_NAMETOINDEX_SYSCALLS;
+	return if_nametoindex(ifname);
+}
+
+void nlstat_report(const struct Args* args) {
+	fprintf(stderr, "netlink: %s used %lu sockets, sent %lu messages (%lu bytes), received %lu messages (%lu bytes), %lu syscalls\n",
+		args->cni_command, nlstat.sockets, nlstat.messages_sent, nlstat.bytes_sent, nlstat.messages_received,
+		nlstat.bytes_received, nlstat.syscalls);
+}
+
+// Checks the traffic of a successful command against its budget, before its result is emitted. Going over is
+// logged; in strict mode it also fails the command (returns 1, with 'err' set).
+int nlstat_check_budget(Err* err, const struct Args* args) {
+	for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); ++i) {
+		const struct NlBudget* b = &budgets[i];
+		if (strcmp(b->command, args->cni_command)) {
+			continue;
+		}
+
+		// every container of a batch is shaped
+		unsigned long containers = args->batch_container_count;
+		unsigned long nft_objects = args->port_mapping_count + args->snat.ip_count;
+		unsigned long shaped_ingress = (args->bandwidth.ingress_rate > 0) * (containers ? containers : 1);
+		unsigned long shaped_egress = (args->bandwidth.egress_rate > 0) * (containers ? containers : 1);
+		// the netkit forwarding program is attached by ifindex to the host end of pods not shaped on egress
+		unsigned long forwarded = (args->pod_interface == POD_INTERFACE_NETKIT && args->bandwidth.egress_rate == 0 &&
+			strcmp(args->cni_command, CNI_CMD_DEL)) * (containers ? containers : 1);
+		unsigned long messages = b->messages + nft_objects * b->messages_per_nft_object +
+			shaped_ingress * b->messages_per_shaped_ingress + shaped_egress * b->messages_per_shaped_egress +
+			containers * b->messages_per_container + nlstat.conntrack_entries * b->messages_per_conntrack_entry;
+		unsigned long syscalls = b->syscalls + nft_objects * b->syscalls_per_nft_object +
+			shaped_ingress * b->syscalls_per_shaped_ingress + shaped_egress * b->syscalls_per_shaped_egress +
+			containers * b->syscalls_per_container + forwarded * IF_NAMETOINDEX_SYSCALLS +
+			nlstat.conntrack_entries * b->syscalls_per_conntrack_entry;
+
+		unsigned long used = nlstat.messages_sent + nlstat.messages_received;
+		if (used <= messages && nlstat.syscalls <= syscalls) {
+			return 0;
+		}
+
+		fprintf(stderr, "netlink: %s over budget: %lu messages (budget %lu), %lu syscalls (budget %lu)\n",
+			args->cni_command, used, messages, nlstat.syscalls, syscalls);
+		if (getenv(NLSTAT_STRICT_ENV_VAR_NAME) == NULL) {
+			return 0;
+		}
+		ERRF(err, "Netlink budget exceeded", "%s: %lu messages (budget %lu), %lu syscalls (budget %lu)",
+			args->cni_command, used, messages, nlstat.syscalls, syscalls);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef SKNF_NLSTAT_H
+#define SKNF_NLSTAT_H
+
+#include <stddef.h>
+#include "args.h"
+#include "err.h"
+
+struct nl_sock;
+
+// Netlink traffic of the current command (one command per process), kept to catch round-trip regressions.
+// 'syscalls' covers netlink sends/receives and the ioctls behind interface name lookups.
+// 'conntrack_entries' counts the entries of flushed pod IPs, which the budgets scale with.
+struct NlStat {
+	unsigned long sockets;
+	unsigned long messages_sent;
+	unsigned long bytes_sent;
+	unsigned long messages_received;
+	unsigned long bytes_received;
+	unsigned long syscalls;
+	unsigned long conntrack_entries;
+};
+
+extern struct NlStat nlstat;
+
+void nlstat_instrument(struct nl_sock* sk);
+void nlstat_count_sent(size_t bytes, unsigned long messages);
+void nlstat_count_received(size_t bytes, unsigned long messages);
+unsigned nlstat_if_nametoindex(const char* ifname);
+void nlstat_report(const struct Args* args);
+int nlstat_check_budget(Err* err, const struct Args* args);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 static int write_sysctl(Err* err, const char *path, const char *value) {
 	FILE *f = fopen(path, "w");
@@ -43,3 +44,26 @@ int sys_enable_br_netfilter(Err* err) {
 
     return 0;
 }
+
+// Writes a sysctl given in its dotted form (net.core.somaxconn). net.* entries belong to the
+// network namespace of the calling thread.
+int sys_set_sysctl(Err* err, const char* name, const char* value) {
+	char path[PATH_MAX];
+	int n = snprintf(path, sizeof(path), "/proc/sys/%s", name);
+	if (n < 0 || n >= (int)sizeof(path)) {
+		fprintf(stderr, "sysctl name too long: %s\n", name);
+		ERR(err, "Sysctl name too long: %s", name);
+		return 1;
+	}
+
+	for (char* c = path + strlen("/proc/sys/"); *c; c++) {
+		if (*c == '.') *c = '/';
+	}
+
+	if (write_sysctl(err, path, value) != 0) {
+		fprintf(stderr, "could not set %s\n", name);
+		return 1;
+	}
+
+	return 0;
+}
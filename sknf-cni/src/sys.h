@@ -5,5 +5,6 @@
 #include "err.h"
 
 int sys_enable_br_netfilter(Err* err);
+int sys_set_sysctl(Err* err, const char* name, const char* value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "def.h"
+#include "io.h"
+
+// Trace file format: records appended back to back, in host byte order
+//   uint32_t magic (TRACE_MAGIC)
+//   uint32_t length of the rest of the record
+//   uint64_t start of the invocation (CLOCK_REALTIME, ns)
+//   uint64_t duration (ns)
+//   int32_t  exit code
+//   fields up to the end of the record: uint8_t kind, uint32_t length, data
+// ENV fields hold one NUL-terminated "CNI_*=value" string; STDIN and STDOUT hold the raw plugin input and result.
+#define TRACE_MAGIC 0x52544b53 // "SKTR"
+#define TRACE_HEADER_LEN (4 + 4 + 8 + 8 + 4)
+#define TRACE_FIELD_HEADER_LEN (1 + 4)
+#define TRACE_FIELD_ENV 1
+#define TRACE_FIELD_STDIN 2
+#define TRACE_FIELD_STDOUT 3
+
+#define TRACE_ENV_PREFIX "CNI_"
+#define TRACE_MAX_ENV 16
+
+#define REPLAY_NETNS_PREFIX "sknf-replay-"
+#define REPLAY_NETNS_DIR "/var/run/netns/"
+#define REPLAY_MAX_PARALLELISM 256
+// granularity of the replay clock and of the measured durations
+#define REPLAY_POLL_NS 100000
+
+extern char** environ;
+
+static uint64_t now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+	struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+	nanosleep(&ts, NULL);
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+// Growable record being built
+struct TraceBuf {
+	char* data;
+	size_t len;
+	size_t cap;
+};
+
+static int buf_put(struct TraceBuf* b, const void* p, size_t n) {
+	if (b->len + n > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		while (cap < b->len + n) cap *= 2;
+		char* grown = realloc(b->data, cap);
+		if (!grown) return 1;
+		b->data = grown;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+	return 0;
+}
+
+static int buf_put_field(struct TraceBuf* b, uint8_t kind, const void* p, size_t n) {
+	uint32_t len = (uint32_t)n;
+	return buf_put(b, &kind, sizeof(kind)) || buf_put(b, &len, sizeof(len)) || buf_put(b, p, n);
+}
+
+// Reads stdin (returned in 'input', as args_parse would) and starts capturing stdout; the invocation is
+// written to the trace by trace_capture_end. Failures to trace never fail the invocation itself.
+int trace_capture_begin(struct TraceCapture* capture, const char* path, char** input, size_t* input_len) {
+	memset(capture, 0, sizeof(*capture));
+	capture->path = path;
+	capture->start_realtime_ns = now_ns(CLOCK_REALTIME);
+	capture->start_monotonic_ns = now_ns(CLOCK_MONOTONIC);
+	capture->result_fd = -1;
+	capture->stdout_fd = -1;
+
+	if (io_read_stream(stdin, input, input_len)) {
+		fprintf(stderr, "Failure: unable to read stdin\n");
+		return 1;
+	}
+
+	// the input is unescaped in place by args_parse_input, so the trace needs its own copy
+	capture->input = malloc(*input_len);
+	if (capture->input) {
+		memcpy(capture->input, *input, *input_len);
+		capture->input_len = *input_len;
+	} else {
+		fprintf(stderr, "trace: failure allocating input copy\n");
+	}
+
+	capture->result_fd = memfd_create("sknf-cni-result", MFD_CLOEXEC);
+	capture->stdout_fd = dup(STDOUT_FILENO);
+	if (capture->result_fd < 0 || capture->stdout_fd < 0 || dup2(capture->result_fd, STDOUT_FILENO) < 0) {
+		fprintf(stderr, "trace: unable to capture stdout: %s\n", strerror(errno));
+		if (capture->result_fd >= 0) close(capture->result_fd);
+		if (capture->stdout_fd >= 0) close(capture->stdout_fd);
+		capture->result_fd = -1;
+		capture->stdout_fd = -1;
+	}
+
+	return 0;
+}
+
+void trace_capture_end(struct TraceCapture* capture, int exit_code) {
+	uint64_t duration_ns = now_ns(CLOCK_MONOTONIC) - capture->start_monotonic_ns;
+	char* result = NULL;
+	size_t result_len = 0;
+
+	// hand the result over to the runtime first
+	fflush(stdout);
+	if (capture->result_fd >= 0) {
+		dup2(capture->stdout_fd, STDOUT_FILENO);
+		close(capture->stdout_fd);
+
+		off_t size = lseek(capture->result_fd, 0, SEEK_END);
+		result = size > 0 ? malloc((size_t)size) : NULL;
+		if (result && pread(capture->result_fd, result, (size_t)size, 0) == size) {
+			result_len = (size_t)size;
+			if (write_all(STDOUT_FILENO, result, result_len)) {
+				fprintf(stderr, "trace: failure writing result: %s\n", strerror(errno));
+			}
+		}
+		close(capture->result_fd);
+	}
+
+	struct TraceBuf b = { 0 };
+	uint32_t magic = TRACE_MAGIC;
+	uint32_t record_len = 0;
+	int32_t code = exit_code;
+	int fail = buf_put(&b, &magic, sizeof(magic)) ||
+		buf_put(&b, &record_len, sizeof(record_len)) ||
+		buf_put(&b, &capture->start_realtime_ns, sizeof(capture->start_realtime_ns)) ||
+		buf_put(&b, &duration_ns, sizeof(duration_ns)) ||
+		buf_put(&b, &code, sizeof(code));
+
+	for (char** e = environ; !fail && *e; ++e) {
+		if (!strncmp(*e, TRACE_ENV_PREFIX, strlen(TRACE_ENV_PREFIX))) {
+			fail = buf_put_field(&b, TRACE_FIELD_ENV, *e, strlen(*e) + 1);
+		}
+	}
+
+	fail = fail ||
+		buf_put_field(&b, TRACE_FIELD_STDIN, capture->input, capture->input_len) ||
+		buf_put_field(&b, TRACE_FIELD_STDOUT, result, result_len);
+
+	if (fail) {
+		fprintf(stderr, "trace: failure allocating record\n");
+		goto out;
+	}
+
+	record_len = (uint32_t)(b.len - 8);
+	memcpy(b.data + 4, &record_len, sizeof(record_len));
+
+	// invocations run concurrently, so records are appended under a lock
+	int fd = open(capture->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "trace: failure opening %s: %s\n", capture->path, strerror(errno));
+		goto out;
+	}
+	flock(fd, LOCK_EX);
+	if (write_all(fd, b.data, b.len)) {
+		fprintf(stderr, "trace: failure writing %s: %s\n", capture->path, strerror(errno));
+	}
+	close(fd);
+
+out:
+	free(b.data);
+	free(result);
+	free(capture->input);
+	capture->input = NULL;
+}
+
+struct TraceRecord {
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	int32_t exit_code;
+	const char* env[TRACE_MAX_ENV];
+	int env_count;
+	const char* input;
+	size_t input_len;
+	const char* command;
+	const char* container_id;
+	int netns; // index of the scratch netns, -1 if none
+
+	// replay outcome
+	uint64_t replay_ns;
+	int replay_exit_code;
+};
+
+static const char* record_env(const struct TraceRecord* r, const char* name) {
+	size_t n = strlen(name);
+	for (int i = 0; i < r->env_count; ++i) {
+		if (!strncmp(r->env[i], name, n) && r->env[i][n] == '=') {
+			return r->env[i] + n + 1;
+		}
+	}
+	return "";
+}
+
+static int parse_records(char* buf, size_t len, struct TraceRecord** out, int* out_count) {
+	int count = 0;
+	int cap = 0;
+	struct TraceRecord* records = NULL;
+	size_t off = 0;
+
+	while (off < len) {
+		uint32_t magic, record_len;
+		if (len - off < TRACE_HEADER_LEN) goto bad;
+		memcpy(&magic, buf + off, 4);
+		memcpy(&record_len, buf + off + 4, 4);
+		if (magic != TRACE_MAGIC || record_len < TRACE_HEADER_LEN - 8 || record_len > len - off - 8) goto bad;
+
+		if (count == cap) {
+			cap = cap ? cap * 2 : 256;
+			struct TraceRecord* grown = realloc(records, sizeof(*records) * cap);
+			if (!grown) {
+				fprintf(stderr, "failure allocating trace records\n");
+				free(records);
+				return 1;
+			}
+			records = grown;
+		}
+
+		struct TraceRecord* r = &records[count++];
+		memset(r, 0, sizeof(*r));
+		memcpy(&r->start_ns, buf + off + 8, 8);
+		memcpy(&r->duration_ns, buf + off + 16, 8);
+		memcpy(&r->exit_code, buf + off + 24, 4);
+		r->netns = -1;
+
+		size_t end = off + 8 + record_len;
+		size_t p = off + TRACE_HEADER_LEN;
+		while (p < end) {
+			uint8_t kind;
+			uint32_t field_len;
+			if (end - p < TRACE_FIELD_HEADER_LEN) goto bad;
+			kind = (uint8_t)buf[p];
+			memcpy(&field_len, buf + p + 1, 4);
+			p += TRACE_FIELD_HEADER_LEN;
+			if (field_len > end - p) goto bad;
+
+			const char* data = buf + p;
+			if (kind == TRACE_FIELD_ENV) {
+				if (field_len == 0 || data[field_len - 1] != '\0' || r->env_count == TRACE_MAX_ENV) goto bad;
+				r->env[r->env_count++] = data;
+			} else if (kind == TRACE_FIELD_STDIN) {
+				r->input = data;
+				r->input_len = field_len;
+			}
+			p += field_len;
+		}
+
+		r->command = record_env(r, "CNI_COMMAND");
+		r->container_id = record_env(r, "CNI_CONTAINERID");
+		off = end;
+	}
+
+	*out = records;
+	*out_count = count;
+	return 0;
+
+bad:
+	fprintf(stderr, "malformed trace record at offset %zu\n", off);
+	free(records);
+	return 1;
+}
+
+static int compare_records(const void* a, const void* b) {
+	const struct TraceRecord* ra = a;
+	const struct TraceRecord* rb = b;
+	return (ra->start_ns > rb->start_ns) - (ra->start_ns < rb->start_ns);
+}
+
+static int compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+struct ReplayChild {
+	pid_t pid;
+	int record;
+	uint64_t start_ns;
+};
+
+struct Replay {
+	const char* plugin;
+	int verbose;
+	struct TraceRecord* records;
+	int record_count;
+	struct ReplayChild running[REPLAY_MAX_PARALLELISM];
+	int running_count;
+};
+
+// Collects the children that exited; returns how many did
+static int reap(struct Replay* rp) {
+	int reaped = 0;
+	for (;;) {
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid <= 0) {
+			return reaped;
+		}
+
+		uint64_t now = now_ns(CLOCK_MONOTONIC);
+		for (int i = 0; i < rp->running_count; ++i) {
+			if (rp->running[i].pid != pid) continue;
+
+			struct TraceRecord* r = &rp->records[rp->running[i].record];
+			r->replay_ns = now - rp->running[i].start_ns;
+			r->replay_exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			printf("%-5s %.12s exit %d %8.2f ms (captured: exit %d %8.2f ms)\n", r->command, r->container_id,
+				r->replay_exit_code, r->replay_ns / 1e6, r->exit_code, r->duration_ns / 1e6);
+
+			rp->running[i] = rp->running[--rp->running_count];
+			++reaped;
+			break;
+		}
+	}
+}
+
+static int container_running(const struct Replay* rp, const char* container_id) {
+	for (int i = 0; i < rp->running_count; ++i) {
+		if (!strcmp(rp->records[rp->running[i].record].container_id, container_id)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int spawn(struct Replay* rp, int index) {
+	struct TraceRecord* r = &rp->records[index];
+
+	// the recorded environment, pointed at the scratch netns, plus PATH for the tools sknf-cni runs
+	char netns[64] = "";
+	if (r->netns >= 0) {
+		snprintf(netns, sizeof(netns), "CNI_NETNS=" REPLAY_NETNS_DIR REPLAY_NETNS_PREFIX "%d", r->netns);
+	} else {
+		snprintf(netns, sizeof(netns), "CNI_NETNS=");
+	}
+	char path[4096];
+	snprintf(path, sizeof(path), "PATH=%s", getenv("PATH") ? getenv("PATH") : "/usr/sbin:/usr/bin:/sbin:/bin");
+
+	// netlink budgets are checked by replays when the replay itself runs in strict mode
+	char strict[] = "SKNF_CNI_NL_STRICT=1";
+
+	char* envp[TRACE_MAX_ENV + 4];
+	int envc = 0;
+	for (int i = 0; i < r->env_count; ++i) {
+		if (strncmp(r->env[i], "CNI_NETNS=", strlen("CNI_NETNS="))) {
+			envp[envc++] = (char*)r->env[i];
+		}
+	}
+	envp[envc++] = netns;
+	envp[envc++] = path;
+	if (getenv("SKNF_CNI_NL_STRICT")) envp[envc++] = strict;
+	envp[envc] = NULL;
+
+	int input_fd = memfd_create("sknf-replay-input", MFD_CLOEXEC);
+	if (input_fd < 0 || write_all(input_fd, r->input, r->input_len) || lseek(input_fd, 0, SEEK_SET) < 0) {
+		fprintf(stderr, "failure preparing input of record %d: %s\n", index, strerror(errno));
+		if (input_fd >= 0) close(input_fd);
+		return 1;
+	}
+
+	uint64_t start = now_ns(CLOCK_MONOTONIC);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "failure forking: %s\n", strerror(errno));
+		close(input_fd);
+		return 1;
+	}
+
+	if (pid == 0) {
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(input_fd, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		if (!rp->verbose) dup2(devnull, STDERR_FILENO);
+		char* argv[] = { "sknf-cni", NULL };
+		execve(rp->plugin, argv, envp);
+		_exit(127);
+	}
+
+	close(input_fd);
+	rp->running[rp->running_count++] = (struct ReplayChild){ .pid = pid, .record = index, .start_ns = start };
+	return 0;
+}
+
+static void print_summary(const struct Replay* rp, const char* command) {
+	uint64_t* replayed = malloc(sizeof(uint64_t) * rp->record_count);
+	uint64_t* captured = malloc(sizeof(uint64_t) * rp->record_count);
+	int n = 0;
+	int mismatches = 0;
+
+	for (int i = 0; replayed && captured && i < rp->record_count; ++i) {
+		const struct TraceRecord* r = &rp->records[i];
+		if (strcmp(r->command, command)) continue;
+		replayed[n] = r->replay_ns;
+		captured[n] = r->duration_ns;
+		mismatches += (r->replay_exit_code != 0) != (r->exit_code != 0);
+		++n;
+	}
+
+	if (n > 0) {
+		qsort(replayed, n, sizeof(uint64_t), compare_u64);
+		qsort(captured, n, sizeof(uint64_t), compare_u64);
+		printf("%-5s %6d calls  replayed p50 %8.2f ms p90 %8.2f ms max %8.2f ms  captured p50 %8.2f ms p90 %8.2f ms max %8.2f ms  %d exit mismatches\n",
+			command, n,
+			replayed[(n - 1) / 2] / 1e6, replayed[(n - 1) * 9 / 10] / 1e6, replayed[n - 1] / 1e6,
+			captured[(n - 1) / 2] / 1e6, captured[(n - 1) * 9 / 10] / 1e6, captured[n - 1] / 1e6,
+			mismatches);
+	}
+
+	free(replayed);
+	free(captured);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: sknf-cni replay [-s speed] [-j parallelism] [-p plugin] [-v] <trace>\n"
+		"  -s  speed-up over the captured timing, 0 to issue calls as fast as possible (default 1)\n"
+		"  -j  maximum concurrent invocations (default 1)\n"
+		"  -p  plugin binary (default: this binary)\n"
+		"  -v  show the plugin's stderr\n");
+}
+
+// Re-issues the invocations of a trace against scratch network namespaces, one per captured ADD
+int trace_replay(int argc, char** argv) {
+	struct Replay* rp = calloc(1, sizeof(struct Replay));
+	double speed = 1;
+	int parallelism = 1;
+	int opt;
+	int rc = 1;
+	int netns_count = 0;
+	char* buf = NULL;
+
+	if (!rp) {
+		fprintf(stderr, "failure allocating replay state\n");
+		return 1;
+	}
+	rp->plugin = "/proc/self/exe";
+
+	while ((opt = getopt(argc, argv, "s:j:p:v")) != -1) {
+		switch (opt) {
+			case 's': speed = atof(optarg); break;
+			case 'j': parallelism = atoi(optarg); break;
+			case 'p': rp->plugin = optarg; break;
+			case 'v': rp->verbose = 1; break;
+			default: usage(); goto out;
+		}
+	}
+	if (optind != argc - 1 || speed < 0 || parallelism < 1 || parallelism > REPLAY_MAX_PARALLELISM) {
+		usage();
+		goto out;
+	}
+
+	FILE* f = fopen(argv[optind], "rb");
+	size_t len;
+	if (!f) {
+		fprintf(stderr, "failure opening %s: %s\n", argv[optind], strerror(errno));
+		goto out;
+	}
+	int read_failed = io_read_stream(f, &buf, &len);
+	fclose(f);
+	if (read_failed || parse_records(buf, len, &rp->records, &rp->record_count)) {
+		goto out;
+	}
+	if (rp->record_count == 0) {
+		fprintf(stderr, "empty trace\n");
+		goto out;
+	}
+
+	// records are appended when invocations end
+	qsort(rp->records, rp->record_count, sizeof(struct TraceRecord), compare_records);
+
+	// one scratch netns per container, created upfront so that it is not part of the replayed timing
+	for (int i = 0; i < rp->record_count; ++i) {
+		struct TraceRecord* r = &rp->records[i];
+		for (int j = 0; j < i && r->netns < 0; ++j) {
+			if (!strcmp(rp->records[j].container_id, r->container_id)) r->netns = rp->records[j].netns;
+		}
+		if (r->netns >= 0 || strcmp(r->command, CNI_CMD_ADD)) continue;
+
+		char cmd[128];
+		snprintf(cmd, sizeof(cmd), "ip netns add " REPLAY_NETNS_PREFIX "%d", netns_count);
+		if (system(cmd)) {
+			fprintf(stderr, "failure running '%s'\n", cmd);
+			goto cleanup;
+		}
+		r->netns = netns_count++;
+	}
+
+	uint64_t first = rp->records[0].start_ns;
+	uint64_t captured_end = 0;
+	uint64_t t0 = now_ns(CLOCK_MONOTONIC);
+	for (int i = 0; i < rp->record_count; ++i) {
+		struct TraceRecord* r = &rp->records[i];
+		if (r->start_ns + r->duration_ns > captured_end) captured_end = r->start_ns + r->duration_ns;
+
+		if (speed > 0) {
+			uint64_t target = t0 + (uint64_t)((r->start_ns - first) / speed);
+			for (uint64_t now = now_ns(CLOCK_MONOTONIC); now < target; now = now_ns(CLOCK_MONOTONIC)) {
+				if (!reap(rp)) sleep_ns(target - now < REPLAY_POLL_NS ? target - now : REPLAY_POLL_NS);
+			}
+		}
+
+		// calls of a container keep their order (a DEL never overtakes its ADD)
+		while (rp->running_count == parallelism || container_running(rp, r->container_id)) {
+			if (!reap(rp)) sleep_ns(REPLAY_POLL_NS);
+		}
+
+		if (spawn(rp, i)) {
+			goto cleanup;
+		}
+	}
+	while (rp->running_count > 0) {
+		if (!reap(rp)) sleep_ns(REPLAY_POLL_NS);
+	}
+
+	printf("replayed %d calls in %.2f ms (captured: %.2f ms)\n", rp->record_count,
+		(now_ns(CLOCK_MONOTONIC) - t0) / 1e6, (captured_end - first) / 1e6);
+	print_summary(rp, CNI_CMD_ADD);
+	print_summary(rp, CNI_CMD_DEL);
+	print_summary(rp, CNI_CMD_CHECK);
+	rc = 0;
+
+cleanup:
+	while (rp->running_count > 0) {
+		if (!reap(rp)) sleep_ns(REPLAY_POLL_NS);
+	}
+	for (int i = 0; i < netns_count; ++i) {
+		char cmd[128];
+		snprintf(cmd, sizeof(cmd), "ip netns del " REPLAY_NETNS_PREFIX "%d", i);
+		if (system(cmd)) {
+			fprintf(stderr, "failure running '%s'\n", cmd);
+		}
+	}
+
+out:
+	free(rp->records);
+	free(rp);
+	free(buf);
+	return rc;
+}
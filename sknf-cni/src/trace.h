@@ -0,0 +1,24 @@
+#ifndef SKNF_TRACE_H
+#define SKNF_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Path of the trace file; when set, every invocation is appended to it (see trace.c for the format)
+#define TRACE_ENV_VAR_NAME "SKNF_CNI_TRACE"
+
+struct TraceCapture {
+	const char* path;
+	uint64_t start_realtime_ns;
+	uint64_t start_monotonic_ns;
+	char* input; // copy of stdin, the original is handed over to args_parse_input
+	size_t input_len;
+	int result_fd; // receives stdout while the command runs
+	int stdout_fd; // original stdout
+};
+
+int trace_capture_begin(struct TraceCapture* capture, const char* path, char** input, size_t* input_len);
+void trace_capture_end(struct TraceCapture* capture, int exit_code);
+int trace_replay(int argc, char** argv);
+
+#endif
@@ -0,0 +1,180 @@
+#include "xdp.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+
+#include "net_utils.h"
+#include "nlstat.h"
+
+#define XDP_POD_MAP_KEY_LEN 6
+
+// enum bpf_attach_type of Linux 6.7+ (newer than the uapi headers of the build): programs of a netkit pair,
+// run on the transmit path of its peer end
+#define XDP_BPF_NETKIT_PEER 55
+
+static int bpf_cmd(int cmd, union bpf_attr* attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// Opens the pinned pod map; 0 with *fd = -1 when it is not pinned, i.e. sknf-app could not set the fast path up
+static int open_pod_map(Err* err, int* fd) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (uint64_t)(uintptr_t)XDP_POD_MAP_PIN_PATH;
+
+	*fd = bpf_cmd(BPF_OBJ_GET, &attr);
+	if (*fd < 0 && errno == ENOENT) {
+		fprintf(stderr, "%s is not pinned, skipping XDP decap\n", XDP_POD_MAP_PIN_PATH);
+		return 0;
+	}
+	if (*fd < 0) {
+		fprintf(stderr, "failure opening %s: %s\n", XDP_POD_MAP_PIN_PATH, strerror(errno));
+		ERRF(err, "Failure opening XDP decap pod map", "%s: %s", XDP_POD_MAP_PIN_PATH, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int pod_map_key(Err* err, const char* pod_cidr, unsigned char key[XDP_POD_MAP_KEY_LEN]) {
+	struct nl_addr* mac = NULL;
+	if (nu_mac_from_cidr(err, pod_cidr, &mac)) {
+		fprintf(stderr, "failure deriving pod MAC\n");
+		return 1;
+	}
+	memcpy(key, nl_addr_get_binary_addr(mac), XDP_POD_MAP_KEY_LEN);
+	nl_addr_put(mac);
+	return 0;
+}
+
+// Points the fast path of every pod at its host interface; the entries of earlier pods with the same IP are replaced
+int xdp_map_pods(Err* err, const char* const* pod_cidrs, const char* const* host_if_names, int count) {
+	int rc = 1;
+	int fd = -1;
+
+	if (open_pod_map(err, &fd)) {
+		goto out;
+	}
+	if (fd < 0) {
+		rc = 0;
+		goto out;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		unsigned char key[XDP_POD_MAP_KEY_LEN];
+		if (pod_map_key(err, pod_cidrs[i], key)) {
+			goto out;
+		}
+
+		uint32_t ifidx = nlstat_if_nametoindex(host_if_names[i]);
+		if (ifidx == 0) {
+			fprintf(stderr, "failed to resolve ifindex for %s\n", host_if_names[i]);
+			ERRF(err, "Failed to resolve ifindex for host veth", "%s", host_if_names[i]);
+			goto out;
+		}
+
+		union bpf_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = fd;
+		attr.key = (uint64_t)(uintptr_t)key;
+		attr.value = (uint64_t)(uintptr_t)&ifidx;
+		attr.flags = BPF_ANY;
+		if (bpf_cmd(BPF_MAP_UPDATE_ELEM, &attr)) {
+			fprintf(stderr, "failure adding %s to the XDP decap pod map: %s\n", pod_cidrs[i], strerror(errno));
+			ERRF(err, "Failure adding pod to the XDP decap pod map", "%s: %s", pod_cidrs[i], strerror(errno));
+			goto out;
+		}
+	}
+
+	rc = 0;
+
+out:
+	if (fd >= 0) close(fd);
+	return rc;
+}
+
+int xdp_unmap_pod(Err* err, const char* pod_cidr) {
+	int rc = 1;
+	int fd = -1;
+
+	if (open_pod_map(err, &fd)) {
+		goto out;
+	}
+	if (fd < 0) {
+		rc = 0;
+		goto out;
+	}
+
+	unsigned char key[XDP_POD_MAP_KEY_LEN];
+	if (pod_map_key(err, pod_cidr, key)) {
+		goto out;
+	}
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(uintptr_t)key;
+	// ENOENT: a DEL retried by the runtime
+	if (bpf_cmd(BPF_MAP_DELETE_ELEM, &attr) && errno != ENOENT) {
+		fprintf(stderr, "failure removing %s from the XDP decap pod map: %s\n", pod_cidr, strerror(errno));
+		ERRF(err, "Failure removing pod from the XDP decap pod map", "%s: %s", pod_cidr, strerror(errno));
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (fd >= 0) close(fd);
+	return rc;
+}
+
+// Attaches the pinned netkit forwarding program to the host end of every pod, so that the frames the pod
+// sends to the pods of other nodes skip the bridge. Skipped when sknf-app has not pinned it.
+int xdp_attach_netkit_forward(Err* err, const char* const* host_if_names, int count) {
+	int rc = 1;
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (uint64_t)(uintptr_t)XDP_NETKIT_FORWARD_PIN_PATH;
+	int fd = bpf_cmd(BPF_OBJ_GET, &attr);
+	if (fd < 0 && errno == ENOENT) {
+		fprintf(stderr, "%s is not pinned, skipping netkit forwarding\n", XDP_NETKIT_FORWARD_PIN_PATH);
+		return 0;
+	}
+	if (fd < 0) {
+		fprintf(stderr, "failure opening %s: %s\n", XDP_NETKIT_FORWARD_PIN_PATH, strerror(errno));
+		ERRF(err, "Failure opening netkit forwarding program", "%s: %s", XDP_NETKIT_FORWARD_PIN_PATH, strerror(errno));
+		return 1;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		uint32_t ifidx = nlstat_if_nametoindex(host_if_names[i]);
+		if (ifidx == 0) {
+			fprintf(stderr, "failed to resolve ifindex for %s\n", host_if_names[i]);
+			ERRF(err, "Failed to resolve ifindex for host veth", "%s", host_if_names[i]);
+			goto out;
+		}
+
+		// target_fd holds the ifindex for netkit (target_ifindex in newer headers)
+		memset(&attr, 0, sizeof(attr));
+		attr.target_fd = ifidx;
+		attr.attach_bpf_fd = fd;
+		attr.attach_type = XDP_BPF_NETKIT_PEER;
+		// a pair that fell back to veth (see nu_create_veth) takes no netkit program: its frames take the
+		// normal path, as they would without the program
+		if (bpf_cmd(BPF_PROG_ATTACH, &attr)) {
+			fprintf(stderr, "failure attaching netkit forwarding program to %s, skipping: %s\n", host_if_names[i],
+				strerror(errno));
+		}
+	}
+
+	rc = 0;
+
+out:
+	close(fd);
+	return rc;
+}
@@ -0,0 +1,19 @@
+#ifndef SKNF_XDP_H
+#define SKNF_XDP_H
+
+#include "def.h"
+#include "err.h"
+
+// Pod map of the XDP decap fast path, pinned by sknf-app (must match sknf-app/internal/xdp): the pod MAC
+// (see nu_mac_from_cidr) to the ifindex of its host interface
+#define XDP_POD_MAP_PIN_PATH "/sys/fs/bpf/sknf/pod_macs"
+
+// Forwarding program of netkit pods, pinned by sknf-app when pods get netkit pairs (must match
+// sknf-app/internal/xdp/forward.go)
+#define XDP_NETKIT_FORWARD_PIN_PATH "/sys/fs/bpf/sknf/netkit_fwd"
+
+int xdp_map_pods(Err* err, const char* const* pod_cidrs, const char* const* host_if_names, int count);
+int xdp_unmap_pod(Err* err, const char* pod_cidr);
+int xdp_attach_netkit_forward(Err* err, const char* const* host_if_names, int count);
+
+#endif